@@ -53,15 +53,29 @@ void HMMMatcher::reset() {
 void HMMMatcher::match(const char *name, const char *seq, const char *desc) {
     ESL_SQ *dbsq = esl_sq_CreateFrom(name, seq, desc, NULL, NULL);
     esl_sq_Digitize(om_->abc, dbsq);
+    match(dbsq);
+    esl_sq_Destroy(dbsq);
+}
 
+bool HMMMatcher::match(const ESL_SQ *dbsq) {
     p7_pli_NewSeq(pli_.get(), dbsq);
     p7_bg_SetLength(bg_.get(), int(dbsq->n));
     p7_oprofile_ReconfigLength(om_.get(), int(dbsq->n));
 
+    uint64_t n_past_fwd = pli_->n_past_fwd;
     p7_Pipeline(pli_.get(), om_.get(), bg_.get(), dbsq, nullptr, th_.get());
     p7_pipeline_Reuse(pli_.get());
 
-    esl_sq_Destroy(dbsq);
+    return pli_->n_past_fwd != n_past_fwd;
+}
+
+void HMMMatcher::skip(const ESL_SQ *dbsq) {
+    p7_pli_NewSeq(pli_.get(), dbsq);
+}
+
+void HMMMatcher::merge(HMMMatcher &other) {
+    p7_tophits_Merge(th_.get(), other.th_.get());
+    p7_pipeline_Merge(pli_.get(), other.pli_.get());
 }
 
 void HMMMatcher::summarize() {
@@ -92,7 +106,7 @@ HMMMatcher::pipeline_create(const hmmer_cfg &cfg, int M_hint, int L_hint, int lo
     if ((pli->oxb = p7_omx_Create(M_hint, 0,      L_hint)) == NULL) goto ERROR;
 
     pli->r                  = esl_randomness_CreateFast(seed);
-    pli->do_reseeding       = FALSE;
+    pli->do_reseeding       = cfg.reseed;
     pli->ddef               = p7_domaindef_Create(pli->r);
     pli->ddef->do_reseeding = pli->do_reseeding;
 
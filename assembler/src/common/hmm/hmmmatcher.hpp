@@ -19,13 +19,16 @@ struct hmmer_cfg {
     double incdomE; double incdomT;
     bool cut_ga; bool cut_nc; bool cut_tc;
     bool max; double F1; double F2; double F3; bool nobias;
+    // Reseed domain definition for each target (as hmmsearch does), so its hits do not depend on the preceding ones
+    bool reseed;
 
     hmmer_cfg()
             : acc(false), noali(false),
               E(10.0), T(0), domE(10.0), domT(0),
               incE(0.01), incT(0.0), incdomE(0.01), incdomT(0),
               cut_ga(false), cut_nc(false), cut_tc(false),
-              max(false), F1(0.02), F2(1e-3), F3(1e-5), nobias(false)
+              max(false), F1(0.02), F2(1e-3), F3(1e-5), nobias(false),
+              reseed(false)
     {}
 };
 
@@ -121,6 +124,14 @@ class HMMMatcher {
     HMMMatcher(const HMM &hmmw,
                const hmmer_cfg &cfg);
     void match(const char *name, const char *seq, const char *desc = NULL);
+    // Matches the sequence already digitized in the alphabet of the model, the sequence is not modified.
+    // Returns true if the sequence passed all the acceleration filters (up to the Forward one)
+    bool match(const ESL_SQ *dbsq);
+    // Accounts the sequence as a target of the search (for E-values) without matching it
+    void skip(const ESL_SQ *dbsq);
+
+    // Moves the hits of another matcher of the same model here and accounts its targets
+    void merge(HMMMatcher &other);
 
     void reset();
     void summarize();
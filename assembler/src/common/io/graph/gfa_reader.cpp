@@ -11,17 +11,270 @@
 
 #include "io/id_mapper.hpp"
 
+#include "io/kmers/mmapped_reader.hpp"
+#include "utils/logger/logger.hpp"
+#include "utils/perf/perfcounter.hpp"
+#include "utils/verify.hpp"
+
 #include "gfa1/gfa.h"
 
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <numeric>
 #include <string>
 #include <memory>
+#include <utility>
 #include <vector>
 #include <unordered_set>
 
+// The line parsers and the graph fixes of gfa1 that its header does not declare
+extern "C" {
+int gfa_parse_S(gfa_t *g, char *s);
+int gfa_parse_L(gfa_t *g, char *s);
+int gfa_parse_P(gfa_t *g, char *s);
+uint64_t gfa_add_arc1(gfa_t *g, uint32_t v, uint32_t w, int32_t ov, int32_t ow, int64_t link_id, int comp);
+void gfa_arc_sort(gfa_t *g);
+void gfa_arc_index(gfa_t *g);
+uint32_t gfa_fix_no_seg(gfa_t *g);
+uint32_t gfa_fix_symm(gfa_t *g);
+}
+
 using namespace debruijn_graph;
 
 namespace gfa {
 
+namespace {
+
+// Lines of a chunk of the file parsed by gfa_parse_S/L/P() into a gfa_t of its own, where the segments
+// are numbered in the order of their first appearance in the chunk. Merged in the order of the chunks,
+// the graphs give the very same gfa_t as gfa_read()
+class GFAChunk {
+  public:
+    GFAChunk()
+            : gfa_(gfa_init(), gfa_destroy) {}
+
+    void parse(const char *begin, const char *end) {
+        gfa_t *g = gfa_.get();
+        std::string line;
+        while (begin < end) {
+            const char *eol = static_cast<const char *>(memchr(begin, '\n', end - begin));
+            if (!eol)
+                eol = end;
+            line.assign(begin, eol);
+            begin = eol + 1;
+            ++nlines;
+
+            if (line.size() > 1 && line.back() == '\r')
+                line.pop_back();
+            if (line.size() < 3 || line[1] != '\t')
+                continue;
+            char *s = &line[0];
+            int ret = 0;
+            if (s[0] == 'S') {
+                ret = gfa_parse_S(g, s);
+                if (ret == 0) {
+                    // The parser leaves the name terminated in place
+                    defined_.resize(g->n_seg);
+                    defined_[gfa_name2id(g, s + 2)] = true;
+                }
+            } else if (s[0] == 'L')
+                ret = gfa_parse_L(g, s);
+            else if (s[0] == 'P')
+                ret = gfa_parse_P(g, s);
+            if (ret < 0)
+                errors_.push_back({ s[0], ret, nlines });
+        }
+    }
+
+    // Moves the records into the graph, the edges of the first created segments of it are already built
+    void merge(gfa_t *g, uint64_t first_lineno, uint32_t created) {
+        for (const Error &error : errors_)
+            WARN("Invalid " << error.type << "-line at line " << first_lineno + error.lineno
+                 << " (error code " << error.ret << ")");
+
+        gfa_t *chunk = gfa_.get();
+        std::vector<uint32_t> ids(chunk->n_seg);
+        for (uint32_t i = 0; i < chunk->n_seg; ++i) {
+            gfa_seg_t &from = chunk->seg[i];
+            ids[i] = gfa_add_seg(g, from.name);
+            gfa_seg_t &to = g->seg[ids[i]];
+            if (i >= defined_.size() || !defined_[i]) {
+                // Only the L1/L2 tags of the links of the chunk extend it
+                to.len = std::max(to.len, from.len);
+            } else if (ids[i] < created) {
+                WARN("Segment " << from.name << " is defined again, its first definition is kept");
+            } else {
+                // The last definition wins
+                free(to.seq);
+                free(to.aux.aux);
+                to.len = from.len, to.seq = from.seq, to.aux = from.aux;
+                from.seq = nullptr, from.aux.aux = nullptr;
+            }
+        }
+        auto vertex = [&ids](uint32_t v) { return ids[v >> 1] << 1 | (v & 1); };
+
+        for (uint64_t k = 0; k < chunk->n_arc; ++k) {
+            const gfa_arc_t &arc = chunk->arc[k];
+            uint64_t link_id = gfa_add_arc1(g, vertex(gfa_arc_head(arc)), vertex(gfa_arc_tail(arc)),
+                                            arc.ov, arc.ow, -1, 0);
+            // The links of the chunk are numbered by their arcs
+            std::swap(g->arc_aux[link_id], chunk->arc_aux[k]);
+        }
+
+        for (uint32_t i = 0; i < chunk->n_path; ++i) {
+            gfa_path_t &path = chunk->path[i];
+            for (uint32_t j = 0; j < path.n_seg; ++j)
+                path.v[j] = vertex(path.v[j]);
+            if (g->m_path == g->n_path) {
+                uint64_t old_m = g->m_path;
+                g->m_path = g->m_path ? g->m_path << 1 : 16;
+                g->path = (gfa_path_t*)realloc(g->path, g->m_path * sizeof(gfa_path_t));
+                memset(&g->path[old_m], 0, (g->m_path - old_m) * sizeof(gfa_path_t));
+            }
+            g->path[g->n_path++] = path;
+            path.name = nullptr, path.v = nullptr;
+        }
+    }
+
+    uint64_t nlines = 0;
+
+  private:
+    struct Error {
+        char type;
+        int ret;
+        uint64_t lineno;  // within the chunk
+    };
+
+    std::unique_ptr<gfa_t, void(*)(gfa_t*)> gfa_;
+    std::vector<bool> defined_;  // by the S-lines of the chunk
+    std::vector<Error> errors_;
+};
+
+// gfa_fix_semi_arc() and gfa_fix_arc_len() of gfa1, which are static there
+uint32_t FixSemiArcs(gfa_t *g) {
+    uint32_t n_err = 0, n_vtx = gfa_n_vtx(g);
+    for (uint32_t v = 0; v < n_vtx; ++v) {
+        int nv = gfa_arc_n(g, v);
+        gfa_arc_t *av = gfa_arc_a(g, v);
+        for (int i = 0; i < nv; ++i) {
+            if (!av[i].del && (av[i].ow == INT32_MAX || av[i].ov == INT32_MAX)) { // overlap length is missing
+                uint32_t w = av[i].w ^ 1;
+                int is_multi = 0, c = 0, jv = -1, nw = gfa_arc_n(g, w);
+                gfa_arc_t *aw = gfa_arc_a(g, w);
+                for (int j = 0; j < nw; ++j)
+                    if (!aw[j].del && aw[j].w == (v ^ 1)) ++c, jv = j;
+                if (c == 1) {
+                    if (av[i].ov != INT32_MAX && aw[jv].ow != INT32_MAX && av[i].ov != aw[jv].ow) is_multi = 1;
+                    if (av[i].ow != INT32_MAX && aw[jv].ov != INT32_MAX && av[i].ow != aw[jv].ov) is_multi = 1;
+                }
+                if (c == 1 && !is_multi) {
+                    if (aw[jv].ov != INT32_MAX) av[i].ow = aw[jv].ov;
+                    if (aw[jv].ow != INT32_MAX) av[i].ov = aw[jv].ow;
+                } else {
+                    if (gfa_verbose >= 2)
+                        fprintf(stderr, "[W] can't infer overlap length for %s%c -> %s%c\n",
+                                g->seg[v>>1].name, "+-"[v&1], g->seg[w>>1].name, "+-"[(w^1)&1]);
+                    ++n_err;
+                    av[i].del = 1;
+                }
+            }
+        }
+    }
+    return n_err;
+}
+
+void FixArcLengths(gfa_t *g) {
+    for (uint64_t k = 0; k < g->n_arc; ++k) {
+        gfa_arc_t *a = &g->arc[k];
+        uint32_t v = gfa_arc_head(*a), w = gfa_arc_tail(*a);
+        if (g->seg[v>>1].del || g->seg[w>>1].del) {
+            a->del = 1;
+        } else {
+            if (g->seg[v>>1].len < a->ov) {
+                fprintf(stderr, "[W] overlap of %u bp is larger than the segment size of %u bp for %s%c -> %s%c\n",
+                        a->ov, g->seg[v>>1].len,
+                        g->seg[v>>1].name, "+-"[v&1], g->seg[w>>1].name, "+-"[w&1]);
+                a->v_lv &= ~0xffffffffULL;
+            } else
+                a->v_lv |= g->seg[v>>1].len - a->ov;
+            if (a->ow != INT32_MAX)
+                a->lw = g->seg[w>>1].len < a->ow ? 0 : g->seg[w>>1].len - a->ow;
+        }
+    }
+}
+
+// The fixes of gfa_read()
+void Finalize(gfa_t *g) {
+    gfa_fix_no_seg(g);
+    gfa_arc_sort(g);
+    gfa_arc_index(g);
+    FixSemiArcs(g);
+    gfa_fix_symm(g);
+    FixArcLengths(g);
+    gfa_cleanup(g);
+}
+
+unsigned RawCoverage(const gfa_seg_t *seg) {
+    uint8_t *kc = gfa_aux_get(seg->aux.l_aux, seg->aux.aux, "KC");
+    unsigned cov = 0;
+    if (kc && kc[0] == 'i')
+        cov = *(int32_t*)(kc+1);
+    return cov;
+}
+
+void MapIds(const gfa_t *gfa, const ConjugateDeBruijnGraph &g, const std::vector<EdgeId> &edges,
+            io::IdMapper<std::string> *id_mapper) {
+    if (!id_mapper)
+        return;
+
+    for (size_t i = 0; i < gfa->n_seg; ++i) {
+        EdgeId e = edges[i];
+        (*id_mapper)[e.int_id()] = gfa->seg[i].name;
+        if (e != g.conjugate(e)) {
+            (*id_mapper)[g.conjugate(e).int_id()] = std::string(gfa->seg[i].name) + '\'';
+        }
+    }
+}
+
+void LinkSegments(gfa_t *gfa, ConjugateDeBruijnGraph &g, const std::vector<EdgeId> &edges) {
+    auto helper = g.GetConstructionHelper();
+    for (uint32_t i = 0; i < gfa->n_seg; ++i) {
+        EdgeId e1 = edges[i];
+        // Process direct links
+        {
+            uint32_t vv = i << 1 | 0;
+            gfa_arc_t *av = gfa_arc_a(gfa, vv);
+            for (size_t j = 0; j < gfa_arc_n(gfa, vv); ++j) {
+                EdgeId e2 = edges[av[j].w >> 1];
+                if (av[j].w & 1)
+                    e2 = g.conjugate(e2);
+                helper.LinkEdges(e1, e2);
+            }
+        }
+
+        // Process rc links
+        {
+            e1 = g.conjugate(e1);
+            uint32_t vv = i << 1 | 1;
+            gfa_arc_t *av = gfa_arc_a(gfa, vv);
+            for (size_t j = 0; j < gfa_arc_n(gfa, vv); ++j) {
+                EdgeId e2 = edges[av[j].w >> 1];
+                if (av[j].w & 1)
+                    e2 = g.conjugate(e2);
+                helper.LinkEdges(e1, e2);
+            }
+        }
+    }
+}
+
+}
+
 GFAReader::GFAReader()
         : gfa_(nullptr, gfa_destroy) {}
 GFAReader::GFAReader(const std::string &filename)
@@ -46,23 +299,14 @@ void GFAReader::to_graph(ConjugateDeBruijnGraph &g,
     for (size_t i = 0; i < gfa_->n_seg; ++i) {
         gfa_seg_t *seg = gfa_->seg + i;
 
-        uint8_t *kc = gfa_aux_get(seg->aux.l_aux, seg->aux.aux, "KC");
-        unsigned cov = 0;
-        if (kc && kc[0] == 'i')
-            cov = *(int32_t*)(kc+1);
+        unsigned cov = RawCoverage(seg);
         DeBruijnEdgeData edata(Sequence(seg->seq));
         EdgeId e = helper.AddEdge(edata);
         g.coverage_index().SetRawCoverage(e, cov);
         g.coverage_index().SetRawCoverage(g.conjugate(e), cov);
-
-        if (id_mapper) {
-            (*id_mapper)[e.int_id()] = seg->name;
-            if (e != g.conjugate(e)) {
-                (*id_mapper)[g.conjugate(e).int_id()] = std::string(seg->name) + '\'';
-            }
-        }
         edges.push_back(e);
     }
+    MapIds(gfa_.get(), g, edges, id_mapper);
 
     // INFO("Creating vertices");
     g.vreserve(gfa_->n_seg * 4);
@@ -80,33 +324,7 @@ void GFAReader::to_graph(ConjugateDeBruijnGraph &g,
     }
 
     // INFO("Linking edges");
-    for (uint32_t i = 0; i < gfa_->n_seg; ++i) {
-        EdgeId e1 = edges[i];
-        // Process direct links
-        {
-            uint32_t vv = i << 1 | 0;
-            gfa_arc_t *av = gfa_arc_a(gfa_.get(), vv);
-            for (size_t j = 0; j < gfa_arc_n(gfa_.get(), vv); ++j) {
-                EdgeId e2 = edges[av[j].w >> 1];
-                if (av[j].w & 1)
-                    e2 = g.conjugate(e2);
-                helper.LinkEdges(e1, e2);
-            }
-        }
-
-        // Process rc links
-        {
-            e1 = g.conjugate(e1);
-            uint32_t vv = i << 1 | 1;
-            gfa_arc_t *av = gfa_arc_a(gfa_.get(), vv);
-            for (size_t j = 0; j < gfa_arc_n(gfa_.get(), vv); ++j) {
-                EdgeId e2 = edges[av[j].w >> 1];
-                if (av[j].w & 1)
-                    e2 = g.conjugate(e2);
-                helper.LinkEdges(e1, e2);
-            }
-        }
-    }
+    LinkSegments(gfa_.get(), g, edges);
 
     // INFO("Filtering dangling vertices");
     for (auto it = vertices.begin(); it != vertices.end(); ) {
@@ -117,6 +335,138 @@ void GFAReader::to_graph(ConjugateDeBruijnGraph &g,
             ++it;
     }
 
+    read_paths(g, edges);
+}
+
+bool GFAReader::read_graph(const std::string &filename, ConjugateDeBruijnGraph &g,
+                           io::IdMapper<std::string> *id_mapper, unsigned nthreads, size_t chunk_size) {
+    auto sequential = [&]() {
+        if (!open(filename))
+            return false;
+        to_graph(g, id_mapper);
+        return true;
+    };
+
+    struct stat st;
+    if (stat(filename.c_str(), &st) != 0 || !S_ISREG(st.st_mode) || st.st_size < 2)
+        return sequential();
+
+    utils::perf_counter pc;
+    MMappedReader file(filename, /* unlink */ false, /* blocksize */ -1ULL);
+    const char *data = static_cast<const char*>(file.data()), *end = data + file.size();
+    if (uint8_t(data[0]) == 0x1f && uint8_t(data[1]) == 0x8b) {
+        INFO("GFA file " << filename << " is compressed, parsing it sequentially");
+        return sequential();
+    }
+
+    // Several chunks per thread in a batch to balance the ones with long segments
+    nthreads = std::max(nthreads, 1u);
+    const size_t batch_size = 4 * nthreads;
+    std::vector<const char*> bounds(1, data);
+    for (const char *p = data + chunk_size; p < end; p += chunk_size) {
+        // Chunks start with lines
+        const char *eol = static_cast<const char*>(memchr(p - 1, '\n', end - p + 1));
+        if (!eol || eol + 1 >= end)
+            break;
+        if (eol + 1 > bounds.back())
+            bounds.push_back(eol + 1);
+        p = eol + 1;
+    }
+    bounds.push_back(end);
+
+    auto helper = g.GetConstructionHelper();
+    gfa_t *gfa = gfa_init();
+    gfa_.reset(gfa);
+    std::vector<EdgeId> edges;
+    uint32_t created = 0;
+    uint64_t next_id = g.min_id(), lineno = 0;
+    const uint64_t min_id = g.min_id();
+    const uintptr_t page_size = getpagesize();
+    const char *released = data;
+    for (size_t first = 0; first + 1 < bounds.size(); first += batch_size) {
+        std::vector<GFAChunk> chunks(std::min(batch_size, bounds.size() - 1 - first));
+#       pragma omp parallel for schedule(dynamic) num_threads(nthreads)
+        for (size_t i = 0; i < chunks.size(); ++i)
+            chunks[i].parse(bounds[first + i], bounds[first + i + 1]);
+
+        for (GFAChunk &chunk : chunks) {
+            chunk.merge(gfa, lineno, created);
+            lineno += chunk.nlines;
+        }
+        chunks.clear();
+
+        // The text of the batch is not needed anymore
+        const char *parsed = reinterpret_cast<const char*>(
+            reinterpret_cast<uintptr_t>(bounds[first + std::min(batch_size, bounds.size() - 1 - first)]) & ~(page_size - 1));
+        if (parsed > released) {
+            madvise(const_cast<char*>(released), parsed - released, MADV_DONTNEED);
+            released = parsed;
+        }
+
+        // The edges of the segments defined so far, the ones of a later segment wait for the earlier ones
+        uint32_t ready = created;
+        while (ready < gfa->n_seg && gfa->seg[ready].seq)
+            ++ready;
+        bool last = first + batch_size + 1 >= bounds.size();
+        if (last && ready < gfa->n_seg) {
+            VERIFY_MSG(false, "Segment " << gfa->seg[ready].name << " of GFA file " << filename << " has no sequence");
+        }
+        if (ready == created)
+            continue;
+
+        // The same ids as of the sequential creation: a pair per segment, a single one for a self-conjugate segment
+        size_t n = ready - created;
+        std::vector<Sequence> seqs(n);
+        std::vector<uint64_t> ids(n + 1, next_id);
+#       pragma omp parallel for schedule(guided) num_threads(nthreads)
+        for (size_t i = 0; i < n; ++i) {
+            gfa_seg_t &seg = gfa->seg[created + i];
+            seqs[i] = Sequence(seg.seq);
+            free(seg.seq);
+            seg.seq = nullptr;
+            ids[i + 1] = seqs[i] == !seqs[i] ? 1 : 2;
+        }
+        std::partial_sum(ids.begin(), ids.end(), ids.begin());
+        if (g.ereserved() < ids[n])
+            g.ereserve(std::max<size_t>(ids[n], 2 * g.ereserved()));
+        if (g.vreserved() < 4 * size_t(ready))
+            g.vreserve(std::max<size_t>(4 * size_t(ready), 2 * g.vreserved()));
+
+        edges.resize(ready);
+#       pragma omp parallel for schedule(guided) num_threads(nthreads)
+        for (size_t i = 0; i < n; ++i) {
+            uint32_t id = uint32_t(created + i);
+            EdgeId e = helper.AddEdge(DeBruijnEdgeData(std::move(seqs[i])), ids[i]);
+            unsigned cov = RawCoverage(gfa->seg + id);
+            g.coverage_index().SetRawCoverage(e, cov);
+            g.coverage_index().SetRawCoverage(g.conjugate(e), cov);
+            edges[id] = e;
+
+            // Two conjugate pairs per segment, only the vertices of the segment are touched
+            VertexId v1 = helper.CreateVertex(DeBruijnVertexData(), min_id + 4 * uint64_t(id)),
+                     v2 = helper.CreateVertex(DeBruijnVertexData(), min_id + 4 * uint64_t(id) + 2);
+            helper.LinkIncomingEdge(v1, e);
+            if (e != g.conjugate(e))
+                helper.LinkIncomingEdge(v2, g.conjugate(e));
+        }
+        next_id = ids[n];
+        created = ready;
+    }
+    Finalize(gfa);
+    MapIds(gfa, g, edges, id_mapper);
+
+    // Sequential: linking moves the edges between the vertices in the order of the arcs
+    LinkSegments(gfa, g, edges);
+    read_paths(g, edges);
+
+    double time = std::max(pc.time(), 1e-6);
+    INFO("GFA read in " << bounds.size() - 1 << " chunks: " << (double(file.size()) / (1 << 20)) / time << " MB/s, "
+         << double(gfa->n_seg) / time << " segments/s");
+
+    return true;
+}
+
+void GFAReader::read_paths(const ConjugateDeBruijnGraph &g, const std::vector<EdgeId> &edges) {
     // INFO("Reading paths")
     paths_.reserve(gfa_->n_path);
     for (uint32_t i = 0; i < gfa_->n_path; ++i) {
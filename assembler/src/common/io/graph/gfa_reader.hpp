@@ -60,8 +60,16 @@ class GFAReader {
     }
 
     void to_graph(debruijn_graph::DeBruijnGraph &g, io::IdMapper<std::string> *id_mapper = nullptr);
+    // open() and to_graph() in one pass over batches of line-aligned chunks of the memory-mapped file.
+    // The chunks of a batch are parsed in parallel, then the edges of its segments are added to the graph
+    // in parallel, so the text of the whole file is never kept. The graph, its ids, names and paths are
+    // the same. Compressed files are read by open()
+    bool read_graph(const std::string &filename, debruijn_graph::DeBruijnGraph &g,
+                    io::IdMapper<std::string> *id_mapper, unsigned nthreads, size_t chunk_size = 1 << 22);
 
   private:
+    void read_paths(const debruijn_graph::DeBruijnGraph &g, const std::vector<EdgeId> &edges);
+
     std::unique_ptr<gfa_t, void(*)(gfa_t*)> gfa_;
     std::vector<GFAPath> paths_;
 };
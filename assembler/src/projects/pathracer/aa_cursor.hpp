@@ -1,5 +1,6 @@
 #pragma once
 
+#include "cursor_adjacency.hpp"
 #include "utils.hpp"
 
 #include "sequence/aa.hpp"
@@ -56,23 +57,41 @@ class AAGraphCursor {
 
   bool is_empty() const { return c0_.is_empty() && c1_.is_empty() && c2_.is_empty(); }
 
-  using EdgeId = std::decay_t<decltype(GraphCursor().edge())>;
+  std::vector<This> prev(Context context) const {
+    std::vector<This> result;
+    for_each_prev(context, [&result](const This &c) { result.push_back(c); });
+    return result;
+  }
 
-  std::vector<This> prev(Context context) const { return from_bases_prev(c0_.prev(context), context); }
+  std::vector<This> next(Context context) const {
+    std::vector<This> result;
+    for_each_next(context, [&result](const This &c) { result.push_back(c); });
+    return result;
+  }
 
-  std::vector<This> next(Context context) const { return from_bases_next(c2_.next(context), context); }
   std::vector<This> next_frame_shift(Context context) const {
     std::vector<This> result;
-    result.reserve(20);
+    for_each_next_frame_shift(context, [&result](const This &c) { result.push_back(c); });
+    return result;
+  }
 
-    for (const auto &cursor : c2_.next(context)) {
-      result.emplace_back(c1_, c2_, cursor, 0b100);
-      for (const auto &n : cursor.next(context)) {
-        result.emplace_back(c2_, cursor, n, 0b110);
-      }
-    }
+  // Triplets are generated in place, the same ones and in the same order as next() / prev() / next_frame_shift() yield
+  template <typename F>
+  void for_each_next(Context context, F &&f) const {
+    ::for_each_next(c2_, context, [&](const GraphCursor &cursor) { from_base_next(cursor, context, f); });
+  }
 
-    return result;
+  template <typename F>
+  void for_each_prev(Context context, F &&f) const {
+    ::for_each_prev(c0_, context, [&](const GraphCursor &cursor) { from_base_prev(cursor, context, f); });
+  }
+
+  template <typename F>
+  void for_each_next_frame_shift(Context context, F &&f) const {
+    ::for_each_next(c2_, context, [&](const GraphCursor &cursor) {
+      f(This(c1_, c2_, cursor, 0b100));
+      ::for_each_next(cursor, context, [&](const GraphCursor &n) { f(This(c2_, cursor, n, 0b110)); });
+    });
   }
 
   std::vector<GraphCursor> triplet_cursors() const { return {c0_, c1_, c2_}; }
@@ -97,28 +116,27 @@ class AAGraphCursor {
   friend auto make_aa_cursors<GraphCursor>(const std::vector<GraphCursor> &cursors, Context context);
   friend std::ostream &operator<<<GraphCursor>(std::ostream &os, const AAGraphCursor<GraphCursor> &cursor);
 
-  static std::vector<This> from_bases_next(const std::vector<GraphCursor> &cursors,
-                                           Context context) {
-    std::vector<This> result;
-    result.reserve(64);
-
-    for (const auto &cursor : cursors)
-      for (const auto &n1 : cursor.next(context))
-        for (const auto &n2 : n1.next(context))
-          result.push_back({ cursor, n1, n2 });
+  template <typename F>
+  static void from_base_next(const GraphCursor &cursor, Context context, F &f) {
+    ::for_each_next(cursor, context, [&](const GraphCursor &n1) {
+      ::for_each_next(n1, context, [&](const GraphCursor &n2) { f(This(cursor, n1, n2)); });
+    });
+  }
 
-    return result;
+  template <typename F>
+  static void from_base_prev(const GraphCursor &cursor, Context context, F &f) {
+    ::for_each_prev(cursor, context, [&](const GraphCursor &p1) {
+      ::for_each_prev(p1, context, [&](const GraphCursor &p2) { f(This(p2, p1, cursor)); });
+    });
   }
 
-  static std::vector<This> from_bases_prev(const std::vector<GraphCursor> &cursors,
-                                           Context context) {
+  template <typename Cursors>
+  static std::vector<This> from_bases_next(const Cursors &cursors, Context context) {
     std::vector<This> result;
-    result.reserve(64);
-
-    for (const auto &cursor : cursors)
-      for (const auto &p1 : cursor.prev(context))
-        for (const auto &p2 : p1.prev(context))
-          result.emplace_back(p2, p1, cursor);
+    auto push = [&result](const This &c) { result.push_back(c); };
+    for (const auto &cursor : cursors) {
+      from_base_next(cursor, context, push);
+    }
 
     return result;
   }
@@ -13,6 +13,8 @@
 #include <bitset>
 
 #include "common/utils/verify.hpp"
+#include "cursor_adjacency.hpp"
+#include "cursor_span.hpp"
 
 // Serialization
 #include <cereal/types/common.hpp>
@@ -28,14 +30,14 @@ public:
     CachedAACursor() : index_{size_t(-1)}, mask_{0b000} {}
     bool is_empty() const { return mask_ == 0b000; }
     bool operator==(const CachedAACursor &other) const { return to_size_t() == other.to_size_t(); }
-    const std::vector<CachedAACursor> &next(Context context) const;
-    const std::vector<CachedAACursor> &prev(Context context) const;
+    CursorSpan<CachedAACursor> next(Context context) const;
+    CursorSpan<CachedAACursor> prev(Context context) const;
     char letter(Context context) const;
     size_t index() const { return index_; }
     unsigned char mask() const { return mask_; }
     // uint64_t to_size_t() const { return *reinterpret_cast<const uint64_t *>(this); }
     uint64_t to_size_t() const { return (index_ << 3) + mask_; }
-    const std::vector<CachedAACursor> &next_frame_shift(Context context) const;
+    CursorSpan<CachedAACursor> next_frame_shift(Context context) const;
 
     CachedAACursor triplet_form() const {
         CachedAACursor result = *this;
@@ -138,48 +140,54 @@ public:
         auto aa_cursors = make_aa_cursors(cursors, context);
         for (const auto &cursor : aa_cursors) {
             get_or_create(cursor);
-            for (const auto &n : cursor.next(context)) {
-                get_or_create(n);
-            }
-            for (const auto &p : cursor.prev(context)) {
-                get_or_create(p);
-            }
-            for (const auto &n : cursor.next_frame_shift(context)) {
-                get_or_create(n);
-            }
+            for_each_next(cursor, context, get_or_create);
+            for_each_prev(cursor, context, get_or_create);
+            for_each_next_frame_shift(cursor, context, get_or_create);
         }
 
-        nexts_.resize(triplets_.size());
-        prevs_.resize(triplets_.size());
-        nexts_frame_shift_.resize(triplets_.size());
+        next_offsets_.assign(triplets_.size() + 1, 0);
+        prev_offsets_.assign(triplets_.size() + 1, 0);
+        next_frame_shift_offsets_.assign(triplets_.size() + 1, 0);
         for (size_t i = 0; i < triplets_.size(); ++i) {
             auto cc = CachedAACursor(i, 0b111);
             auto cursor = UnpackCursor(cc, cursors);
-            for (const auto &c : cursor.next(context)) {
-                nexts_[i].emplace_back(get(c), c.mask());
-            }
-            for (const auto &c : cursor.prev(context)) {
-                prevs_[i].emplace_back(get(c), c.mask());
-            }
-            for (const auto &c : cursor.next_frame_shift(context)) {
-                nexts_frame_shift_[i].emplace_back(get(c), c.mask());
-            }
+            for_each_next(cursor, context, [&](const auto &c) { nexts_.emplace_back(get(c), c.mask()); });
+            for_each_prev(cursor, context, [&](const auto &c) { prevs_.emplace_back(get(c), c.mask()); });
+            for_each_next_frame_shift(cursor, context, [&](const auto &c) { nexts_frame_shift_.emplace_back(get(c), c.mask()); });
+            next_offsets_[i + 1] = nexts_.size();
+            prev_offsets_[i + 1] = prevs_.size();
+            next_frame_shift_offsets_[i + 1] = nexts_frame_shift_.size();
         }
+        nexts_.shrink_to_fit();
+        prevs_.shrink_to_fit();
+        nexts_frame_shift_.shrink_to_fit();
     }
 
+    size_t size() const { return letters_.size(); }
+
     friend class CachedAACursor;
 
     template <class Archive>
     void serialize(Archive &archive) {
-        archive(triplets_, letters_, nexts_, prevs_, nexts_frame_shift_);
+        archive(triplets_, letters_,
+                next_offsets_, nexts_, prev_offsets_, prevs_, next_frame_shift_offsets_, nexts_frame_shift_);
     }
 
 private:
     std::vector<std::array<Index, 3>> triplets_;
     std::vector<char> letters_;
-    std::vector<std::vector<CachedAACursor>> nexts_;
-    std::vector<std::vector<CachedAACursor>> prevs_;
-    std::vector<std::vector<CachedAACursor>> nexts_frame_shift_;
+    // CSR adjacency, see CachedCursorContext
+    std::vector<size_t> next_offsets_;
+    std::vector<CachedAACursor> nexts_;
+    std::vector<size_t> prev_offsets_;
+    std::vector<CachedAACursor> prevs_;
+    std::vector<size_t> next_frame_shift_offsets_;
+    std::vector<CachedAACursor> nexts_frame_shift_;
+
+    static CursorSpan<CachedAACursor> span(const std::vector<size_t> &offsets, const std::vector<CachedAACursor> &adjacent,
+                                           size_t i) {
+        return {adjacent.data() + offsets[i], adjacent.data() + offsets[i + 1]};
+    }
 };
 
 // FIXME add cpp
@@ -207,17 +215,17 @@ inline std::vector<size_t> CachedAACursor::nucl_cursor_indices(Context context)
     return result;
 }
 
-inline const std::vector<CachedAACursor> &CachedAACursor::next(CachedAACursor::Context context) const {
+inline CursorSpan<CachedAACursor> CachedAACursor::next(CachedAACursor::Context context) const {
     VERIFY(!is_empty());
-    return context->nexts_[index_];
+    return CachedAACursorContext::span(context->next_offsets_, context->nexts_, index_);
 }
-inline const std::vector<CachedAACursor> &CachedAACursor::prev(CachedAACursor::Context context) const {
+inline CursorSpan<CachedAACursor> CachedAACursor::prev(CachedAACursor::Context context) const {
     VERIFY(!is_empty());
-    return context->prevs_[index_];
+    return CachedAACursorContext::span(context->prev_offsets_, context->prevs_, index_);
 }
-inline const std::vector<CachedAACursor> &CachedAACursor::next_frame_shift(CachedAACursor::Context context) const {
+inline CursorSpan<CachedAACursor> CachedAACursor::next_frame_shift(CachedAACursor::Context context) const {
     VERIFY(!is_empty());
-    return context->nexts_frame_shift_[index_];
+    return CachedAACursorContext::span(context->next_frame_shift_offsets_, context->nexts_frame_shift_, index_);
 }
 
 // vim: set ts=4 sw=4 et :
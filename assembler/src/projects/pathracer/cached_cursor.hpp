@@ -6,12 +6,15 @@
 
 #pragma once
 
+#include <algorithm>
 #include <cstdint>
 #include <limits>
 #include <unordered_map>
 #include <vector>
 
 #include "common/utils/verify.hpp"
+#include "cursor_adjacency.hpp"
+#include "cursor_span.hpp"
 
 
 // Serialization
@@ -29,8 +32,8 @@ public:
     CachedCursor(Index index = Index(-1)) : index_{index} {}
     bool is_empty() const { return index_ == Index(-1); }
     bool operator==(const CachedCursor &other) const { return index_ == other.index_; }
-    const std::vector<CachedCursor> &next(Context context) const;
-    const std::vector<CachedCursor> &prev(Context context) const;
+    CursorSpan<CachedCursor> next(Context context) const;
+    CursorSpan<CachedCursor> prev(Context context) const;
     char letter(Context context) const;
     Index index() const { return index_; }
 
@@ -64,12 +67,13 @@ class CachedCursorContext {
 public:
     using Index = CachedCursor::Index;
 
+    // cursors should be the same vector the context was built from
     template <typename Cursor>
-    static std::vector<Cursor> UnpackPath(const std::vector<CachedCursor> &path, const std::vector<Cursor> &cursors) {
+    std::vector<Cursor> UnpackPath(const std::vector<CachedCursor> &path, const std::vector<Cursor> &cursors) const {
         std::vector<Cursor> result;
         result.reserve(path.size());
         for (const auto &cursor : path) {
-            result.push_back(cursors[cursor.index()]);
+            result.push_back(cursors[order_[cursor.index()]]);
         }
         return result;
     }
@@ -94,38 +98,138 @@ public:
         }
 
         letters_.resize(cursors.size());
-        nexts_.resize(cursors.size());
-        prevs_.resize(cursors.size());
+        next_offsets_.assign(cursors.size() + 1, 0);
+        prev_offsets_.assign(cursors.size() + 1, 0);
         for (size_t i = 0; i < cursors.size(); ++i) {
             const auto &cursor = cursors[i];
             letters_[i] = cursor.letter(context);
-            for (const auto &c : cursor.next(context)) {
-                nexts_[i].push_back(cursor2index[c]);
-                nexts_[i].shrink_to_fit();
-            }
-            for (const auto &c : cursor.prev(context)) {
-                prevs_[i].push_back(cursor2index[c]);
-                prevs_[i].shrink_to_fit();
-            }
+            for_each_next(cursor, context, [&](const Cursor &c) { nexts_.push_back(cursor2index[c]); });
+            for_each_prev(cursor, context, [&](const Cursor &c) { prevs_.push_back(cursor2index[c]); });
+            next_offsets_[i + 1] = static_cast<Index>(nexts_.size());
+            prev_offsets_[i + 1] = static_cast<Index>(prevs_.size());
         }
+        VERIFY(std::numeric_limits<Index>::max() > std::max(nexts_.size(), prevs_.size()));
+        nexts_.shrink_to_fit();
+        prevs_.shrink_to_fit();
+        Reorder();
+    }
+
+    // Neighbours of the i-th cursor are nexts[next_offsets[i]], ..., nexts[next_offsets[i + 1] - 1]
+    CachedCursorContext(std::vector<char> letters,
+                        std::vector<Index> next_offsets, std::vector<CachedCursor> nexts,
+                        std::vector<Index> prev_offsets, std::vector<CachedCursor> prevs)
+            : letters_{std::move(letters)},
+              next_offsets_{std::move(next_offsets)}, nexts_{std::move(nexts)},
+              prev_offsets_{std::move(prev_offsets)}, prevs_{std::move(prevs)} {
+        VERIFY(next_offsets_.size() == letters_.size() + 1 && prev_offsets_.size() == letters_.size() + 1);
+        VERIFY(next_offsets_.back() == nexts_.size() && prev_offsets_.back() == prevs_.size());
+        Reorder();
     }
 
+    size_t size() const { return letters_.size(); }
+
+    // The position of the i-th cursor in the vector the context was built from
+    Index position(Index i) const { return order_[i]; }
+
     friend class CachedCursor;
 
     template <class Archive>
     void serialize(Archive &archive) {
-        archive(letters_, nexts_, prevs_);
+        archive(letters_, next_offsets_, nexts_, prev_offsets_, prevs_, order_);
     }
 private:
+    // Renumbers cursors depth-first along next() links starting from the sources, so unbranched runs
+    // get consecutive indices and DP touches neighbours in mostly sequential memory
+    void Reorder() {
+        const size_t n = letters_.size();
+        std::vector<Index> order;
+        order.reserve(n);
+        std::vector<bool> visited(n, false);
+        std::vector<Index> stack;
+        auto visit = [&](Index start) {
+            if (visited[start]) {
+                return;
+            }
+            visited[start] = true;
+            stack.push_back(start);
+            while (!stack.empty()) {
+                Index i = stack.back();
+                stack.pop_back();
+                order.push_back(i);
+                // Pushed in the reverse order, so the first next cursor follows the current one
+                for (Index j = next_offsets_[i + 1]; j-- > next_offsets_[i];) {
+                    Index next = nexts_[j].index();
+                    if (!visited[next]) {
+                        visited[next] = true;
+                        stack.push_back(next);
+                    }
+                }
+            }
+        };
+        for (Index i = 0; i < n; ++i) {
+            if (prev_offsets_[i] == prev_offsets_[i + 1]) {
+                visit(i);
+            }
+        }
+        for (Index i = 0; i < n; ++i) {
+            visit(i);
+        }
+
+        std::vector<Index> rank(n);
+        for (Index i = 0; i < n; ++i) {
+            rank[order[i]] = i;
+        }
+
+        auto permute = [&](const std::vector<Index> &offsets, const std::vector<CachedCursor> &adjacent,
+                           std::vector<Index> &new_offsets, std::vector<CachedCursor> &new_adjacent) {
+            new_offsets.resize(n + 1);
+            new_adjacent.resize(adjacent.size());
+            new_offsets[0] = 0;
+            for (Index i = 0; i < n; ++i) {
+                Index k = new_offsets[i];
+                for (Index j = offsets[order[i]]; j < offsets[order[i] + 1]; ++j) {
+                    new_adjacent[k++] = CachedCursor(rank[adjacent[j].index()]);
+                }
+                new_offsets[i + 1] = k;
+            }
+        };
+
+        std::vector<char> letters(n);
+        for (Index i = 0; i < n; ++i) {
+            letters[i] = letters_[order[i]];
+        }
+        std::vector<Index> next_offsets, prev_offsets;
+        std::vector<CachedCursor> nexts, prevs;
+        permute(next_offsets_, nexts_, next_offsets, nexts);
+        permute(prev_offsets_, prevs_, prev_offsets, prevs);
+
+        letters_ = std::move(letters);
+        next_offsets_ = std::move(next_offsets);
+        nexts_ = std::move(nexts);
+        prev_offsets_ = std::move(prev_offsets);
+        prevs_ = std::move(prevs);
+        order_ = std::move(order);
+    }
+
     std::vector<char> letters_;
-    std::vector<std::vector<CachedCursor>> nexts_;
-    std::vector<std::vector<CachedCursor>> prevs_;
+    // CSR adjacency
+    std::vector<Index> next_offsets_;
+    std::vector<CachedCursor> nexts_;
+    std::vector<Index> prev_offsets_;
+    std::vector<CachedCursor> prevs_;
+    std::vector<Index> order_;  // the position of the cursor in the original cursor vector
 };
 
 // FIXME add cpp
 
 inline char CachedCursor::letter(Context context) const { return context->letters_[index_]; }
 
-inline const std::vector<CachedCursor> &CachedCursor::next(Context context) const { return context->nexts_[index_]; }
+inline CursorSpan<CachedCursor> CachedCursor::next(Context context) const {
+    const CachedCursor *nexts = context->nexts_.data();
+    return {nexts + context->next_offsets_[index_], nexts + context->next_offsets_[index_ + 1]};
+}
 
-inline const std::vector<CachedCursor> &CachedCursor::prev(Context context) const { return context->prevs_[index_]; }
+inline CursorSpan<CachedCursor> CachedCursor::prev(Context context) const {
+    const CachedCursor *prevs = context->prevs_.data();
+    return {prevs + context->prev_offsets_[index_], prevs + context->prev_offsets_[index_ + 1]};
+}
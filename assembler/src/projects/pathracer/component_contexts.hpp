@@ -0,0 +1,200 @@
+//***************************************************************************
+//* Copyright (c) 2019 Saint Petersburg State University
+//* All Rights Reserved
+//* See file LICENSE for details.
+//***************************************************************************
+
+#pragma once
+
+#include "aa_cursor.hpp"
+#include "cached_cursor.hpp"
+#include "cursor_index.hpp"
+#include "cursor_set.hpp"
+#include "debruijn_graph_cursor.hpp"
+#include "depth_oracle.hpp"
+#include "restricted_cursor.hpp"
+
+#include "utils/logger/logger.hpp"
+#include "utils/verify.hpp"
+
+#include <algorithm>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+// Cached context over the cursors along with its depth table
+template <typename Cursor>
+struct CachedSearchSpace {
+  std::vector<Cursor> cursors;  // paths over the cached context are unpacked to them
+  std::unique_ptr<CachedCursorContext> context;
+  // Built in advance for the spaces shared by several searches, otherwise every search builds its own
+  std::unique_ptr<depth_filter::DepthOracle> depth;
+};
+
+// Model-independent search structures of a neighbourhood component: cursor contexts and depth tables.
+// Everything is built on the first request and is read-only afterwards, so a single instance
+// could serve all the models whose seeds produced the same component (see ComponentCache)
+class ComponentContexts {
+ public:
+  using GraphCursor = DebruijnGraphCursor;
+  using RestrictedCursor = OptimizedRestrictedGraphCursor<GraphCursor>;
+  using RestrictedContext = OptimizedRestrictedGraphCursorContext<GraphCursor>;
+
+  ComponentContexts(std::vector<GraphCursor> cursors,
+                    const debruijn_graph::ConjugateDeBruijnGraph &graph,
+                    const CursorIndex *cursor_index,
+                    bool shared = false)
+      : cursors_{std::move(cursors)}, graph_{graph}, cursor_index_{cursor_index}, shared_{shared} {}
+
+  const std::vector<GraphCursor> &cursors() const { return cursors_; }
+
+  // Subgraph carved from the cursor index, nullptr if there is no index or it misses some of the cursors
+  const CachedCursorContext *indexed() {
+    init();
+    return indexed_nt_.context.get();
+  }
+
+  // Available only if indexed() is nullptr
+  const RestrictedContext *restricted() {
+    init();
+    return restricted_context_.get();
+  }
+
+  const CachedSearchSpace<GraphCursor> &indexed_nt() {
+    init();
+    VERIFY(indexed_nt_.context);
+    std::call_once(indexed_nt_flag_, [this]() { fill_depth(indexed_nt_); });
+    return indexed_nt_;
+  }
+
+  const CachedSearchSpace<AAGraphCursor<CachedCursor>> &indexed_aa() {
+    const CachedCursorContext *context = indexed();
+    VERIFY(context);
+    std::call_once(indexed_aa_flag_, [this, context]() {
+      // Codons are read from the index instead of hashing the triplets of the context
+      indexed_aa_.context = cursor_index_->AAContext(*context, cursors_, indexed_aa_.cursors);
+      fill_depth(indexed_aa_);
+    });
+    return indexed_aa_;
+  }
+
+  const CachedSearchSpace<RestrictedCursor> &restricted_nt() {
+    const RestrictedContext *context = restricted();
+    VERIFY(context);
+    std::call_once(restricted_nt_flag_, [this, context]() { build(restricted_nt_, make_optimized_restricted_cursors(cursors_), context); });
+    return restricted_nt_;
+  }
+
+  const CachedSearchSpace<AAGraphCursor<RestrictedCursor>> &restricted_aa() {
+    const RestrictedContext *context = restricted();
+    VERIFY(context);
+    std::call_once(restricted_aa_flag_, [this, context]() {
+      build(restricted_aa_, make_aa_cursors(make_optimized_restricted_cursors(cursors_), context), context);
+    });
+    return restricted_aa_;
+  }
+
+ private:
+  std::vector<GraphCursor> cursors_;
+  const debruijn_graph::ConjugateDeBruijnGraph &graph_;
+  const CursorIndex *cursor_index_;
+  bool shared_;
+
+  std::once_flag init_flag_, indexed_nt_flag_, indexed_aa_flag_, restricted_nt_flag_, restricted_aa_flag_;
+  std::unique_ptr<CursorSet<GraphCursor>> cursor_set_;
+  std::unique_ptr<RestrictedContext> restricted_context_;
+  CachedSearchSpace<GraphCursor> indexed_nt_;
+  CachedSearchSpace<AAGraphCursor<CachedCursor>> indexed_aa_;
+  CachedSearchSpace<RestrictedCursor> restricted_nt_;
+  CachedSearchSpace<AAGraphCursor<RestrictedCursor>> restricted_aa_;
+
+  void init() {
+    std::call_once(init_flag_, [this]() {
+      if (cursor_index_) {
+        indexed_nt_.context = cursor_index_->Context(cursors_);
+        if (!indexed_nt_.context) {
+          WARN("Component cursors are missing in the cursor index, falling back to the graph");
+        } else {
+          // The indexed context is built from the component cursors, so paths are unpacked to them directly
+          indexed_nt_.cursors = cursors_;
+          return;
+        }
+      }
+
+      cursor_set_.reset(new CursorSet<GraphCursor>(cursors_.cbegin(), cursors_.cend()));
+      restricted_context_.reset(new RestrictedContext{*cursor_set_, &graph_});
+    });
+  }
+
+  template <typename Cursor, typename Context>
+  void build(CachedSearchSpace<Cursor> &space, std::vector<Cursor> cursors, Context context) const {
+    space.cursors = std::move(cursors);
+    space.context.reset(new CachedCursorContext(space.cursors, context));
+    fill_depth(space);
+  }
+
+  template <typename Cursor>
+  void fill_depth(CachedSearchSpace<Cursor> &space) const {
+    if (!shared_) {
+      return;
+    }
+
+    space.depth.reset(new depth_filter::DepthOracle(space.context.get()));
+  }
+};
+
+// Shares component contexts between the models (batched mode, see --batch).
+// All the uses of components are registered before the search, an entry is dropped after its last use.
+// Components are collected from hash sets, so the same component could come in different orders:
+// entries are keyed by the sorted cursors and the contexts are built over them
+class ComponentCache {
+ public:
+  using GraphCursor = DebruijnGraphCursor;
+
+  ComponentCache(const debruijn_graph::ConjugateDeBruijnGraph &graph, const CursorIndex *cursor_index)
+      : graph_{graph}, cursor_index_{cursor_index} {}
+
+  // Not thread-safe, should be called before any Acquire()
+  void Register(const std::vector<GraphCursor> &cursors) {
+    ++entries_[key(cursors)].uses;
+  }
+
+  std::shared_ptr<ComponentContexts> Acquire(const std::vector<GraphCursor> &cursors) {
+    auto sorted = key(cursors);
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto it = entries_.find(sorted);
+    VERIFY_MSG(it != entries_.end(), "Component was not registered");
+    auto &entry = it->second;
+    if (!entry.contexts) {
+      entry.contexts = std::make_shared<ComponentContexts>(it->first, graph_, cursor_index_, entry.uses > 1);
+    }
+
+    auto result = entry.contexts;
+    if (--entry.uses == 0) {
+      entries_.erase(it);
+    }
+
+    return result;
+  }
+
+  size_t size() const { return entries_.size(); }
+
+ private:
+  static std::vector<GraphCursor> key(std::vector<GraphCursor> cursors) {
+    std::sort(cursors.begin(), cursors.end());
+    return cursors;
+  }
+
+  struct Entry {
+    size_t uses = 0;
+    std::shared_ptr<ComponentContexts> contexts;
+  };
+
+  const debruijn_graph::ConjugateDeBruijnGraph &graph_;
+  const CursorIndex *cursor_index_;
+  std::mutex mutex_;
+  std::unordered_map<std::vector<GraphCursor>, Entry> entries_;
+};
+
+// vim: set ts=2 sw=2 et :
@@ -0,0 +1,138 @@
+//***************************************************************************
+//* Copyright (c) 2019 Saint Petersburg State University
+//* All Rights Reserved
+//* See file LICENSE for details.
+//***************************************************************************
+
+#pragma once
+
+#include <cstddef>
+#include <type_traits>
+#include <utility>
+
+// Non-allocating traversal of cursor neighbours: f(cursor) is called for every next (prev) cursor.
+// Cursors could provide for_each_next(context, f) / for_each_prev(context, f) members generating
+// neighbours in place; for the others (e.g. cached cursors whose next() is a span) the result
+// of next() / prev() is iterated
+
+namespace cursor_adjacency_impl {
+
+template <typename... Ts>
+struct make_void {
+  using type = void;
+};
+
+struct AnyVisitor {
+  template <typename T>
+  void operator()(const T &) const {}
+};
+
+template <typename T, typename = void>
+struct has_for_each_next : std::false_type {};
+
+template <typename T>
+struct has_for_each_next<T, typename make_void<decltype(std::declval<const T &>().for_each_next(
+                                std::declval<typename T::Context>(), AnyVisitor{}))>::type> : std::true_type {};
+
+template <typename T, typename = void>
+struct has_for_each_prev : std::false_type {};
+
+template <typename T>
+struct has_for_each_prev<T, typename make_void<decltype(std::declval<const T &>().for_each_prev(
+                                std::declval<typename T::Context>(), AnyVisitor{}))>::type> : std::true_type {};
+
+template <typename T, typename = void>
+struct has_for_each_next_frame_shift : std::false_type {};
+
+template <typename T>
+struct has_for_each_next_frame_shift<T, typename make_void<decltype(std::declval<const T &>().for_each_next_frame_shift(
+                                            std::declval<typename T::Context>(), AnyVisitor{}))>::type> : std::true_type {};
+
+template <typename T, typename = void>
+struct has_next_frame_shift : std::false_type {};
+
+template <typename T>
+struct has_next_frame_shift<T, typename make_void<decltype(std::declval<const T &>().next_frame_shift(
+                                   std::declval<typename T::Context>()))>::type> : std::true_type {};
+
+}  // namespace cursor_adjacency_impl
+
+template <typename Cursor, typename F>
+std::enable_if_t<cursor_adjacency_impl::has_for_each_next<Cursor>::value>
+for_each_next(const Cursor &cursor, typename Cursor::Context context, F &&f) {
+  cursor.for_each_next(context, std::forward<F>(f));
+}
+
+template <typename Cursor, typename F>
+std::enable_if_t<!cursor_adjacency_impl::has_for_each_next<Cursor>::value>
+for_each_next(const Cursor &cursor, typename Cursor::Context context, F &&f) {
+  for (const auto &next : cursor.next(context)) {
+    f(next);
+  }
+}
+
+template <typename Cursor, typename F>
+std::enable_if_t<cursor_adjacency_impl::has_for_each_prev<Cursor>::value>
+for_each_prev(const Cursor &cursor, typename Cursor::Context context, F &&f) {
+  cursor.for_each_prev(context, std::forward<F>(f));
+}
+
+template <typename Cursor, typename F>
+std::enable_if_t<!cursor_adjacency_impl::has_for_each_prev<Cursor>::value>
+for_each_prev(const Cursor &cursor, typename Cursor::Context context, F &&f) {
+  for (const auto &prev : cursor.prev(context)) {
+    f(prev);
+  }
+}
+
+// Frame shift transitions exist for amino acid cursors only, for the others nothing is visited
+template <typename Cursor, typename F>
+std::enable_if_t<cursor_adjacency_impl::has_for_each_next_frame_shift<Cursor>::value>
+for_each_next_frame_shift(const Cursor &cursor, typename Cursor::Context context, F &&f) {
+  cursor.for_each_next_frame_shift(context, std::forward<F>(f));
+}
+
+template <typename Cursor, typename F>
+std::enable_if_t<!cursor_adjacency_impl::has_for_each_next_frame_shift<Cursor>::value &&
+                 cursor_adjacency_impl::has_next_frame_shift<Cursor>::value>
+for_each_next_frame_shift(const Cursor &cursor, typename Cursor::Context context, F &&f) {
+  for (const auto &next : cursor.next_frame_shift(context)) {
+    f(next);
+  }
+}
+
+template <typename Cursor, typename F>
+std::enable_if_t<!cursor_adjacency_impl::has_for_each_next_frame_shift<Cursor>::value &&
+                 !cursor_adjacency_impl::has_next_frame_shift<Cursor>::value>
+for_each_next_frame_shift(const Cursor &, typename Cursor::Context, F &&) {}
+
+template <typename Cursor>
+size_t next_count(const Cursor &cursor, typename Cursor::Context context) {
+  size_t count = 0;
+  for_each_next(cursor, context, [&count](const Cursor &) { ++count; });
+  return count;
+}
+
+template <typename Cursor>
+size_t prev_count(const Cursor &cursor, typename Cursor::Context context) {
+  size_t count = 0;
+  for_each_prev(cursor, context, [&count](const Cursor &) { ++count; });
+  return count;
+}
+
+// For cursors having exactly one next (prev) cursor, e.g. inside unbranched runs
+template <typename Cursor>
+Cursor unique_next(const Cursor &cursor, typename Cursor::Context context) {
+  Cursor result;
+  for_each_next(cursor, context, [&result](const Cursor &next) { result = next; });
+  return result;
+}
+
+template <typename Cursor>
+Cursor unique_prev(const Cursor &cursor, typename Cursor::Context context) {
+  Cursor result;
+  for_each_prev(cursor, context, [&result](const Cursor &prev) { result = prev; });
+  return result;
+}
+
+// vim: set ts=2 sw=2 et :
@@ -6,6 +6,8 @@
 
 #pragma once
 
+#include "cursor_adjacency.hpp"
+
 #include <common/adt/concurrent_dsu.hpp>
 #include <unordered_map>
 
@@ -31,15 +33,15 @@ std::vector<std::vector<GraphCursor>> cursor_connected_components(const std::vec
   for (const auto &kv : cursor2id) {
     const GraphCursor &cursor = kv.first;
     const size_t &id = kv.second;
-    for (const auto &adj : {cursor.next(context), cursor.prev(context)}) {
-      for (const GraphCursor &adj_cursor : adj) {
-        auto it = cursor2id.find(adj_cursor);
-        if (it != cursor2id.cend()) {
-          size_t &adj_id = it->second;
-          dsu.unite(id, adj_id);
-        }
+    auto unite = [&](const GraphCursor &adj_cursor) {
+      auto it = cursor2id.find(adj_cursor);
+      if (it != cursor2id.cend()) {
+        size_t &adj_id = it->second;
+        dsu.unite(id, adj_id);
       }
-    }
+    };
+    for_each_next(cursor, context, unite);
+    for_each_prev(cursor, context, unite);
   }
 
   std::vector<std::vector<size_t>> comps_ids;
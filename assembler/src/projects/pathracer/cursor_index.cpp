@@ -0,0 +1,366 @@
+//***************************************************************************
+//* Copyright (c) 2019 Saint Petersburg State University
+//* All Rights Reserved
+//* See file LICENSE for details.
+//***************************************************************************
+
+#include "cursor_index.hpp"
+
+#include "sequence/aa.hpp"
+#include "utils/logger/logger.hpp"
+#include "common/utils/verify.hpp"
+
+#include <sys/stat.h>
+
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+#include <functional>
+#include <numeric>
+
+using namespace debruijn_graph;
+
+constexpr CursorIndex::Index CursorIndex::NONE;
+const uint64_t CursorIndex::VERSION;
+const char CursorIndex::MAGIC[8] = {'P', 'R', 'C', 'U', 'R', 'I', 'D', 'X'};
+
+namespace {
+
+size_t index_of(const DebruijnGraphCursor &cursor,
+                const uint64_t *edge_offsets, const uint32_t *edge_first_pos, size_t n_edge_ids) {
+  size_t id = cursor.edge().int_id();
+  if (cursor.is_empty() || id >= n_edge_ids || cursor.position() < edge_first_pos[id]) {
+    return CursorIndex::NONE;
+  }
+
+  size_t i = edge_offsets[id] + cursor.position() - edge_first_pos[id];
+  return i < edge_offsets[id + 1] ? i : CursorIndex::NONE;
+}
+
+template <typename T>
+void write_array(std::ofstream &out, const std::vector<T> &v) {
+  out.write(reinterpret_cast<const char *>(v.data()), v.size() * sizeof(T));
+  // Keep all the arrays 8-byte aligned
+  size_t padding = (8 - v.size() * sizeof(T) % 8) % 8;
+  const char zeros[8] = {};
+  out.write(zeros, padding);
+}
+
+template <typename T>
+const T *map_array(const char *&p, size_t size) {
+  const T *result = reinterpret_cast<const T *>(p);
+  p += (size * sizeof(T) + 7) / 8 * 8;
+  return result;
+}
+
+bool file_identity(const std::string &filename, uint64_t &size, int64_t &mtime) {
+  struct stat st;
+  if (stat(filename.c_str(), &st) != 0) {
+    return false;
+  }
+  size = static_cast<uint64_t>(st.st_size);
+  mtime = static_cast<int64_t>(st.st_mtime);
+  return true;
+}
+
+}  // namespace
+
+uint64_t CursorIndex::Fingerprint(const ConjugateDeBruijnGraph &graph) {
+  uint64_t result = graph.k();
+  auto combine = [&result](uint64_t value) { result ^= value + 0x9e3779b97f4a7c15ULL + (result << 6) + (result >> 2); };
+  for (auto it = graph.ConstEdgeBegin(); !it.IsEnd(); ++it) {
+    EdgeId e = *it;
+    combine(e.int_id());
+    combine(graph.EdgeStart(e).int_id());
+    combine(graph.EdgeEnd(e).int_id());
+    combine(std::hash<std::string>()(graph.EdgeNucls(e).str()));
+  }
+  return result;
+}
+
+// Layout of the edges the index was built for, cheap enough to check on every load
+bool CursorIndex::Matches(const ConjugateDeBruijnGraph &graph) const {
+  const size_t k = graph.k();
+  size_t n_edges = 0;
+  for (auto it = graph.ConstEdgeBegin(); !it.IsEnd(); ++it) {
+    EdgeId e = *it;
+    size_t id = e.int_id();
+    if (id >= header_->n_edge_ids) {
+      return false;
+    }
+    size_t first_pos = graph.IncomingEdgeCount(graph.EdgeStart(e)) ? k : 0;
+    if (edge_first_pos_[id] != first_pos || edge_offsets_[id + 1] - edge_offsets_[id] != graph.length(e) + k - first_pos) {
+      return false;
+    }
+    ++n_edges;
+  }
+
+  size_t n_indexed = 0;
+  for (size_t id = 0; id < header_->n_edge_ids; ++id) {
+    n_indexed += edge_offsets_[id] != edge_offsets_[id + 1];
+  }
+  return n_edges == n_indexed;
+}
+
+void CursorIndex::Build(const ConjugateDeBruijnGraph &graph, const std::string &filename,
+                        const std::string &source) {
+  const size_t k = graph.k();
+  size_t n_edge_ids = 0;
+  for (auto it = graph.ConstEdgeBegin(); !it.IsEnd(); ++it) {
+    n_edge_ids = std::max<size_t>(n_edge_ids, (*it).int_id() + 1);
+  }
+
+  // Cursors inside the start vertex of an edge having incoming edges are not normalized,
+  // they coincide with the cursors at the ends of incoming edges
+  std::vector<uint32_t> edge_first_pos(n_edge_ids, 0);
+  std::vector<uint64_t> edge_offsets(n_edge_ids + 1, 0);
+  for (auto it = graph.ConstEdgeBegin(); !it.IsEnd(); ++it) {
+    EdgeId e = *it;
+    edge_first_pos[e.int_id()] = static_cast<uint32_t>(graph.IncomingEdgeCount(graph.EdgeStart(e)) ? k : 0);
+    edge_offsets[e.int_id() + 1] = graph.length(e) + k - edge_first_pos[e.int_id()];
+  }
+  std::partial_sum(edge_offsets.cbegin(), edge_offsets.cend(), edge_offsets.begin());
+  const size_t n_cursors = edge_offsets.back();
+  VERIFY_MSG(n_cursors < NONE, "Too many cursors for 32-bit index: " << n_cursors);
+  INFO("Indexing " << n_cursors << " cursors");
+
+  std::vector<char> letters(n_cursors);
+  std::vector<uint64_t> next_offsets(n_cursors + 1, 0), prev_offsets(n_cursors + 1, 0);
+  std::vector<Index> nexts, prevs;
+  nexts.reserve(n_cursors);
+  prevs.reserve(n_cursors);
+  auto index = [&](const DebruijnGraphCursor &cursor) -> Index {
+    size_t i = index_of(cursor, edge_offsets.data(), edge_first_pos.data(), n_edge_ids);
+    VERIFY(i != NONE);
+    return static_cast<Index>(i);
+  };
+
+  for (size_t id = 0; id < n_edge_ids; ++id) {
+    if (edge_offsets[id] == edge_offsets[id + 1]) {
+      continue;
+    }
+    EdgeId e(id);
+    for (size_t pos = edge_first_pos[id]; pos < graph.length(e) + k; ++pos) {
+      DebruijnGraphCursor cursor(e, pos);
+      size_t i = index(cursor);
+      letters[i] = cursor.letter(&graph);
+      cursor.for_each_next(&graph, [&](const DebruijnGraphCursor &next) { nexts.push_back(index(next)); });
+      cursor.for_each_prev(&graph, [&](const DebruijnGraphCursor &prev) { prevs.push_back(index(prev)); });
+      next_offsets[i + 1] = nexts.size();
+      prev_offsets[i + 1] = prevs.size();
+    }
+  }
+
+  // Codons are enumerated the way make_aa_cursors() does: along the next() links of the first cursor
+  std::vector<uint64_t> codon_offsets(n_cursors + 1, 0);
+  std::vector<Codon> codons;
+  std::vector<char> codon_letters;
+  codons.reserve(n_cursors);
+  codon_letters.reserve(n_cursors);
+  for (size_t i = 0; i < n_cursors; ++i) {
+    for (size_t j = next_offsets[i]; j < next_offsets[i + 1]; ++j) {
+      Index second = nexts[j];
+      for (size_t l = next_offsets[second]; l < next_offsets[second + 1]; ++l) {
+        Index third = nexts[l];
+        codons.push_back({second, third});
+        codon_letters.push_back(aa::to_one_letter(aa::to_aa(letters[i], letters[second], letters[third])));
+      }
+    }
+    codon_offsets[i + 1] = codons.size();
+  }
+  INFO("Indexed " << codons.size() << " codons");
+
+  Header header;
+  std::memset(&header, 0, sizeof(header));
+  std::memcpy(header.magic, MAGIC, sizeof(MAGIC));
+  header.version = VERSION;
+  header.k = k;
+  header.n_edge_ids = n_edge_ids;
+  header.n_cursors = n_cursors;
+  header.n_next = nexts.size();
+  header.n_prev = prevs.size();
+  header.n_codons = codons.size();
+  header.fingerprint = Fingerprint(graph);
+  if (!file_identity(source, header.source_size, header.source_mtime)) {
+    WARN("Cannot stat " << source << ", the graph will be fingerprinted on every load of the index");
+  }
+
+  std::ofstream out(filename, std::ios::binary);
+  VERIFY_MSG(out, "Cannot open " << filename);
+  out.write(reinterpret_cast<const char *>(&header), sizeof(header));
+  write_array(out, edge_offsets);
+  write_array(out, edge_first_pos);
+  write_array(out, letters);
+  write_array(out, next_offsets);
+  write_array(out, nexts);
+  write_array(out, prev_offsets);
+  write_array(out, prevs);
+  write_array(out, codon_offsets);
+  write_array(out, codons);
+  write_array(out, codon_letters);
+  VERIFY_MSG(out, "Error writing " << filename);
+  INFO("Cursor index saved to " << filename);
+}
+
+CursorIndex::CursorIndex(const std::string &filename, const ConjugateDeBruijnGraph &graph,
+                         const std::string &source)
+    : file_(filename, /* unlink */ false, /* blocksize */ -1ULL) {
+  VERIFY_MSG(file_.size() >= sizeof(Header), "Cursor index " << filename << " is truncated");
+  const char *p = static_cast<const char *>(file_.data());
+  header_ = reinterpret_cast<const Header *>(p);
+  VERIFY_MSG(std::memcmp(header_->magic, MAGIC, sizeof(MAGIC)) == 0 && header_->version == VERSION,
+             filename << " is not a cursor index of supported version");
+
+  p += sizeof(Header);
+  edge_offsets_ = map_array<uint64_t>(p, header_->n_edge_ids + 1);
+  edge_first_pos_ = map_array<uint32_t>(p, header_->n_edge_ids);
+  letters_ = map_array<char>(p, header_->n_cursors);
+  next_offsets_ = map_array<uint64_t>(p, header_->n_cursors + 1);
+  next_ = map_array<Index>(p, header_->n_next);
+  prev_offsets_ = map_array<uint64_t>(p, header_->n_cursors + 1);
+  prev_ = map_array<Index>(p, header_->n_prev);
+  codon_offsets_ = map_array<uint64_t>(p, header_->n_cursors + 1);
+  codons_ = map_array<Codon>(p, header_->n_codons);
+  codon_letters_ = map_array<char>(p, header_->n_codons);
+  VERIFY_MSG(p <= static_cast<const char *>(file_.data()) + file_.size(), "Cursor index " << filename << " is truncated");
+
+  // Sequences are hashed only if the graph file was changed after the index had been built
+  uint64_t source_size = 0;
+  int64_t source_mtime = 0;
+  bool same_source = file_identity(source, source_size, source_mtime) &&
+                     source_size == header_->source_size && source_mtime == header_->source_mtime;
+  VERIFY_MSG(header_->k == graph.k() && Matches(graph) && (same_source || header_->fingerprint == Fingerprint(graph)),
+             "Cursor index " << filename << " was built for another graph");
+  INFO("Cursor index loaded: " << size() << " cursors");
+}
+
+CursorIndex::Index CursorIndex::index(const DebruijnGraphCursor &cursor) const {
+  return static_cast<Index>(index_of(cursor, edge_offsets_, edge_first_pos_, header_->n_edge_ids));
+}
+
+std::unique_ptr<CachedCursorContext> CursorIndex::Context(const std::vector<DebruijnGraphCursor> &cursors) const {
+  VERIFY(cursors.size() < NONE);
+  // (global index, local index) sorted by global one, used for subgraph membership lookups
+  std::vector<std::pair<Index, Index>> ids;
+  ids.reserve(cursors.size());
+  for (size_t i = 0; i < cursors.size(); ++i) {
+    Index global = index(cursors[i]);
+    if (global == NONE) {
+      return nullptr;
+    }
+    ids.emplace_back(global, static_cast<Index>(i));
+  }
+  std::sort(ids.begin(), ids.end());
+
+  auto local = [&ids](Index global) -> Index {
+    auto it = std::lower_bound(ids.cbegin(), ids.cend(), std::make_pair(global, Index(0)));
+    return it != ids.cend() && it->first == global ? it->second : NONE;
+  };
+
+  std::vector<char> letters(cursors.size());
+  std::vector<Index> next_offsets(cursors.size() + 1, 0), prev_offsets(cursors.size() + 1, 0);
+  std::vector<CachedCursor> nexts, prevs;
+  for (size_t i = 0; i < cursors.size(); ++i) {
+    Index global = index(cursors[i]);
+    letters[i] = letter(global);
+    for (Index next : next(global)) {
+      Index j = local(next);
+      if (j != NONE) {
+        nexts.emplace_back(j);
+      }
+    }
+    for (Index prev : prev(global)) {
+      Index j = local(prev);
+      if (j != NONE) {
+        prevs.emplace_back(j);
+      }
+    }
+    next_offsets[i + 1] = static_cast<Index>(nexts.size());
+    prev_offsets[i + 1] = static_cast<Index>(prevs.size());
+  }
+
+  return std::unique_ptr<CachedCursorContext>(new CachedCursorContext(std::move(letters),
+                                                                      std::move(next_offsets), std::move(nexts),
+                                                                      std::move(prev_offsets), std::move(prevs)));
+}
+
+std::unique_ptr<CachedCursorContext> CursorIndex::AAContext(const CachedCursorContext &context,
+                                                            const std::vector<DebruijnGraphCursor> &cursors,
+                                                            std::vector<AAGraphCursor<CachedCursor>> &aa_cursors) const {
+  const size_t n = context.size();
+  std::vector<Index> global(n);
+  std::vector<std::pair<Index, Index>> ids;
+  ids.reserve(n);
+  for (Index i = 0; i < n; ++i) {
+    global[i] = index(cursors[context.position(i)]);
+    VERIFY(global[i] != NONE);
+    ids.emplace_back(global[i], i);
+  }
+  std::sort(ids.begin(), ids.end());
+
+  auto local = [&ids](Index global) -> Index {
+    auto it = std::lower_bound(ids.cbegin(), ids.cend(), std::make_pair(global, Index(0)));
+    return it != ids.cend() && it->first == global ? it->second : NONE;
+  };
+
+  // Codons of the component are the ones with all the cursors in it, they are numbered in the order
+  // of make_aa_cursors() over the context. local_codon[first[i] + j] is the number of the j-th codon
+  // of the i-th cursor in the index, NONE if it leaves the component
+  std::vector<size_t> first(n + 1, 0);
+  std::vector<Index> local_codon;
+  std::vector<std::array<Index, 3>> triplets;
+  std::vector<char> letters;
+  for (Index i = 0; i < n; ++i) {
+    first[i] = local_codon.size();
+    for (uint64_t c = codon_offsets_[global[i]]; c < codon_offsets_[global[i] + 1]; ++c) {
+      Index second = local(codons_[c].second), third = local(codons_[c].third);
+      if (second == NONE || third == NONE) {
+        local_codon.push_back(NONE);
+        continue;
+      }
+      local_codon.push_back(static_cast<Index>(triplets.size()));
+      triplets.push_back({i, second, third});
+      letters.push_back(codon_letters_[c]);
+    }
+  }
+  first[n] = local_codon.size();
+  VERIFY(triplets.size() < NONE);
+
+  // Adjacency of the codons follows AAGraphCursor::for_each_next() / for_each_prev()
+  std::vector<Index> next_offsets(triplets.size() + 1, 0), prev_offsets(triplets.size() + 1, 0);
+  std::vector<CachedCursor> nexts, prevs;
+  for (size_t a = 0; a < triplets.size(); ++a) {
+    for (const CachedCursor &next : CachedCursor(triplets[a][2]).next(&context)) {
+      for (size_t c = first[next.index()]; c < first[next.index() + 1]; ++c) {
+        if (local_codon[c] != NONE) {
+          nexts.emplace_back(local_codon[c]);
+        }
+      }
+    }
+    for (const CachedCursor &third : CachedCursor(triplets[a][0]).prev(&context)) {
+      for (const CachedCursor &second : third.prev(&context)) {
+        for (const CachedCursor &prev : second.prev(&context)) {
+          auto codon = std::find_if(local_codon.cbegin() + first[prev.index()], local_codon.cbegin() + first[prev.index() + 1],
+                                    [&](Index codon) {
+                                      return codon != NONE && triplets[codon][1] == second.index() && triplets[codon][2] == third.index();
+                                    });
+          VERIFY(codon != local_codon.cbegin() + first[prev.index() + 1]);
+          prevs.emplace_back(*codon);
+        }
+      }
+    }
+    next_offsets[a + 1] = static_cast<Index>(nexts.size());
+    prev_offsets[a + 1] = static_cast<Index>(prevs.size());
+  }
+
+  aa_cursors.clear();
+  aa_cursors.reserve(triplets.size());
+  for (const auto &triplet : triplets) {
+    aa_cursors.emplace_back(CachedCursor(triplet[0]), CachedCursor(triplet[1]), CachedCursor(triplet[2]));
+  }
+  return std::unique_ptr<CachedCursorContext>(new CachedCursorContext(std::move(letters),
+                                                                      std::move(next_offsets), std::move(nexts),
+                                                                      std::move(prev_offsets), std::move(prevs)));
+}
+
+// vim: set ts=2 sw=2 et :
@@ -0,0 +1,106 @@
+//***************************************************************************
+//* Copyright (c) 2019 Saint Petersburg State University
+//* All Rights Reserved
+//* See file LICENSE for details.
+//***************************************************************************
+
+#pragma once
+
+#include "aa_cursor.hpp"
+#include "cached_cursor.hpp"
+#include "debruijn_graph_cursor.hpp"
+
+#include "io/kmers/mmapped_reader.hpp"
+
+#include <llvm/ADT/ArrayRef.h>
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+// Nucleotide cursor graph of the whole assembly graph in CSR layout along with its codons.
+// It is built once per graph by pathracer-index and memory-mapped by pathracer,
+// so per-component cached contexts are carved out of it without touching
+// the assembly graph and without hashing of cursors.
+// Only normalized cursors (see DebruijnGraphCursor::get_cursors()) are indexed.
+class CursorIndex {
+ public:
+  using Index = uint32_t;
+  static constexpr Index NONE = Index(-1);
+
+  // source is the file the graph was loaded from, its size and modification time are kept with the fingerprint
+  static void Build(const debruijn_graph::ConjugateDeBruijnGraph &graph, const std::string &filename,
+                    const std::string &source);
+
+  // Maps the index and checks that it was built for the given graph. The fingerprint of the graph is
+  // recomputed only if its source file is not the one the index was built from
+  CursorIndex(const std::string &filename, const debruijn_graph::ConjugateDeBruijnGraph &graph,
+              const std::string &source);
+
+  size_t size() const { return header_->n_cursors; }
+
+  Index index(const DebruijnGraphCursor &cursor) const;
+
+  char letter(Index i) const { return letters_[i]; }
+  llvm::ArrayRef<Index> next(Index i) const {
+    return llvm::makeArrayRef(next_ + next_offsets_[i], next_ + next_offsets_[i + 1]);
+  }
+  llvm::ArrayRef<Index> prev(Index i) const {
+    return llvm::makeArrayRef(prev_ + prev_offsets_[i], prev_ + prev_offsets_[i + 1]);
+  }
+
+  // Cached context of the subgraph induced by the cursors, its UnpackPath() maps paths back to the cursors.
+  // The search addresses its dense columns and depth tables by the cursors of the context, so the component
+  // is renumbered rather than viewed through a lookup per transition.
+  // Returns nullptr if some of the cursors are not indexed
+  std::unique_ptr<CachedCursorContext> Context(const std::vector<DebruijnGraphCursor> &cursors) const;
+
+  // Codon graph over the context carved for the cursors: the same context (and the same aa_cursors)
+  // CachedCursorContext(make_aa_cursors(context.Cursors(), &context), &context) builds, read from the index
+  std::unique_ptr<CachedCursorContext> AAContext(const CachedCursorContext &context,
+                                                 const std::vector<DebruijnGraphCursor> &cursors,
+                                                 std::vector<AAGraphCursor<CachedCursor>> &aa_cursors) const;
+
+ private:
+  struct Header {
+    char magic[8];
+    uint64_t version;
+    uint64_t k;
+    uint64_t n_edge_ids;
+    uint64_t n_cursors;
+    uint64_t n_next;
+    uint64_t n_prev;
+    uint64_t n_codons;
+    uint64_t fingerprint;
+    // Identity of the graph file the fingerprint was computed for
+    uint64_t source_size;
+    int64_t source_mtime;
+  };
+
+  struct Codon {
+    Index second, third;
+  };
+
+  static const char MAGIC[8];
+  static const uint64_t VERSION = 2;
+
+  static uint64_t Fingerprint(const debruijn_graph::ConjugateDeBruijnGraph &graph);
+  bool Matches(const debruijn_graph::ConjugateDeBruijnGraph &graph) const;
+
+  MMappedReader file_;
+  const Header *header_;
+  const uint64_t *edge_offsets_;  // the index of the first cursor of edge, n_edge_ids + 1 entries
+  const uint32_t *edge_first_pos_;  // the position of the first cursor of edge
+  const char *letters_;
+  const uint64_t *next_offsets_;
+  const Index *next_;
+  const uint64_t *prev_offsets_;
+  const Index *prev_;
+  // Codons (triplets along next() links) starting at the i-th cursor are codon_offsets_[i], ..., codon_offsets_[i + 1] - 1
+  const uint64_t *codon_offsets_;
+  const Codon *codons_;
+  const char *codon_letters_;
+};
+
+// vim: set ts=2 sw=2 et :
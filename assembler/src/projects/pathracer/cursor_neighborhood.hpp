@@ -6,6 +6,8 @@
 
 #pragma once
 
+#include "cursor_adjacency.hpp"
+
 #include <boost/heap/binomial_heap.hpp>
 #include <unordered_map>
 #include <unordered_set>
@@ -83,12 +85,12 @@ std::vector<GraphCursor> depth_subset(const std::vector<std::pair<GraphCursor, s
         visited.insert(cursor_with_depth.key);
 
         if (cursor_with_depth.value > 0) {
-            auto cursors = forward ? cursor_with_depth.key.next(context) : cursor_with_depth.key.prev(context);
-            for (const auto &cursor : cursors) {
+            auto push = [&](const GraphCursor &cursor) {
                 if (!visited.count(cursor)) {
                     q.push_or_increase(cursor, cursor_with_depth.value - 1);
                 }
-            }
+            };
+            forward ? for_each_next(cursor_with_depth.key, context, push) : for_each_prev(cursor_with_depth.key, context, push);
         }
     }
 
@@ -136,12 +138,12 @@ std::vector<GraphCursor> depth_subset_dirty_heap(const std::vector<std::pair<Gra
         visited.insert(cursor_with_depth.cursor);
 
         if (cursor_with_depth.depth > 0) {
-            auto cursors = forward ? cursor_with_depth.cursor.next(context) : cursor_with_depth.cursor.prev(context);
-            for (const auto &cursor : cursors) {
+            auto push = [&](const GraphCursor &cursor) {
                 if (!visited.count(cursor)) {
                     q.push({cursor, cursor_with_depth.depth - 1});
                 }
-            }
+            };
+            forward ? for_each_next(cursor_with_depth.cursor, context, push) : for_each_prev(cursor_with_depth.cursor, context, push);
         }
     }
 
@@ -0,0 +1,116 @@
+//***************************************************************************
+//* Copyright (c) 2019 Saint Petersburg State University
+//* All Rights Reserved
+//* See file LICENSE for details.
+//***************************************************************************
+
+#pragma once
+
+#include "debruijn_graph_cursor.hpp"
+
+#include <parallel_hashmap/phmap.h>
+
+#include <algorithm>
+#include <cstdint>
+#include <unordered_set>
+#include <vector>
+
+// Read-only set of cursors a restricted cursor context is limited to (see OptimizedRestrictedGraphCursorContext).
+// Generic cursors are kept in a hash set, de Bruijn graph cursors are packed per edge (see the specialization)
+template <class GraphCursor>
+class CursorSet {
+ public:
+  template <typename Iterator>
+  CursorSet(Iterator begin, Iterator end) : set_(begin, end) {}
+
+  size_t count(const GraphCursor &cursor) const { return set_.count(cursor); }
+  size_t size() const { return set_.size(); }
+
+ private:
+  std::unordered_set<GraphCursor> set_;
+};
+
+// Cursors of an edge are kept as a position interval, plus a bitmap over the interval if it has gaps.
+// Components consist of whole edges or long runs of them, so most edges take a single map entry,
+// and a lookup is one probe into a flat map followed by an interval check or a bit test
+template <>
+class CursorSet<DebruijnGraphCursor> {
+ public:
+  template <typename Iterator>
+  CursorSet(Iterator begin, Iterator end) {
+    for (auto it = begin; it != end; ++it) {
+      auto ins = edges_.insert({it->edge().int_id(), {it->position(), it->position(), 0}});
+      Edge &edge = ins.first->second;
+      edge.first = std::min(edge.first, it->position());
+      edge.last = std::max(edge.last, it->position());
+    }
+
+    // Bitmaps are built for all the edges first (cursors could repeat), the full ones are dropped afterwards
+    std::vector<uint64_t> bits;
+    for (auto &kv : edges_) {
+      Edge &edge = kv.second;
+      edge.bits = bits.size();
+      bits.resize(bits.size() + words(edge), 0);
+    }
+    for (auto it = begin; it != end; ++it) {
+      const Edge &edge = edges_.find(it->edge().int_id())->second;
+      size_t i = it->position() - edge.first;
+      bits[edge.bits + i / 64] |= uint64_t(1) << (i % 64);
+    }
+
+    size_ = 0;
+    for (auto &kv : edges_) {
+      Edge &edge = kv.second;
+      size_t count = 0;
+      for (size_t i = 0; i < words(edge); ++i) {
+        count += __builtin_popcountll(bits[edge.bits + i]);
+      }
+      size_ += count;
+      if (count == edge.last - edge.first + 1) {
+        edge.bits = NO_BITS;
+      } else {
+        size_t offset = bits_.size();
+        bits_.insert(bits_.end(), bits.cbegin() + edge.bits, bits.cbegin() + edge.bits + words(edge));
+        edge.bits = offset;
+      }
+    }
+    bits_.shrink_to_fit();
+  }
+
+  size_t count(const DebruijnGraphCursor &cursor) const {
+    auto it = edges_.find(cursor.edge().int_id());
+    if (it == edges_.end()) {
+      return 0;
+    }
+
+    const Edge &edge = it->second;
+    size_t pos = cursor.position();
+    if (pos < edge.first || pos > edge.last) {
+      return 0;
+    }
+    if (edge.bits == NO_BITS) {
+      return 1;
+    }
+
+    size_t i = pos - edge.first;
+    return (bits_[edge.bits + i / 64] >> (i % 64)) & 1;
+  }
+
+  size_t size() const { return size_; }
+
+ private:
+  static const size_t NO_BITS = size_t(-1);
+
+  struct Edge {
+    size_t first, last;  // positions interval
+    size_t bits;         // offset of the bitmap in bits_, NO_BITS if the interval is full
+  };
+
+  static size_t words(const Edge &edge) { return (edge.last - edge.first) / 64 + 1; }
+
+  phmap::flat_hash_map<uint64_t, Edge> edges_;
+  std::vector<uint64_t> bits_;
+  size_t size_;
+};
+
+// vim: set ts=2 sw=2 et :
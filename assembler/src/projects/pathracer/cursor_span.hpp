@@ -0,0 +1,49 @@
+//***************************************************************************
+//* Copyright (c) 2019 Saint Petersburg State University
+//* All Rights Reserved
+//* See file LICENSE for details.
+//***************************************************************************
+
+#pragma once
+
+#include <cstddef>
+#include <ostream>
+#include <vector>
+
+// Read-only view of contiguous cursors returned by next()/prev() of cached cursors.
+// Unlike llvm::ArrayRef it is not convertible to std::vector, so expressions like
+// `cursor.is_empty() ? initial : cursor.next(context)` stay unambiguous
+template <typename T>
+class CursorSpan {
+ public:
+  using value_type = T;
+  using const_iterator = const T *;
+  using iterator = const_iterator;
+
+  CursorSpan() = default;
+  CursorSpan(const T *begin, const T *end) : begin_{begin}, end_{end} {}
+  CursorSpan(const std::vector<T> &v) : begin_{v.data()}, end_{v.data() + v.size()} {}
+
+  const T *begin() const { return begin_; }
+  const T *end() const { return end_; }
+  size_t size() const { return end_ - begin_; }
+  bool empty() const { return begin_ == end_; }
+  const T &operator[](size_t i) const { return begin_[i]; }
+
+ private:
+  const T *begin_ = nullptr;
+  const T *end_ = nullptr;
+};
+
+template <typename T>
+std::ostream &operator<<(std::ostream &os, const CursorSpan<T> &span) {
+  os << "[";
+  const char *delim = "";
+  for (const auto &e : span) {
+    os << delim << e;
+    delim = ", ";
+  }
+  return os << "]";
+}
+
+// vim: set ts=2 sw=2 et :
@@ -7,10 +7,14 @@
 #pragma once
 
 #include <parallel_hashmap/phmap.h>
+#include <cstdint>
+#include <limits>
 #include <vector>
 
 #include "common/utils/verify.hpp"
 
+#include "cursor_adjacency.hpp"
+
 #include "fees.hpp"
 
 template <typename Cursor>
@@ -19,7 +23,7 @@ auto vertex_cursors(const std::vector<Cursor> &cursors, typename Cursor::Context
 
     for (const Cursor &cursor : cursors) {
         VERIFY(!cursor.is_empty());
-        if (cursor.prev(context).size() != 1 || cursor.next(context).size() != 1) {
+        if (prev_count(cursor, context) != 1 || next_count(cursor, context) != 1) {
             result.insert(cursor);
         }
     }
@@ -35,7 +39,7 @@ auto vertex_cursors(const std::vector<Cursor> &cursors, typename Cursor::Context
         Cursor p = cursor;
         while (!result.count(p) && !processed.count(p)) {
             processed.insert(p);
-            p = p.prev(context)[0];
+            p = unique_prev(p, context);
         }
         if (p == cursor) {
             INFO("Isolated loop detected");
@@ -60,8 +64,8 @@ auto extract_leftmost_cursors(const phmap::flat_hash_set<Cursor> &cursors, const
 
         Cursor p = cursor;
         do {
-            VERIFY(p.prev(context).size() == 1 && p.next(context).size() == 1);
-            p = p.prev(context)[0];
+            VERIFY(prev_count(p, context) == 1 && next_count(p, context) == 1);
+            p = unique_prev(p, context);
         } while (!cursors.count(p) && !vertices.count(p));
 
         if (!cursors.count(p)) {
@@ -115,3 +119,62 @@ auto ultra_compression(const phmap::flat_hash_set<Cursor> &vertices, typename Cu
 
     return outgoing;
 }
+
+// Unbranched runs between vertex cursors (see vertex_cursors()) laid out as plain arrays.
+// Every non-vertex cursor belongs to exactly one run; a run is entered only from its source vertex
+// and leaves to its end vertex, so I-loops could be relaxed along a run by a linear scan
+template <typename Cursor>
+class UnbranchedRuns {
+public:
+    struct Position {
+        uint32_t run;
+        uint32_t offset;
+    };
+
+    UnbranchedRuns(const phmap::flat_hash_set<Cursor> &vertices, typename Cursor::Context context,
+                   const hmm::DigitalCodind &code) {
+        offsets_.push_back(0);
+        for (const Cursor &vertex : vertices) {
+            for (Cursor n : vertex.next(context)) {
+                if (vertices.count(n)) {
+                    continue;
+                }
+
+                uint32_t run = static_cast<uint32_t>(sources_.size());
+                uint32_t offset = 0;
+                do {
+                    VERIFY(prev_count(n, context) == 1 && next_count(n, context) == 1);
+                    positions_[n] = {run, offset++};
+                    cursors_.push_back(n);
+                    codes_.push_back(static_cast<uint8_t>(code(n.letter(context))));
+                    n = unique_next(n, context);
+                } while (!vertices.count(n));
+                sources_.push_back(vertex);
+                ends_.push_back(n);
+                VERIFY(cursors_.size() < std::numeric_limits<uint32_t>::max());
+                offsets_.push_back(static_cast<uint32_t>(cursors_.size()));
+            }
+        }
+    }
+
+    size_t size() const { return sources_.size(); }
+    size_t length(uint32_t run) const { return offsets_[run + 1] - offsets_[run]; }
+    const Cursor &source(uint32_t run) const { return sources_[run]; }
+    const Cursor &end(uint32_t run) const { return ends_[run]; }
+    const Cursor &cursor(uint32_t run, uint32_t offset) const { return cursors_[offsets_[run] + offset]; }
+    size_t code(uint32_t run, uint32_t offset) const { return codes_[offsets_[run] + offset]; }
+
+    // Should be called for non-vertex cursors only
+    Position position(const Cursor &cursor) const {
+        auto it = positions_.find(cursor);
+        VERIFY(it != positions_.end());
+        return it->second;
+    }
+
+private:
+    std::vector<Cursor> cursors_;
+    std::vector<uint8_t> codes_;
+    std::vector<uint32_t> offsets_;
+    std::vector<Cursor> sources_, ends_;
+    phmap::flat_hash_map<Cursor, Position> positions_;
+};
@@ -91,6 +91,41 @@ public:
     std::vector<DebruijnGraphCursor> prev(Context) const;
     std::vector<DebruijnGraphCursor> next(Context) const;
 
+    // The same cursors as next() / prev() yield, but passed to f without building a vector
+    template <typename F>
+    void for_each_next(Context context, F &&f) const {
+        const debruijn_graph::ConjugateDeBruijnGraph &g = this->g(context);
+
+        // Common case: we have not reached the end of the edge (in nucls)
+        if (position() + 1 < g.length(edge()) + g.k()) {
+            f(DebruijnGraphCursor(edge(), position() + 1));
+            return;
+        }
+
+        // Otherwise we're inside the vertex and need to go out of it
+        for (EdgeId out : g.OutgoingEdges(g.EdgeEnd(edge())))
+            f(DebruijnGraphCursor(out, g.k()));  // Vertices are k-mers
+    }
+
+    template <typename F>
+    void for_each_prev(Context context, F &&f) const {
+        const debruijn_graph::ConjugateDeBruijnGraph &g = this->g(context);
+
+        // Case 1: edge is a tip and we're inside the terminal vertex
+        if (position() == 0)
+            return;
+
+        // Case 2: move backwards possibly going inside the terminal vertex of a tip
+        if (position() != g.k() || g.IncomingEdgeCount(g.EdgeStart(edge())) == 0) {
+            f(DebruijnGraphCursor(edge(), position() - 1));
+            return;
+        }
+
+        // Case 3: go into incoming edges
+        for (EdgeId in : g.IncomingEdges(g.EdgeStart(edge())))
+            f(DebruijnGraphCursor(in, g.length(in) + g.k() - 1));
+    }
+
     static std::vector<DebruijnGraphCursor> get_cursors(const debruijn_graph::ConjugateDeBruijnGraph &g, const debruijn_graph::EdgeId &e, size_t pos) {
         // Unfortunately, several different cursors (actually different, having different prev's) may have the same edge & position
         // Therefore, it's impossible to design a correct get_cursor() method, we have to implement get_cursorS()
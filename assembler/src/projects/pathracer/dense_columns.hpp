@@ -0,0 +1,310 @@
+//***************************************************************************
+//* Copyright (c) 2019 Saint Petersburg State University
+//* All Rights Reserved
+//* See file LICENSE for details.
+//***************************************************************************
+
+#pragma once
+
+#include "cached_cursor.hpp"
+#include "cached_aa_cursor.hpp"
+#include "fees.hpp"
+#include "pathtree.hpp"
+#include "reversed_cursor.hpp"
+
+#include <algorithm>
+#include <cstdint>
+#include <limits>
+#include <memory>
+#include <vector>
+
+extern "C" {
+#include "hmmer.h"
+}
+
+namespace impl {
+
+using pathtree::PathLink;
+using pathtree::PathLinkRef;
+
+// Maps cursors onto a contiguous range [0, size) so that DP columns could be stored
+// as plain arrays instead of hash maps. Only index-based (cached) cursors support it.
+template <typename GraphCursor>
+struct DenseCursorTraits {
+  static constexpr bool enabled = false;
+  static size_t size(typename GraphCursor::Context) { return 0; }
+  static size_t index(const GraphCursor &) { return 0; }
+  static GraphCursor cursor(size_t) { return GraphCursor(); }
+};
+
+template <>
+struct DenseCursorTraits<CachedCursor> {
+  static constexpr bool enabled = true;
+  static size_t size(CachedCursor::Context context) { return context->size(); }
+  static size_t index(const CachedCursor &cursor) { return cursor.index(); }
+  static CachedCursor cursor(size_t index) { return CachedCursor(static_cast<CachedCursor::Index>(index)); }
+};
+
+template <>
+struct DenseCursorTraits<ReversedGraphCursor<CachedCursor>> {
+  static constexpr bool enabled = true;
+  static size_t size(CachedCursor::Context context) { return context->size(); }
+  static size_t index(const CachedCursor &cursor) { return cursor.index(); }
+  static ReversedGraphCursor<CachedCursor> cursor(size_t index) { return CachedCursor(static_cast<CachedCursor::Index>(index)); }
+};
+
+template <>
+struct DenseCursorTraits<CachedAACursor> {
+  static constexpr bool enabled = true;
+  static size_t size(CachedAACursor::Context context) { return context->size() << 3; }
+  static size_t index(const CachedAACursor &cursor) { return cursor.to_size_t(); }
+  static CachedAACursor cursor(size_t index) {
+    return CachedAACursor(index >> 3, static_cast<unsigned char>(index & 0b111));
+  }
+};
+
+// Residue codes of all the cursors of a dense context digitized once per search, so an emission lookup
+// in the DP loops is two array loads. Cursors of other contexts are digitized on the fly
+template <typename GraphCursor>
+class ResidueCodes {
+  using Traits = DenseCursorTraits<GraphCursor>;
+
+ public:
+  ResidueCodes(typename GraphCursor::Context context, const hmm::DigitalCodind &code)
+      : context_{context}, code_{code} {
+    if (!Traits::enabled) {
+      return;
+    }
+
+    codes_.resize(Traits::size(context));
+    for (size_t i = 0; i < codes_.size(); ++i) {
+      codes_[i] = static_cast<uint8_t>(code(Traits::cursor(i).letter(context)));
+    }
+  }
+
+  size_t operator()(const GraphCursor &cursor) const {
+    return Traits::enabled ? codes_[Traits::index(cursor)] : code_(cursor.letter(context_));
+  }
+
+ private:
+  typename GraphCursor::Context context_;
+  const hmm::DigitalCodind &code_;
+  std::vector<uint8_t> codes_;
+};
+
+// Dense structure-of-arrays representation of the D, M, I and F columns used to
+// compute the D/M recurrences of one pHMM position in a single linear sweep.
+// The sweep is branchless (min-plus with selects) and is vectorized by the compiler.
+// Slot size() is reserved for the empty cursor (the source).
+template <typename GraphCursor>
+class DenseColumns {
+  using Traits = DenseCursorTraits<GraphCursor>;
+  using PathLinkT = PathLink<GraphCursor>;
+
+ public:
+  // Dense sweep touches every slot, so it pays off only when a noticeable fraction
+  // of the graph is occupied by the states
+  static constexpr size_t DENSITY_FACTOR = 8;
+  // Large columns are swept in chunks by OpenMP tasks, so idle threads could help with a giant component
+  static constexpr size_t CHUNK_SIZE = 1 << 16;
+
+  static std::unique_ptr<DenseColumns> create(typename GraphCursor::Context context) {
+    if (!Traits::enabled) {
+      return nullptr;
+    }
+    return std::unique_ptr<DenseColumns>(new DenseColumns(Traits::size(context)));
+  }
+
+  size_t size() const { return n_; }
+
+  bool worth(size_t n_of_states) const { return n_of_states * DENSITY_FACTOR >= n_; }
+
+  // D' = min(D + DD, M + MD)
+  // M' = transfer(min(D + DM, M + MM, I + IM, F + MM))
+  // The order of operands in min() follows sparse implementation, so ties are resolved the same way.
+  // The column keeps the best limit states under the threshold (see ScoresFilterMapMixin::score_filter()),
+  // states under feed_threshold are kept as well, since I and F are transferred from M before it is filtered
+  template <typename DeletionStateSet, typename StateSet>
+  void dm(DeletionStateSet &D, StateSet &M, const StateSet &I, const StateSet &F,
+          const double *t, const double *emission_fees,
+          const ResidueCodes<GraphCursor> &residue, const std::vector<GraphCursor> &initial,
+          typename GraphCursor::Context context, score_t threshold, size_t limit, score_t feed_threshold) {
+    const size_t total = n_ + 1;
+    const size_t chunks = (total + CHUNK_SIZE - 1) / CHUNK_SIZE;
+#pragma omp taskloop default(shared) if(chunks > 1)
+    for (size_t chunk = 0; chunk < chunks; ++chunk) {
+      reset(chunk * CHUNK_SIZE, std::min(total, (chunk + 1) * CHUNK_SIZE));
+    }
+
+    for (const auto &state : D.states()) scatter(d_, state);
+    for (const auto &state : M.states()) scatter(m_, state);
+    for (const auto &state : I.states()) scatter(i_, state);
+    for (const auto &state : F.states()) scatter(f_, state);
+
+#pragma omp taskloop default(shared) if(chunks > 1)
+    for (size_t chunk = 0; chunk < chunks; ++chunk) {
+      sweep(chunk * CHUNK_SIZE, std::min(total, (chunk + 1) * CHUNK_SIZE),
+            t[p7H_DD], t[p7H_MD], t[p7H_DM], t[p7H_MM], t[p7H_IM]);
+    }
+
+    // Links referenced by the sweep results are owned by old columns, so new columns
+    // should be completely built before the old ones are released
+    DeletionStateSet newD;
+    StateSet newM;
+    for (size_t i = 0; i < total; ++i) {
+      if (nd_.score[i] <= threshold) {
+        PathLinkRef<GraphCursor> plink(nd_.link[i]);
+        newD.insert({plink->cursor(), {plink, nd_.score[i]}});
+      }
+    }
+
+    auto for_each_transfer = [&](auto &&f) {
+      for (size_t i = 0; i < total; ++i) {
+        const score_t score = pm_.score[i];
+        if (score == inf()) continue;
+        const GraphCursor cursor = i == n_ ? GraphCursor() : Traits::cursor(i);
+        for (const auto &next : (cursor.is_empty() ? initial : cursor.next(context))) {
+          f(i, next, score + emission_fees[residue(next)]);
+        }
+      }
+    };
+
+    // The best scores of the new states go first, so links are created only for the states to be kept
+    touched_.clear();
+    for_each_transfer([&](size_t, const GraphCursor &next, score_t score) {
+      const size_t j = slot(next);
+      if (!visited_[j]) {
+        visited_[j] = true;
+        touched_.push_back(j);
+      }
+      next_score_[j] = std::min(next_score_[j], score);
+    });
+
+    score_t keep = limit ? threshold : -inf();
+    if (limit && touched_.size() > limit) {
+      buffer_.clear();
+      for (size_t j : touched_) {
+        buffer_.push_back(next_score_[j]);
+      }
+      std::nth_element(buffer_.begin(), buffer_.begin() + limit - 1, buffer_.end());
+      keep = std::min(keep, buffer_[limit - 1]);
+    }
+    keep = std::max(keep, feed_threshold);
+
+    kept_.clear();
+    for_each_transfer([&](size_t i, const GraphCursor &next, score_t score) {
+      const size_t j = slot(next);
+      if (!(next_score_[j] <= keep)) return;
+      auto &target = next_[j];
+      if (!target) {
+        target = PathLinkT::create(next);
+        kept_.push_back(j);
+      }
+      target->update(score, PathLinkRef<GraphCursor>(pm_.link[i]));
+    });
+
+    for (size_t j : touched_) {
+      visited_[j] = false;
+      next_score_[j] = inf();
+    }
+
+    newM.reserve(kept_.size());
+    for (size_t j : kept_) {
+      newM.insert({next_[j]->cursor(), std::move(next_[j])});
+      next_[j] = nullptr;
+    }
+
+    D = std::move(newD);
+    M = std::move(newM);
+  }
+
+ private:
+  static score_t inf() { return std::numeric_limits<score_t>::infinity(); }
+
+  struct Column {
+    std::vector<score_t> score;
+    std::vector<PathLinkT *> link;
+
+    void resize(size_t n) {
+      score.assign(n, inf());
+      link.assign(n, nullptr);
+    }
+
+    void reset(size_t begin, size_t end) {
+      std::fill(score.begin() + begin, score.begin() + end, inf());
+    }
+  };
+
+  DenseColumns(size_t n) : n_{n} {
+    for (Column *column : {&d_, &m_, &i_, &f_, &nd_, &pm_}) {
+      column->resize(n_ + 1);
+    }
+    next_.resize(n_ + 1);
+    next_score_.assign(n_ + 1, inf());
+    visited_.assign(n_ + 1, false);
+  }
+
+  size_t slot(const GraphCursor &cursor) const {
+    return cursor.is_empty() ? n_ : Traits::index(cursor);
+  }
+
+  template <typename State>
+  void scatter(Column &column, const State &state) {
+    size_t i = slot(state.cursor);
+    column.score[i] = state.score;
+    column.link[i] = state.plink.get();
+  }
+
+  void reset(size_t begin, size_t end) {
+    for (Column *column : {&d_, &m_, &i_, &f_}) {
+      column->reset(begin, end);
+    }
+  }
+
+  void sweep(size_t begin, size_t end, score_t dd, score_t md, score_t dm, score_t mm, score_t im) {
+    const score_t *ds = d_.score.data(), *ms = m_.score.data(), *is = i_.score.data(), *fs = f_.score.data();
+    PathLinkT *const *dl = d_.link.data(), *const *ml = m_.link.data(), *const *il = i_.link.data(), *const *fl = f_.link.data();
+    score_t *nds = nd_.score.data(), *pms = pm_.score.data();
+    PathLinkT **ndl = nd_.link.data(), **pml = pm_.link.data();
+
+#pragma omp simd
+    for (size_t i = begin; i < end; ++i) {
+      score_t d = ds[i] + dd;
+      PathLinkT *dlink = dl[i];
+      const score_t from_m = ms[i] + md;
+      bool better = from_m < d;
+      nds[i] = better ? from_m : d;
+      ndl[i] = better ? ml[i] : dlink;
+
+      score_t p = ds[i] + dm;
+      PathLinkT *plink = dlink;
+      const score_t mm_score = ms[i] + mm;
+      better = mm_score < p;
+      p = better ? mm_score : p;
+      plink = better ? ml[i] : plink;
+      const score_t im_score = is[i] + im;
+      better = im_score < p;
+      p = better ? im_score : p;
+      plink = better ? il[i] : plink;
+      const score_t fm_score = fs[i] + mm;
+      better = fm_score < p;
+      p = better ? fm_score : p;
+      plink = better ? fl[i] : plink;
+      pms[i] = p;
+      pml[i] = plink;
+    }
+  }
+
+  size_t n_;
+  Column d_, m_, i_, f_;
+  Column nd_, pm_;
+  std::vector<PathLinkRef<GraphCursor>> next_;
+  std::vector<score_t> next_score_;
+  std::vector<bool> visited_;
+  std::vector<size_t> touched_, kept_;
+  std::vector<score_t> buffer_;
+};
+
+}  // namespace impl
+
+// vim: set ts=2 sw=2 et :
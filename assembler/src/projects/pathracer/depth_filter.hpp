@@ -11,6 +11,7 @@
 #include "utils/logger/logger.hpp"
 #include <unordered_map>
 #include <unordered_set>
+#include "cursor_adjacency.hpp"
 #include "utils.hpp"
 
 namespace depth_filter {
@@ -56,13 +57,12 @@ class Depth {
       return depth_[cursor] = std::numeric_limits<double>::infinity();
     }
 
-    auto nexts = cursor.next(context);
     stack.insert(cursor);
     max_stack_size_ = std::max(max_stack_size_, stack.size());
     double max_child = 0;
-    for (const GraphCursor &n : nexts) {
+    for_each_next(cursor, context, [&](const GraphCursor &n) {
       max_child = std::max(max_child, get_depth_(n, stack, context));
-    }
+    });
     stack.erase(cursor);
 
     return depth_[cursor] = 1 + max_child;
@@ -92,6 +92,15 @@ class DepthInt {
   }
 
 
+  // Depths do not depend on the order of queries, so the table could be filled in advance.
+  // Afterwards depth() only reads it and the table could be shared by concurrent searches
+  template <typename Cursors>
+  void precompute(const Cursors &cursors, typename GraphCursor::Context context) {
+    for (const auto &cursor : cursors) {
+      depth(cursor, context);
+    }
+  }
+
   size_t max_stack_size() const { return max_stack_size_; }
 
  private:
@@ -114,22 +123,21 @@ class DepthInt {
         continue;
       }
 
-      auto nexts = cursor.next(context);
       // Check children
       size_t max_child = 0;
       size_t unknown_children = 0;
-      for (const GraphCursor &n : nexts) {
+      for_each_next(cursor, context, [&](const GraphCursor &n) {
+        if (max_child == INF) {
+          return;  // The remaining children do not matter
+        }
         auto it = depth_.find(n);
         if (it != depth_.cend()) {
           max_child = std::max(max_child, it->second);
-          if (max_child == INF) {
-            break;
-          }
         } else {
           stack.push_back(n);
           ++unknown_children;
         }
-      }
+      });
 
       if (!unknown_children || max_child == INF) {
         stack.resize(stack.size() - unknown_children - 1);
@@ -231,16 +239,15 @@ class DepthAtLeast {
       return depth_[cursor] = {1, false};
     }
 
-    auto nexts = cursor.next(context);
     stack.insert(cursor);
     max_stack_size_ = std::max(max_stack_size_, stack.size());
     size_t max_child = 0;
     bool exact = true;
-    for (const GraphCursor &n : nexts) {
+    for_each_next(cursor, context, [&](const GraphCursor &n) {
       auto result = get_depth_(n, stack, stack_limit - 1, context);
       max_child = std::max(max_child, result.value);
       exact = exact && result.exact;
-    }
+    });
 
     stack.erase(cursor);
 
@@ -0,0 +1,144 @@
+//***************************************************************************
+//* Copyright (c) 2019 Saint Petersburg State University
+//* All Rights Reserved
+//* See file LICENSE for details.
+//***************************************************************************
+
+#pragma once
+
+#include "cached_cursor.hpp"
+#include "utils.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <limits>
+#include <memory>
+#include <vector>
+
+namespace depth_filter {
+
+// Depths of all the cursors of a cached context computed at once, the same values as DepthInt yields.
+// Depths are propagated backwards level by level starting from the cursors with no continuation:
+// a cursor gets its depth as soon as all its next cursors have got theirs. Cursors lying on a cycle
+// or leading to one never get there and have infinite depth, i.e. cycles are condensed implicitly.
+// The table is a plain array indexed by CachedCursor::index(), so after construction it is read-only
+// and could be shared by any number of concurrent searches over the context
+class DepthOracle {
+ public:
+  using Index = CachedCursor::Index;
+  static const size_t INF = std::numeric_limits<size_t>::max();
+
+  explicit DepthOracle(const CachedCursorContext *context) {
+    build(context);
+  }
+
+  bool depth_at_least(const CachedCursor &cursor, double d, CachedCursor::Context = nullptr) const {
+    return static_cast<double>(depth(cursor)) >= d;
+  }
+
+  size_t depth(const CachedCursor &cursor, CachedCursor::Context = nullptr) const {
+    if (cursor.is_empty()) {
+      return INF;
+    }
+
+    uint32_t result = depth_[cursor.index()];
+    return result == INF_DEPTH ? INF : result;
+  }
+
+  size_t size() const { return depth_.size(); }
+
+ private:
+  static const uint32_t INF_DEPTH = std::numeric_limits<uint32_t>::max();
+  static const size_t CHUNK_SIZE = 4096;
+
+  std::vector<uint32_t> depth_;
+
+  static bool is_stop(const CachedCursor &cursor, CachedCursor::Context context) {
+    char letter = cursor.letter(context);
+    return letter == '*' || letter == 'X';  // FIXME X is not actual stop codon
+  }
+
+  void build(const CachedCursorContext *context) {
+    const size_t n = context->size();
+    depth_.assign(n, uint32_t(INF_DEPTH));  // copied, INF_DEPTH has no out-of-line definition
+
+    // prev() is not necessarily the inverse of next() (e.g. for AA contexts), so predecessors are collected here.
+    // Stop cursors terminate paths, their next() links are ignored
+    std::vector<Index> prev_offsets(n + 1, 0);
+    std::unique_ptr<std::atomic<Index>[]> pending(new std::atomic<Index>[n]);
+    for (Index i = 0; i < n; ++i) {
+      CachedCursor cursor(i);
+      Index out = 0;
+      if (!is_stop(cursor, context)) {
+        for (const auto &next : cursor.next(context)) {
+          ++prev_offsets[next.index() + 1];
+          ++out;
+        }
+      }
+      pending[i] = out;
+    }
+    for (size_t i = 0; i < n; ++i) {
+      prev_offsets[i + 1] += prev_offsets[i];
+    }
+    std::vector<Index> prevs(prev_offsets.back());
+    {
+      std::vector<Index> fill(prev_offsets.cbegin(), prev_offsets.cend() - 1);
+      for (Index i = 0; i < n; ++i) {
+        CachedCursor cursor(i);
+        if (is_stop(cursor, context)) {
+          continue;
+        }
+        for (const auto &next : cursor.next(context)) {
+          prevs[fill[next.index()]++] = i;
+        }
+      }
+    }
+
+    // Maximal depth over the already finalized next cursors
+    std::unique_ptr<std::atomic<uint32_t>[]> max_child(new std::atomic<uint32_t>[n]);
+    std::vector<Index> frontier;
+    for (Index i = 0; i < n; ++i) {
+      max_child[i] = 0;
+      if (pending[i] == 0) {
+        depth_[i] = is_stop(CachedCursor(i), context) ? 0 : 1;
+        frontier.push_back(i);
+      }
+    }
+
+    std::vector<std::vector<Index>> parts;
+    while (!frontier.empty()) {
+      const size_t chunks = (frontier.size() + CHUNK_SIZE - 1) / CHUNK_SIZE;
+      parts.assign(chunks, {});
+#pragma omp taskloop default(shared) if(chunks > 1)
+      for (size_t chunk = 0; chunk < chunks; ++chunk) {
+        auto &part = parts[chunk];
+        size_t end = std::min(frontier.size(), (chunk + 1) * CHUNK_SIZE);
+        for (size_t j = chunk * CHUNK_SIZE; j < end; ++j) {
+          Index v = frontier[j];
+          uint32_t d = depth_[v];
+          for (Index k = prev_offsets[v]; k < prev_offsets[v + 1]; ++k) {
+            Index u = prevs[k];
+            uint32_t current = max_child[u].load(std::memory_order_relaxed);
+            while (current < d && !max_child[u].compare_exchange_weak(current, d, std::memory_order_relaxed)) {
+            }
+            // The last finalized child sees the maximum of all the children (acq_rel orders the updates above)
+            if (pending[u].fetch_sub(1, std::memory_order_acq_rel) == 1) {
+              depth_[u] = saturated_inc(max_child[u].load(std::memory_order_relaxed), INF_DEPTH);
+              part.push_back(u);
+            }
+          }
+        }
+      }
+
+      frontier.clear();
+      for (const auto &part : parts) {
+        frontier.insert(frontier.end(), part.cbegin(), part.cend());
+      }
+    }
+  }
+};
+
+}  // namespace depth_filter
+
+// vim: set ts=2 sw=2 et :
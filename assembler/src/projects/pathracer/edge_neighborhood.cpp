@@ -0,0 +1,132 @@
+//***************************************************************************
+//* Copyright (c) 2019 Saint Petersburg State University
+//* All Rights Reserved
+//* See file LICENSE for details.
+//***************************************************************************
+
+#include "edge_neighborhood.hpp"
+
+#include "utils/logger/logger.hpp"
+
+#include <parallel_hashmap/phmap.h>
+
+#include <algorithm>
+
+using namespace debruijn_graph;
+
+namespace {
+
+using Interval = std::pair<size_t, size_t>;  // closed interval of positions
+
+class EdgeExpansion {
+ public:
+  EdgeExpansion(const ConjugateDeBruijnGraph &g, bool forward) : g_{g}, k_{g.k()}, forward_{forward} {}
+
+  // Walks along the edge from the position, returns the depth remaining at the last position of the edge
+  // (in the direction of the walk) if it is reached and the walk could leave the edge
+  size_t walk(EdgeId e, size_t pos, size_t depth) {
+    size_t last = g_.length(e) + k_ - 1;
+    if (forward_) {
+      add(e, pos, std::min(last, pos + depth));
+      return pos + depth > last ? depth - (last - pos) : 0;
+    }
+
+    // Backward walk leaves the edge at position k if the edge has incoming ones, otherwise it stops at 0
+    bool leaves = pos >= k_ && g_.IncomingEdgeCount(g_.EdgeStart(e)) > 0;
+    size_t first = leaves ? k_ : 0;
+    add(e, pos > first + depth ? pos - depth : first, pos);
+    return leaves && first + depth > pos ? depth - (pos - first) : 0;
+  }
+
+  // Edges entered from the last position of the edge
+  template <typename F>
+  void for_each_adjacent(EdgeId e, const F &f) const {
+    if (forward_) {
+      for (EdgeId out : g_.OutgoingEdges(g_.EdgeEnd(e))) {
+        f(out);
+      }
+    } else {
+      for (EdgeId in : g_.IncomingEdges(g_.EdgeStart(e))) {
+        f(in);
+      }
+    }
+  }
+
+  std::vector<DebruijnGraphCursor> cursors() {
+    std::vector<DebruijnGraphCursor> result;
+    for (auto &kv : intervals_) {
+      EdgeId e(kv.first);
+      auto &intervals = kv.second;
+      std::sort(intervals.begin(), intervals.end());
+      size_t next = 0;  // the first position not emitted yet
+      for (const auto &interval : intervals) {
+        for (size_t pos = std::max(next, interval.first); pos <= interval.second; ++pos) {
+          result.emplace_back(e, pos);
+        }
+        next = std::max(next, interval.second + 1);
+      }
+    }
+    return result;
+  }
+
+ private:
+  const ConjugateDeBruijnGraph &g_;
+  size_t k_;
+  bool forward_;
+  phmap::flat_hash_map<size_t, std::vector<Interval>> intervals_;
+
+  void add(EdgeId e, size_t from, size_t to) {
+    intervals_[e.int_id()].emplace_back(from, to);
+  }
+};
+
+}  // namespace
+
+std::vector<DebruijnGraphCursor> edge_neighborhood(const std::vector<std::pair<DebruijnGraphCursor, size_t>> &initial,
+                                                   DebruijnGraphCursor::Context context,
+                                                   bool forward) {
+  const ConjugateDeBruijnGraph &g = *context;
+  EdgeExpansion expansion(g, forward);
+
+  size_t max_depth = 0;
+  for (const auto &cursor_with_depth : initial) {
+    max_depth = std::max(max_depth, cursor_with_depth.second);
+  }
+
+  // Bucket queue of edges entered from adjacent ones indexed by the remaining depth.
+  // Depth only decreases along the walk, so buckets are processed from the deepest one and
+  // the first time an edge is popped it is entered with the maximal depth
+  std::vector<std::vector<EdgeId>> buckets(max_depth + 1);
+  auto leave = [&](EdgeId e, size_t depth) {
+    if (depth == 0) {
+      return;
+    }
+    expansion.for_each_adjacent(e, [&](EdgeId adjacent) { buckets[depth - 1].push_back(adjacent); });
+  };
+
+  for (const auto &cursor_with_depth : initial) {
+    const auto &cursor = cursor_with_depth.first;
+    leave(cursor.edge(), expansion.walk(cursor.edge(), cursor.position(), cursor_with_depth.second));
+  }
+  INFO("Initial queue size: " << initial.size());
+
+  phmap::flat_hash_set<size_t> entered;
+  for (size_t depth = max_depth + 1; depth-- > 0;) {
+    // Buckets below the current one could grow while it is processed, so no references are held
+    for (size_t i = 0; i < buckets[depth].size(); ++i) {
+      EdgeId e = buckets[depth][i];
+      if (!entered.insert(e.int_id()).second) {
+        continue;
+      }
+
+      size_t pos = forward ? g.k() : g.length(e) + g.k() - 1;
+      leave(e, expansion.walk(e, pos, depth));
+    }
+    std::vector<EdgeId>().swap(buckets[depth]);
+  }
+  INFO("Edges entered: " << entered.size());
+
+  return expansion.cursors();
+}
+
+// vim: set ts=2 sw=2 et :
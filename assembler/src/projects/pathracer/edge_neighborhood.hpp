@@ -0,0 +1,22 @@
+//***************************************************************************
+//* Copyright (c) 2019 Saint Petersburg State University
+//* All Rights Reserved
+//* See file LICENSE for details.
+//***************************************************************************
+
+#pragma once
+
+#include "debruijn_graph_cursor.hpp"
+
+#include <utility>
+#include <vector>
+
+// Cursors reachable from the initial ones in at most the given number of steps forward (backward),
+// the same set as neighborhood() yields for de Bruijn graph cursors.
+// The graph is traversed edge by edge: a visited edge is a position interval and
+// per-position cursors are only materialized for the result
+std::vector<DebruijnGraphCursor> edge_neighborhood(const std::vector<std::pair<DebruijnGraphCursor, size_t>> &initial,
+                                                   DebruijnGraphCursor::Context context,
+                                                   bool forward = true);
+
+// vim: set ts=2 sw=2 et :
@@ -99,6 +99,40 @@ bool Fees::check_i_negative_loops() const {
  *      TDM is therefore 1.0 by definition. TMM and TDM are interpreted as the
  *      M->E and D->E end transitions. t[M][TDM] must be 1.0, therefore.
  */
+RemainingCostBounds Fees::remaining_cost_bounds() const {
+  auto best = [](const std::vector<double> &fees) { return *min_element(fees.cbegin(), fees.cend()); };
+  // At most max_insertion_length loop iterations are made, so positive-score I-loops are bounded too
+  auto loop = [this, &best](size_t m) {
+    return static_cast<double>(max_insertion_length) * std::min(0., t[m][p7H_II] + best(ins[m]));
+  };
+
+  RemainingCostBounds bounds;
+  bounds.match.resize(M + 1);
+  bounds.insertion.resize(M + 1);
+  bounds.deletion.resize(M + 1);
+  bounds.frame_shift.resize(M + 1);
+
+  // In the local mode deletions could leave the model at any position
+  auto deletion = [this](size_t m, double cost) { return local && m > 0 ? std::min(cost, cleavage_cost) : cost; };
+
+  bounds.match[M] = t[M][p7H_MM];
+  bounds.frame_shift[M] = t[M][p7H_MM];
+  bounds.insertion[M] = t[M][p7H_IM] + loop(M);
+  bounds.deletion[M] = deletion(M, t[M][p7H_DM]);
+  for (size_t m = M; m-- > 0;) {
+    double next_match = best(mat[m + 1]) + bounds.match[m + 1];
+    bounds.insertion[m] = t[m][p7H_IM] + next_match + loop(m);
+    bounds.deletion[m] = deletion(m, std::min(t[m][p7H_DM] + next_match, t[m][p7H_DD] + bounds.deletion[m + 1]));
+    bounds.frame_shift[m] = t[m][p7H_MM] + next_match;
+    bounds.match[m] = std::min({t[m][p7H_MM] + next_match,
+                                t[m][p7H_MD] + bounds.deletion[m + 1],
+                                t[m][p7H_MI] + best(ins[m]) + bounds.insertion[m],
+                                frame_shift_cost + bounds.frame_shift[m]});
+  }
+
+  return bounds;
+}
+
 void Fees::reverse() {
   std::reverse(consensus.begin(), consensus.end());
   std::reverse(ins.begin(), ins.end());
@@ -120,6 +154,37 @@ void Fees::reverse() {
   t[M][p7H_DD] = std::numeric_limits<double>::infinity();
 }
 
+static_assert(PackedFees::TRANSITIONS == p7H_NTRANSITIONS, "Invalid number of transitions");
+
+PackedFees::PackedFees(const Fees &fees) : width_{0} {
+  const size_t rows = fees.M + 1;
+  VERIFY(fees.mat.size() == rows && fees.ins.size() == rows && fees.t.size() == rows);
+  for (size_t m = 0; m < rows; ++m) {
+    width_ = std::max({width_, fees.mat[m].size(), fees.ins[m].size()});
+  }
+
+  // Each table starts at a cache line
+  auto lines = [](size_t n) { return (n * sizeof(double) + ALIGNMENT - 1) / ALIGNMENT * ALIGNMENT / sizeof(double); };
+  const size_t emissions = lines(rows * width_), transitions = lines(rows * TRANSITIONS);
+  void *p = nullptr;
+  int rc = posix_memalign(&p, ALIGNMENT, (2 * emissions + transitions) * sizeof(double));
+  VERIFY_MSG(rc == 0, "Failed to allocate model tables");
+  data_.reset(static_cast<double *>(p));
+
+  double *mat = data_.get(), *ins = mat + emissions, *t = ins + emissions;
+  const double inf = std::numeric_limits<double>::infinity();
+  std::fill(mat, t, inf);  // padding of the last lines
+  for (size_t m = 0; m < rows; ++m) {
+    std::copy(fees.mat[m].cbegin(), fees.mat[m].cend(), mat + m * width_);
+    std::copy(fees.ins[m].cbegin(), fees.ins[m].cend(), ins + m * width_);
+    VERIFY(fees.t[m].size() == TRANSITIONS);
+    std::copy(fees.t[m].cbegin(), fees.t[m].cend(), t + m * TRANSITIONS);
+  }
+  mat_ = mat;
+  ins_ = ins;
+  t_ = t;
+}
+
 Fees levenshtein_fees(const std::string &s, double mismatch, double gap_open, double gap_ext) {
   size_t M = s.size();
   Fees fees;
@@ -7,6 +7,7 @@
 #include <vector>
 #include <limits>
 #include <cstdlib>
+#include <memory>
 
 namespace hmm {
 
@@ -22,6 +23,12 @@ class DigitalCodind {
   size_t k_;
 };
 
+// Lower bounds of the cost of completing a path from M/I/D/F states at HMM position m, indexed by m.
+// Emissions are taken at their best regardless of the graph, see Fees::remaining_cost_bounds()
+struct RemainingCostBounds {
+  std::vector<double> match, insertion, deletion, frame_shift;
+};
+
 struct Fees {
   size_t M;
   size_t k;
@@ -42,6 +49,11 @@ struct Fees {
   size_t minimal_match_length = 50;
 
   bool use_experimental_i_loop_processing = false;
+  bool use_dense_columns = false;
+  bool use_compressed_runs = false;
+  bool use_cost_bounds = false;
+  bool use_bidirectional_search = false;
+  bool use_streaming_filter = false;
 
   double empty_sequence_score() const;
   double all_matches_score(const std::string &seq) const;
@@ -63,6 +75,8 @@ struct Fees {
   bool is_i_loop_non_negative(size_t i) const { return check_i_loop(i); }
   bool check_i_negative_loops() const;
 
+  RemainingCostBounds remaining_cost_bounds() const;
+
   void reverse();
   Fees reversed() const {
     Fees copy{*this};
@@ -71,6 +85,30 @@ struct Fees {
   }
 };
 
+// The tables of a model packed for the DP loops: emission rows of all the positions follow each other
+// in one cache-line aligned block (width() codes per row), and so do the rows of transitions
+class PackedFees {
+ public:
+  static constexpr size_t TRANSITIONS = 7;  // p7H_NTRANSITIONS
+  static constexpr size_t ALIGNMENT = 64;
+
+  explicit PackedFees(const Fees &fees);
+
+  size_t width() const { return width_; }
+  const double *mat(size_t m) const { return mat_ + m * width_; }
+  const double *ins(size_t m) const { return ins_ + m * width_; }
+  const double *t(size_t m) const { return t_ + m * TRANSITIONS; }
+
+ private:
+  struct Free {
+    void operator()(double *p) const { std::free(p); }
+  };
+
+  size_t width_;
+  std::unique_ptr<double[], Free> data_;
+  const double *mat_, *ins_, *t_;
+};
+
 Fees levenshtein_fees(const std::string &s, double mismatch = 1, double gap_open = 1, double gap_ext = 1);
 Fees fees_from_hmm(const P7_HMM *hmm, const ESL_ALPHABET *abc, double lambda = 0);
 Fees fees_from_file(const std::string &filename);
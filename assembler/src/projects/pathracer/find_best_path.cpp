@@ -43,8 +43,19 @@ PathSet<StringCursor> find_best_path(const hmm::Fees &fees, const std::vector<St
 }
 
 PathSet<CachedCursor> find_best_path(const hmm::Fees &fees, const std::vector<CachedCursor> &initial,
-                                     CachedCursor::Context context) {
-    return impl::find_best_path(fees, initial, context);
+                                     CachedCursor::Context context,
+                                     const depth_filter::DepthOracle *depth) {
+    auto search = [&](const depth_filter::DepthOracle &depth) {
+        // Nucleotide cursors have no frame shifts, so they could be searched from both ends
+        return fees.use_bidirectional_search && !fees.local ? impl::find_best_path_bidirectional(fees, initial, context, depth)
+                                                            : impl::find_best_path(fees, initial, context, depth);
+    };
+    if (depth) {
+        return search(*depth);
+    }
+
+    depth_filter::DepthOracle own_depth(context);
+    return search(own_depth);
 }
 
 PathSet<AAGraphCursor<StringCursor>> find_best_path(const hmm::Fees &fees, const std::vector<AAGraphCursor<StringCursor>> &initial,
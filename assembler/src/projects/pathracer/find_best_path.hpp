@@ -14,6 +14,7 @@
 #include "cached_cursor.hpp"
 #include "debruijn_graph_cursor.hpp"
 #include "reversed_cursor.hpp"
+#include "depth_oracle.hpp"
 
 double score_sequence(const hmm::Fees &fees, const std::string &seq);
 double score_subsequence(const hmm::Fees &fees, const std::string &seq);
@@ -45,8 +46,10 @@ PathSet<AAGraphCursor<OptimizedRestrictedGraphCursor<DebruijnGraphCursor>>> find
 PathSet<StringCursor> find_best_path(const hmm::Fees &fees, const std::vector<StringCursor> &initial,
                                      StringCursor::Context context);
 
+// The depth table of the context is built on the fly unless given; a given one could be shared between threads
 PathSet<CachedCursor> find_best_path(const hmm::Fees &fees, const std::vector<CachedCursor> &initial,
-                                     CachedCursor::Context context);
+                                     CachedCursor::Context context,
+                                     const depth_filter::DepthOracle *depth = nullptr);
 
 PathSet<AAGraphCursor<StringCursor>> find_best_path(const hmm::Fees &fees, const std::vector<AAGraphCursor<StringCursor>> &initial,
                                                     AAGraphCursor<StringCursor>::Context context);
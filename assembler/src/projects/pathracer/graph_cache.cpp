@@ -0,0 +1,304 @@
+//***************************************************************************
+//* Copyright (c) 2019 Saint Petersburg State University
+//* All Rights Reserved
+//* See file LICENSE for details.
+//***************************************************************************
+
+#include "graph_cache.hpp"
+
+#include "io/kmers/mmapped_reader.hpp"
+#include "utils/filesystem/path_helper.hpp"
+#include "utils/logger/logger.hpp"
+#include "common/utils/verify.hpp"
+
+#include <city/city.h>
+
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iomanip>
+#include <istream>
+#include <sstream>
+#include <streambuf>
+
+using namespace debruijn_graph;
+
+const uint64_t GraphCache::VERSION;
+const char GraphCache::MAGIC[8] = {'P', 'R', 'G', 'R', 'C', 'A', 'C', 'H'};
+
+namespace {
+
+// 2-bit nucleotides, 32 per word starting from the lowest bits, as Sequence packs them
+constexpr size_t NUCLS_PER_WORD = 32;
+static_assert(sizeof(seq_element_type) == sizeof(uint64_t) && sizeof(size_t) == sizeof(uint64_t),
+              "Sequences are stored in the binary layout of Sequence");
+
+// The GFA file is hashed by chunks, every one chained into the hash of the previous ones
+constexpr size_t HASH_CHUNK_SIZE = 1 << 22;
+
+// Read-only stream over the mapped snapshot, Sequence::BinRead() takes the sequences from it
+class MappedBuffer : public std::streambuf {
+ public:
+  MappedBuffer(const char *data, size_t size)
+      : data_{const_cast<char *>(data)}, size_{size} {
+    seek(0);
+  }
+
+  void seek(size_t offset) { setg(data_, data_ + offset, data_ + size_); }
+
+ private:
+  char *data_;
+  size_t size_;
+};
+
+template <typename T>
+void write_array(std::ofstream &out, const std::vector<T> &v) {
+  out.write(reinterpret_cast<const char *>(v.data()), v.size() * sizeof(T));
+  // Keep all the arrays 8-byte aligned
+  size_t padding = (8 - v.size() * sizeof(T) % 8) % 8;
+  const char zeros[8] = {};
+  out.write(zeros, padding);
+}
+
+template <typename T>
+const T *map_array(const char *&p, size_t size) {
+  const T *result = reinterpret_cast<const T *>(p);
+  p += (size * sizeof(T) + 7) / 8 * 8;
+  return result;
+}
+
+}  // namespace
+
+std::string GraphCache::Filename(const std::string &cache_dir, const std::string &gfa_filename) {
+  const std::string path = fs::make_full_path(gfa_filename);
+  std::ostringstream filename;
+  filename << fs::append_path(cache_dir, fs::filename(gfa_filename)) << '.'
+           << std::hex << std::setw(16) << std::setfill('0') << CityHash64(path.data(), path.size())
+           << ".pathracer-cache";
+  return filename.str();
+}
+
+bool GraphCache::Describe(const std::string &gfa_filename, Header &header) {
+  struct stat st;
+  if (stat(gfa_filename.c_str(), &st) != 0) {
+    return false;
+  }
+  header.gfa_size = st.st_size;
+  header.gfa_mtime = uint64_t(st.st_mtim.tv_sec) * 1000000000ULL + st.st_mtim.tv_nsec;
+  return true;
+}
+
+bool GraphCache::Hash(const std::string &gfa_filename, Header &header) {
+  std::ifstream in(gfa_filename, std::ios::binary);
+  if (!in) {
+    return false;
+  }
+  std::vector<char> buffer(HASH_CHUNK_SIZE);
+  uint64_t hash = 0xcbf29ce484222325ULL;
+  size_t hashed = 0;
+  while (in.read(buffer.data(), buffer.size()) || in.gcount() > 0) {
+    hash = CityHash64WithSeed(buffer.data(), in.gcount(), hash);
+    hashed += in.gcount();
+  }
+  header.gfa_hash = hash;
+  return hashed == header.gfa_size;
+}
+
+bool GraphCache::Load(const std::string &cache_dir, const std::string &gfa_filename, Graph &graph,
+                      std::vector<std::vector<EdgeId>> &paths, io::IdMapper<std::string> *id_mapper) {
+  const std::string filename = Filename(cache_dir, gfa_filename);
+  if (!fs::check_existence(filename) || fs::filesize(filename) < sizeof(Header)) {
+    return false;
+  }
+
+  Header expected;
+  if (!Describe(gfa_filename, expected)) {
+    return false;
+  }
+
+  MMappedReader file(filename, /* unlink */ false, /* blocksize */ -1ULL);
+  const char *p = static_cast<const char *>(file.data());
+  const Header &header = *reinterpret_cast<const Header *>(p);
+  if (std::memcmp(header.magic, MAGIC, sizeof(MAGIC)) != 0 || header.version != VERSION) {
+    WARN("Graph cache " << filename << " is not of supported version, ignored");
+    return false;
+  }
+  // The whole GFA file is read to hash it, so the cheap checks go first
+  if (header.k != graph.k() || header.gfa_size != expected.gfa_size || header.gfa_mtime != expected.gfa_mtime ||
+      !Hash(gfa_filename, expected) || header.gfa_hash != expected.gfa_hash) {
+    INFO("Graph cache " << filename << " is outdated, ignored");
+    return false;
+  }
+
+  p += sizeof(Header);
+  const uint64_t *vertices = map_array<uint64_t>(p, 2 * header.n_vertices);
+  const uint64_t *out_offsets = map_array<uint64_t>(p, header.n_vertices + 1);
+  const EdgeRecord *edges = map_array<EdgeRecord>(p, header.n_edges);
+  const uint64_t *words = map_array<uint64_t>(p, header.n_words);
+  const uint64_t *name_ids = map_array<uint64_t>(p, header.n_names);
+  const uint64_t *name_offsets = map_array<uint64_t>(p, header.n_names + 1);
+  const char *name_chars = map_array<char>(p, header.n_name_chars);
+  const uint64_t *path_offsets = map_array<uint64_t>(p, header.n_paths + 1);
+  const uint64_t *path_edges = map_array<uint64_t>(p, header.n_path_edges);
+  if (p > static_cast<const char *>(file.data()) + file.size()) {
+    WARN("Graph cache " << filename << " is truncated, ignored");
+    return false;
+  }
+
+  graph.reserve(header.vreserved, header.ereserved);
+  auto add_vertex = [&graph](uint64_t id, uint64_t conjugate_id) {
+    if (graph.contains(VertexId(id))) {
+      return;
+    }
+    VertexId new_id = graph.AddVertex(DeBruijnVertexData(), id, conjugate_id);
+    VERIFY_MSG(new_id.int_id() == id, "Vertex id " << id << " is not preserved");
+  };
+
+  MappedBuffer buffer(reinterpret_cast<const char *>(words), header.n_words * sizeof(uint64_t));
+  std::istream sequences(&buffer);
+  for (size_t i = 0; i < header.n_vertices; ++i) {
+    const uint64_t start = vertices[2 * i];
+    add_vertex(start, vertices[2 * i + 1]);
+    for (size_t j = out_offsets[i]; j < out_offsets[i + 1]; ++j) {
+      const EdgeRecord &edge = edges[j];
+      add_vertex(edge.end, edge.end_conjugate);
+      Sequence seq;
+      buffer.seek(edge.offset * sizeof(uint64_t));
+      VERIFY_MSG(seq.BinRead(sequences) && seq.size() == edge.length, "Graph cache " << filename << " is corrupted");
+      EdgeId new_id = graph.AddEdge(start, edge.end, DeBruijnEdgeData(std::move(seq)), edge.id, edge.conjugate_id);
+      VERIFY_MSG(new_id.int_id() == edge.id, "Edge id " << edge.id << " is not preserved");
+      graph.coverage_index().SetRawCoverage(new_id, edge.coverage);
+      graph.coverage_index().SetRawCoverage(graph.conjugate(new_id), edge.conjugate_coverage);
+    }
+  }
+
+  if (id_mapper) {
+    for (size_t i = 0; i < header.n_names; ++i) {
+      (*id_mapper)[name_ids[i]] = std::string(name_chars + name_offsets[i], name_chars + name_offsets[i + 1]);
+    }
+  }
+
+  paths.reserve(paths.size() + header.n_paths);
+  for (size_t i = 0; i < header.n_paths; ++i) {
+    paths.emplace_back(path_edges + path_offsets[i], path_edges + path_offsets[i + 1]);
+  }
+
+  INFO("Graph loaded from cache " << filename << ": " << header.n_edges << " edge pairs, " << header.n_paths << " paths");
+  return true;
+}
+
+bool GraphCache::Save(const std::string &cache_dir, const std::string &gfa_filename, const Graph &graph,
+                      const std::vector<std::vector<EdgeId>> &paths, const io::IdMapper<std::string> *id_mapper) {
+  Header header;
+  std::memcpy(header.magic, MAGIC, sizeof(MAGIC));
+  header.version = VERSION;
+  header.k = graph.k();
+  if (!Describe(gfa_filename, header) || !Hash(gfa_filename, header)) {
+    WARN("Cannot access " << gfa_filename << ", graph cache is not saved");
+    return false;
+  }
+  header.vreserved = graph.vreserved();
+  header.ereserved = graph.ereserved();
+
+  std::vector<uint64_t> vertices, out_offsets(1, 0), words;
+  std::vector<EdgeRecord> edges;
+  for (VertexId v : graph) {
+    vertices.push_back(v.int_id());
+    vertices.push_back(graph.conjugate(v).int_id());
+    for (EdgeId e : graph.OutgoingEdges(v)) {
+      EdgeId conjugate = graph.conjugate(e);
+      if (conjugate < e) {
+        continue;
+      }
+      const Sequence &seq = graph.EdgeNucls(e);
+      EdgeRecord edge;
+      edge.id = e.int_id();
+      edge.conjugate_id = conjugate.int_id();
+      edge.end = graph.EdgeEnd(e).int_id();
+      edge.end_conjugate = graph.EdgeStart(conjugate).int_id();
+      edge.offset = words.size();
+      edge.length = seq.size();
+      edge.coverage = graph.coverage_index().RawCoverage(e);
+      edge.conjugate_coverage = graph.coverage_index().RawCoverage(conjugate);
+      words.push_back(seq.size());
+      const size_t first_word = words.size();
+      words.resize(words.size() + (seq.size() + NUCLS_PER_WORD - 1) / NUCLS_PER_WORD, 0);
+      for (size_t pos = 0; pos < seq.size(); ++pos) {
+        words[first_word + pos / NUCLS_PER_WORD] |= uint64_t(seq[pos]) << (2 * (pos % NUCLS_PER_WORD));
+      }
+      edges.push_back(edge);
+    }
+    out_offsets.push_back(edges.size());
+  }
+  header.n_vertices = out_offsets.size() - 1;
+  header.n_edges = edges.size();
+  header.n_words = words.size();
+
+  std::vector<uint64_t> name_ids, name_offsets(1, 0);
+  std::vector<char> name_chars;
+  if (id_mapper) {
+    for (auto it = graph.ConstEdgeBegin(); !it.IsEnd(); ++it) {
+      const size_t id = (*it).int_id();
+      if (!id_mapper->count(id)) {
+        continue;
+      }
+      const std::string &name = (*id_mapper)[id];
+      name_ids.push_back(id);
+      name_chars.insert(name_chars.end(), name.cbegin(), name.cend());
+      name_offsets.push_back(name_chars.size());
+    }
+  }
+  header.n_names = name_ids.size();
+  header.n_name_chars = name_chars.size();
+
+  std::vector<uint64_t> path_offsets(1, 0), path_edges;
+  for (const auto &path : paths) {
+    for (EdgeId e : path) {
+      path_edges.push_back(e.int_id());
+    }
+    path_offsets.push_back(path_edges.size());
+  }
+  header.n_paths = paths.size();
+  header.n_path_edges = path_edges.size();
+
+  // Written aside and renamed, so concurrent runs never map a partial snapshot
+  fs::make_dirs(cache_dir);
+  const std::string filename = Filename(cache_dir, gfa_filename);
+  const std::string tmp_filename = filename + "." + std::to_string(getpid());
+  {
+    std::ofstream out(tmp_filename, std::ios::binary);
+    if (!out) {
+      WARN("Cannot open " << tmp_filename << ", graph cache is not saved");
+      return false;
+    }
+    out.write(reinterpret_cast<const char *>(&header), sizeof(header));
+    write_array(out, vertices);
+    write_array(out, out_offsets);
+    write_array(out, edges);
+    write_array(out, words);
+    write_array(out, name_ids);
+    write_array(out, name_offsets);
+    write_array(out, name_chars);
+    write_array(out, path_offsets);
+    write_array(out, path_edges);
+    if (!out) {
+      WARN("Error writing " << tmp_filename << ", graph cache is not saved");
+      out.close();
+      std::remove(tmp_filename.c_str());
+      return false;
+    }
+  }
+  if (std::rename(tmp_filename.c_str(), filename.c_str()) != 0) {
+    WARN("Cannot rename " << tmp_filename << " to " << filename << ", graph cache is not saved");
+    std::remove(tmp_filename.c_str());
+    return false;
+  }
+
+  INFO("Graph cache saved to " << filename);
+  return true;
+}
+
+// vim: set ts=2 sw=2 et :
@@ -0,0 +1,75 @@
+//***************************************************************************
+//* Copyright (c) 2019 Saint Petersburg State University
+//* All Rights Reserved
+//* See file LICENSE for details.
+//***************************************************************************
+
+#pragma once
+
+#include "assembly_graph/core/graph.hpp"
+#include "io/id_mapper.hpp"
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// Binary snapshot of a graph loaded from GFA along with the segment names and the scaffold paths.
+// Snapshots are kept in a cache directory given by the user (see --graph-cache): one is written there
+// on the first load of a GFA file and memory-mapped by the later runs, so the GFA is not parsed again.
+// Edge sequences are stored in the binary layout of Sequence (see Sequence::BinWrite()), so they are
+// copied from the mapping word by word; outgoing edges of the vertices are stored in CSR layout.
+// Edge and vertex ids are preserved.
+// The snapshot is valid while the size, the modification time and the hash of the whole GFA file match
+class GraphCache {
+ public:
+  using Graph = debruijn_graph::ConjugateDeBruijnGraph;
+  using EdgeId = Graph::EdgeId;
+
+  // Snapshots of the GFA files of the same name from different directories do not clash
+  static std::string Filename(const std::string &cache_dir, const std::string &gfa_filename);
+
+  // Returns false (leaving the graph untouched) if there is no valid snapshot for the GFA file
+  static bool Load(const std::string &cache_dir, const std::string &gfa_filename, Graph &graph,
+                   std::vector<std::vector<EdgeId>> &paths, io::IdMapper<std::string> *id_mapper);
+
+  // Failures are reported, but not fatal: the snapshot is just an acceleration
+  static bool Save(const std::string &cache_dir, const std::string &gfa_filename, const Graph &graph,
+                   const std::vector<std::vector<EdgeId>> &paths, const io::IdMapper<std::string> *id_mapper);
+
+ private:
+  struct Header {
+    char magic[8];
+    uint64_t version;
+    uint64_t k;
+    uint64_t gfa_size;
+    uint64_t gfa_mtime;  // ns
+    uint64_t gfa_hash;  // chained CityHash64 of the whole file
+    uint64_t vreserved;
+    uint64_t ereserved;
+    uint64_t n_vertices;
+    uint64_t n_edges;  // one of each conjugate pair
+    uint64_t n_words;
+    uint64_t n_names;
+    uint64_t n_name_chars;
+    uint64_t n_paths;
+    uint64_t n_path_edges;
+  };
+
+  struct EdgeRecord {
+    uint64_t id, conjugate_id;
+    uint64_t end, end_conjugate;  // ids of the end vertex and of the start one of the conjugate edge
+    uint64_t offset;  // the first word of the sequence: its length in nucleotides followed by the packed nucleotides
+    uint64_t length;  // in nucleotides
+    uint32_t coverage, conjugate_coverage;  // raw coverage
+  };
+
+  static const char MAGIC[8];
+  static const uint64_t VERSION = 2;
+
+  // Fill the GFA-dependent fields of the header: the size and the modification time, and the hash
+  // of the whole file. Return false if the file could not be accessed
+  static bool Describe(const std::string &gfa_filename, Header &header);
+  static bool Hash(const std::string &gfa_filename, Header &header);
+};
+
+// vim: set ts=2 sw=2 et :
@@ -3,22 +3,30 @@
 #include "fees.hpp"
 #include "pathtree.hpp"
 #include "depth_filter.hpp"
+#include "cursor_adjacency.hpp"
 #include "cursor_utils.hpp"
+#include "dense_columns.hpp"
+#include "memory_governor.hpp"
+#include "reversed_cursor.hpp"
 
 #include "utils/logger/logger.hpp"
+#include "utils/perf/perfcounter.hpp"
 
 #include <llvm/ADT/iterator.h>
 #include <llvm/ADT/iterator_range.h>
 #include <debug_assert/debug_assert.hpp>
 
+#include <algorithm>
 #include <unordered_map>
 #include <unordered_set>
 #include <queue>
+#include <utility>
 #include <memory>
 #include <vector>
 #include <limits>
 
 #include <parallel_hashmap/phmap.h>
+#include <omp.h>
 
 extern "C" {
 #include "hmmer.h"
@@ -32,44 +40,6 @@ struct hmmpath_assert : debug_assert::default_handler,
 using pathtree::PathLink;
 using pathtree::PathLinkRef;
 
-// template <typename... Ts> using void_t = void;
-//
-// template <typename T, typename = void>
-// struct has_next_frame_shift_method : std::false_type {};
-//
-// template <typename T>
-// struct has_next_frame_shift_method<T, void_t<decltype(std::declval<T>().next_frame_shift(std::declval<T::Context>()))>> : std::true_type {};
-//
-// template <class GraphCursor>
-// std::enable_if_t<has_next_frame_shift_method<GraphCursor>::value, const std::vector<GraphCursor>>
-// next_frame_shift(const GraphCursor &cursor, typename GraphCursor::Context context) {
-//   return cursor.next_frame_shift(context);
-// }
-//
-// template <class GraphCursor>
-// std::enable_if_t<!has_next_frame_shift_method<GraphCursor>::value, const std::vector<GraphCursor>>
-// next_frame_shift(const GraphCursor&, typename GraphCursor::Context) {
-//   return {};
-// }
-// FIXME use SFINAE
-
-template <typename GraphCursor>
-const std::vector<GraphCursor> next_frame_shift(const GraphCursor&, typename GraphCursor::Context) {
-  return {};
-}
-
-template <typename GraphCursor>
-const std::vector<AAGraphCursor<GraphCursor>> next_frame_shift(const AAGraphCursor<GraphCursor> &cursor,
-                                                               typename AAGraphCursor<GraphCursor>::Context context) {
-  return cursor.next_frame_shift(context);
-}
-
-template <>
-inline const std::vector<CachedAACursor> next_frame_shift(const CachedAACursor &cursor,
-                                                          typename CachedAACursor::Context context) {
-  return cursor.next_frame_shift(context);
-}
-
 template <typename Map>
 class FilterMapMixin {
  public:
@@ -108,6 +78,64 @@ class FilterMapMixin {
   const Map *crtp_this() const { return static_cast<const Map *>(this); }
 };
 
+// Running upper bound of the score of the n-th best state of a set (see Fees::use_streaming_filter).
+// The score of a state only decreases after insertion, so the n-th best of the first scores of n distinct states
+// bounds the n-th best final score, and a new state worse than the bound would not pass score_filter() anyway.
+// limit caps the bound: states worse than it are filtered out unconditionally
+class ScoreThreshold {
+ public:
+  static constexpr size_t UNLIMITED = std::numeric_limits<size_t>::max();
+
+  void reset(size_t n, score_t limit) {
+    n_ = n;
+    limit_ = limit;
+    heap_.clear();
+  }
+
+  score_t threshold() const {
+    if (n_ == 0) {
+      return -std::numeric_limits<score_t>::infinity();
+    }
+    return heap_.size() < n_ ? limit_ : std::min(limit_, heap_.front());
+  }
+
+  bool rejects(score_t score) const {
+    return score > threshold();
+  }
+
+  // Registers the first score of a new state
+  void push(score_t score) {
+    if (n_ == UNLIMITED || n_ == 0) return;
+    if (heap_.size() < n_) {
+      heap_.push_back(score);
+      std::push_heap(heap_.begin(), heap_.end());
+    } else if (score < heap_.front()) {
+      std::pop_heap(heap_.begin(), heap_.end());
+      heap_.back() = score;
+      std::push_heap(heap_.begin(), heap_.end());
+    }
+  }
+
+  template <typename Set>
+  void push_all(const Set &S) {
+    for (const auto &state : S.states()) {
+      push(state.score);
+    }
+  }
+
+ private:
+  size_t n_ = UNLIMITED;
+  score_t limit_ = std::numeric_limits<score_t>::infinity();
+  std::vector<score_t> heap_;  // max-heap of the n best first scores
+};
+
+// Buffers of the streaming ScoresFilterMapMixin::score_filter() reused between columns
+template <typename Key>
+struct ScoreFilterBuffer {
+  std::vector<score_t> heap;  // max-heap of the n best scores met
+  std::vector<std::pair<score_t, Key>> kept;
+};
+
 template <typename Map>
 class ScoresFilterMapMixin : public FilterMapMixin<Map> {
  public:
@@ -141,6 +169,57 @@ class ScoresFilterMapMixin : public FilterMapMixin<Map> {
     return crtp_this()->filter_key_value(pred);
   }
 
+  // The same filtering in a single pass over the set: states worse than the running threshold (see ScoreThreshold)
+  // or than the n-th best score seen so far are erased as they are met. The scores and the keys of the kept states
+  // are collected into the buffer reused between columns, and the few of them that turn out to be worse than
+  // the final n-th best score are erased by key afterwards
+  template <typename Key>
+  size_t score_filter(size_t n, score_t score, const ScoreThreshold &threshold, ScoreFilterBuffer<Key> &buffer) {
+    n = std::min(n, crtp_this()->size());
+    if (n == 0) {
+      crtp_this()->clear();
+      return 0;
+    }
+
+    score = std::min(score, threshold.threshold());
+    auto &heap = buffer.heap;
+    auto &kept = buffer.kept;
+    heap.clear();
+    kept.clear();
+    size_t count = 0;
+    for (auto it = crtp_this()->begin(); it != crtp_this()->end();) {
+      const score_t s = Map::score_fnc(*it);
+      if (s > (heap.size() < n ? score : std::min(score, heap.front()))) {
+        it = crtp_this()->erase(it);
+        ++count;
+        continue;
+      }
+
+      if (heap.size() < n) {
+        heap.push_back(s);
+        std::push_heap(heap.begin(), heap.end());
+      } else if (s < heap.front()) {
+        std::pop_heap(heap.begin(), heap.end());
+        heap.back() = s;
+        std::push_heap(heap.begin(), heap.end());
+      }
+      kept.emplace_back(s, it->first);
+      ++it;
+    }
+
+    if (heap.size() == n) {
+      score = std::min(score, heap.front());
+    }
+    for (const auto &score_key : kept) {
+      if (score_key.first > score) {
+        crtp_this()->erase(score_key.second);
+        ++count;
+      }
+    }
+
+    return count;
+  }
+
  private:
   Map *crtp_this() { return static_cast<Map *>(this); }
   const Map *crtp_this() const { return static_cast<const Map *>(this); }
@@ -292,6 +371,19 @@ class DeletionStateSet : public phmap::flat_hash_map<GraphCursor, ScoredPLink<Gr
     return false;
   }
 
+  // The same as update(), but a new state worse than the threshold is not inserted
+  bool update(score_t score,
+              const PathLinkRef<GraphCursor> &plink,
+              ScoreThreshold &threshold) {
+    if (!this->count(plink->cursor())) {
+      if (threshold.rejects(score)) {
+        return false;
+      }
+      threshold.push(score);
+    }
+    return update(score, plink);
+  }
+
   template <typename Set>
   size_t merge(const Set &S, score_t fee = 0) {
     size_t count = 0;
@@ -303,6 +395,17 @@ class DeletionStateSet : public phmap::flat_hash_map<GraphCursor, ScoredPLink<Gr
     return count;
   }
 
+  template <typename Set>
+  size_t merge(const Set &S, score_t fee, ScoreThreshold &threshold) {
+    size_t count = 0;
+
+    for (const auto &state : S.states()) {
+      count += update(state.score + fee, state.plink, threshold);
+    }
+
+    return count;
+  }
+
   void increment(score_t fee = 0) {
     for (auto &kv : *this) {
       kv.second.score += fee;
@@ -426,6 +529,24 @@ class StateSet : public phmap::flat_hash_map<GraphCursor, PathLinkRef<GraphCurso
     return prev > score;
   }
 
+  // The same as update(), but a new state worse than the threshold is not inserted
+  bool update(const GraphCursor &cursor, score_t score,
+              const PathLinkRef<GraphCursor> &plink,
+              ScoreThreshold &threshold) {
+    auto it = this->find(cursor);
+    if (it == this->end()) {
+      if (threshold.rejects(score)) {
+        return false;
+      }
+      threshold.push(score);
+      it = this->emplace(cursor, PathLink<GraphCursor>::create(cursor)).first;
+    }
+
+    score_t prev = it->second->score();
+    it->second->update(score, plink);
+    return prev > score;
+  }
+
   template <typename KV>  // TODO Use exact type here instof duck typing
   static score_t score_fnc(const KV &kv) {
     return kv.second->score();
@@ -433,13 +554,127 @@ class StateSet : public phmap::flat_hash_map<GraphCursor, PathLinkRef<GraphCurso
 
 };
 
+// Event graph states after a column of the model
 template <typename GraphCursor>
-PathSet<GraphCursor> find_best_path(const hmm::Fees &fees,
-                                    const std::vector<GraphCursor> &cursors,
-                                    typename GraphCursor::Context context) {
+struct Frontier {
+  StateSet<GraphCursor> I, M, F;
+  DeletionStateSet<GraphCursor> D;
+  PathLinkRef<GraphCursor> sink;  // complete paths which have left the model earlier (local mode)
+  std::shared_ptr<typename PathLink<GraphCursor>::Arena> arena;  // keeps the links of the states
+};
+
+template <typename GraphCursor, typename Set>
+void update_sink(const PathLinkRef<GraphCursor> &sink, const Set &S, double fee) {
+  for (const auto &state : S.states()) {
+    sink->update(state.score + fee, state.plink);
+  }
+}
+
+// Transfers from the states of a large column into an empty state set by OpenMP tasks.
+// relax(state, emit) should call emit(next, score) for all the transfers of a state, the way
+// the serial loop would. Chunks of sources enumerate their transfers into buckets, targets are
+// sharded by hash, so each task builds the links of its own shard. Links receive their ancestors
+// in the serial order and are inserted in the order of their first transfer, so the resulting set
+// (including its iteration order the ties of the later columns depend on) is the serial one.
+template <typename GraphCursor>
+class ShardedTransfer {
+ public:
+  // Smaller columns are not worth the bucketing
+  static constexpr size_t MIN_SOURCES = 1 << 14;
+  static constexpr size_t CHUNK_SIZE = 1 << 11;
+  static constexpr size_t SHARDS = 32;
+
+  static bool worth(size_t n_of_sources) {
+    return n_of_sources >= MIN_SOURCES && omp_get_num_threads() > 1;
+  }
+
+  template <typename Map, typename Relax>
+  static void run(StateSet<GraphCursor> &to, const Map &from, const Relax &relax) {
+    VERIFY(to.empty());
+    std::vector<State<GraphCursor>> sources;
+    sources.reserve(from.size());
+    for (const auto &state : from.states()) {
+      sources.push_back(state);
+    }
+
+    const size_t chunks = (sources.size() + CHUNK_SIZE - 1) / CHUNK_SIZE;
+    std::vector<std::vector<std::vector<Transfer>>> buckets(chunks, std::vector<std::vector<Transfer>>(SHARDS));
+#pragma omp taskloop default(shared) grainsize(1)
+    for (size_t chunk = 0; chunk < chunks; ++chunk) {
+      auto &bucket = buckets[chunk];
+      uint64_t order = static_cast<uint64_t>(chunk) << 32;
+      for (size_t i = chunk * CHUNK_SIZE; i < std::min(sources.size(), (chunk + 1) * CHUNK_SIZE); ++i) {
+        const auto &state = sources[i];
+        relax(state, [&](const GraphCursor &next, score_t score) {
+          bucket[shard(next)].push_back({next, score, state.plink, order++});
+        });
+      }
+    }
+
+    // Links created by the shards with the positions of their first transfers
+    std::vector<std::vector<std::pair<uint64_t, PathLinkRef<GraphCursor>>>> created(SHARDS);
+    const auto &arena = PathLink<GraphCursor>::Arena::Scope::current()->arena_ptr();
+#pragma omp taskloop default(shared) grainsize(1)
+    for (size_t s = 0; s < SHARDS; ++s) {
+      typename PathLink<GraphCursor>::Arena::Scope scope(arena);
+      phmap::flat_hash_map<GraphCursor, PathLinkRef<GraphCursor>> links;
+      for (const auto &bucket : buckets) {
+        for (const auto &transfer : bucket[s]) {
+          auto it = links.find(transfer.cursor);
+          if (it == links.end()) {
+            it = links.emplace(transfer.cursor, PathLink<GraphCursor>::create(transfer.cursor)).first;
+            created[s].emplace_back(transfer.order, it->second);
+          }
+          it->second->update(transfer.score, transfer.plink);
+        }
+      }
+    }
+
+    std::vector<std::pair<uint64_t, PathLinkRef<GraphCursor>>> links;
+    for (auto &shard_links : created) {
+      links.insert(links.end(), shard_links.cbegin(), shard_links.cend());
+    }
+    std::sort(links.begin(), links.end(),
+              [](const auto &a, const auto &b) { return a.first < b.first; });
+    for (const auto &link : links) {
+      to.emplace(link.second->cursor(), link.second);
+    }
+  }
+
+ private:
+  struct Transfer {
+    GraphCursor cursor;
+    score_t score;
+    PathLinkRef<GraphCursor> plink;
+    uint64_t order;  // position among the transfers of the serial loop
+  };
+
+  static size_t shard(const GraphCursor &cursor) {
+    // High bits of the mixed hash, the flat maps of the shards use the low ones
+    const uint64_t hash = phmap::Hash<GraphCursor>()(cursor);
+    return static_cast<size_t>((hash * 0x9E3779B97F4A7C15ULL) >> 59) % SHARDS;
+  }
+};
+
+// Runs the search over the columns 1..last of the model and returns the states of the last one.
+// depth is anything answering depth_at_least() queries: either a lazy DepthInt or a precomputed table.
+// Event graph vertices are allocated in the current arena (see find_best_path()), the ones unreachable from
+// the states are released after each column.
+// collapse = false keeps all the links of M vertices, trimming and collapsing depend on the direction of the search
+template <typename GraphCursor, typename Depth>
+Frontier<GraphCursor> sweep(const hmm::Fees &fees,
+                            const std::vector<GraphCursor> &cursors,
+                            typename GraphCursor::Context context,
+                            Depth &depth,
+                            size_t last,
+                            bool collapse = true) {
   using StateSet = StateSet<GraphCursor>;
   using DeletionStateSet = DeletionStateSet<GraphCursor>;
   const auto &code = fees.code;
+  VERIFY(last <= fees.M);
+  // Packed model tables and pre-digitized residues of the cursors, so an emission fee is two array loads
+  const hmm::PackedFees packed(fees);
+  const ResidueCodes<GraphCursor> residue(context, code);
 
   INFO("pHMM size: " << fees.M);
   if (!fees.check_i_loop(0)) {
@@ -464,35 +699,61 @@ PathSet<GraphCursor> find_best_path(const hmm::Fees &fees,
 
   // auto outcoming_long_edges = ultra_compression(vcursors, context);
 
-  depth_filter::DepthInt<GraphCursor> depth;
+  std::unique_ptr<UnbranchedRuns<GraphCursor>> runs;
+  if (fees.use_compressed_runs) {
+    runs.reset(new UnbranchedRuns<GraphCursor>(vcursors, context, code));
+    INFO("Unbranched runs: " << runs->size());
+  }
 
   std::vector<GraphCursor> initial;
 
-  auto transfer = [&code, &initial, context](StateSet &to, const auto &from, double transfer_fee,
-                                             const std::vector<double> &emission_fees) {
+  // threshold is nullptr unless the streaming filter is used
+  auto transfer = [&residue, &initial, context](StateSet &to, const auto &from, double transfer_fee,
+                                                 const double *emission_fees,
+                                                 ScoreThreshold *threshold) {
     DEBUG_ASSERT((void*)(&to) != (void*)(&from), hmmpath_assert{});
+    if (!threshold && to.empty() && ShardedTransfer<GraphCursor>::worth(from.size())) {
+      // The streaming filter depends on the order of insertions, so it keeps to the serial loop
+      ShardedTransfer<GraphCursor>::run(to, from, [&](const State<GraphCursor> &state, const auto &emit) {
+        auto relax = [&](const GraphCursor &next) {
+          emit(next, state.score + transfer_fee + emission_fees[residue(next)]);
+        };
+        if (state.cursor.is_empty()) {
+          std::for_each(initial.cbegin(), initial.cend(), relax);
+        } else {
+          for_each_next(state.cursor, context, relax);
+        }
+      });
+      return;
+    }
     for (const auto &state : from.states()) {
-      for (const auto &next : (state.cursor.is_empty() ? initial : state.cursor.next(context))) {
-        double cost = state.score + transfer_fee + emission_fees[code(next.letter(context))];
-        to.update(next, cost, state.plink);
+      auto relax = [&](const GraphCursor &next) {
+        double cost = state.score + transfer_fee + emission_fees[residue(next)];
+        threshold ? to.update(next, cost, state.plink, *threshold) : to.update(next, cost, state.plink);
+      };
+      if (state.cursor.is_empty()) {
+        std::for_each(initial.cbegin(), initial.cend(), relax);
+      } else {
+        for_each_next(state.cursor, context, relax);
       }
     }
   };
 
-  auto transfer_frame_shift = [context](StateSet &to, const auto &from, double transfer_fee) {
+  auto transfer_frame_shift = [context](StateSet &to, const auto &from, double transfer_fee,
+                                        ScoreThreshold *threshold) {
     DEBUG_ASSERT((void*)(&to) != (void*)(&from), hmmpath_assert{});
     for (const auto &state : from.states()) {
       if (state.cursor.is_empty()) continue;
-      for (const auto &next : next_frame_shift(state.cursor, context)) {
+      for_each_next_frame_shift(state.cursor, context, [&](const GraphCursor &next) {
         double cost = state.score + transfer_fee;
-        to.update(next, cost, state.plink);
-      }
+        threshold ? to.update(next, cost, state.plink, *threshold) : to.update(next, cost, state.plink);
+      });
     }
   };
 
-  auto loop_transfer_ff= [&code, context, &fees, &depth, &vcursors](StateSet &I, double transfer_fee,
-                                                                    const std::vector<double> &emission_fees,
-                                                                    const phmap::flat_hash_set<GraphCursor> &keys) {
+  auto loop_transfer_ff= [&residue, context, &fees, &depth, &vcursors](StateSet &I, double transfer_fee,
+                                                                       const double *emission_fees,
+                                                                       const phmap::flat_hash_set<GraphCursor> &keys) {
     DEBUG("loop_transfer_ff begins");
     StateSet Inext;
     std::vector<GraphCursor> updated_vertices;
@@ -508,10 +769,10 @@ PathSet<GraphCursor> find_best_path(const hmm::Fees &fees,
       relaxed.insert(cursor);
 
       double required_cursor_depth = static_cast<double>(fees.minimal_match_length) - static_cast<double>(plink->max_prefix_size());
-      for (const auto &next : cursor.next(context)) {
-        double cost = plink->score() + transfer_fee + emission_fees[code(next.letter(context))];
+      for_each_next(cursor, context, [&](const GraphCursor &next) {
+        double cost = plink->score() + transfer_fee + emission_fees[residue(next)];
         if (!vcursors.count(next)) {
-          VERIFY(next.prev(context).size() == 1 && next.next(context).size() == 1);
+          VERIFY(prev_count(next, context) == 1 && next_count(next, context) == 1);
           DEBUG("FAST FORWARD");
           bool successful_update = (cost <= fees.absolute_threshold) &&
                                    (depth.depth_at_least(next, required_cursor_depth, context)) &&
@@ -528,21 +789,21 @@ PathSet<GraphCursor> find_best_path(const hmm::Fees &fees,
             DEBUG("Update inefficient; go forward along the edge to the next non-vertex key");
             GraphCursor nn = next;
             while (!vcursors.count(nn) && !keys.count(nn)) {
-              nn = nn.next(context)[0];  // It's correct due to triviality of nn
+              nn = unique_next(nn, context);  // It's correct due to triviality of nn
             }
             if (keys.count(nn) && !vcursors.count(nn)) {
               stack.push_back(nn);
             }
           }
         } else {
-          if (cost > fees.absolute_threshold) continue;
-          if (!depth.depth_at_least(next, required_cursor_depth, context)) continue;
+          if (cost > fees.absolute_threshold) return;
+          if (!depth.depth_at_least(next, required_cursor_depth, context)) return;
           Inext.update(next, cost, plink);
           if (cost < I.get_cost(next)) {
             updated_vertices.push_back(next);
           }
         }
-      }
+      });
     }
     for (const GraphCursor &cursor : keys) {
       if (!relaxed.count(cursor)) {
@@ -601,24 +862,24 @@ PathSet<GraphCursor> find_best_path(const hmm::Fees &fees,
   //   return updated;
   // };
 
-  auto loop_transfer_negative = [&code, context, &fees, &depth](StateSet &I, double transfer_fee,
-                                                                const std::vector<double> &emission_fees,
-                                                                const auto &keys,
-                                                                bool just_all = false) {
+  auto loop_transfer_negative = [&residue, context, &fees, &depth](StateSet &I, double transfer_fee,
+                                                                   const double *emission_fees,
+                                                                   const auto &keys,
+                                                                   bool just_all = false) {
     StateSet Inext;
     std::vector<GraphCursor> updated;
     auto process = [&](const auto &collection) -> void {
       for (const auto &state : collection) {
         double required_cursor_depth = static_cast<double>(fees.minimal_match_length) - static_cast<double>(state.plink->max_prefix_size());
-        for (const auto &next : state.cursor.next(context)) {
-          double cost = state.score + transfer_fee + emission_fees[code(next.letter(context))];
-          if (cost > fees.absolute_threshold) continue;
-          if (!depth.depth_at_least(next, required_cursor_depth, context)) continue;
+        for_each_next(state.cursor, context, [&](const GraphCursor &next) {
+          double cost = state.score + transfer_fee + emission_fees[residue(next)];
+          if (cost > fees.absolute_threshold) return;
+          if (!depth.depth_at_least(next, required_cursor_depth, context)) return;
           Inext.update(next, cost, state.plink);
           if (cost < I.get_cost(next)) {
             updated.push_back(next);
           }
-        }
+        });
       }
     };
     just_all ? process(I.states()) : process(I.states(keys));
@@ -633,14 +894,14 @@ PathSet<GraphCursor> find_best_path(const hmm::Fees &fees,
     return updated;
   };
 
-  auto i_loop_processing_ff_simple = [&loop_transfer_ff, &fees](StateSet &I, size_t m) {
+  auto i_loop_processing_ff_simple = [&loop_transfer_ff, &fees, &packed](StateSet &I, size_t m) {
     phmap::flat_hash_set<GraphCursor> updated;
     for (const auto &kv : I) {
       updated.insert(kv.first);
     }
     I.set_event(m, EventType::INSERTION);
     for (size_t i = 0; i < fees.max_insertion_length && !updated.empty(); ++i) {
-      updated = loop_transfer_ff(I, fees.t[m][p7H_II], fees.ins[m], updated);
+      updated = loop_transfer_ff(I, packed.t(m)[p7H_II], packed.ins(m), updated);
       if (is_power_of_two_or_zero(m)) {
         INFO("Updated: " << updated.size() << " over " << I.size() << " on i = " << i << " m = " << m);
       }
@@ -654,11 +915,129 @@ PathSet<GraphCursor> find_best_path(const hmm::Fees &fees,
     }
   };
 
-  auto i_loop_processing_universal = [&loop_transfer_negative, &fees](StateSet &I, size_t m) {
+  // The same relaxation as loop_transfer_ff, but over the unbranched runs: keys inside a run are sorted by offset,
+  // so the run is scanned as an array jumping from key to key instead of walking and looking up cursor by cursor
+  auto loop_transfer_runs = [&residue, context, &fees, &depth, &vcursors, &runs](StateSet &I, double transfer_fee,
+                                                                                 const double *emission_fees,
+                                                                                 const std::vector<GraphCursor> &keys) {
+    StateSet Inext;
+    std::vector<GraphCursor> updated_vertices;
+    std::vector<GraphCursor> updated;
+
+    auto relax_vertex = [&](const GraphCursor &next, const PathLinkRef<GraphCursor> &plink) {
+      double cost = plink->score() + transfer_fee + emission_fees[residue(next)];
+      double required_cursor_depth = static_cast<double>(fees.minimal_match_length) - static_cast<double>(plink->max_prefix_size());
+      if (cost > fees.absolute_threshold) return;
+      if (!depth.depth_at_least(next, required_cursor_depth, context)) return;
+      Inext.update(next, cost, plink);
+      if (cost < I.get_cost(next)) {
+        updated_vertices.push_back(next);
+      }
+    };
+
+    // (run, offset + 1) for keys inside runs, (run, 0) for runs entered from a key source vertex
+    std::vector<std::pair<uint32_t, uint32_t>> entries;
+    for (const GraphCursor &cursor : keys) {
+      if (!vcursors.count(cursor)) {
+        auto position = runs->position(cursor);
+        entries.emplace_back(position.run, position.offset + 1);
+        continue;
+      }
+
+      VERIFY(I.count(cursor));
+      const auto plink = I[cursor];
+      for_each_next(cursor, context, [&](const GraphCursor &next) {
+        if (vcursors.count(next)) {
+          relax_vertex(next, plink);
+        } else {
+          entries.emplace_back(runs->position(next).run, 0);
+        }
+      });
+    }
+    std::sort(entries.begin(), entries.end());
+
+    for (size_t i = 0; i < entries.size();) {
+      const uint32_t run = entries[i].first;
+      const uint32_t length = static_cast<uint32_t>(runs->length(run));
+      // from is the state relaxed into the offset-th cursor, nullptr if the scan should jump to the next key
+      PathLinkRef<GraphCursor> from = nullptr;
+      uint32_t offset = 0;
+      if (entries[i].second == 0) {
+        from = I[runs->source(run)];
+        ++i;
+      }
+
+      while (true) {
+        bool is_key = i < entries.size() && entries[i].first == run && entries[i].second == offset + 1;
+        if (!from) {
+          if (i == entries.size() || entries[i].first != run) break;
+          offset = entries[i].second - 1;
+          from = I[runs->cursor(run, offset)];
+          ++i;
+          if (++offset == length) break;
+          continue;
+        }
+
+        const GraphCursor &next = runs->cursor(run, offset);
+        double cost = from->score() + transfer_fee + emission_fees[runs->code(run, offset)];
+        double required_cursor_depth = static_cast<double>(fees.minimal_match_length) - static_cast<double>(from->max_prefix_size());
+        if ((cost <= fees.absolute_threshold) &&
+            (depth.depth_at_least(next, required_cursor_depth, context)) &&
+            (cost < I.get_cost(next))) {
+          auto new_plink = PathLink<GraphCursor>::create(next);
+          new_plink->update(cost, from);
+          I[next] = new_plink;
+          updated.push_back(next);
+          from = std::move(new_plink);
+        } else {
+          // The key state is kept and relaxed further instead of the rejected one
+          from = is_key ? I[next] : nullptr;
+        }
+        if (is_key) ++i;
+        if (++offset == length) break;
+      }
+
+      if (from && offset == length) {
+        relax_vertex(runs->end(run), from);
+      }
+      while (i < entries.size() && entries[i].first == run) ++i;
+    }
+
+    remove_duplicates(updated_vertices);
+    for (const GraphCursor &cursor : updated_vertices) {
+      auto plink = std::move(Inext[cursor]);
+      I[cursor] = std::move(plink);
+    }
+    updated.insert(updated.end(), updated_vertices.cbegin(), updated_vertices.cend());
+
+    return updated;
+  };
+
+  auto i_loop_processing_runs = [&loop_transfer_runs, &fees, &packed](StateSet &I, size_t m) {
+    std::vector<GraphCursor> updated;
+    for (const auto &kv : I) {
+      updated.push_back(kv.first);
+    }
+    I.set_event(m, EventType::INSERTION);
+    for (size_t i = 0; i < fees.max_insertion_length && !updated.empty(); ++i) {
+      updated = loop_transfer_runs(I, packed.t(m)[p7H_II], packed.ins(m), updated);
+      if (is_power_of_two_or_zero(m)) {
+        INFO("Updated: " << updated.size() << " over " << I.size() << " on i = " << i << " m = " << m);
+      }
+      for (const GraphCursor &cursor : updated) {
+        I[cursor]->set_emission(m, EventType::INSERTION);
+      }
+    }
+    if (!updated.empty()) {
+      DEBUG("i_loop_processing_runs has not been converged");
+    }
+  };
+
+  auto i_loop_processing_universal = [&loop_transfer_negative, &fees, &packed](StateSet &I, size_t m) {
     std::vector<GraphCursor> updated;
     I.set_event(m, EventType::INSERTION);
     for (size_t i = 0; i < fees.max_insertion_length && (i == 0 || !updated.empty()); ++i) {
-      updated = loop_transfer_negative(I, fees.t[m][p7H_II], fees.ins[m], updated, /*just_all*/ i == 0);
+      updated = loop_transfer_negative(I, packed.t(m)[p7H_II], packed.ins(m), updated, /*just_all*/ i == 0);
       if (is_power_of_two_or_zero(m)) {
         INFO("Updated: " << updated.size() << " over " << I.size() << " on i = " << i << " m = " << m);
       }
@@ -724,19 +1103,50 @@ PathSet<GraphCursor> find_best_path(const hmm::Fees &fees,
   //   }
   // };
 
-  auto dm_new = [&](DeletionStateSet &D, StateSet &M, const StateSet &I, const StateSet &F, size_t m) {
+  std::unique_ptr<DenseColumns<GraphCursor>> dense;
+  if (fees.use_dense_columns) {
+    dense = DenseColumns<GraphCursor>::create(context);
+    if (dense) {
+      INFO("Dense columns enabled, column size: " << dense->size());
+    }
+  }
+
+  // Streaming filter (see Fees::use_streaming_filter): running thresholds of the sets of the current column
+  const bool streaming = fees.use_streaming_filter;
+  ScoreThreshold threshold_I, threshold_M, threshold_D, threshold_F;
+  ScoreFilterBuffer<GraphCursor> filter_buffer;
+  double filter_time = 0;
+
+  auto dm_new = [&](DeletionStateSet &D, StateSet &M, const StateSet &I, const StateSet &F, size_t m, size_t limit) {
+    if (dense && dense->worth(D.size() + M.size() + I.size() + F.size())) {
+      // Dense columns are filled as a whole, the thresholds stay at their limits. Links are created only for
+      // the M states kept by the score filter or the ones whose transfers into I and F could pass the threshold
+      score_t feed = packed.t(m)[p7H_MI] + *std::min_element(fees.ins[m].cbegin(), fees.ins[m].cend());
+      if (cursor_adjacency_impl::has_for_each_next_frame_shift<GraphCursor>::value) {
+        feed = std::min(feed, fees.frame_shift_cost);
+      }
+      dense->dm(D, M, I, F, packed.t(m - 1), packed.mat(m), residue, initial, context, fees.absolute_threshold,
+                limit, fees.absolute_threshold - feed);
+      return;
+    }
+
     DeletionStateSet preM = D;
 
-    D.increment(fees.t[m - 1][p7H_DD]);
-    D.merge(M, fees.t[m - 1][p7H_MD]);
+    D.increment(packed.t(m - 1)[p7H_DD]);
+    if (streaming) {
+      threshold_D.push_all(D);
+      D.merge(M, packed.t(m - 1)[p7H_MD], threshold_D);
+    } else {
+      D.merge(M, packed.t(m - 1)[p7H_MD]);
+    }
 
-    preM.increment(fees.t[m - 1][p7H_DM]);
-    preM.merge(M, fees.t[m - 1][p7H_MM]);
-    preM.merge(I, fees.t[m - 1][p7H_IM]);
-    preM.merge(F, fees.t[m - 1][p7H_MM]);
+    preM.increment(packed.t(m - 1)[p7H_DM]);
+    preM.merge(M, packed.t(m - 1)[p7H_MM]);
+    preM.merge(I, packed.t(m - 1)[p7H_IM]);
+    preM.merge(F, packed.t(m - 1)[p7H_MM]);
 
     M.clear();
-    transfer(M, preM, 0, fees.mat[m]);
+    transfer(M, preM, 0, packed.mat(m), streaming ? &threshold_M : nullptr);
   };
 
   INFO("Original (before filtering) initial set size: " << cursors.size());
@@ -757,11 +1167,6 @@ PathSet<GraphCursor> find_best_path(const hmm::Fees &fees,
   auto source = PathLink<GraphCursor>::create_source();
   auto sink = PathLink<GraphCursor>::create_sink();
   M[GraphCursor()] = source;
-  auto update_sink = [&sink](const auto &S, double fee) {
-    for (const auto &state : S.states()) {
-      sink->update(state.score + fee, state.plink);
-    }
-  };
 
   INFO("The number of links (M): " << fees.M);
 
@@ -778,37 +1183,91 @@ PathSet<GraphCursor> find_best_path(const hmm::Fees &fees,
     return !depth.depth_at_least(cursor, required_cursor_depth, context);
   };
 
+  // Exact pruning (see Fees::use_cost_bounds): paths are reported only if their cost is not positive
+  // (see PathLink::for_each_top()), so a state is dropped if even the best completion of its paths is positive.
+  // It is applied after the score filter, so the states kept in a column are the same as without it
+  std::unique_ptr<hmm::RemainingCostBounds> bounds;
+  double bound_slack = 0;
+  if (fees.use_cost_bounds) {
+    bounds.reset(new hmm::RemainingCostBounds(fees.remaining_cost_bounds()));
+    // Path costs are summed in another order, and the reported score of a path carries the rounding of the
+    // stored ancestor scores it deviates through (see ScoreStorage), at most one per position
+    bound_slack = 1e-6 + 2 * static_cast<double>(fees.M + 1) * ScoreStorage::rounding(bounds->match[0]);
+    INFO("Best remaining cost bound: " << bounds->match[0] << ", slack " << bound_slack);
+  }
+  size_t bound_filtered = 0;
+  auto bound_filter = [&](auto &S, std::vector<double> hmm::RemainingCostBounds::*bound, size_t m) {
+    if (!bounds) return;
+    using Map = std::decay_t<decltype(S)>;
+    const double max_cost = -((*bounds).*bound)[m] + bound_slack;
+    bound_filtered += S.filter_key_value([max_cost](const auto &kv) { return Map::score_fnc(kv) > max_cost; });
+  };
+
   auto i_loop_processing_checked = [&](StateSet &I, size_t m) {
     if (!fees.is_i_loop_non_negative(m)) {
       INFO("Processing positive-score I-loop");
       i_loop_processing_universal(I, m);
     } else {
-      fees.use_experimental_i_loop_processing ? i_loop_processing_ff_simple(I, m) : i_loop_processing_universal(I, m);
+      if (runs) {
+        i_loop_processing_runs(I, m);
+      } else {
+        fees.use_experimental_i_loop_processing ? i_loop_processing_ff_simple(I, m) : i_loop_processing_universal(I, m);
+      }
     }
   };
 
-  transfer(I, M, fees.t[0][p7H_MI], fees.ins[0]);
+  transfer(I, M, packed.t(0)[p7H_MI], packed.ins(0), nullptr);
   i_loop_processing_checked(I, 0);  // Do we really need I at the beginning???
   I.set_event(0, EventType::INSERTION);
 
-  transfer_frame_shift(F, M, fees.frame_shift_cost);
+  transfer_frame_shift(F, M, fees.frame_shift_cost, nullptr);
   F.collapse_all_to_one();  // FIXME implement proper collapsing for F state
   F.set_event(0, EventType::FRAME_SHIFT);
 
-  for (size_t m = 1; m <= fees.M; ++m) {
+  // Under memory pressure the limits are scaled down (see MemoryGovernor), the first positions get limited as well
+  MemoryGovernor &governor = MemoryGovernor::instance();
+  MemoryGovernor::Search footprint(governor);
+  double scale = 1;
+  auto state_limit = [&fees, &scale](size_t m) -> size_t {
+    if (m > 500) return static_cast<size_t>(static_cast<double>(fees.state_limits.l500) * scale);
+    if (m > 100) return static_cast<size_t>(static_cast<double>(fees.state_limits.l100) * scale);
+    if (m > 25 || scale < 1) return static_cast<size_t>(static_cast<double>(fees.state_limits.l25) * scale);
+    return ScoreThreshold::UNLIMITED;
+  };
+  auto &arena_scope = *PathLink<GraphCursor>::Arena::Scope::current();
+  // Event graph vertices of the search are counted by its arena, state sets by their capacity
+  auto report_footprint = [&]() {
+    size_t bytes = arena_scope.arena().allocated_bytes();
+    bytes += (I.bucket_count() + M.bucket_count() + F.bucket_count()) * (sizeof(typename StateSet::value_type) + 1);
+    bytes += D.bucket_count() * (sizeof(typename DeletionStateSet::value_type) + 1);
+    footprint.report(bytes, D.size() + I.size() + M.size() + F.size());
+  };
+  for (size_t m = 1; m <= last; ++m) {
+    scale = governor.state_limit_scale();
+    if (scale < 1) {
+      footprint.degrade(scale, m);
+    }
+    if (streaming) {
+      threshold_I.reset(state_limit(m), fees.absolute_threshold);
+      threshold_M.reset(state_limit(m), fees.absolute_threshold);
+      threshold_D.reset(state_limit(m), fees.absolute_threshold);
+      threshold_F.reset(state_limit(m), fees.absolute_threshold);
+    }
     if (fees.local && m > 1) {  // FIXME check latter condition. Does it really make sense?
       D.update(fees.cleavage_cost, source);
     }
-    dm_new(D, M, I, F, m);
-    M.trim_all();
-    M.collapse_all();
+    dm_new(D, M, I, F, m, state_limit(m));
+    if (collapse) {
+      M.trim_all();
+      M.collapse_all();
+    }
 
     I.clear();
-    transfer(I, M, fees.t[m][p7H_MI], fees.ins[m]);
+    transfer(I, M, packed.t(m)[p7H_MI], packed.ins(m), streaming ? &threshold_I : nullptr);
     i_loop_processing_checked(I, m);
 
     F.clear();
-    transfer_frame_shift(F, M, fees.frame_shift_cost);
+    transfer_frame_shift(F, M, fees.frame_shift_cost, streaming ? &threshold_F : nullptr);
     F.collapse_all_to_one();  // FIXME Implement proper collapsing for F state OR split F and G states
 
     I.set_event(m, EventType::INSERTION);
@@ -818,26 +1277,34 @@ PathSet<GraphCursor> find_best_path(const hmm::Fees &fees,
     size_t n_of_states = D.size() + I.size() + M.size() + F.size();
 
     TRACE("# states " << m << " => " << n_of_states);
-    size_t top = n_of_states;
-    if (m > 25) {
-      top = fees.state_limits.l25;
-    }
-    if (m > 100) {
-      top = fees.state_limits.l100;
-    }
-    if (m > 500) {
-      top = fees.state_limits.l500;
-    }
+    size_t top = std::min(n_of_states, state_limit(m));
 
     if (is_power_of_two_or_zero(m)) {
       INFO("Step #: " << m);
       INFO("# states " << m << " => " << n_of_states << ": I = " << I.size() << " M = " << M.size() << " D = " << D.size() << " F = " << F.size());
     }
 
-    I.score_filter(top, fees.absolute_threshold);
-    M.score_filter(top, fees.absolute_threshold);
-    D.score_filter(top, fees.absolute_threshold);
-    F.score_filter(top, fees.absolute_threshold);
+    utils::perf_counter filter_counter;
+    size_t score_filtered = 0;
+    if (streaming) {
+      score_filtered += I.score_filter(top, fees.absolute_threshold, threshold_I, filter_buffer);
+      score_filtered += M.score_filter(top, fees.absolute_threshold, threshold_M, filter_buffer);
+      score_filtered += D.score_filter(top, fees.absolute_threshold, threshold_D, filter_buffer);
+      score_filtered += F.score_filter(top, fees.absolute_threshold, threshold_F, filter_buffer);
+    } else {
+      score_filtered += I.score_filter(top, fees.absolute_threshold);
+      score_filtered += M.score_filter(top, fees.absolute_threshold);
+      score_filtered += D.score_filter(top, fees.absolute_threshold);
+      score_filtered += F.score_filter(top, fees.absolute_threshold);
+    }
+    const double column_filter_time = filter_counter.time_ms();
+    filter_time += column_filter_time;
+    TRACE("score-filtered " << score_filtered << " in " << column_filter_time << " ms position in HMM " << m);
+
+    bound_filter(I, &hmm::RemainingCostBounds::insertion, m);
+    bound_filter(M, &hmm::RemainingCostBounds::match, m);
+    bound_filter(D, &hmm::RemainingCostBounds::deletion, m);
+    bound_filter(F, &hmm::RemainingCostBounds::frame_shift, m);
 
     size_t depth_filtered = 0;
     if (m % 1 == 0) {
@@ -847,11 +1314,25 @@ PathSet<GraphCursor> find_best_path(const hmm::Fees &fees,
     }
 
     if (fees.local) {
-      update_sink(D, fees.cleavage_cost);  // FIXME subtract cost for transition -> D state ?  // FIXME check it twice! I collapsing is dangerous
+      update_sink(sink, D, fees.cleavage_cost);  // FIXME subtract cost for transition -> D state ?  // FIXME check it twice! I collapsing is dangerous
     }
 
+    arena_scope.collect([&](auto &&visit) {
+      for (const auto *S : {&I, &M, &F}) {
+        for (const auto &kv : *S) visit(kv.second.get());
+      }
+      for (const auto &kv : D) visit(kv.second.plink.get());
+      visit(source.get());
+      visit(sink.get());
+    });
+    report_footprint();
+
     if (is_power_of_two_or_zero(m)) {
       INFO("depth-filtered " << depth_filtered << " position in HMM " << m);
+      INFO("score-filtered " << score_filtered << " in " << column_filter_time << " ms (" << filter_time << " ms in total) position in HMM " << m);
+      if (bounds) {
+        INFO("bound-filtered " << bound_filtered << " position in HMM " << m);
+      }
       INFO("I = " << I.size() << " M = " << M.size() << " D = " << D.size());
       auto scores = M.scores();
       std::sort(scores.begin(), scores.end());
@@ -863,17 +1344,27 @@ PathSet<GraphCursor> find_best_path(const hmm::Fees &fees,
     }
   }
 
-  INFO("Max stack size in Depth: " << depth.max_stack_size());
+  return {std::move(I), std::move(M), std::move(F), std::move(D), std::move(sink), arena_scope.arena_ptr()};
+}
 
-  update_sink(D, fees.t[fees.M][p7H_DM]);
-  update_sink(I, fees.t[fees.M][p7H_IM]);  // Do we really need I at the end?
-  update_sink(F, fees.t[fees.M][p7H_MM]);  // Do we really need F at the end?
-  update_sink(M, fees.t[fees.M][p7H_MM]);
+template <typename GraphCursor, typename Depth>
+PathSet<GraphCursor> find_best_path(const hmm::Fees &fees,
+                                    const std::vector<GraphCursor> &cursors,
+                                    typename GraphCursor::Context context,
+                                    Depth &depth) {
+  // Event graph vertices live in a per-search arena released together with the resulting PathSet
+  typename PathLink<GraphCursor>::Arena::Scope arena_scope;
+
+  auto frontier = sweep(fees, cursors, context, depth, fees.M);
+  const auto &sink = frontier.sink;
+  update_sink(sink, frontier.D, fees.t[fees.M][p7H_DM]);
+  update_sink(sink, frontier.I, fees.t[fees.M][p7H_IM]);  // Do we really need I at the end?
+  update_sink(sink, frontier.F, fees.t[fees.M][p7H_MM]);  // Do we really need F at the end?
+  update_sink(sink, frontier.M, fees.t[fees.M][p7H_MM]);
   sink->collapse_and_trim();
 
-  DEBUG(sink->object_count_current() << " pathlink objects");
-  DEBUG(sink->object_count_max() << " pathlink objects maximum");
-  DEBUG(sink->object_count_constructed() << " pathlink objects constructed");
+  DEBUG(arena_scope.arena().size() << " pathlink objects in arena after " << arena_scope.arena().collections() << " collections, "
+        << arena_scope.arena().allocated_bytes() << " bytes allocated");
 
   INFO("Sink size: " << sink->size());
 
@@ -881,6 +1372,156 @@ PathSet<GraphCursor> find_best_path(const hmm::Fees &fees,
   return result;
 }
 
+// Meet-in-the-middle search (see Fees::use_bidirectional_search). The columns 1..h are swept forward and
+// the columns M..h+1 backward over the reversed graph with the reversed fees; the halves run concurrently.
+// The backward event graph is turned over and linked to the forward states of column h, so the top paths
+// are extracted from the joint event graph as usual. Frame shifts and local exits are not supported
+template <typename GraphCursor, typename Depth>
+PathSet<GraphCursor> find_best_path_bidirectional(const hmm::Fees &fees,
+                                                  const std::vector<GraphCursor> &cursors,
+                                                  typename GraphCursor::Context context,
+                                                  Depth &depth) {
+  using RevCursor = ReversedGraphCursor<GraphCursor>;
+  using RevLink = PathLink<RevCursor>;
+  VERIFY(!fees.local);
+  const size_t M = fees.M;
+  const size_t h = M / 2;
+  const hmm::Fees rev_fees = fees.reversed();
+  const auto &code = fees.code;
+
+  typename PathLink<GraphCursor>::Arena::Scope arena_scope;
+  Frontier<RevCursor> backward;
+#pragma omp task default(shared)
+  {
+    typename RevLink::Arena::Scope rev_arena_scope;
+    depth_filter::DepthInt<RevCursor> rev_depth;
+    std::vector<RevCursor> rev_cursors(cursors.cbegin(), cursors.cend());
+    // Links are collapsed after turning over, as the forward search does
+    backward = sweep(rev_fees, rev_cursors, context, rev_depth, M - h, /*collapse*/ false);
+  }
+  auto forward = sweep(fees, cursors, context, depth, h);
+#pragma omp taskwait
+  INFO("Joining halves at column " << h << ": forward I = " << forward.I.size() << " M = " << forward.M.size() << " D = " << forward.D.size()
+       << ", backward M = " << backward.M.size() << " D = " << backward.D.size());
+
+  // Backward links include the emission of their own cursors, turned over links should include the emissions
+  // of their ancestors instead. Reversed columns m correspond to the original M + 1 - m (matches) and M - m (insertions)
+  auto emission = [&](const RevLink *link) -> double {
+    if (link->cursor().is_empty()) return 0;
+    auto event = link->emission();
+    size_t letter = code(link->cursor().letter(context));
+    return event.type == EventType::MATCH ? rev_fees.mat[event.m][letter] : rev_fees.ins[event.m][letter];
+  };
+
+  // Backward links reachable from the middle column in such an order that every link follows its ancestors
+  std::vector<const RevLink *> order;
+  phmap::flat_hash_map<const RevLink *, PathLinkRef<GraphCursor>> turned;
+  {
+    phmap::flat_hash_set<const RevLink *> visited;
+    std::vector<std::pair<const RevLink *, bool>> stack;
+    auto visit = [&](const RevLink *root) {
+      stack.emplace_back(root, false);
+      while (!stack.empty()) {
+        auto top = stack.back();
+        stack.pop_back();
+        if (top.second) {
+          order.push_back(top.first);
+          continue;
+        }
+        if (!visited.insert(top.first).second) continue;
+        stack.emplace_back(top.first, true);
+        top.first->for_each_ancestor([&](double, const PathLinkRef<RevCursor> &ancestor) {
+          if (!visited.count(ancestor.get())) stack.emplace_back(ancestor.get(), false);
+        });
+      }
+    };
+    for (const auto &state : backward.M.states()) visit(state.plink.get());
+    for (const auto &state : backward.D.states()) visit(state.plink.get());
+  }
+
+  auto sink = forward.sink;
+  for (const RevLink *link : order) {
+    if (link->is_source()) {
+      turned[link] = sink;
+    } else {
+      auto plink = PathLink<GraphCursor>::create(link->cursor());
+      auto event = link->emission();
+      plink->set_emission(event.type == EventType::MATCH ? M + 1 - event.m : M - event.m, event.type);
+      turned[link] = std::move(plink);
+    }
+  }
+
+  // Links between the states of column h and the backward states of column h + 1. A state of column h + 1 keeps
+  // the first cursor of the rest of the path (its links go through the deletions), an empty one means the end
+  auto join = [&](const RevCursor &cursor, const RevLink *link, double fee, bool match) {
+    const auto &target = turned[link];
+    const double in = fee + emission(link);
+    auto link_forward = [&](const GraphCursor &prev) {
+      auto it = forward.M.find(prev);
+      if (it != forward.M.end()) target->update(it->second->score() + fees.t[h][match ? p7H_MM : p7H_MD] + in, it->second);
+      if (match) {
+        auto it = forward.I.find(prev);
+        if (it != forward.I.end()) target->update(it->second->score() + fees.t[h][p7H_IM] + in, it->second);
+      }
+      auto dit = forward.D.find(prev);
+      if (dit != forward.D.end()) target->update(dit->second.score + fees.t[h][match ? p7H_DM : p7H_DD] + in, dit->second.plink);
+    };
+
+    if (cursor.is_empty()) {
+      // Deletions up to the end. The empty path is kept as well, it trims the sink as in the forward search
+      VERIFY(!match);
+      for (const auto &state : forward.M.states()) {
+        target->update(state.score + fees.t[h][p7H_MD] + in, state.plink);
+      }
+      for (const auto &state : forward.D.states()) {
+        target->update(state.score + fees.t[h][p7H_DD] + in, state.plink);
+      }
+      return;
+    }
+
+    const GraphCursor &first = cursor;
+    for_each_prev(first, context, link_forward);
+    // Deletions from the beginning
+    auto dit = forward.D.find(GraphCursor());
+    if (dit != forward.D.end() && depth.depth_at_least(first, static_cast<double>(fees.minimal_match_length), context)) {
+      target->update(dit->second.score + fees.t[h][match ? p7H_DM : p7H_DD] + in, dit->second.plink);
+    }
+  };
+  for (const auto &state : backward.M.states()) {
+    join(state.cursor, state.plink.get(), state.score - state.plink->score(), true);
+  }
+  for (const auto &state : backward.D.states()) {
+    join(state.cursor, state.plink.get(), state.score - state.plink->score(), false);
+  }
+
+  // Descendants go first, so the links are complete when they become ancestors
+  for (auto it = order.rbegin(); it != order.rend(); ++it) {
+    const RevLink *link = *it;
+    if (link->is_source()) continue;
+    const auto &plink = turned[link];
+    plink->collapse_and_trim();
+    if (!std::isfinite(plink->score())) continue;
+    const double out = plink->score() - emission(link);
+    link->for_each_ancestor([&](double score, const PathLinkRef<RevCursor> &ancestor) {
+      turned[ancestor.get()]->update(out + score - ancestor->score() + emission(ancestor.get()), plink);
+    });
+  }
+  sink->collapse_and_trim();
+
+  INFO("Sink size: " << sink->size());
+  return PathSet<GraphCursor>(sink);
+}
+
+template <typename GraphCursor>
+PathSet<GraphCursor> find_best_path(const hmm::Fees &fees,
+                                    const std::vector<GraphCursor> &cursors,
+                                    typename GraphCursor::Context context) {
+  depth_filter::DepthInt<GraphCursor> depth;
+  auto result = find_best_path(fees, cursors, context, depth);
+  INFO("Max stack size in Depth: " << depth.max_stack_size());
+  return result;
+}
+
 }  // namespace impl
 
 // vim: set ts=2 sw=2 et :
@@ -7,13 +7,19 @@
 #include "fees.hpp"
 #include "find_best_path.hpp"
 #include "debruijn_graph_cursor.hpp"
-#include "cursor_neighborhood.hpp"
+#include "edge_neighborhood.hpp"
 #include "cursor_conn_comps.hpp"
 #include "path_utils.hpp"
 #include "cached_cursor.hpp"
+#include "cursor_index.hpp"
+#include "component_contexts.hpp"
 #include "superpath_index.hpp"
 #include "hmm_path_info.hpp"
 #include "fasta_reader.hpp"
+#include "graph_cache.hpp"
+#include "memory_governor.hpp"
+#include "query_server.hpp"
+#include "result_writer.hpp"
 
 #include "stack_limit.hpp"
 #include <unistd.h>  // getpid()
@@ -47,8 +53,11 @@
 
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <csignal>
 #include <string>
+#include <thread>
 #include <functional>
+#include <numeric>
 
 #include <llvm/ADT/iterator_range.h>
 #include <type_traits>
@@ -102,11 +111,23 @@ struct PathracerConfig {
     bool parallel_component_processing = false;
     bool disable_depth_filter = false;
     size_t memory = 100;  // 100GB
+    bool memory_governor = true;
     int use_experimental_i_loop_processing = true;
+    bool use_dense_columns = false;
+    bool use_compressed_runs = false;
+    bool use_cost_bounds = false;
+    bool use_bidirectional_search = false;
+    bool use_streaming_filter = false;
     std::string known_sequences = "";
+    std::string cursor_index = "";
     bool export_event_graph = false;
     double minimal_match_length = 0.9;
     size_t max_insertion_length = 30;
+    size_t top_memory = 1024;  // MB
+    bool batch = false;
+    std::string graph_cache = "";  // directory of GFA graph snapshots, disabled if empty
+    bool parallel_gfa = true;
+    bool gzip_output = false;
 
     hmmer::hmmer_cfg hcfg;
 };
@@ -124,7 +145,8 @@ extern "C" {
 #include "hmmer.h"
 }
 
-void process_cmdline(int argc, char **argv, PathracerConfig &cfg) {
+// Returns false with the usage in the message if the command line is invalid
+bool parse_cmdline(int argc, char **argv, PathracerConfig &cfg, std::string &message) {
   using namespace clipp;
 
   auto cli = (
@@ -137,7 +159,7 @@ void process_cmdline(int argc, char **argv, PathracerConfig &cfg) {
       (option("--length", "-l") & value("value", cfg.minimal_match_length)) % "minimal length of resultant matched sequence; if <=1 then to be multiplied on aligned HMM length [default: 0.9]",
       (option("--top") & integer("N", cfg.top)) % "extract top N paths [default: 10000]",
       (option("--threads", "-t") & integer("NTHREADS", cfg.threads)) % "the number of parallel threads [default: 16]",
-      (option("--memory", "-m") & integer("MEMORY", cfg.memory)) % "RAM limit for PathRacer in GB (terminates if exceeded) [default: 100]",
+      (option("--memory", "-m") & integer("MEMORY", cfg.memory)) % "RAM limit for PathRacer in GB (searches are degraded as the limit approaches, terminates if exceeded) [default: 100]",
       (option("--max-size") & integer("SIZE", cfg.max_size)) % "maximal component size to consider [default: INF]",
       (option("--queries") & values("queries", cfg.queries)) % "queries names to lookup [default: all queries from input query file]",
       "Query type:" %
@@ -186,18 +208,41 @@ void process_cmdline(int argc, char **argv, PathracerConfig &cfg) {
       "Developer options:" % (
           cfg.parallel_component_processing << option("--parallel-components") % "process connected components of neighborhood subgraph in parallel [default: false]",
           (option("--max-insertion-length") & integer("x", cfg.max_insertion_length)) % "maximal allowed number of successive I-emissions [default: 30]",
+          (option("--top-memory") & integer("MB", cfg.top_memory)) % "memory budget for the queue of partial paths and the fingerprints of reported paths during top paths extraction in MB [default: 1024]",
           (option("--expand-coef") & number("value", cfg.expand_coef)) % "overhang expansion coefficient for neighborhood search [default: 2]",
           (option("--expand-const") & integer("value", cfg.expand_const)) % "const addition to overhang values for neighborhood search [default: 20]",
           (option("--no-top-score-filter").set(cfg.state_limits_coef, size_t(100500))) % "disable top score Event Graph vertices filter [default: false]",
+          option("--no-memory-governor").set(cfg.memory_governor, false) % "do not tighten the top score filter and throttle large components as the memory limit approaches [default: false]",
           option("--no-fast-forward").set(cfg.use_experimental_i_loop_processing, 0) % "disable fast forward in I-loops processing [default: false]",
+          cfg.use_dense_columns << option("--dense-columns") % "use dense vectorized D/M columns for dense event graph layers [default: false]",
+          cfg.use_compressed_runs << option("--compressed-runs") % "relax I-loops along unbranched runs of the graph as arrays, faster on long edges [default: false]",
+          cfg.use_cost_bounds << option("--cost-bounds") % "drop Event Graph vertices whose best possible completion cannot be reported [default: false]",
+          cfg.use_bidirectional_search << option("--bidirectional") % "search nucleotide HMMs from both ends concurrently and join the halves in the middle, global mode only [default: false]",
+          cfg.use_streaming_filter << option("--streaming-filter") % "reject states worse than the running top-N threshold before insertion instead of selecting them after each column [default: false]",
           // cfg.disable_depth_filter << option("--disable-depth-filter") % "disable depth filter",  // TODO restore this option
+          (option("--cursor-index") & value("filename", cfg.cursor_index)) % "cursor index of the graph built by pathracer-index",
+          (option("--graph-cache") & value("dir", cfg.graph_cache)) % "directory of binary snapshots of GFA graphs written on the first load and memory-mapped by the later runs [default: disabled]",
+          option("--no-parallel-gfa").set(cfg.parallel_gfa, false) % "parse GFA graph in a single thread, the graph is the same [default: false]",
+          cfg.gzip_output << option("--gzip-output") % "gzip the files of resulting paths and edges (.seqs.fa.gz, .nucs.fa.gz, .edges.fa.gz) [default: false]",
+          cfg.batch << option("--batch") % "seed all the queries first and share cursor contexts and depth tables of identical components between them [default: false]",
           (option("--known-sequences") & value("filename", cfg.known_sequences)) % "FASTA file with known sequnces that should be definitely found",
           cfg.export_event_graph << option("--export-event-graph") % "export event graph in cereal format"
       )
   );
 
   if (!parse(argc, argv, cli)) {
-    std::cout << make_man_page(cli, argv[0]);
+    std::ostringstream ss;
+    ss << make_man_page(cli, argv[0]);
+    message = ss.str();
+    return false;
+  }
+  return true;
+}
+
+void process_cmdline(int argc, char **argv, PathracerConfig &cfg) {
+  std::string message;
+  if (!parse_cmdline(argc, argv, cfg, message)) {
+    std::cout << message;
     exit(1);
   }
 }
@@ -248,6 +293,21 @@ private:
     std::function<T(size_t)> function_;
 };
 
+// Nucleotide sequence is matched as is against nucleotide HMMs and as three frames named REF/SHIFT against amino acid ones
+void MatchSequence(hmmer::HMMMatcher &matcher, const std::string &ref, const std::string &seq, bool hmm_in_aas) {
+    if (!hmm_in_aas) {
+        matcher.match(ref.c_str(), seq.c_str());
+        return;
+    }
+
+    VERIFY(seq.size() >= 2);
+    for (size_t shift = 0; shift < 3; ++shift) {
+        std::string ref_shift = ref + "/" + std::to_string(shift);
+        std::string seq_aas = aa::translate(seq.c_str() + shift);
+        matcher.match(ref_shift.c_str(), seq_aas.c_str());
+    }
+}
+
 template <typename StringArray>
 auto ScoreSequences(const StringArray &seqs,
                     const std::vector<std::string> &refs,
@@ -263,19 +323,72 @@ auto ScoreSequences(const StringArray &seqs,
     }
 
     for (size_t i = 0; i < seqs.size(); ++i) {
-        std::string seq = seqs[i];
-        std::string ref = refs.size() > i ? refs[i] : std::to_string(i);
-        if (!hmm_in_aas) {
-            matcher.match(ref.c_str(), seq.c_str());
+        MatchSequence(matcher, refs.size() > i ? refs[i] : std::to_string(i), seqs[i], hmm_in_aas);
+    }
+
+    matcher.summarize();
+    return matcher;
+}
+
+using ESLSequencePtr = std::unique_ptr<ESL_SQ, void(*)(ESL_SQ*)>;
+
+// Sequences are expected to be digitized in the alphabet of the HMM (and translated for amino acid HMMs),
+// see SeedSequences.
+// Targets are sharded between tasks with their own matchers. The vast majority of targets is rejected by
+// the acceleration filters, the rest is matched again serially in the original order. Since the serial
+// matcher accounts all the targets (including skipped ones) in the same order, E-values thresholds (Z)
+// and the random number stream of domain definition are the same as of the fully serial run,
+// so exactly the same hits are reported
+hmmer::HMMMatcher ScoreSequences(const std::vector<ESLSequencePtr> &seqs,
+                                 const hmmer::HMM &hmm, const PathracerConfig &cfg) {
+    DEBUG("ScoreSequences started");
+    hmmer::HMMMatcher matcher(hmm, cfg.hcfg);
+
+    const size_t MIN_SHARD_SIZE = 1024;
+    size_t shard_size = std::max(MIN_SHARD_SIZE, seqs.size() / (4 * static_cast<size_t>(omp_get_max_threads())) + 1);
+    size_t shards = (seqs.size() + shard_size - 1) / shard_size;
+    if (shards <= 1) {
+        for (const auto &seq : seqs) {
+            matcher.match(seq.get());
+        }
+        matcher.summarize();
+        return matcher;
+    }
+
+    std::vector<char> passed(seqs.size(), false);
+    std::vector<std::unique_ptr<hmmer::HMMMatcher>> shard_matchers(shards);
+    #pragma omp taskloop default(shared) grainsize(1)
+    for (size_t shard = 0; shard < shards; ++shard) {
+        shard_matchers[shard].reset(new hmmer::HMMMatcher(hmm, cfg.hcfg));
+        for (size_t i = shard * shard_size; i < std::min(seqs.size(), (shard + 1) * shard_size); ++i) {
+            passed[i] = shard_matchers[shard]->match(seqs[i].get());
+        }
+    }
+
+    size_t npassed = 0;
+    for (size_t i = 0; i < seqs.size(); ++i) {
+        if (passed[i]) {
+            matcher.match(seqs[i].get());
+            ++npassed;
         } else {
-            VERIFY(seq.size() >= 2);
-            for (size_t shift = 0; shift < 3; ++shift) {
-                std::string ref_shift = ref + "/" + std::to_string(shift);
-                std::string seq_aas = aa::translate(seq.c_str() + shift);
-                matcher.match(ref_shift.c_str(), seq_aas.c_str());
-            }
+            matcher.skip(seqs[i].get());
         }
     }
+    DEBUG(npassed << " of " << seqs.size() << " sequences passed filters in " << shards << " shards");
+
+    // Statistics of the filters preceding the Forward one are collected by the shards
+    P7_PIPELINE *pli = matcher.pipeline();
+    pli->n_past_msv = pli->n_past_bias = pli->n_past_vit = 0;
+    pli->pos_past_msv = pli->pos_past_bias = pli->pos_past_vit = 0;
+    for (const auto &shard_matcher : shard_matchers) {
+        const P7_PIPELINE *shard_pli = shard_matcher->pipeline();
+        pli->n_past_msv += shard_pli->n_past_msv;
+        pli->n_past_bias += shard_pli->n_past_bias;
+        pli->n_past_vit += shard_pli->n_past_vit;
+        pli->pos_past_msv += shard_pli->pos_past_msv;
+        pli->pos_past_bias += shard_pli->pos_past_bias;
+        pli->pos_past_vit += shard_pli->pos_past_vit;
+    }
 
     matcher.summarize();
     return matcher;
@@ -283,9 +396,9 @@ auto ScoreSequences(const StringArray &seqs,
 
 using PathAlnInfo = std::vector<std::pair<size_t, std::pair<int, int>>>;
 
-template <typename StringArray>
+template <typename LengthArray>
 PathAlnInfo GetOverhangs(const hmmer::HMMMatcher &matcher,
-                         const StringArray &seqs,
+                         const LengthArray &seq_lengths,
                          const hmmer::HMM &hmm) {
     // TODO Move this logic to ScoreSequences()
     // we need only alphabet size (actually aa/nt flag) from hmm
@@ -304,7 +417,7 @@ PathAlnInfo GetOverhangs(const hmmer::HMMMatcher &matcher,
         VERIFY((slash_pos == std::string::npos ) ^ (hmm_in_aas));
         int shift = hmm_in_aas ? static_cast<int>(std::strtol(name.c_str() + slash_pos + 1, nullptr, 10)) : 0;
         VERIFY(0 <= shift && shift < 3);  // shift should be 0, 1, or 3
-        size_t seqlen = seqs[id].length();
+        size_t seqlen = seq_lengths[id];
         VERIFY(seqlen >= 3);
 
         for (const auto &domain : hit.domains()) {
@@ -333,41 +446,117 @@ PathAlnInfo GetOverhangs(const hmmer::HMMMatcher &matcher,
     return matches;
 }
 
+size_t path_length(const ConjugateDeBruijnGraph &graph, const std::vector<EdgeId> &path) {
+    if (path.size() == 0) {
+        return 0;
+    }
+
+    size_t sum = 0;
+    for (const auto &e : path) {
+        sum += graph.length(e);
+    }
+
+    return sum + graph.k();
+}
+
 std::string PathToString(const std::vector<EdgeId>& path,
                          const ConjugateDeBruijnGraph &graph) {
     if (path.size() == 0) {
         return "";
     }
 
-    std::string res = graph.EdgeNucls(path[0]).str();
+    size_t k = graph.k();
+    std::string res;
+    res.reserve(path_length(graph, path));
+    res += graph.EdgeNucls(path[0]).str();
     for (size_t i = 1; i < path.size(); ++i) {
         const auto &e = path[i];
-        res = res + graph.EdgeNucls(e).Last(graph.length(e)).str();
-        size_t k = graph.k();
-        VERIFY(graph.EdgeNucls(path[i - 1]).Last(k).str() == graph.EdgeNucls(path[i]).First(k).str());
+        res += graph.EdgeNucls(e).Last(graph.length(e)).str();
+        VERIFY(graph.EdgeNucls(path[i - 1]).Last(k) == graph.EdgeNucls(path[i]).First(k));
     }
 
     return res;
 }
 
+// Sequences of seeding paths (edges and/or scaffolds) translated and digitized once and then shared
+// read-only by all the models. Amino acid sequences are the three frames of each path named as in ScoreSequences()
+class SeedSequences {
+public:
+    SeedSequences(std::vector<std::vector<EdgeId>> paths,
+                  const ConjugateDeBruijnGraph &graph,
+                  const std::set<int> &alphabet_types)
+            : paths_{std::move(paths)} {
+        for (int type : alphabet_types) {
+            Block &block = blocks_[type];
+            block.abc.reset(esl_alphabet_Create(type));
+            size_t count = paths_.size() * (type == eslAMINO ? 3 : 1);
+            block.seqs.reserve(count);
+            for (size_t i = 0; i < count; ++i) {
+                block.seqs.emplace_back(nullptr, esl_sq_Destroy);
+            }
+        }
+
+        #pragma omp parallel for schedule(dynamic, 64)
+        for (size_t i = 0; i < paths_.size(); ++i) {
+            std::string seq = PathToString(paths_[i], graph);
+            std::string ref = std::to_string(i);
+            for (auto &kv : blocks_) {
+                Block &block = kv.second;
+                if (kv.first != eslAMINO) {
+                    block.seqs[i] = digitize(ref, seq, block.abc.get());
+                    continue;
+                }
+
+                VERIFY(seq.size() >= 2);
+                for (size_t shift = 0; shift < 3; ++shift) {
+                    std::string ref_shift = ref + "/" + std::to_string(shift);
+                    block.seqs[3 * i + shift] = digitize(ref_shift, aa::translate(seq.c_str() + shift), block.abc.get());
+                }
+            }
+        }
+    }
+
+    const std::vector<std::vector<EdgeId>> &paths() const { return paths_; }
+
+    const std::vector<ESLSequencePtr> &sequences(const ESL_ALPHABET *abc) const {
+        auto it = blocks_.find(abc->type);
+        VERIFY_MSG(it != blocks_.end(), "Seed sequences were not prepared for the alphabet of the model");
+        return it->second.seqs;
+    }
+
+private:
+    struct Block {
+        std::unique_ptr<ESL_ALPHABET, void(*)(ESL_ALPHABET*)> abc{nullptr, esl_alphabet_Destroy};
+        std::vector<ESLSequencePtr> seqs;
+    };
+
+    std::vector<std::vector<EdgeId>> paths_;
+    std::map<int, Block> blocks_;
+
+    static ESLSequencePtr digitize(const std::string &name, const std::string &seq, const ESL_ALPHABET *abc) {
+        ESLSequencePtr result(esl_sq_CreateFrom(name.c_str(), seq.c_str(), nullptr, nullptr, nullptr), esl_sq_Destroy);
+        esl_sq_Digitize(abc, result.get());
+        return result;
+    }
+};
+
 PathAlnInfo MatchedPaths(const std::vector<std::vector<EdgeId>> &paths,
                          const ConjugateDeBruijnGraph &graph,
-                         const hmmer::HMM &hmm, const PathracerConfig &cfg) {
+                         const hmmer::HMM &hmm, const PathracerConfig &cfg,
+                         const SeedSequences *seed_sequences = nullptr) {
     DEBUG("MatchedPaths started");
-    // std::vector<std::string> seqs;
-    // seqs.reserve(paths.size());
-    // for (const auto &path : paths) {
-    //     seqs.push_back(PathToString(path, graph));
-    // }
-    // INFO("seqs constructed");
     auto get = [&](size_t i) -> std::string {
         return PathToString(paths[i], graph);
     };
+    auto length = [&](size_t i) -> size_t {
+        return path_length(graph, paths[i]);
+    };
 
-    PseudoVector<std::string> seqs(paths.size(), get);
-    auto matcher = ScoreSequences(seqs, {}, hmm, cfg);
+    VERIFY(!seed_sequences || &seed_sequences->paths() == &paths);
+    auto matcher = seed_sequences ? ScoreSequences(seed_sequences->sequences(hmm.abc()), hmm, cfg)
+                                  : ScoreSequences(PseudoVector<std::string>(paths.size(), get), {}, hmm, cfg);
 
-    auto matched = GetOverhangs(matcher, seqs, hmm);
+    auto matched = GetOverhangs(matcher, PseudoVector<size_t>(paths.size(), length), hmm);
     INFO(matched.size() << " matched edges found");
 
     if (matched.size() && cfg.debug) {
@@ -386,19 +575,6 @@ PathAlnInfo MatchedPaths(const std::vector<std::vector<EdgeId>> &paths,
 using EdgeAlnInfo = std::vector<std::pair<EdgeId, std::pair<int, int>>>;
 using graph_t = debruijn_graph::ConjugateDeBruijnGraph;
 
-size_t path_length(const graph_t &graph, const std::vector<EdgeId> &path) {
-    if (path.size() == 0) {
-        return 0;
-    }
-
-    size_t sum = 0;
-    for (const auto &e : path) {
-        sum += graph.length(e);
-    }
-
-    return sum + graph.k();
-}
-
 EdgeAlnInfo PathAlignments2EdgeAlignments(const PathAlnInfo &painfo,
                                           const std::vector<std::vector<EdgeId>> &paths,
                                           const graph_t &graph) {
@@ -447,38 +623,43 @@ void OutputMatches(const hmmer::HMM &hmm, const hmmer::HMMMatcher &matcher, cons
     fclose(fp);
 }
 
-template<class Graph>
-Sequence MergeSequences(const Graph &g,
-                        const std::vector<typename Graph::EdgeId> &continuous_path) {
-    std::vector<Sequence> path_sequences;
-    path_sequences.push_back(g.EdgeNucls(continuous_path[0]));
-    for (size_t i = 1; i < continuous_path.size(); ++i) {
-        VERIFY(g.EdgeEnd(continuous_path[i - 1]) == g.EdgeStart(continuous_path[i]));
-        path_sequences.push_back(g.EdgeNucls(continuous_path[i]));
-    }
-    return MergeOverlappingSequences(path_sequences, g.k());
-}
-
-std::vector<hmmer::HMM> ParseHMMFile(const std::string &filename) {
+// The errors are fatal unless they are requested, the result is empty then
+std::vector<hmmer::HMM> ParseHMMFile(const std::string &filename, std::string *error = nullptr) {
     /* Open the query profile HMM file */
     hmmer::HMMFile hmmfile(filename);
+    std::vector<hmmer::HMM> hmms;
+    std::string message;
     if (!hmmfile.valid()) {
-        FATAL_ERROR("Error opening HMM file " << filename);
+        message = "Error opening HMM file " + filename;
+    } else {
+        for (;;) {
+            auto hmmw = hmmfile.read();
+            if (!hmmw) {
+                // A malformed model is not skipped silently
+                if (hmmw.getError() != hmmer::make_error_code(hmmer::ReadErrc::EndOfFile)) {
+                    message = "Error reading HMM file " + filename + ": " + hmmw.getError().message();
+                }
+                break;
+            }
+            hmms.emplace_back(std::move(hmmw.get()));
+        }
+        if (message.empty() && hmms.empty()) {
+            message = "Error reading HMM file " + filename;
+        }
     }
 
-    std::vector<hmmer::HMM> hmms;
-
-    while (auto hmmw = hmmfile.read())
-        hmms.emplace_back(std::move(hmmw.get()));
-
-    if (hmms.empty()) {
-        FATAL_ERROR("Error reading HMM file " << filename);
+    if (!message.empty()) {
+        if (!error) {
+            FATAL_ERROR(message);
+        }
+        *error = message;
+        hmms.clear();
     }
 
     return hmms;
 }
 
-std::vector<hmmer::HMM> ParseFASTAFile(const std::string &filename, enum Mode mode) {
+std::vector<hmmer::HMM> ParseFASTAFile(const std::string &filename, enum Mode mode, std::string *error = nullptr) {
     std::vector<hmmer::HMM> res;
     hmmer::HMMSequenceBuilder builder(mode == Mode::nucl ? hmmer::Alphabet::DNA : hmmer::Alphabet::AMINO,
                                       hmmer::ScoreSystem::Default);
@@ -487,33 +668,42 @@ std::vector<hmmer::HMM> ParseFASTAFile(const std::string &filename, enum Mode mo
     ESL_SQ         *qsq  = esl_sq_CreateDigital(abc);
     ESL_SQFILE     *qfp  = NULL;
     const char *qfile = filename.c_str();
+    std::string message;
 
     // Open the query sequence file in FASTA format
     int status = esl_sqfile_Open(qfile, eslSQFILE_FASTA, NULL, &qfp);
     if      (status == eslENOTFOUND) {
-        FATAL_ERROR("No such file " << filename);
+        message = "No such file " + filename;
     } else if (status == eslEFORMAT) {
-        FATAL_ERROR("Format of " << filename << " unrecognized.");
+        message = "Format of " + filename + " unrecognized.";
     } else if (status == eslEINVAL) {
-        FATAL_ERROR("Can't autodetect stdin or .gz.");
+        message = "Can't autodetect stdin or .gz.";
     } else if (status != eslOK) {
-        FATAL_ERROR("Open of " << filename << " failed, code " << status);
-    }
-
-    // For each sequence, build a model and save it.
-    while ((status = esl_sqio_Read(qfp, qsq)) == eslOK) {
-        INFO("Converting " << qsq->name << ", len: " << qsq->n);
-        res.push_back(builder.from_string(qsq));
-        esl_sq_Reuse(qsq);
-    }
-    if (status != eslEOF) {
-        FATAL_ERROR("Unexpected error " << status << " reading sequence file " << filename);
+        message = "Open of " + filename + " failed, code " + std::to_string(status);
+    } else {
+        // For each sequence, build a model and save it.
+        while ((status = esl_sqio_Read(qfp, qsq)) == eslOK) {
+            INFO("Converting " << qsq->name << ", len: " << qsq->n);
+            res.push_back(builder.from_string(qsq));
+            esl_sq_Reuse(qsq);
+        }
+        if (status != eslEOF) {
+            message = "Unexpected error " + std::to_string(status) + " reading sequence file " + filename;
+        }
+        esl_sqfile_Close(qfp);
     }
 
     esl_sq_Destroy(qsq);
-    esl_sqfile_Close(qfp);
     esl_alphabet_Destroy(abc);
 
+    if (!message.empty()) {
+        if (!error) {
+            FATAL_ERROR(message);
+        }
+        *error = message;
+        res.clear();
+    }
+
     return res;
 }
 
@@ -529,18 +719,56 @@ std::string edgepath2str(const Path &path,
     return join(mapped_ids, "_");
 }
 
+// Names and merged sequences of result paths. Different models often report the same paths, so they are
+// built once and shared by the tasks of all the models of a run (or of a server job)
+class PathSequences {
+public:
+    struct Entry {
+        std::string id;
+        std::string seq;
+    };
+
+    PathSequences(const debruijn_graph::ConjugateDeBruijnGraph &graph, const MappingF &mapping_f)
+            : graph_{graph}, mapping_f_{mapping_f} {}
+
+    // Thread-safe, the entries are never moved
+    const Entry &operator[](const std::vector<EdgeId> &path) {
+        const Entry *entry = nullptr;
+        #pragma omp critical(path_sequences)
+        {
+            auto it = entries_.find(path);
+            if (it != entries_.end()) {
+                entry = &it->second;
+            }
+        }
+        if (entry) {
+            return *entry;
+        }
+
+        Entry built{ edgepath2str(path, mapping_f_), PathToString(path, graph_) };
+        #pragma omp critical(path_sequences)
+        {
+            entry = &entries_.emplace(path, std::move(built)).first->second;
+        }
+        return *entry;
+    }
+
+private:
+    const debruijn_graph::ConjugateDeBruijnGraph &graph_;
+    MappingF mapping_f_;
+    std::unordered_map<std::vector<EdgeId>, Entry> entries_;
+};
+
 template <typename Container>
 auto EdgesToSequences(const Container &entries,
-                      const debruijn_graph::ConjugateDeBruijnGraph &graph,
-                      const MappingF &mapping_f) {
-    std::vector<std::pair<std::string, std::string>> ids_n_seqs;
+                      PathSequences &sequences) {
+    std::vector<const PathSequences::Entry*> ids_n_seqs;
     for (const auto &entry : entries) {
-        std::string id = edgepath2str(entry, mapping_f);
-        std::string seq = MergeSequences(graph, entry).str();
-        ids_n_seqs.push_back({id, seq});
+        ids_n_seqs.push_back(&sequences[entry]);
     }
 
-    std::sort(ids_n_seqs.begin(), ids_n_seqs.end());
+    std::sort(ids_n_seqs.begin(), ids_n_seqs.end(),
+              [](const auto *a, const auto *b) { return std::tie(a->id, a->seq) < std::tie(b->id, b->seq); });
     return ids_n_seqs;
 }
 
@@ -557,24 +785,27 @@ std::string SuperPathInfo(const std::vector<EdgeId> &path,
     return join(results, ",");
 }
 
+// Paths are formatted and written by the writer thread
 template <typename Container>
-void ExportEdges(const Container &entries,
-                 const debruijn_graph::ConjugateDeBruijnGraph &graph,
+void ExportEdges(Container entries,
+                 PathSequences &sequences,
                  const SuperpathIndex &scaffold_paths,
                  const std::string &filename,
-                 const MappingF &mapping_f) {
+                 const MappingF &mapping_f,
+                 ResultWriter &writer) {
     if (entries.size() == 0)
         return;
 
-    std::ofstream o(filename, std::ios::out);
-
-    for (const auto &path : entries) {
-        std::string id = edgepath2str(path, mapping_f);
-        std::string seq = MergeSequences(graph, path).str();
-        // FIXME return sorting like in EdgesToSequences
-        o << ">" << id << "|ScaffoldSuperpaths=" << SuperPathInfo(path, scaffold_paths, mapping_f) << "\n";
-        io::WriteWrapped(seq, o);
-    }
+    auto format = [entries = std::move(entries), &sequences, &scaffold_paths, mapping_f](const std::vector<std::ostream*> &files) {
+        std::ostream &o = *files[0];
+        for (const auto &path : entries) {
+            const auto &entry = sequences[path];
+            // FIXME return sorting like in EdgesToSequences
+            o << ">" << entry.id << "|ScaffoldSuperpaths=" << SuperPathInfo(path, scaffold_paths, mapping_f) << "\n";
+            io::WriteWrapped(entry.seq, o);
+        }
+    };
+    writer.push({ filename }, std::move(format));
 }
 
 std::vector<EdgeId> conjugate_path(const std::vector<EdgeId> &path,
@@ -589,40 +820,60 @@ std::vector<EdgeId> conjugate_path(const std::vector<EdgeId> &path,
 void LoadGraph(debruijn_graph::ConjugateDeBruijnGraph &graph,
                std::vector<std::vector<EdgeId>> &paths,
                const std::string &filename,
-               io::IdMapper<std::string> *id_mapper) {
+               io::IdMapper<std::string> *id_mapper,
+               const std::string &cache_dir = "",
+               bool parallel = true) {
     using namespace debruijn_graph;
     if (ends_with(filename, ".gfa")) {
-        gfa::GFAReader gfa(filename);
+        // Parsing of a large GFA takes longer than many searches, the graph is loaded from its snapshot if possible
+        if (!cache_dir.empty() && GraphCache::Load(cache_dir, filename, graph, paths, id_mapper)) {
+            return;
+        }
+        gfa::GFAReader gfa;
+        if (parallel) {
+            VERIFY_MSG(gfa.read_graph(filename, graph, id_mapper, omp_get_max_threads()),
+                       "Cannot read GFA file " << filename);
+        } else {
+            VERIFY_MSG(gfa.open(filename), "Cannot read GFA file " << filename);
+            gfa.to_graph(graph, id_mapper);
+        }
         INFO("GFA segments: " << gfa.num_edges() << ", links: " << gfa.num_links());
-        gfa.to_graph(graph, id_mapper);
         paths.reserve(gfa.num_paths());
         for (const auto &path : gfa.paths()) {
             paths.push_back(path.edges);
             paths.push_back(conjugate_path(path.edges, graph));
         }
+        if (!cache_dir.empty()) {
+            GraphCache::Save(cache_dir, filename, graph, paths, id_mapper);
+        }
     } else {
         io::binary::GraphIO<debruijn_graph::ConjugateDeBruijnGraph> gio;
         gio.Load(filename, graph);
     }
 }
 
-void SaveResults(const hmmer::HMM &hmm, const ConjugateDeBruijnGraph & /* graph */,
+// Results are formatted and written by the writer thread
+void SaveResults(const hmmer::HMM &hmm,
                  const PathracerConfig &cfg,
-                 const std::vector<HMMPathInfo> &results,
+                 std::vector<HMMPathInfo> results,
                  const SuperpathIndex &scaffold_paths,
-                 const MappingF &mapping_f) {
+                 const MappingF &mapping_f,
+                 ResultWriter &writer) {
     const P7_HMM *p7hmm = hmm.get();  // TODO We use only hmm name from this object, may be we should just pass the name itself
     bool hmm_in_aas = hmm.abc()->K == 20;
 
     INFO("Total " << results.size() << " resultant paths extracted");
 
-    if (!results.empty()) {
-        std::ofstream o_seqs(cfg.output_dir + std::string("/") + p7hmm->name + ".seqs.fa", std::ios::out);
-        std::ofstream o_nucs;
-        if (hmm_in_aas) {
-            o_nucs.open(cfg.output_dir + std::string("/") + p7hmm->name + ".nucs.fa", std::ios::out);
-        }
+    if (results.empty()) {
+        return;
+    }
 
+    std::vector<std::string> filenames = { cfg.output_dir + std::string("/") + p7hmm->name + ".seqs.fa" };
+    if (hmm_in_aas) {
+        filenames.push_back(cfg.output_dir + std::string("/") + p7hmm->name + ".nucs.fa");
+    }
+    auto format = [results = std::move(results), hmm_in_aas, &scaffold_paths, mapping_f](const std::vector<std::ostream*> &files) {
+        std::ostream &o_seqs = *files[0];
         for (const auto &result : results) {
             if (result.seq.size() == 0)
                 continue;
@@ -642,18 +893,65 @@ void SaveResults(const hmmer::HMM &hmm, const ConjugateDeBruijnGraph & /* graph
             io::WriteWrapped(result.seq, o_seqs);
 
             if (hmm_in_aas) {
-                o_nucs << header.str();
-                io::WriteWrapped(result.nuc_seq, o_nucs);
+                *files[1] << header.str();
+                io::WriteWrapped(result.nuc_seq, *files[1]);
             }
         }
+    };
+    writer.push(std::move(filenames), std::move(format));
+}
+
+// Targets are sharded between tasks matching them with the pipeline of their thread, the hits of the threads are merged.
+// Domain definition is reseeded for each target and the hits are sorted by score and name, so they are the same
+// whichever thread matches a target
+hmmer::HMMMatcher RescoreSequences(const std::vector<const PathSequences::Entry*> &targets,
+                                   const hmmer::HMM &hmm, const PathracerConfig &cfg) {
+    bool hmm_in_aas = hmm.abc()->K == 20;
+    hmmer::hmmer_cfg hcfg = cfg.hcfg;
+    hcfg.reseed = true;
+    hmmer::HMMMatcher matcher(hmm, hcfg);
+
+    const size_t MIN_SHARD_SIZE = 16;
+    size_t shard_size = std::max(MIN_SHARD_SIZE, targets.size() / (4 * static_cast<size_t>(omp_get_max_threads())) + 1);
+    size_t shards = (targets.size() + shard_size - 1) / shard_size;
+    if (shards <= 1) {
+        for (const auto *target : targets) {
+            MatchSequence(matcher, target->id, target->seq, hmm_in_aas);
+        }
+        matcher.summarize();
+        return matcher;
+    }
+
+    // Shard tasks have no scheduling points, so a thread never runs two of them at once
+    std::vector<std::unique_ptr<hmmer::HMMMatcher>> thread_matchers(omp_get_num_threads());
+    #pragma omp taskloop default(shared) grainsize(1)
+    for (size_t shard = 0; shard < shards; ++shard) {
+        auto &thread_matcher = thread_matchers[omp_get_thread_num()];
+        if (!thread_matcher) {
+            thread_matcher.reset(new hmmer::HMMMatcher(hmm, hcfg));
+        }
+        for (size_t i = shard * shard_size; i < std::min(targets.size(), (shard + 1) * shard_size); ++i) {
+            MatchSequence(*thread_matcher, targets[i]->id, targets[i]->seq, hmm_in_aas);
+        }
     }
+    for (const auto &thread_matcher : thread_matchers) {
+        if (thread_matcher) {
+            matcher.merge(*thread_matcher);
+        }
+    }
+    DEBUG(targets.size() << " sequences rescored in " << shards << " shards");
+
+    matcher.summarize();
+    return matcher;
 }
 
-void Rescore(const hmmer::HMM &hmm, const ConjugateDeBruijnGraph &graph,
+void Rescore(const hmmer::HMM &hmm,
              const PathracerConfig &cfg,
              const std::vector<HMMPathInfo> &results,
              const SuperpathIndex &scaffold_paths,
-             const MappingF &mapping_f) {
+             PathSequences &sequences,
+             const MappingF &mapping_f,
+             ResultWriter &writer) {
     P7_HMM *p7hmm = hmm.get();
 
     std::unordered_set<std::vector<EdgeId>> to_rescore;
@@ -681,21 +979,19 @@ void Rescore(const hmmer::HMM &hmm, const ConjugateDeBruijnGraph &graph,
     sort_by(to_rescore_ordered.begin(), to_rescore_ordered.end(),
             [&](const auto &path){ return std::make_tuple(-path2score[path], path); });
 
+    std::vector<const PathSequences::Entry*> targets;
+    if (cfg.rescore) {
+        targets = EdgesToSequences(to_rescore_ordered, sequences);
+    }
+
     // TODO export paths along with their best score
-    ExportEdges(to_rescore_ordered, graph, scaffold_paths,
+    ExportEdges(std::move(to_rescore_ordered), sequences, scaffold_paths,
                 cfg.output_dir + std::string("/") + p7hmm->name + ".edges.fa",
-                mapping_f);
-
-    std::vector<std::string> seqs_to_rescore;
-    std::vector<std::string> refs_to_rescore;
-    for (const auto &kv : EdgesToSequences(to_rescore_ordered, graph, mapping_f)) {
-        refs_to_rescore.push_back(kv.first);
-        seqs_to_rescore.push_back(kv.second);
-    }
+                mapping_f, writer);
 
     if (cfg.rescore) {
         INFO("Rescore edges using HMMER");
-        auto matcher = ScoreSequences(seqs_to_rescore, refs_to_rescore, hmm, cfg);
+        auto matcher = RescoreSequences(targets, hmm, cfg);
         INFO("Edges rescored, output");
         OutputMatches(hmm, matcher, cfg.output_dir + "/" + p7hmm->name + ".tblout", "tblout");
         OutputMatches(hmm, matcher, cfg.output_dir + "/" + p7hmm->name + ".domtblout", "domtblout");
@@ -735,10 +1031,18 @@ auto ConnCompsFromEdgesMatches(const EdgeAlnInfo &matched_edges, const graph_t &
         }
     }
 
-    INFO("Getting leftside neighbourhoods");
-    auto left_cursors = neighborhood(left_queries, &graph, /* forward */ false);
-    INFO("Getting rightside neighbourhoods");
-    auto right_cursors = neighborhood(right_queries, &graph, /* forward */ true);
+    // Leftside and rightside neighbourhoods are independent and are collected in parallel
+    std::vector<GraphCursor> left_cursors, right_cursors;
+    #pragma omp taskgroup
+    {
+        #pragma omp task default(shared)
+        {
+            INFO("Getting leftside neighbourhoods");
+            left_cursors = edge_neighborhood(left_queries, &graph, /* forward */ false);
+        }
+        INFO("Getting rightside neighbourhoods");
+        right_cursors = edge_neighborhood(right_queries, &graph, /* forward */ true);
+    }
 
     INFO("Exporting cursors");
     cursors.insert(left_cursors.cbegin(), left_cursors.cend());
@@ -752,11 +1056,51 @@ auto ConnCompsFromEdgesMatches(const EdgeAlnInfo &matched_edges, const graph_t &
     return cursor_conn_comps;
 }
 
-void TraceHMM(const hmmer::HMM &hmm,
-              const debruijn_graph::ConjugateDeBruijnGraph &graph, const std::vector<EdgeId> &edges,
-              const SuperpathIndex scaffold_paths,
-              const PathracerConfig &cfg,
-              std::vector<HMMPathInfo> &results) {
+// OpenMP task priority growing with the amount of work (component size or model length).
+// Priorities take effect only when OMP_MAX_TASK_PRIORITY is set
+int task_priority(size_t work) {
+    int priority = 0;
+    while (work >>= 1) {
+        ++priority;
+    }
+    return priority;
+}
+
+// Neighbourhood components to search a model in
+struct Seeds {
+    std::vector<std::vector<GraphCursor>> components;
+    std::vector<std::string> names;  // either empty or one per component
+};
+
+bool UsesSeedSequences(SeedMode seed_mode) {
+    return seed_mode == SeedMode::edges || seed_mode == SeedMode::scaffolds || seed_mode == SeedMode::edges_scaffolds;
+}
+
+// Paths matched against all the models at once, see SeedSequences
+std::vector<std::vector<EdgeId>> SeedPaths(SeedMode seed_mode,
+                                           const std::vector<EdgeId> &edges,
+                                           const SuperpathIndex &scaffold_paths) {
+    VERIFY(UsesSeedSequences(seed_mode));
+    std::vector<std::vector<EdgeId>> paths;
+    if (seed_mode != SeedMode::scaffolds) {
+        // Fill paths by single edges
+        for (const auto &e : edges) {
+            paths.push_back(std::vector<EdgeId>({e}));
+        }
+    }
+    if (seed_mode != SeedMode::edges) {
+        // Fill paths by paths read from GFA
+        paths.insert(paths.end(), scaffold_paths.cbegin(), scaffold_paths.cend());
+    }
+
+    return paths;
+}
+
+Seeds SeedComponents(const hmmer::HMM &hmm,
+                     const debruijn_graph::ConjugateDeBruijnGraph &graph, const std::vector<EdgeId> &edges,
+                     const SuperpathIndex &scaffold_paths,
+                     const SeedSequences *seed_sequences,
+                     const PathracerConfig &cfg) {
     const P7_HMM *p7hmm = hmm.get();
 
     INFO("Query:         " << p7hmm->name << "  [M=" << p7hmm->M << "]");
@@ -767,33 +1111,15 @@ void TraceHMM(const hmmer::HMM &hmm,
         INFO("Description:   " << p7hmm->desc);
     }
 
-    auto fees = hmm::fees_from_hmm(p7hmm, hmm.abc());
-    fees.state_limits.l25 = 1000000 * cfg.state_limits_coef;
-    fees.state_limits.l100 = 50000 * cfg.state_limits_coef;
-    fees.state_limits.l500 = 10000 * cfg.state_limits_coef;
-    if (cfg.minimal_match_length <= 1.0) {
-        fees.minimal_match_length = static_cast<size_t>(cfg.minimal_match_length * static_cast<double>(fees.M));
-    } else {
-        fees.minimal_match_length = static_cast<size_t>(cfg.minimal_match_length);
-    }
-
-    fees.max_insertion_length = cfg.max_insertion_length;
-    fees.local = cfg.local;
-    fees.use_experimental_i_loop_processing = cfg.use_experimental_i_loop_processing;
-
-    INFO("HMM consensus: " << fees.consensus);
-    INFO("HMM " << p7hmm->name << " has " << fees.count_negative_loops() << " positive-score I-loops over " << fees.ins.size());
-    INFO("All-matches consensus sequence score: " << fees.all_matches_score());
-    INFO("Empty sequence score: " << fees.empty_sequence_score());
-
     // INFO("Matched paths:");
     // for (const auto &kv : matched_paths) {
     //     const auto &path = paths[kv.first];
     //     INFO(path);
     // }
 
-    std::vector<std::vector<GraphCursor>> cursor_conn_comps;
-    std::vector<std::string> component_names;
+    Seeds seeds;
+    auto &cursor_conn_comps = seeds.components;
+    auto &component_names = seeds.names;
 
     if (cfg.seed_mode == SeedMode::scaffolds_one_by_one) {
         for (size_t idx = 0; idx < scaffold_paths.size(); ++idx) {
@@ -829,31 +1155,10 @@ void TraceHMM(const hmmer::HMM &hmm,
                 component_names.push_back("edge_" + std::to_string(e.int_id()));
             }
         }
-    } else if (cfg.seed_mode == SeedMode::edges) {
-        std::vector<std::vector<EdgeId>> paths;
-        // Fill paths by single edges
-        for (const auto &e : edges) {
-            paths.push_back(std::vector<EdgeId>({e}));
-        }
-        auto matched_paths = MatchedPaths(paths, graph, hmm, cfg);
-        auto matched_edges = PathAlignments2EdgeAlignments(matched_paths, paths, graph);
-        cursor_conn_comps = ConnCompsFromEdgesMatches(matched_edges, graph, cfg.expand_coef, cfg.expand_const, cfg.parallel_component_processing);
-    } else if (cfg.seed_mode == SeedMode::scaffolds) {
-        std::vector<std::vector<EdgeId>> paths;
-        // Fill paths by paths read from GFA
-        paths.insert(paths.end(), scaffold_paths.cbegin(), scaffold_paths.cend());
-        auto matched_paths = MatchedPaths(paths, graph, hmm, cfg);
-        auto matched_edges = PathAlignments2EdgeAlignments(matched_paths, paths, graph);
-        cursor_conn_comps = ConnCompsFromEdgesMatches(matched_edges, graph, cfg.expand_coef, cfg.expand_const, cfg.parallel_component_processing);
-    } else if (cfg.seed_mode == SeedMode::edges_scaffolds) {
-        std::vector<std::vector<EdgeId>> paths;
-        // Fill paths by single edges
-        for (const auto &e : edges) {
-            paths.push_back(std::vector<EdgeId>({e}));
-        }
-        // Fill paths by paths read from GFA
-        paths.insert(paths.end(), scaffold_paths.cbegin(), scaffold_paths.cend());
-        auto matched_paths = MatchedPaths(paths, graph, hmm, cfg);
+    } else if (seed_sequences) {
+        // edges, scaffolds, or edges_scaffolds mode, see SeedPaths()
+        const auto &paths = seed_sequences->paths();
+        auto matched_paths = MatchedPaths(paths, graph, hmm, cfg, seed_sequences);
         auto matched_edges = PathAlignments2EdgeAlignments(matched_paths, paths, graph);
         cursor_conn_comps = ConnCompsFromEdgesMatches(matched_edges, graph, cfg.expand_coef, cfg.expand_const, cfg.parallel_component_processing);
     } else if (cfg.seed_mode == SeedMode::exhaustive) {
@@ -870,6 +1175,47 @@ void TraceHMM(const hmmer::HMM &hmm,
         }
     }
 
+    return seeds;
+}
+
+void TraceHMM(const hmmer::HMM &hmm,
+              const debruijn_graph::ConjugateDeBruijnGraph &graph, const std::vector<EdgeId> &edges,
+              const Seeds &seeds,
+              const PathracerConfig &cfg,
+              const CursorIndex *cursor_index,
+              ComponentCache *component_cache,
+              std::vector<HMMPathInfo> &results) {
+    const P7_HMM *p7hmm = hmm.get();
+    const auto &cursor_conn_comps = seeds.components;
+    const auto &component_names = seeds.names;
+
+    auto fees = hmm::fees_from_hmm(p7hmm, hmm.abc());
+    fees.state_limits.l25 = 1000000 * cfg.state_limits_coef;
+    fees.state_limits.l100 = 50000 * cfg.state_limits_coef;
+    fees.state_limits.l500 = 10000 * cfg.state_limits_coef;
+    if (cfg.minimal_match_length <= 1.0) {
+        fees.minimal_match_length = static_cast<size_t>(cfg.minimal_match_length * static_cast<double>(fees.M));
+    } else {
+        fees.minimal_match_length = static_cast<size_t>(cfg.minimal_match_length);
+    }
+
+    fees.max_insertion_length = cfg.max_insertion_length;
+    fees.local = cfg.local;
+    fees.use_experimental_i_loop_processing = cfg.use_experimental_i_loop_processing;
+    fees.use_dense_columns = cfg.use_dense_columns;
+    fees.use_compressed_runs = cfg.use_compressed_runs;
+    fees.use_cost_bounds = cfg.use_cost_bounds;
+    fees.use_bidirectional_search = cfg.use_bidirectional_search;
+    fees.use_streaming_filter = cfg.use_streaming_filter;
+    if (cfg.use_bidirectional_search && (cfg.local || fees.is_proteomic())) {
+        WARN("Bidirectional search is available for nucleotide HMMs in the global mode only, ignored");
+    }
+
+    INFO("HMM consensus: " << fees.consensus);
+    INFO("HMM " << p7hmm->name << " has " << fees.count_negative_loops() << " positive-score I-loops over " << fees.ins.size());
+    INFO("All-matches consensus sequence score: " << fees.all_matches_score());
+    INFO("Empty sequence score: " << fees.empty_sequence_score());
+
     if (!cursor_conn_comps.size()) {
         WARN("No components to process!");
         return;
@@ -883,17 +1229,20 @@ void TraceHMM(const hmmer::HMM &hmm,
     }
     INFO("Connected component sizes: " << cursor_conn_comps_sizes);
 
-    auto run_search = [&fees, &p7hmm, &cfg, &graph](const auto &cursors, size_t top,
-                                                    std::vector<HMMPathInfo> &local_results,
-                                                    const auto context,
-                                                    const std::string &component_name = "") -> void {
-        CachedCursorContext ccc(cursors, context);
+    // to_graph_path maps the nucleotide path to cursors providing edge() and position()
+    auto search_cached = [&fees, &p7hmm, &cfg, &graph](const auto &space, size_t top,
+                                                       std::vector<HMMPathInfo> &local_results,
+                                                       const auto context,
+                                                       const std::string &component_name,
+                                                       const auto &to_graph_path) -> void {
+        const CachedCursorContext &ccc = *space.context;
+        const auto &cursors = space.cursors;
         auto cached_cursors = ccc.Cursors();
         for (const auto &cursor : cached_cursors) {
             DEBUG_ASSERT(check_cursor_symmetry(cursor, &ccc), main_assert{}, debug_assert::level<2>{});
             // VERIFY(check_cursor_symmetry(cursor, &ccc));
         }
-        auto result = find_best_path(fees, cached_cursors, &ccc);
+        auto result = find_best_path(fees, cached_cursors, &ccc, space.depth.get());
         INFO("Collapsing event graph");
         size_t collapsed_count = result.pathlink_mutable()->collapse_all();
         INFO(collapsed_count << " event graph vertices modified");
@@ -929,29 +1278,31 @@ void TraceHMM(const hmmer::HMM &hmm,
         }
 
         INFO("Extracting top paths");
-        auto top_paths = result.top_k(&ccc, top);
         bool x_as_m_in_alignment = fees.is_proteomic();
-        if (!top_paths.empty()) {
-            INFO("Best score in the current component: " << result.best_score());
-            INFO("Best sequence in the current component");
-            INFO(top_paths.str(0, &ccc));
-            INFO("Alignment: " << compress_alignment(top_paths.alignment(0, fees, &ccc), x_as_m_in_alignment));
-        }
-
         std::unordered_set<std::tuple<std::vector<EdgeId>, size_t, size_t>> extracted_paths;
+        bool first = true;
 
-        for (const auto& annotated_path : top_paths) {
+        // Paths are processed as soon as they are extracted, so only the resultant edge paths are kept
+        auto process_path = [&](auto &&annotated_path) {
             VERIFY(annotated_path.path.size());
             std::string seq = annotated_path.str(&ccc);
+            if (first) {
+                first = false;
+                INFO("Best score in the current component: " << result.best_score());
+                INFO("Best sequence in the current component");
+                INFO(seq);
+                INFO("Alignment: " << compress_alignment(annotated_path.alignment(fees, &ccc), x_as_m_in_alignment));
+            }
             if (seq.length() < fees.minimal_match_length) {
-                continue;
+                return;
             }
             auto unpacked_path = ccc.UnpackPath(annotated_path.path, cursors);
             VERIFY(check_path_continuity(unpacked_path, context));
             auto alignment = compress_alignment(annotated_path.alignment(fees, &ccc), x_as_m_in_alignment);
             auto nucl_path = to_nucl_path(unpacked_path);
             std::string nucl_seq = pathtree::path2string(nucl_path, context);
-            auto edge_path = to_path(nucl_path);
+            auto graph_path = to_graph_path(nucl_path);
+            auto edge_path = to_path(graph_path);
             DEBUG_ASSERT(check_path_continuity(nucl_path, context), main_assert{}, debug_assert::level<2>{});
             // VERIFY(check_path_continuity(nucl_path, context));
             // DEBUG_ASSERT(!edge_path.empty(), main_assert{});
@@ -961,7 +1312,7 @@ void TraceHMM(const hmmer::HMM &hmm,
             //     ERROR("AA: " << edge_path_aas);
             // }
             // DEBUG_ASSERT(edge_path == edge_path_aas, main_assert{}, debug_assert::level<2>{});
-            size_t pos = nucl_path[0].position();
+            size_t pos = graph_path[0].position();
             HMMPathInfo info(p7hmm->name, annotated_path.score, seq, nucl_seq, std::move(edge_path), std::move(alignment),
                              component_name, pos);
             info.trim_first_edges(graph);
@@ -970,7 +1321,9 @@ void TraceHMM(const hmmer::HMM &hmm,
                 local_results.push_back(std::move(info));
                 extracted_paths.insert(tpl);
             }
-        }
+        };
+        size_t extracted = result.for_each_top(&ccc, top, cfg.top_memory * (size_t(1) << 20), process_path);
+        INFO(extracted << " top paths extracted");
     };
 
     std::vector<EdgeId> match_edges;
@@ -980,7 +1333,7 @@ void TraceHMM(const hmmer::HMM &hmm,
     }
     remove_duplicates(match_edges);
 
-    auto process_component = [&hmm, &run_search, &cfg, &results, &graph](const auto &component_cursors,
+    auto process_component = [&hmm, &search_cached, &cfg, &cursor_index, &component_cache, &results, &graph](const auto &component_cursors,
                                                                          const std::string &component_name = "") -> std::unordered_set<std::vector<EdgeId>> {
         assert(!component_cursors.empty());
         INFO("Component size " << component_cursors.size());
@@ -990,6 +1343,9 @@ void TraceHMM(const hmmer::HMM &hmm,
             return {};
         }
 
+        // Large components wait here while another one is running under memory pressure
+        MemoryGovernor::Admission admission(component_cursors.size());
+
         for (const auto &cursor : component_cursors) {
             DEBUG_ASSERT(check_cursor_symmetry(cursor, &graph), main_assert{}, debug_assert::level<2>{});
         }
@@ -1004,18 +1360,33 @@ void TraceHMM(const hmmer::HMM &hmm,
 
         INFO("Running path search");
         std::vector<HMMPathInfo> local_results;
-        std::unordered_set<GraphCursor> component_set(component_cursors.cbegin(), component_cursors.cend());
-        auto restricted_context = make_optimized_restricted_cursor_context(component_set, &graph);
-        auto restricted_component_cursors = make_optimized_restricted_cursors(component_cursors);
-
         bool hmm_in_aas = hmm.abc()->K == 20;
-        if (hmm_in_aas) {
-            run_search(make_aa_cursors(restricted_component_cursors, &restricted_context), cfg.top, local_results, &restricted_context, component_name);
+        // Contexts of the component are either shared with other models or built for this search only
+        auto contexts = component_cache ? component_cache->Acquire(component_cursors)
+                                        : std::make_shared<ComponentContexts>(component_cursors, graph, cursor_index);
+        auto identity = [](const auto &path) -> const auto & { return path; };
+
+        if (const CachedCursorContext *context = contexts->indexed()) {
+            if (hmm_in_aas) {
+                const auto &space = contexts->indexed_aa();
+                // The context is numbered after its own cursors, shared contexts have them sorted
+                auto to_graph_path = [context, &cursors = contexts->cursors()](const std::vector<CachedCursor> &path) {
+                    return context->UnpackPath(path, cursors);
+                };
+                search_cached(space, cfg.top, local_results, context, component_name, to_graph_path);
+            } else {
+                search_cached(contexts->indexed_nt(), cfg.top, local_results, &graph, component_name, identity);
+            }
+        } else if (hmm_in_aas) {
+            search_cached(contexts->restricted_aa(), cfg.top, local_results, contexts->restricted(), component_name, identity);
         } else {
-            run_search(restricted_component_cursors, cfg.top, local_results, &restricted_context, component_name);
+            search_cached(contexts->restricted_nt(), cfg.top, local_results, contexts->restricted(), component_name, identity);
         }
 
-        results.insert(results.end(), local_results.begin(), local_results.end());
+        #pragma omp critical(trace_hmm_results)
+        {
+            results.insert(results.end(), local_results.begin(), local_results.end());
+        }
 
         std::unordered_set<std::vector<EdgeId>> paths;
         for (const auto& entry : local_results) {
@@ -1025,8 +1396,12 @@ void TraceHMM(const hmmer::HMM &hmm,
     };
 
 
-    #pragma omp parallel for schedule(dynamic)
+    // Components are spawned as tasks (largest first), so idle threads of the outer HMM-level team
+    // could pick them up instead of waiting for a single giant component
+    #pragma omp taskgroup
     for (size_t i = 0; i < cursor_conn_comps.size(); ++i) {
+    #pragma omp task default(shared) firstprivate(i) priority(task_priority(cursor_conn_comps[i].size()))
+    {
         const auto &component_cursors = cursor_conn_comps[i];
         const std::string &component_name = component_names.size() ? component_names[i] : "";
         auto paths = process_component(component_cursors, component_name);
@@ -1055,22 +1430,32 @@ void TraceHMM(const hmmer::HMM &hmm,
             }
         }
     }
+    }
 }
 
-void hmm_main(const PathracerConfig &cfg,
-              const debruijn_graph::ConjugateDeBruijnGraph &graph,
-              const std::vector<EdgeId> &edges,
-              const std::vector<std::vector<EdgeId>> scaffold_paths,
-              std::unordered_set<std::vector<EdgeId>> &to_rescore,
-              std::set<std::pair<std::string, std::vector<EdgeId>>> &gfa_paths,
-              const std::function<std::string(EdgeId)> &mapping_f) {
+// Queries of a pathracer run or of a pathracer-server job, along with their search state and results
+struct QueryJob {
+    PathracerConfig cfg;
+    const std::vector<EdgeId> *edges = nullptr;
+    std::vector<hmmer::HMM> hmms;
+    const SeedSequences *seed_sequences = nullptr;
+    PathSequences *sequences = nullptr;
+    ResultWriter *writer = nullptr;
+    std::vector<Seeds> seeds;
+    std::unique_ptr<ComponentCache> component_cache;
+    std::unordered_set<std::vector<EdgeId>> to_rescore;
+    std::set<std::pair<std::string, std::vector<EdgeId>>> gfa_paths;
+    // Called from the task of a query after its results are pushed to the writer, optional. It runs in a compute
+    // thread, so it must not wait for the writer or for I/O
+    std::function<void(const hmmer::HMM &hmm, size_t results)> on_query_done;
+};
+
+std::vector<hmmer::HMM> ParseQueries(const PathracerConfig &cfg, std::string *error = nullptr) {
     std::vector<hmmer::HMM> hmms;
     if (cfg.mode == Mode::hmm)
-        hmms = ParseHMMFile(cfg.hmmfile);
+        hmms = ParseHMMFile(cfg.hmmfile, error);
     else
-        hmms = ParseFASTAFile(cfg.hmmfile, cfg.mode);
-
-    SuperpathIndex scaffold_path_index(scaffold_paths);
+        hmms = ParseFASTAFile(cfg.hmmfile, cfg.mode, error);
 
     // Filter input hmms
     if (!cfg.queries.empty()) {
@@ -1080,42 +1465,174 @@ void hmm_main(const PathracerConfig &cfg,
                    hmms.end());
     }
 
-    // Outer loop: over each query HMM in <hmmfile>.
-    omp_set_num_threads(cfg.threads);
+    return hmms;
+}
+
+std::set<int> AlphabetTypes(const std::vector<hmmer::HMM> &hmms) {
+    std::set<int> alphabet_types;
+    for (const auto &hmm : hmms) {
+        alphabet_types.insert(hmm.abc()->type);
+    }
+    return alphabet_types;
+}
+
+// In batched mode all the models are seeded first, so the components hit by several models are known in advance
+// and their contexts are built once. Results are the same as of the models processed one by one
+void PrepareBatch(QueryJob &job,
+                  const debruijn_graph::ConjugateDeBruijnGraph &graph,
+                  const SuperpathIndex &scaffold_path_index,
+                  const CursorIndex *cursor_index) {
+    job.seeds.resize(job.hmms.size());
+    if (!job.cfg.batch) {
+        return;
+    }
+
     #pragma omp parallel for schedule(dynamic)
-    for (size_t _i = 0; _i < hmms.size(); ++_i) {
-        const auto &hmm = hmms[_i];
+    for (size_t i = 0; i < job.hmms.size(); ++i) {
+        job.seeds[i] = SeedComponents(job.hmms[i], graph, *job.edges, scaffold_path_index, job.seed_sequences, job.cfg);
+    }
+
+    job.component_cache.reset(new ComponentCache(graph, cursor_index));
+    size_t total = 0;
+    for (const auto &hmm_seeds : job.seeds) {
+        for (const auto &component : hmm_seeds.components) {
+            if (component.size() <= job.cfg.max_size) {
+                job.component_cache->Register(component);
+                ++total;
+            }
+        }
+    }
+    INFO("Batched search: " << job.component_cache->size() << " distinct components over " << total << " model-component pairs");
+}
+
+// Every (HMM, component) pair of all the jobs is a separate task on the same thread pool, see TraceHMM()
+void TraceQueries(const std::vector<QueryJob*> &jobs,
+                  const debruijn_graph::ConjugateDeBruijnGraph &graph,
+                  const SuperpathIndex &scaffold_path_index,
+                  const CursorIndex *cursor_index,
+                  const std::function<std::string(EdgeId)> &mapping_f) {
+    // Longer models are started first
+    std::vector<std::pair<QueryJob*, size_t>> hmm_order;
+    for (QueryJob *job : jobs) {
+        for (size_t i = 0; i < job->hmms.size(); ++i) {
+            hmm_order.emplace_back(job, i);
+        }
+    }
+    std::stable_sort(hmm_order.begin(), hmm_order.end(),
+                     [](const auto &a, const auto &b) { return a.first->hmms[a.second].get()->M > b.first->hmms[b.second].get()->M; });
+
+    // Outer loop: over each query HMM in <hmmfile>.
+    #pragma omp parallel
+    #pragma omp single
+    for (size_t _k = 0; _k < hmm_order.size(); ++_k) {
+    QueryJob *job = hmm_order[_k].first;
+    const size_t _i = hmm_order[_k].second;
+    #pragma omp task default(shared) firstprivate(job, _i) priority(task_priority(job->hmms[_i].get()->M))
+    {
+        const auto &cfg = job->cfg;
+        const auto &hmm = job->hmms[_i];
 
         std::vector<HMMPathInfo> results;
 
-        TraceHMM(hmm, graph, edges, scaffold_path_index,
-                 cfg, results);
+        if (!cfg.batch) {
+            job->seeds[_i] = SeedComponents(hmm, graph, *job->edges, scaffold_path_index, job->seed_sequences, cfg);
+        }
+        TraceHMM(hmm, graph, *job->edges, job->seeds[_i],
+                 cfg, cursor_index, job->component_cache.get(), results);
+        job->seeds[_i] = Seeds();
 
         std::sort(results.begin(), results.end());
         unique_hmm_path_info(results, scaffold_path_index);
-        SaveResults(hmm, graph, cfg, results, scaffold_path_index, mapping_f);
 
         if (cfg.annotate_graph) {
-            size_t idx = 0;
-            for (const auto &result : results) {
-                #pragma omp critical
-                {
-                    gfa_paths.insert({ std::string(hmm.get()->name) + "_" + std::to_string(idx++) + "_score_" + std::to_string(result.score), result.path });
-                }
+            std::vector<std::pair<std::string, std::vector<EdgeId>>> hmm_gfa_paths;
+            for (size_t idx = 0; idx < results.size(); ++idx) {
+                hmm_gfa_paths.push_back({ std::string(hmm.get()->name) + "_" + std::to_string(idx) + "_score_" + std::to_string(results[idx].score), results[idx].path });
+            }
+            #pragma omp critical
+            {
+                job->gfa_paths.insert(hmm_gfa_paths.begin(), hmm_gfa_paths.end());
             }
         }
 
-        Rescore(hmm, graph, cfg, results, scaffold_paths, mapping_f);
+        Rescore(hmm, cfg, results, scaffold_path_index, *job->sequences, mapping_f, *job->writer);
 
-        for (const auto &result : results) {
-#pragma omp critical
-            {
-                to_rescore.insert(result.path);
+        #pragma omp critical
+        {
+            for (const auto &result : results) {
+                job->to_rescore.insert(result.path);
             }
         }
+
+        const size_t nresults = results.size();
+        SaveResults(hmm, cfg, std::move(results), scaffold_path_index, mapping_f, *job->writer);
+
+        if (job->on_query_done) {
+            job->on_query_done(hmm, nresults);
+        }
+    }
     } // end outer loop over query HMMs
 }
 
+void hmm_main(const PathracerConfig &cfg,
+              const debruijn_graph::ConjugateDeBruijnGraph &graph,
+              const std::vector<EdgeId> &edges,
+              const std::vector<std::vector<EdgeId>> scaffold_paths,
+              std::unordered_set<std::vector<EdgeId>> &to_rescore,
+              std::set<std::pair<std::string, std::vector<EdgeId>>> &gfa_paths,
+              PathSequences &sequences,
+              ResultWriter &writer,
+              const std::function<std::string(EdgeId)> &mapping_f) {
+    QueryJob job;
+    job.cfg = cfg;
+    job.edges = &edges;
+    job.sequences = &sequences;
+    job.writer = &writer;
+    job.hmms = ParseQueries(cfg);
+
+    SuperpathIndex scaffold_path_index(scaffold_paths);
+
+    std::unique_ptr<CursorIndex> cursor_index;
+    if (!cfg.cursor_index.empty()) {
+        cursor_index.reset(new CursorIndex(cfg.cursor_index, graph, cfg.load_from));
+    }
+
+    omp_set_num_threads(cfg.threads);
+
+    std::unique_ptr<SeedSequences> seed_sequences;
+    if (UsesSeedSequences(cfg.seed_mode) && !job.hmms.empty()) {
+        seed_sequences.reset(new SeedSequences(SeedPaths(cfg.seed_mode, edges, scaffold_path_index), graph, AlphabetTypes(job.hmms)));
+        INFO(seed_sequences->paths().size() << " seed sequences prepared");
+    }
+    job.seed_sequences = seed_sequences.get();
+
+    PrepareBatch(job, graph, scaffold_path_index, cursor_index.get());
+    TraceQueries({ &job }, graph, scaffold_path_index, cursor_index.get(), mapping_f);
+    // The pushed batches refer to the index
+    writer.flush();
+
+    to_rescore = std::move(job.to_rescore);
+    gfa_paths = std::move(job.gfa_paths);
+}
+
+// Edges of the given names (' could be replaced by ^ in them), all the edges if none are given
+std::vector<EdgeId> CollectEdges(const debruijn_graph::ConjugateDeBruijnGraph &graph,
+                                 io::IdMapper<std::string> &id_mapper,
+                                 std::vector<std::string> names) {
+    std::vector<EdgeId> edges;
+    for (std::string &edge : names) {
+        std::replace(edge.begin(), edge.end(), '^', '\'');
+    }
+    std::unordered_set<std::string> allowed_edges(names.cbegin(), names.cend());
+    for (auto it = graph.ConstEdgeBegin(); !it.IsEnd(); ++it) {
+        EdgeId edge = *it;
+        if (allowed_edges.empty() || allowed_edges.count(id_mapper[edge.int_id()])) {
+            edges.push_back(edge);
+        }
+    }
+    return edges;
+}
+
 int pathracer_main(int argc, char* argv[]) {
     utils::segfault_handler sh;
     utils::perf_counter pc;
@@ -1156,7 +1673,7 @@ int pathracer_main(int argc, char* argv[]) {
     debruijn_graph::ConjugateDeBruijnGraph graph(cfg.k);
     std::vector<std::vector<EdgeId>> scaffold_paths;
     std::unique_ptr<io::IdMapper<std::string>> id_mapper(new io::IdMapper<std::string>());
-    LoadGraph(graph, scaffold_paths, cfg.load_from, id_mapper.get());
+    LoadGraph(graph, scaffold_paths, cfg.load_from, id_mapper.get(), cfg.graph_cache, cfg.parallel_gfa);
     size_t letters = 0;
     for (auto it = graph.ConstEdgeBegin(); !it.IsEnd(); ++it) {
         EdgeId edge = *it;
@@ -1167,30 +1684,37 @@ int pathracer_main(int argc, char* argv[]) {
     INFO("Total paths " << scaffold_paths.size());
 
     // Collect all the edges
-    std::vector<EdgeId> edges;
-    for (std::string &edge : cfg.edges) {
-        std::replace(edge.begin(), edge.end(), '^', '\'');
-    }
-    std::unordered_set<std::string> allowed_edges(cfg.edges.cbegin(), cfg.edges.cend());
-    for (auto it = graph.ConstEdgeBegin(); !it.IsEnd(); ++it) {
-        EdgeId edge = *it;
-        if (allowed_edges.empty() || allowed_edges.count(id_mapper->operator[](edge.int_id()))) {
-            edges.push_back(edge);
-        }
-    }
+    std::vector<EdgeId> edges = CollectEdges(graph, *id_mapper, cfg.edges);
 
     std::unordered_set<std::vector<EdgeId>> to_rescore;
     std::set<std::pair<std::string, std::vector<EdgeId>>> gfa_paths;
 
+    // The hard limit above stays as a backstop, the governor degrades the searches before it is hit.
+    // Everything loaded so far is accounted as the baseline (max RSS is reported in KB)
+    MemoryGovernor &governor = MemoryGovernor::instance();
+    if (cfg.memory_governor) {
+        governor.configure(cfg.memory * GB, utils::get_max_rss() * 1024);
+        INFO("Memory governor baseline: " << (utils::get_max_rss() >> 10) << " MB");
+    }
+
     const auto mapping_f = [&id_mapper, &graph](EdgeId id) -> std::string { return (*id_mapper)[graph.int_id(id)]; };
-    hmm_main(cfg, graph, edges, scaffold_paths, to_rescore, gfa_paths,
+    PathSequences sequences(graph, mapping_f);
+    ResultWriter writer(cfg.gzip_output);
+    hmm_main(cfg, graph, edges, scaffold_paths, to_rescore, gfa_paths, sequences, writer,
              mapping_f);
 
+    if (governor.degraded() || governor.throttled()) {
+        WARN("Memory pressure: state limits were tightened " << governor.degraded() << " time(s), "
+             << governor.throttled() << " large component(s) were delayed; results could be less sensitive");
+    }
+
     if (cfg.rescore) {
         INFO("Total " << to_rescore.size() << " paths to rescore");
-        ExportEdges(to_rescore, graph, scaffold_paths,
+        SuperpathIndex scaffold_path_index(scaffold_paths);
+        ExportEdges(std::move(to_rescore), sequences, scaffold_path_index,
                     cfg.output_dir + "/all.edges.fa",
-                    mapping_f);
+                    mapping_f, writer);
+        writer.flush();
     }
 
     if (cfg.annotate_graph) {
@@ -1206,9 +1730,334 @@ int pathracer_main(int argc, char* argv[]) {
         }
     }
 
+    writer.flush();
     INFO("Pathracer successfully finished! Thanks for flying us!");
     return 0;
 }
+
+int pathracer_index_main(int argc, char* argv[]) {
+    using namespace clipp;
+
+    std::string load_from;
+    size_t k = 0;
+    std::string output;
+
+    auto cli =
+        (load_from << value("load from"),
+         k << integer("k-mer size"),
+         required("--output", "-o") & value("output file", output) % "output cursor index file"
+         );
+
+    if (!parse(argc, argv, cli)) {
+        std::cout << make_man_page(cli, argv[0]);
+        exit(1);
+    }
+
+    utils::segfault_handler sh;
+    utils::perf_counter pc;
+    create_console_logger();
+
+    START_BANNER("Graph cursor index builder");
+
+    debruijn_graph::ConjugateDeBruijnGraph graph(k);
+    std::vector<std::vector<EdgeId>> scaffold_paths;
+    std::unique_ptr<io::IdMapper<std::string>> id_mapper(new io::IdMapper<std::string>());
+    LoadGraph(graph, scaffold_paths, load_from, id_mapper.get());
+    INFO("Graph loaded. Total vertices: " << graph.size() << ", edges: " << graph.e_size());
+
+    CursorIndex::Build(graph, output, load_from);
+
+    return 0;
+}
+// A job of pathracer-server, the queries of one connection
+struct ServerJob {
+    size_t id = 0;
+    std::string request;
+    std::unique_ptr<QueryServer::Connection> connection;
+    QueryJob query;
+    std::vector<EdgeId> edges;  // if restricted by --edges of the job
+    std::unique_ptr<SeedSequences> seed_sequences;  // of these edges
+    std::unique_ptr<PathSequences> sequences;
+    std::atomic<size_t> pending{0};  // queries
+    std::atomic<size_t> results{0};
+    utils::perf_counter accepted, started;
+    double wait = 0;
+
+    // Files of a query for the sender of the job, they are written once the writer passes the ticket
+    struct Send {
+        std::vector<std::string> names;
+        size_t ticket = 0;
+        bool last = false;  // query of the job
+    };
+    JobQueue<Send> sends;
+};
+
+// Options of a job are the ones of pathracer without the graph and k. The thread pool, the memory limit
+// and the cursor index are the server's, the annotated graph is not written, the output is not compressed.
+// The output directory of a job is a name of a directory in the output root of the server
+bool ParseJobRequest(const std::string &request, const PathracerConfig &server_cfg, const std::string &output_root,
+                     PathracerConfig &cfg, std::string &error) {
+    std::istringstream ss(request);
+    std::vector<std::string> args = { "pathracer" };
+    std::string arg;
+    if (!(ss >> arg)) {
+        error = "empty request";
+        return false;
+    }
+    args.push_back(arg);
+    args.push_back(server_cfg.load_from);
+    args.push_back(std::to_string(server_cfg.k));
+    while (ss >> arg) {
+        args.push_back(arg);
+    }
+    std::vector<char*> argv;
+    for (auto &a : args) {
+        argv.push_back(&a[0]);
+    }
+
+    std::string usage;
+    if (!parse_cmdline(int(argv.size()), argv.data(), cfg, usage)) {
+        error = "invalid arguments, see pathracer --help";
+        return false;
+    }
+    cfg.threads = server_cfg.threads;
+    cfg.memory = server_cfg.memory;
+    cfg.memory_governor = server_cfg.memory_governor;
+    cfg.cursor_index = server_cfg.cursor_index;
+    cfg.annotate_graph = false;
+    cfg.gzip_output = false;
+
+    if (access(cfg.hmmfile.c_str(), R_OK) != 0) {
+        error = "cannot read " + cfg.hmmfile;
+        return false;
+    }
+    if (cfg.output_dir.empty() || cfg.output_dir == "." || cfg.output_dir == ".." ||
+        cfg.output_dir.find('/') != std::string::npos) {
+        error = "output directory must be a name of a directory in the output root of the server";
+        return false;
+    }
+    cfg.output_dir = output_root + "/" + cfg.output_dir;
+    // Not a symlink out of the root
+    struct stat st;
+    if ((mkdir(cfg.output_dir.c_str(), 0775) != 0 && errno != EEXIST) ||
+        lstat(cfg.output_dir.c_str(), &st) != 0 || !S_ISDIR(st.st_mode)) {
+        error = "cannot create output directory " + cfg.output_dir;
+        return false;
+    }
+    return true;
+}
+
+namespace {
+std::string server_socket;
+
+void StopServer(int) {
+    unlink(server_socket.c_str());
+    _exit(0);
+}
+}
+
+int pathracer_server_main(int argc, char* argv[]) {
+    using namespace clipp;
+
+    PathracerConfig cfg;
+    std::string socket_path, output_root;
+    auto cli =
+        (cfg.load_from << value("load from"),
+         cfg.k << integer("k-mer size"),
+         required("--socket") & value("path", socket_path) % "Unix domain socket to accept query jobs on",
+         required("--output-root") & value("dir", output_root) % "directory of the output directories of the jobs, --output of a job is a name of one",
+         (option("--threads", "-t") & integer("NTHREADS", cfg.threads)) % "the number of parallel threads shared by all the jobs [default: 4]",
+         (option("--memory", "-m") & integer("MEMORY", cfg.memory)) % "RAM limit in GB (searches are degraded as the limit approaches, terminates if exceeded) [default: 100]",
+         option("--no-memory-governor").set(cfg.memory_governor, false) % "do not tighten the top score filter and throttle large components as the memory limit approaches [default: false]",
+         (option("--cursor-index") & value("filename", cfg.cursor_index)) % "cursor index of the graph built by pathracer-index",
+         (option("--graph-cache") & value("dir", cfg.graph_cache)) % "directory of binary snapshots of GFA graphs written on the first load and memory-mapped by the later runs [default: disabled]",
+         option("--no-parallel-gfa").set(cfg.parallel_gfa, false) % "parse GFA graph in a single thread, the graph is the same [default: false]"
+         );
+
+    if (!parse(argc, argv, cli)) {
+        std::cout << make_man_page(cli, argv[0]);
+        exit(1);
+    }
+
+    utils::segfault_handler sh;
+    create_console_logger();
+
+    START_BANNER("Graph HMM aligning server");
+    INFO("Process ID: " << getpid());
+
+    const size_t GB = 1 << 30;
+    utils::limit_memory(cfg.memory * GB);
+
+    if (mkdir(output_root.c_str(), 0775) != 0 && errno != EEXIST) {
+        FATAL_ERROR("Cannot create output root " << output_root);
+    }
+
+    // Everything that does not depend on the queries is loaded once
+    debruijn_graph::ConjugateDeBruijnGraph graph(cfg.k);
+    std::vector<std::vector<EdgeId>> scaffold_paths;
+    std::unique_ptr<io::IdMapper<std::string>> id_mapper(new io::IdMapper<std::string>());
+    LoadGraph(graph, scaffold_paths, cfg.load_from, id_mapper.get(), cfg.graph_cache, cfg.parallel_gfa);
+    INFO("Graph loaded. Total vertices: " << graph.size() << ", edges: " << graph.e_size() << ", paths: " << scaffold_paths.size());
+
+    const std::vector<EdgeId> edges = CollectEdges(graph, *id_mapper, {});
+    SuperpathIndex scaffold_path_index(scaffold_paths);
+    std::unique_ptr<CursorIndex> cursor_index;
+    if (!cfg.cursor_index.empty()) {
+        cursor_index.reset(new CursorIndex(cfg.cursor_index, graph, cfg.load_from));
+    }
+    // Seed paths translated for the first job of each seed mode and set of alphabets
+    std::map<std::pair<SeedMode, std::set<int>>, std::unique_ptr<SeedSequences>> seed_sequences;
+
+    if (cfg.memory_governor) {
+        MemoryGovernor::instance().configure(cfg.memory * GB, utils::get_max_rss() * 1024);
+        INFO("Memory governor baseline: " << (utils::get_max_rss() >> 10) << " MB");
+    }
+    omp_set_num_threads(cfg.threads);
+
+    const auto mapping_f = [&id_mapper, &graph](EdgeId id) -> std::string { return (*id_mapper)[graph.int_id(id)]; };
+    // Files are sent once written, so their senders wait for the writer
+    ResultWriter writer(false);
+
+    QueryServer server(socket_path);
+    server_socket = socket_path;
+    std::signal(SIGINT, StopServer);
+    std::signal(SIGTERM, StopServer);
+    INFO("Listening on " << socket_path);
+
+    JobQueue<ServerJob> queue;
+    // Requests are read and their queries are parsed by a thread per connection, so neither a silent client
+    // nor a malformed query file holds or stops the others
+    const unsigned REQUEST_TIMEOUT = 60;  // seconds
+    auto receive = [&](std::unique_ptr<ServerJob> job) {
+        std::string error;
+        if (!job->connection->ReadLine(job->request)) {
+            WARN("Job " << job->id << ": no request received");
+            return;
+        }
+        if (ParseJobRequest(job->request, cfg, output_root, job->query.cfg, error)) {
+            job->query.hmms = ParseQueries(job->query.cfg, &error);
+        }
+        if (!error.empty()) {
+            WARN("Job " << job->id << " (" << job->request << ") rejected: " << error);
+            job->connection->Write("#error " + error + "\n");
+            return;
+        }
+        INFO("Job " << job->id << " accepted: " << job->request);
+        queue.push(std::move(job));
+    };
+    std::thread acceptor([&]() {
+        for (size_t id = 1;; ++id) {
+            std::unique_ptr<ServerJob> job(new ServerJob);
+            job->id = id;
+            job->connection = server.Accept();
+            job->accepted.reset();
+            job->connection->SetTimeout(REQUEST_TIMEOUT);
+            std::thread(receive, std::move(job)).detach();
+        }
+    });
+    acceptor.detach();
+
+    auto finish = [&](ServerJob &job) {
+        const auto &job_cfg = job.query.cfg;
+        if (job_cfg.rescore && !job.query.to_rescore.empty()) {
+            ExportEdges(job.query.to_rescore, *job.query.sequences, scaffold_path_index, job_cfg.output_dir + "/all.edges.fa", mapping_f, writer);
+            writer.flush();
+            job.connection->SendFile("all.edges.fa", job_cfg.output_dir + "/all.edges.fa");
+        }
+
+        const size_t run_ms = size_t(job.started.time_ms()), total_ms = size_t(job.accepted.time_ms());
+        std::ostringstream done;
+        done << "queries=" << job.query.hmms.size() << " results=" << job.results.load()
+             << " wait_ms=" << size_t(job.wait * 1000) << " run_ms=" << run_ms << " total_ms=" << total_ms;
+        INFO("Job " << job.id << " done: " << done.str());
+        job.connection->Write("#done " + done.str() + "\n");
+        job.connection.reset();
+    };
+
+    // A thread per job sends its files and finishes it, so neither the tasks nor the writer wait for the client.
+    // The job is kept by its sender
+    auto send = [&](std::shared_ptr<ServerJob> job) {
+        for (;;) {
+            for (const auto &item : job->sends.pop_all()) {
+                writer.wait(item->ticket);
+                for (const auto &name : item->names) {
+                    job->connection->SendFile(name, job->query.cfg.output_dir + "/" + name);
+                }
+                if (item->last) {
+                    finish(*job);
+                    return;
+                }
+            }
+        }
+    };
+
+    // Jobs accepted while a batch runs make the next one, the queries of all the jobs of a batch share the threads
+    for (;;) {
+        std::vector<std::shared_ptr<ServerJob>> batch;
+        for (auto &job : queue.pop_all()) {
+            batch.emplace_back(std::move(job));
+        }
+        std::vector<QueryJob*> queries;
+        for (auto &job : batch) {
+            job->wait = job->accepted.time();
+            job->started.reset();
+            QueryJob &query = job->query;
+            const PathracerConfig &job_cfg = query.cfg;
+
+            query.edges = &edges;
+            job->sequences.reset(new PathSequences(graph, mapping_f));
+            query.sequences = job->sequences.get();
+            query.writer = &writer;
+            if (!job_cfg.edges.empty()) {
+                job->edges = CollectEdges(graph, *id_mapper, job_cfg.edges);
+                query.edges = &job->edges;
+            }
+            if (UsesSeedSequences(job_cfg.seed_mode) && !query.hmms.empty()) {
+                const std::set<int> alphabet_types = AlphabetTypes(query.hmms);
+                if (query.edges != &edges) {
+                    job->seed_sequences.reset(new SeedSequences(SeedPaths(job_cfg.seed_mode, *query.edges, scaffold_path_index), graph, alphabet_types));
+                    query.seed_sequences = job->seed_sequences.get();
+                } else {
+                    auto &cached = seed_sequences[{ job_cfg.seed_mode, alphabet_types }];
+                    if (!cached) {
+                        cached.reset(new SeedSequences(SeedPaths(job_cfg.seed_mode, edges, scaffold_path_index), graph, alphabet_types));
+                        INFO(cached->paths().size() << " seed sequences prepared");
+                    }
+                    query.seed_sequences = cached.get();
+                }
+            }
+            PrepareBatch(query, graph, scaffold_path_index, cursor_index.get());
+            std::thread(send, job).detach();
+
+            if (query.hmms.empty()) {
+                std::unique_ptr<ServerJob::Send> last(new ServerJob::Send);
+                last->last = true;
+                job->sends.push(std::move(last));
+                continue;
+            }
+            job->pending = query.hmms.size();
+            ServerJob *server_job = job.get();
+            query.on_query_done = [&writer, server_job](const hmmer::HMM &hmm, size_t results) {
+                // The results of the query are pushed already, so they are numbered below the ticket
+                std::unique_ptr<ServerJob::Send> item(new ServerJob::Send);
+                const std::string name = hmm.get()->name;
+                if (results) {
+                    item->names = { name + ".seqs.fa", name + ".nucs.fa", name + ".edges.fa" };
+                }
+                item->ticket = writer.pushed();
+                server_job->results += results;
+                item->last = --server_job->pending == 0;
+                server_job->sends.push(std::move(item));
+            };
+            queries.push_back(&query);
+        }
+
+        TraceQueries(queries, graph, scaffold_path_index, cursor_index.get(), mapping_f);
+    }
+
+    return 0;
+}
+
 #include "cached_aa_cursor.hpp"
 int aling_fs(int argc, char* argv[]) {
     using namespace clipp;
@@ -1338,12 +2187,12 @@ int aling_fs(int argc, char* argv[]) {
                 }
             }
             std::unordered_set<size_t> indices;
-            auto get = [&](size_t i) -> const std::string& {
-                return seqs[i].second;
+            auto length = [&](size_t i) -> size_t {
+                return seqs[i].second.length();
             };
 
-            PseudoVector<std::string> local_seqs(seqs.size(), get);
-            auto overs = GetOverhangs(matcher, local_seqs, hmm);
+            PseudoVector<size_t> local_lengths(seqs.size(), length);
+            auto overs = GetOverhangs(matcher, local_lengths, hmm);
             for (const auto &over : overs) {
                 int loverhang = over.second.first + expand_const;
                 int roverhang = over.second.second + expand_const;
@@ -1372,7 +2221,7 @@ int aling_fs(int argc, char* argv[]) {
             }
             INFO("Sequence: " << id);
 
-            std::unordered_set<StringCursor> cursor_set(cursors.cbegin(), cursors.cend());
+            CursorSet<StringCursor> cursor_set(cursors.cbegin(), cursors.cend());
 
             auto restricted_context = make_optimized_restricted_cursor_context(cursor_set, &seq);
             auto restricted_component_cursors = make_optimized_restricted_cursors(cursors);
@@ -1449,7 +2298,7 @@ int aling_fs(int argc, char* argv[]) {
 }
 
 int aling_kmers_main(int argc, char* argv[]) {
-    create_console_logger("");
+    create_console_logger();
     using namespace clipp;
 
     std::string hmm_file;
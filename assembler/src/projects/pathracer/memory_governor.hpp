@@ -0,0 +1,190 @@
+//***************************************************************************
+//* Copyright (c) 2019 Saint Petersburg State University
+//* All Rights Reserved
+//* See file LICENSE for details.
+//***************************************************************************
+
+#pragma once
+
+#include "utils/logger/logger.hpp"
+#include "utils/verify.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <condition_variable>
+#include <cstddef>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include <omp.h>
+
+// Keeps the searches within the memory budget (see --memory) by degrading them instead of running into
+// the hard limit. Every running search reports the footprint of its event graph and state sets after each
+// HMM position. As the estimated usage approaches the budget, the state limits of the running searches
+// are tightened and large components are admitted one at a time. Disabled unless configured.
+// Process-wide, as the memory limit itself
+class MemoryGovernor {
+ public:
+  // Degradation starts at this fraction of the budget, the state limits are halved
+  // for every further 1/LEVELS of the remaining headroom down to 2^-LEVELS
+  static constexpr double SOFT_PRESSURE = 0.7;
+  static constexpr size_t LEVELS = 6;
+  // Components of at least this number of cursors are throttled under pressure
+  static constexpr size_t LARGE_COMPONENT = 10000;
+
+  static MemoryGovernor &instance() {
+    static MemoryGovernor governor;
+    return governor;
+  }
+
+  // budget = 0 disables the governor, baseline is the memory used outside of the searches (graph, indices)
+  void configure(size_t budget, size_t baseline) {
+    budget_ = budget;
+    baseline_ = baseline;
+  }
+
+  bool enabled() const { return budget_ != 0; }
+
+  double pressure() const {
+    return enabled() ? static_cast<double>(baseline_ + tracked_) / static_cast<double>(budget_) : 0;
+  }
+
+  // Multiplier for the state limits (see Fees::state_limits), a power of two
+  double state_limit_scale() const {
+    const double p = pressure();
+    if (p < SOFT_PRESSURE) return 1;
+    const double level = std::floor((p - SOFT_PRESSURE) / (1 - SOFT_PRESSURE) * LEVELS) + 1;
+    return std::ldexp(1., -static_cast<int>(std::min(level, static_cast<double>(LEVELS))));
+  }
+
+  // Footprint of one running search, registered during its lifetime
+  class Search {
+   public:
+    Search(MemoryGovernor &governor = MemoryGovernor::instance())
+        : governor_{governor}, thread_{omp_get_thread_num()} {
+      governor_.attach(this);
+    }
+    Search(const Search &) = delete;
+    Search &operator=(const Search &) = delete;
+    ~Search() {
+      report(0, 0);
+      governor_.detach(this);
+    }
+
+    void report(size_t bytes, size_t states) {
+      governor_.tracked_ += bytes - bytes_;  // wraps around for shrinking searches, as intended
+      bytes_ = bytes;
+      states_ = states;
+    }
+
+    // Logs the degradation when the scale of the state limits drops
+    void degrade(double scale, size_t m) {
+      if (scale >= logged_scale_) return;
+      logged_scale_ = scale;
+      ++governor_.degraded_;
+      WARN("Memory pressure " << governor_.pressure() * 100 << "%: state limits scaled by " << scale
+           << " at position " << m << ", running searches: " << governor_.footprints());
+    }
+
+   private:
+    friend class MemoryGovernor;
+    MemoryGovernor &governor_;
+    int thread_;
+    std::atomic<size_t> bytes_{0};
+    std::atomic<size_t> states_{0};
+    double logged_scale_ = 1;
+  };
+
+  // Holds an admission of a large component, waits while another one runs under pressure
+  class Admission {
+   public:
+    Admission(size_t component_size, MemoryGovernor &governor = MemoryGovernor::instance())
+        : governor_{governor}, large_{governor.admit(component_size)} {}
+    Admission(const Admission &) = delete;
+    Admission &operator=(const Admission &) = delete;
+    ~Admission() {
+      if (large_) governor_.release();
+    }
+
+   private:
+    MemoryGovernor &governor_;
+    bool large_;
+  };
+
+  size_t degraded() const { return degraded_; }
+  size_t throttled() const { return throttled_; }
+
+ private:
+  MemoryGovernor() = default;
+
+  void attach(Search *search) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    searches_.push_back(search);
+  }
+
+  void detach(Search *search) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    searches_.erase(std::find(searches_.begin(), searches_.end(), search));
+  }
+
+  // "thread: states/MB" of the running searches
+  std::string footprints() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    std::ostringstream ss;
+    for (const Search *search : searches_) {
+      ss << (search == searches_.front() ? "" : ", ") << search->thread_ << ": " << search->states_.load() << " states/"
+         << (search->bytes_.load() >> 20) << " MB";
+    }
+    return ss.str();
+  }
+
+  // Admissions are reentrant: a thread holding one could pick up another component task at a scheduling
+  // point of its own search, waiting there would deadlock
+  static size_t &held() {
+    static thread_local size_t held = 0;
+    return held;
+  }
+
+  bool admit(size_t component_size) {
+    if (!enabled() || component_size < LARGE_COMPONENT) return false;
+    std::unique_lock<std::mutex> lock(mutex_);
+    if (!held() && running_ && pressure() >= SOFT_PRESSURE) {
+      ++throttled_;
+      WARN("Memory pressure " << pressure() * 100 << "%: component of size " << component_size
+           << " waits for " << running_ << " large component(s) to finish");
+      // Pressure also drops without notifications, as other searches go on
+      while (running_ && pressure() >= SOFT_PRESSURE) {
+        released_.wait_for(lock, std::chrono::seconds(1));
+      }
+    }
+    ++running_;
+    ++held();
+    return true;
+  }
+
+  void release() {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      --running_;
+      --held();
+    }
+    released_.notify_all();
+  }
+
+  size_t budget_ = 0;
+  size_t baseline_ = 0;
+  std::atomic<size_t> tracked_{0};
+  std::atomic<size_t> degraded_{0};
+  std::atomic<size_t> throttled_{0};
+
+  std::mutex mutex_;
+  std::condition_variable released_;
+  size_t running_ = 0;
+  std::vector<const Search *> searches_;
+};
+
+// vim: set ts=2 sw=2 et :
@@ -8,9 +8,9 @@
 
 #include <aa_cursor.hpp>
 
-template <typename T>
-bool in_vector(const T &val, const std::vector<T> &vec) {
-    return std::find(vec.cbegin(), vec.cend(), val) != vec.cend();
+template <typename T, typename Container>
+bool in_vector(const T &val, const Container &vec) {
+    return std::find(vec.begin(), vec.end(), val) != vec.end();
 }
 
 template <typename GraphCursor>
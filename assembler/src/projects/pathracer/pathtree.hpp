@@ -1,13 +1,13 @@
 #pragma once
 
 #include "pathtrie.hpp"
-#include "trie.hpp"
-#include "object_counter.hpp"
+#include "slab_arena.hpp"
 
 #include "utils/logger/logger.hpp"
 
-#include <llvm/ADT/IntrusiveRefCntPtr.h>
+#include <llvm/ADT/SmallVector.h>
 #include <debug_assert/debug_assert.hpp>
+#include <parallel_hashmap/phmap.h>
 
 #include <memory>
 #include <cmath>
@@ -16,6 +16,8 @@
 #include <unordered_set>
 #include <vector>
 #include <algorithm>
+#include <cstdint>
+#include <limits>
 
 #include "fees.hpp"
 #include "utils.hpp"
@@ -24,7 +26,6 @@
 #include <cereal/types/vector.hpp>
 #include <cereal/types/common.hpp>
 #include <cereal/types/utility.hpp>
-#include "cereal_llvm_intrusive_ptr.hpp"
 
 #include "aa_cursor.hpp"
 #include "cached_aa_cursor.hpp"
@@ -32,6 +33,50 @@
 enum EventType { NONE, MATCH, INSERTION, FRAME_SHIFT };
 using score_t = double;
 
+// Storage of the ancestor scores kept in the Event Graph (see PATHRACER_SCORE_STORAGE in CMakeLists.txt).
+// Scores are always computed in score_t. The best score of a PathLink is kept exact, so rounding does not
+// accumulate along a path; only the scores of the edges to the ancestors are rounded when stored
+struct DoubleScoreStorage {
+  using type = double;
+  static type store(score_t score) { return score; }
+  static score_t load(type score) { return score; }
+  // The largest error of a stored score of about this magnitude
+  static score_t rounding(score_t) { return 0; }
+};
+
+struct FloatScoreStorage {
+  using type = float;
+  static type store(score_t score) { return static_cast<type>(score); }
+  static score_t load(type score) { return score; }
+  static score_t rounding(score_t score) { return std::abs(score) * std::numeric_limits<type>::epsilon() / 2; }
+};
+
+// Fixed point nats x 1000, the same precision as the reported scores (see unique_hmm_path_info())
+struct MilliNatScoreStorage {
+  using type = int32_t;
+  static constexpr score_t SCALE = 1000;
+  static constexpr type INF = std::numeric_limits<type>::max();
+
+  static type store(score_t score) {
+    if (!(score < INF / SCALE)) return INF;
+    if (score <= -INF / SCALE) return -INF;
+    return static_cast<type>(std::lround(score * SCALE));
+  }
+  static score_t load(type score) {
+    return score == INF ? std::numeric_limits<score_t>::infinity() : score / SCALE;
+  }
+  static score_t rounding(score_t) { return 0.5 / SCALE; }
+};
+
+#if defined(PATHRACER_FLOAT_SCORES)
+using ScoreStorage = FloatScoreStorage;
+#elif defined(PATHRACER_MILLINAT_SCORES)
+using ScoreStorage = MilliNatScoreStorage;
+#else
+using ScoreStorage = DoubleScoreStorage;
+#endif
+using stored_score_t = ScoreStorage::type;
+
 struct pathtree_assert : debug_assert::default_handler,
                          debug_assert::set_level<1> {};
 
@@ -189,79 +234,106 @@ struct AnnotatedPath {
   }
 };
 
+// Non-owning reference to an event graph vertex, vertices are owned by the arena of their search
+template <typename T>
+class LinkRef {
+ public:
+  LinkRef(T *p = nullptr) : p_{p} {}
+
+  T *get() const { return p_; }
+  T *operator->() const { return p_; }
+  T &operator*() const { return *p_; }
+  explicit operator bool() const { return p_ != nullptr; }
+
+  bool operator==(const LinkRef &that) const { return p_ == that.p_; }
+  bool operator!=(const LinkRef &that) const { return p_ != that.p_; }
+
+ private:
+  T *p_;
+};
+
+template <class GraphCursor>
+class PathSet;
+
 template <typename GraphCursor>
-class PathLink : public llvm::RefCountedBase<PathLink<GraphCursor>>,
-                 public AtomicObjectCounter<PathLink<GraphCursor>> {
+class PathLink {
   using This = PathLink<GraphCursor>;
-  using ThisRef = llvm::IntrusiveRefCntPtr<This>;
+  using ThisRef = LinkRef<This>;
+  using Scores = llvm::SmallVector<std::pair<stored_score_t, This *>, 4>;
 
   // Make it private
-  void* operator new (size_t sz) {
-      return ::operator new(sz);
+  void* operator new (size_t) {
+      return Arena::allocate();
   }
-  friend class cereal::access;
 
 public:
+  // All the links created during a search share one arena, see find_best_path().
+  // Ancestors are kept in the edge pool of the arena as 32-bit indices with their scores
+  using Arena = SlabArena<This, stored_score_t>;
+
+  // Links are released together with their arena
+  void operator delete(void *) {}
+
   double score() const {
     return score_;
   }
 
   ThisRef get_unique_ancestor() const {
-    return scores_.size() == 1 ? scores_.front().second : nullptr;
+    return size() == 1 ? ancestor(0) : nullptr;
+  }
+
+  // Calls f(score, ancestor) for all the incoming links
+  template <typename F>
+  void for_each_ancestor(F &&f) const {
+    const Arena &arena = Arena::of(this);
+    const auto *ancestors = arena.ancestors(block_);
+    const stored_score_t single = stored_score();
+    const auto *scores = arena.scores(block_, single);
+    for (size_t i = 0; i < block_.size; ++i) {
+      f(ScoreStorage::load(scores[i]), ThisRef(arena.object(ancestors[i])));
+    }
   }
 
   bool update(score_t score, const ThisRef &pl, size_t insertion_len = 1) {
-    scores_.push_back({score, pl});
+    DEBUG_ASSERT(&Arena::of(pl.get()) == &Arena::of(this), pathtree_assert{});
+    const bool better = score_ > score;
+    append(Arena::of(this).index(pl.get()), score);
 
     // FIXME fix this for I loops
-    max_prefix_size_ = std::max(max_prefix_size_, pl->max_prefix_size_ + insertion_len);
+    max_prefix_size_ = std::max(max_prefix_size_, pl->max_prefix_size_ + static_cast<uint32_t>(insertion_len));
 
-    if (score_ > score) {
-      score_ = score;
-      return true;
-    } else {
-      return false;
-    }
+    return better;
   }
 
   size_t size() const {
-    return scores_.size();
+    return block_.size;
   }
 
   bool empty() const {
-    return scores_.empty();
+    return block_.size == 0;
   }
 
-  PathLink(const GraphCursor &cursor = GraphCursor()) : score_{std::numeric_limits<score_t>::infinity()}, cursor_{cursor} {
-    scores_.reserve(8);
-  }
+  PathLink(const GraphCursor &cursor = GraphCursor()) : score_{std::numeric_limits<score_t>::infinity()}, cursor_{cursor} {}
 
   const GraphCursor &cursor() const {
     return cursor_;
   }
 
-  auto best_ancestor() const {
-    DEBUG_ASSERT(scores_.size(), pathtree_assert{});
-    return std::min_element(scores_.cbegin(), scores_.cend(),
-                            [](const auto &e1, const auto &e2) { return e1.first < e2.first; });
-  }
-
-
-  static void collapse_scores_left(std::vector<std::pair<double, ThisRef>> &scores) {
+  static void collapse_scores_left(Scores &scores) {
     sort_by(scores.begin(), scores.end(), [](const auto &p) { return std::make_tuple(triplet_form(p.second->cursor()), p.first); }); // TODO prefer matchs to insertions in case of eveness
-    auto it = unique_copy_by(scores.cbegin(), scores.cend(), scores.begin(),
+    auto it = unique_copy_by(scores.begin(), scores.end(), scores.begin(),
                              [](const auto &p){ return triplet_form(p.second->cursor()); });
     scores.resize(std::distance(scores.begin(), it));
   }
 
-  static void trim_scores_left_to_one(std::vector<std::pair<double, ThisRef>> &scores) {
+  static void trim_scores_left_to_one(Scores &scores) {
     sort_by(scores.begin(), scores.end(), [](const auto &p) { return p.first; });
     if (scores.size() > 1) {
       scores.resize(1);
     }
   }
 
-  static void trim_scores_left(std::vector<std::pair<double, ThisRef>> &scores) {
+  static void trim_scores_left(Scores &scores) {
     sort_by(scores.begin(), scores.end(), [](const auto &p) { return p.first; });
 
     for (size_t i = 0; i < scores.size(); ++i) {
@@ -277,55 +349,71 @@ public:
   }
 
   bool trim() {
-    if (scores_.size() <= 1) {
+    if (size() <= 1) {
       return false;
     }
-    size_t prev_size = scores_.size();
-    trim_scores_left(scores_);
-    scores_.shrink_to_fit();
+    size_t prev_size = size();
+    Scores scores = ancestor_scores();
+    trim_scores_left(scores);
+    assign_ancestors(scores);
     update_max_prefix_size();
-    return scores_.size() != prev_size;
+    return size() != prev_size;
   }
 
   bool collapse_and_trim() {
-    if (scores_.size() <= 1) {
+    if (size() <= 1) {
       return false;
     }
-    size_t prev_size = scores_.size();
-    collapse_scores_left(scores_);
-    trim_scores_left(scores_);
-    scores_.shrink_to_fit();
+    size_t prev_size = size();
+    Scores scores = ancestor_scores();
+    collapse_scores_left(scores);
+    trim_scores_left(scores);
+    assign_ancestors(scores);
     update_max_prefix_size();
-    // if (scores_.size() != prev_size) {
+    // if (size() != prev_size) {
     //   INFO("Collapsed:" << this->event_.m << " " << event_.type);
     // }
-    return scores_.size() != prev_size;
+    return size() != prev_size;
   }
 
   bool collapse_and_trim_to_one() {
-    if (scores_.size() <= 1) {
+    if (size() <= 1) {
       return false;
     }
-    size_t prev_size = scores_.size();
-    collapse_scores_left(scores_);
-    trim_scores_left_to_one(scores_);
-    scores_.shrink_to_fit();
+    size_t prev_size = size();
+    Scores scores = ancestor_scores();
+    collapse_scores_left(scores);
+    trim_scores_left_to_one(scores);
+    assign_ancestors(scores);
     update_max_prefix_size();
-    // if (scores_.size() != prev_size) {
-    //   INFO("Collapsed:" << this->event_.m << " " << event_.type);
-    // }
-    return scores_.size() != prev_size;
+    return size() != prev_size;
   }
 
   void update_max_prefix_size() {
     max_prefix_size_ = 0;
-    for (const auto &p : scores_) {
-      max_prefix_size_ = std::max(max_prefix_size_, p.second->max_prefix_size() + 1);  // FIXME it could not be used for skipped I-s More one argument for counting M-s only!
-    }
+    for_each_ancestor([this](double, const ThisRef &ancestor) {
+      max_prefix_size_ = std::max(max_prefix_size_, ancestor->max_prefix_size_ + 1);  // FIXME it could not be used for skipped I-s More one argument for counting M-s only!
+    });
   }
 
   static ThisRef create(const GraphCursor &cursor) { return new This(cursor); }
-  ThisRef clone() const { return new This(*this); }
+
+  // The copy is created in the arena of the calling thread, which should be the arena of this link
+  ThisRef clone() const {
+    ThisRef copy = create(cursor_);
+    DEBUG_ASSERT(&Arena::of(copy.get()) == &Arena::of(this), pathtree_assert{});
+    const Arena &arena = Arena::of(this);
+    const auto *ancestors = arena.ancestors(block_);
+    const stored_score_t single = stored_score();
+    const auto *scores = arena.scores(block_, single);
+    for (size_t i = 0; i < block_.size; ++i) {
+      copy->append(ancestors[i], ScoreStorage::load(scores[i]));
+    }
+    copy->max_prefix_size_ = max_prefix_size_;
+    copy->score_ = score_;
+    copy->event_ = event_;
+    return copy;
+  }
 
   static ThisRef create_sink() {
     return create(GraphCursor());
@@ -338,11 +426,33 @@ public:
   }
 
   bool is_source() const {
-    return scores_.size() == 0 && score_ == 0;
+    return empty() && score_ == 0;
   }
 
+  static constexpr size_t DEFAULT_TOP_QUEUE_MEMORY = size_t(1) << 30;  // 1GB
+
   std::vector<AnnotatedPath<GraphCursor>> top_k(typename GraphCursor::Context context,
-                                                size_t k, double min_score = 0) const {
+                                                size_t k, double min_score = 0,
+                                                size_t queue_memory = DEFAULT_TOP_QUEUE_MEMORY) const {
+    std::vector<AnnotatedPath<GraphCursor>> result;
+    for_each_top(context, k, min_score, queue_memory,
+                 [&result](AnnotatedPath<GraphCursor> &&path) { result.push_back(std::move(path)); });
+    return result;
+  }
+
+  // Streaming best-first extraction of up to k best paths. Paths are passed to emit() in the order of
+  // decreasing score as soon as they are found, so the caller decides what to keep.
+  // Partial paths are kept as deviations sharing common suffixes (pathtrie). Half of queue_memory bytes
+  // limits the queue of them: when it is exceeded, the worst partial paths are dropped, so the tail of
+  // a very deep extraction could be incomplete. The other half limits the fingerprints of the reported
+  // paths, the extraction stops when they exceed it, so memory does not depend on k.
+  // As trie::Trie::try_add() did, a path is not reported if its nucleotide path is a prefix or an extension
+  // of an already reported one. Nucleotide paths and all their prefixes are compared by 128-bit fingerprints.
+  // Trimming flags are kept per arena slot of the event graph links.
+  // Returns the number of emitted paths
+  template <typename Emit>
+  size_t for_each_top(typename GraphCursor::Context context,
+                      size_t k, double min_score, size_t queue_memory, Emit &&emit) const {
     struct Event {
       const This *path_link;
     };
@@ -359,11 +469,32 @@ public:
       }
     };
 
-    std::priority_queue<QueueElement, std::vector<QueueElement>, Comp> q;
+    const size_t element_size = sizeof(QueueElement) + sizeof(typename EventPath::element_type);
+    const size_t max_queue_size = std::max<size_t>(queue_memory / 2 / element_size, 1024);
+    bool truncated = false;
+
+    // Binary heap over vector, so it could be truncated
+    std::vector<QueueElement> q;
+    auto push = [&](QueueElement &&element) {
+      q.push_back(std::move(element));
+      std::push_heap(q.begin(), q.end(), Comp());
+      if (q.size() > 2 * max_queue_size) {
+        std::nth_element(q.begin(), q.begin() + max_queue_size, q.end(),
+                         [](const QueueElement &e1, const QueueElement &e2) { return e1.cost < e2.cost; });
+        q.resize(max_queue_size);
+        std::make_heap(q.begin(), q.end(), Comp());
+        truncated = true;
+      }
+    };
+    auto pop = [&]() {
+      std::pop_heap(q.begin(), q.end(), Comp());
+      QueueElement result = std::move(q.back());
+      q.pop_back();
+      return result;
+    };
 
-    std::vector<AnnotatedPath<GraphCursor>> result;
     auto SinkPath = pathtrie::make_root<Event>({this});
-    q.push({SinkPath, score()});
+    push({SinkPath, score()});
 
     auto get_annotated_path = [&](const EventPath &epath, double cost) -> AnnotatedPath<GraphCursor> {
       std::vector<GraphCursor> path;
@@ -380,15 +511,50 @@ public:
       return AnnotatedPath<GraphCursor>{path, -cost, events}; // FIXME sign!!!!!
     };
 
-    // TODO use one map instead of two sets
-    std::unordered_set<const This*> was_end_of_some_path;
-    std::unordered_set<const This*> was_nonend_of_some_path;
+    // Fingerprints of all the prefixes of a path, the last one is of the whole path
+    using Fingerprint = std::pair<uint64_t, uint64_t>;
+    std::vector<Fingerprint> fingerprints;
+    auto fingerprint = [&fingerprints](const auto &path) {
+      fingerprints.clear();
+      uint64_t h1 = 0xcbf29ce484222325ULL, h2 = 0x9e3779b97f4a7c15ULL;
+      for (const auto &cursor : path) {
+        uint64_t x = std::hash<std::decay_t<decltype(cursor)>>()(cursor);
+        // splitmix64 finalizer, std::hash is often the identity
+        x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+        x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+        x ^= x >> 31;
+        h1 = (h1 ^ x) * 0x100000001b3ULL;
+        h2 = (h2 + x) * 0xff51afd7ed558ccdULL + (h2 >> 29);
+        fingerprints.emplace_back(h1, h2);
+      }
+    };
+    struct FingerprintHash {
+      size_t operator()(const Fingerprint &fp) const { return fp.first; }
+    };
+    // Reported paths and the proper prefixes of them
+    phmap::flat_hash_set<Fingerprint, FingerprintHash> extracted, prefixes;
+    auto try_add = [&]() {
+      const Fingerprint &whole = fingerprints.back();
+      auto is_extracted = [&](const Fingerprint &fp) { return extracted.count(fp); };
+      if (prefixes.count(whole) || std::any_of(fingerprints.cbegin(), fingerprints.cend(), is_extracted)) {
+        return false;
+      }
+      extracted.insert(whole);
+      prefixes.insert(fingerprints.cbegin(), fingerprints.cend() - 1);
+      return true;
+    };
+    const size_t max_fingerprints_size = queue_memory / 2;
+    auto fingerprints_size = [&]() {
+      return (extracted.capacity() + prefixes.capacity()) * (sizeof(Fingerprint) + 1);
+    };
 
-    trie::Trie<NuclCursor<GraphCursor>> trie;
+    enum : unsigned char { END_OF_SOME_PATH = 1, NONEND_OF_SOME_PATH = 2 };
+    const Arena &arena = Arena::of(this);
+    std::vector<unsigned char> trimming(arena.slots());
 
-    while (!q.empty() && result.size() < k) {
-      auto qe = q.top();
-      q.pop();
+    size_t count = 0;
+    while (!q.empty() && count < k) {
+      auto qe = pop();
       const This *path_link = qe.path->data().path_link;
       const double &cost = qe.cost;
 
@@ -400,18 +566,19 @@ public:
       if (!qe.path->is_root()) {
         const This *prev_path_link = qe.path->parent()->data().path_link;
         const GraphCursor &prev_gp = prev_path_link->cursor();
+        unsigned char &flags = trimming[arena.index(path_link)];
         // Trimming
         if (prev_gp.is_empty()) {
-          was_end_of_some_path.insert(path_link);  // Strong trimming!
+          flags |= END_OF_SOME_PATH;  // Strong trimming!
           // Check has non-empty cursor
-          if (was_nonend_of_some_path.count(path_link)) {
+          if (flags & NONEND_OF_SOME_PATH) {
             continue;
           }
         } else {
-          if (was_end_of_some_path.count(path_link)) {
+          if (flags & END_OF_SOME_PATH) {
             continue;
           }
-          was_nonend_of_some_path.insert(path_link);
+          flags |= NONEND_OF_SOME_PATH;
         }
       }
 
@@ -429,23 +596,33 @@ public:
           break;
         }
 
-        auto nucl_path = _to_nucl_path(annotated_path.path, context);
-        if (trie.try_add(nucl_path)) {
-          result.push_back(annotated_path);
+        fingerprint(_to_nucl_path(annotated_path.path, context));
+        if (try_add()) {
+          emit(std::move(annotated_path));
+          ++count;
+          if (fingerprints_size() > max_fingerprints_size) {
+            WARN("Fingerprints of top paths exceeded the memory budget, the extraction is stopped after #" << count);
+            break;
+          }
         }
 
         continue;
       }
 
-      for (const auto &score_pl : path_link->scores_) {
-        Event new_event{const_cast<const This *>(score_pl.second.get())};
+      path_link->for_each_ancestor([&](double score, const ThisRef &ancestor) {
+        Event new_event{ancestor.get()};
         auto new_path = qe.path->child(new_event);
-        double delta = score_pl.first - path_link->score();
-        q.push({new_path, cost + delta});
-      }
+        // The best ancestor is followed exactly, deviations from it carry the rounding of their edges
+        double delta = score - ScoreStorage::load(path_link->stored_score());
+        push({new_path, cost + delta});
+      });
     }
 
-    return result;
+    if (truncated) {
+      WARN("Top paths queue exceeded the memory budget, some of the paths after #" << count << " could be missed");
+    }
+
+    return count;
   }
 
   void set_emission(size_t m, EventType type) {
@@ -457,9 +634,9 @@ public:
   }
 
   bool is_collapsed() const {
-    auto scores = scores_;
+    Scores scores = ancestor_scores();
     collapse_scores_left(scores);
-    return scores.size() == scores_.size();
+    return scores.size() == size();
   }
 
   std::vector<const This*> collect_const() const {
@@ -476,12 +653,7 @@ public:
 
       checked.insert(current);
 
-      for (const auto &kv : current->scores_) {
-        const This *p = kv.second.get();
-        if (p) {
-          q.push(p);
-        }
-      }
+      current->for_each_ancestor([&q](double, const ThisRef &ancestor) { q.push(ancestor.get()); });
     }
     return std::vector<const This*>(std::make_move_iterator(checked.begin()),
                                     std::make_move_iterator(checked.end()));
@@ -499,9 +671,11 @@ public:
   }
 
   void set_finishes(const std::unordered_set<GraphCursor> &finishes) {
-    auto it = std::remove_if(scores_.begin(), scores_.end(),
+    Scores scores = ancestor_scores();
+    auto it = std::remove_if(scores.begin(), scores.end(),
                              [&finishes](const auto &x){ return !finishes.count(x.second->cursor()); });
-    scores_.erase(it, scores_.end());
+    scores.erase(it, scores.end());
+    assign_ancestors(scores);
     update_score();
   }
 
@@ -518,45 +692,18 @@ public:
     return count;
   }
 
-  // template <typename Function>
-  // auto apply(const Function &function) {
-  //   std::unordered_set<const This *> checked;
-  //
-  //   std::queue<const This *> q;
-  //   q.push(this);
-  //   while (!q.empty()) {
-  //     const This *current = q.front();
-  //     q.pop();
-  //     if (!current || checked.count(current)) {
-  //       continue;
-  //     }
-  //
-  //     function(*current);
-  //
-  //     checked.insert(current);
-  //
-  //     for (const auto &kv : current->scores_) {
-  //       const This *p = kv.second.second.get();
-  //       if (p) {
-  //         q.push(p);
-  //       }
-  //     }
-  //   }
-  // }
-
   size_t has_sequence(const std::string &seq, typename GraphCursor::Context context) const {
     std::vector<const This*> pointers = collect_const();
 
     for (size_t i = seq.length() - 1; i + 1 > 0; --i) {
       std::vector<const This*> new_pointers;
       for (const This *p : pointers) {
-        for (const auto &kv : p->scores_) {
-          const This* next = kv.second.get();
+        p->for_each_ancestor([&](double, const ThisRef &next) {
           const GraphCursor &cursor = next->cursor();
           if (!cursor.is_empty() && cursor.letter(context) == seq[i]) {
-            new_pointers.push_back(next);
+            new_pointers.push_back(next.get());
           }
-        }
+        });
       }
       pointers = std::move(new_pointers);
     }
@@ -567,60 +714,93 @@ public:
     return max_prefix_size_;
   }
 
-  template <class Archive>
-  void serialize(Archive &archive) {
-    archive(scores_, score_, event_, cursor_, max_prefix_size_);
-  }
-
 private:
-  // std::unordered_map<GraphCursor, std::pair<double, ThisRef>> scores_;
-  // std::vector<std::pair<GraphCursor, std::pair<double, ThisRef>>> scores_;
-  std::vector<std::pair<double, ThisRef>> scores_;
+  friend Arena;
+  friend class PathSet<GraphCursor>;
+
+  SlabBlock block_;
+  uint32_t max_prefix_size_ = 0;
   score_t score_;
   GraphCursor cursor_;
   Event event_;
-  size_t max_prefix_size_ = 0;
 
-  void update_score() {
-    if (!scores_.empty()) {
-      auto it = best_ancestor();
-      score_ = it->first;
-    } else {
-      score_ = std::numeric_limits<double>::infinity();
+  ThisRef ancestor(size_t i) const {
+    const Arena &arena = Arena::of(this);
+    return arena.object(arena.ancestors(block_)[i]);
+  }
+
+  Scores ancestor_scores() const {
+    const Arena &arena = Arena::of(this);
+    const auto *ancestors = arena.ancestors(block_);
+    const stored_score_t single = stored_score();
+    const auto *scores = arena.scores(block_, single);
+    Scores result;
+    result.reserve(block_.size);
+    for (size_t i = 0; i < block_.size; ++i) {
+      result.emplace_back(scores[i], arena.object(ancestors[i]));
     }
+    return result;
   }
 
-  // const auto& get_cursor_delta_trimmed_left() const { // FIXME rename
-  //   // TODO Check and fix this description
-  //   // the idea is in the following:
-  //   // if a path is a prefix or suffix of another one,
-  //   // we do not consider them as DIFFERENT paths. We leave only one (the best) of them
-  //   // In order to implement this we do not allow to link to be "left-terminal" (contain backref to "empty cursor") and
-  //   // "transit" (contain backrefs to other nontrivial links).
-  //   // Here we just remove ref to empty cursor or refs to nontrivial links dependent on what is better
-  //
-  //   // If terminal ref is present:
-  //   // 1) Remove all other refs worse than it
-  //   // 2) In case of some non-terminal refs still present, remove terminal ref as well
-  //   // We add some tolerance. If two paths have almost equal scores we keep them both
-  //   // const double eps = 1e-7;
-  //   const_cast<This*>(this)->collapse_and_trim();
-  //   return scores_;
-  // }
+  // The score of the edge to an inline ancestor is the stored best score (see SlabBlock)
+  stored_score_t stored_score() const {
+    return ScoreStorage::store(score_);
+  }
 
+  void append(uint32_t ancestor, score_t score) {
+    if (empty()) {
+      score_ = score;
+    }
+    const stored_score_t single = stored_score();
+    Arena::of(this).push_back(this, block_, single, ancestor, ScoreStorage::store(score));
+    score_ = std::min(score_, score);
+  }
+
+  // Replaces the ancestors by their subset reordered
+  void assign_ancestors(const Scores &scores) {
+    Arena &arena = Arena::of(this);
+    DEBUG_ASSERT(scores.size() <= block_.size, pathtree_assert{});
+    auto *ancestors = arena.ancestors(block_);
+    stored_score_t single = stored_score();
+    auto *stored = arena.scores(block_, single);
+    for (size_t i = 0; i < scores.size(); ++i) {
+      stored[i] = scores[i].first;
+      ancestors[i] = arena.index(scores[i].second);
+    }
+    block_.size = static_cast<typename Arena::Index>(scores.size());
+    arena.rewritten(this);
+  }
+
+  void update_score() {
+    if (empty()) {
+      score_ = std::numeric_limits<score_t>::infinity();
+      return;
+    }
+    const stored_score_t single = stored_score();
+    const auto *scores = Arena::of(this).scores(block_, single);
+    const stored_score_t best = *std::min_element(scores, scores + block_.size);
+    // Keep the exact score while the best ancestor is kept
+    if (best != single) {
+      score_ = ScoreStorage::load(best);
+    }
+  }
 };
 
 template <class GraphCursor>
-using PathLinkRef = llvm::IntrusiveRefCntPtr<PathLink<GraphCursor>>;
+using PathLinkRef = LinkRef<PathLink<GraphCursor>>;
 
 template <class GraphCursor>
 class PathSet {
+  using Link = PathLink<GraphCursor>;
+
  public:
   class path_container {
    public:
     path_container(const pathtree::PathLinkRef<GraphCursor> &paths,
                    typename GraphCursor::Context context,
-                   size_t k, double min_score = 0) : paths_(paths->top_k(context, k, min_score)) {}
+                   size_t k, double min_score = 0,
+                   size_t queue_memory = PathLink<GraphCursor>::DEFAULT_TOP_QUEUE_MEMORY)
+        : paths_(paths->top_k(context, k, min_score, queue_memory)) {}
 
     auto begin() const { return paths_.begin(); }
     auto end() const { return paths_.end(); }
@@ -635,7 +815,9 @@ class PathSet {
     std::vector<AnnotatedPath<GraphCursor>> paths_;
   };
 
-  PathSet(const PathLinkRef<GraphCursor> &pathlink) : pathlink_{pathlink} {}
+  // The set keeps the arena of the event graph alive
+  PathSet(const PathLinkRef<GraphCursor> &pathlink)
+      : pathlink_{pathlink}, arena_{pathlink ? Link::Arena::of(pathlink.get()).shared_from_this() : nullptr} {}
 
   double best_score() const { return -pathlink_->score(); }  // FIXME sign
   // AnnotatedPath<GraphCursor> best_path(typename GraphCursor::Context context) const { return top_k(context, 1, -std::numeric_limits<double>::infinity())[0]; }
@@ -645,6 +827,14 @@ class PathSet {
                        size_t k,
                        double min_score = 0) const { return path_container(pathlink_, context, k, min_score); }
 
+  // Streams top paths to emit() without keeping them, see PathLink::for_each_top()
+  template <typename Emit>
+  size_t for_each_top(typename GraphCursor::Context context,
+                      size_t k, size_t queue_memory, Emit &&emit,
+                      double min_score = 0) const {
+    return pathlink_->for_each_top(context, k, min_score, queue_memory, std::forward<Emit>(emit));
+  }
+
   const PathLink<GraphCursor> *pathlink() const {
     return pathlink_.get();
   }
@@ -653,12 +843,53 @@ class PathSet {
     return pathlink_;
   }
 
+  // The event graph is stored as a list of links, ancestors refer to the positions in it
   template <class Archive>
-  void serialize(Archive &archive) {
-    archive(pathlink_);
+  void save(Archive &archive) const {
+    std::vector<const Link *> links = pathlink_->collect_const();
+    std::unordered_map<const Link *, uint32_t> ids;
+    for (const Link *link : links) {
+      ids.emplace(link, static_cast<uint32_t>(ids.size()));
+    }
+
+    archive(static_cast<uint64_t>(links.size()), ids.at(pathlink_.get()));
+    for (const Link *link : links) {
+      std::vector<std::pair<stored_score_t, uint32_t>> ancestors;
+      for (const auto &p : link->ancestor_scores()) {
+        ancestors.emplace_back(p.first, ids.at(p.second));
+      }
+      archive(ancestors, link->score_, link->event_, link->cursor_, link->max_prefix_size_);
+    }
+  }
+
+  template <class Archive>
+  void load(Archive &archive) {
+    typename Link::Arena::Scope scope;
+    uint64_t size;
+    uint32_t root;
+    archive(size, root);
+    std::vector<Link *> links(size);
+    for (auto &link : links) {
+      link = Link::create(GraphCursor()).get();
+    }
+
+    auto &arena = scope.arena();
+    for (Link *link : links) {
+      std::vector<std::pair<stored_score_t, uint32_t>> ancestors;
+      score_t score;
+      archive(ancestors, score, link->event_, link->cursor_, link->max_prefix_size_);
+      for (const auto &p : ancestors) {
+        link->append(arena.index(links.at(p.second)), ScoreStorage::load(p.first));
+      }
+      link->score_ = score;
+    }
+    pathlink_ = links.at(root);
+    arena_ = scope.arena_ptr();
   }
+
  private:
   PathLinkRef<GraphCursor> pathlink_;
+  std::shared_ptr<typename Link::Arena> arena_;
 };
 
 }  // namespace pathtree
@@ -0,0 +1,176 @@
+//***************************************************************************
+//* Copyright (c) 2019 Saint Petersburg State University
+//* All Rights Reserved
+//* See file LICENSE for details.
+//***************************************************************************
+
+#pragma once
+
+#include "utils/logger/logger.hpp"
+
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <condition_variable>
+#include <cstring>
+#include <deque>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <vector>
+
+// Transport of pathracer-server: query jobs come over a Unix domain socket, one per connection.
+// A job is a single line of pathracer arguments, its output is streamed back over the same connection
+// as "#file NAME" headers followed by the contents of the files and a final "#done ..." or "#error ..." line
+class QueryServer {
+ public:
+  class Connection {
+   public:
+    explicit Connection(int fd) : fd_{fd} {}
+    Connection(const Connection &) = delete;
+    Connection &operator=(const Connection &) = delete;
+    ~Connection() { close(fd_); }
+
+    // A blocked read fails after the timeout, so a silent peer does not hold its reader forever
+    void SetTimeout(unsigned seconds) {
+      timeval tv;
+      tv.tv_sec = seconds, tv.tv_usec = 0;
+      setsockopt(fd_, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    }
+
+    // Reads the request line, false if the peer hung up before sending it, it is too long or it timed out
+    bool ReadLine(std::string &line, size_t max_size = 1 << 20) {
+      line.clear();
+      char buffer[4096];
+      for (;;) {
+        ssize_t n = recv(fd_, buffer, sizeof(buffer), 0);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return false;
+        const char *eol = static_cast<const char *>(memchr(buffer, '\n', size_t(n)));
+        line.append(buffer, eol ? size_t(eol - buffer) : size_t(n));
+        if (eol) return true;
+        if (line.size() > max_size) return false;
+      }
+    }
+
+    // Thread-safe, the output of a peer that hung up is dropped
+    void Write(const std::string &data) {
+      std::lock_guard<std::mutex> lock(mutex_);
+      for (size_t sent = 0; !broken_ && sent < data.size();) {
+        ssize_t n = send(fd_, data.data() + sent, data.size() - sent, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) {
+          broken_ = true;
+          WARN("Client hung up: " << strerror(errno));
+          break;
+        }
+        sent += size_t(n);
+      }
+    }
+
+    // Does nothing if there is no such file
+    void SendFile(const std::string &name, const std::string &filename) {
+      std::ifstream in(filename);
+      if (!in) return;
+      std::ostringstream ss;
+      ss << "#file " << name << '\n' << in.rdbuf();
+      Write(ss.str());
+    }
+
+   private:
+    int fd_;
+    std::mutex mutex_;
+    bool broken_ = false;
+  };
+
+  explicit QueryServer(const std::string &path) : path_{path} {
+    sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (path.size() >= sizeof(addr.sun_path)) {
+      FATAL_ERROR("Socket path is too long: " << path);
+    }
+    strncpy(addr.sun_path, path.c_str(), sizeof(addr.sun_path) - 1);
+
+    // A socket left by a killed server is replaced, a live one is not
+    struct stat st;
+    if (lstat(path.c_str(), &st) == 0) {
+      if (!S_ISSOCK(st.st_mode)) {
+        FATAL_ERROR("File exists and is not a socket: " << path);
+      }
+      int probe = socket(AF_UNIX, SOCK_STREAM, 0);
+      bool live = connect(probe, reinterpret_cast<const sockaddr *>(&addr), sizeof(addr)) == 0;
+      close(probe);
+      if (live) {
+        FATAL_ERROR("Another server is listening on " << path);
+      }
+      unlink(path.c_str());
+    }
+
+    fd_ = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd_ < 0 || bind(fd_, reinterpret_cast<const sockaddr *>(&addr), sizeof(addr)) != 0 ||
+        listen(fd_, SOMAXCONN) != 0) {
+      FATAL_ERROR("Cannot listen on " << path << ": " << strerror(errno));
+    }
+  }
+  QueryServer(const QueryServer &) = delete;
+  QueryServer &operator=(const QueryServer &) = delete;
+
+  ~QueryServer() {
+    close(fd_);
+    unlink(path_.c_str());
+  }
+
+  const std::string &path() const { return path_; }
+
+  // Blocks until a client connects
+  std::unique_ptr<Connection> Accept() {
+    for (;;) {
+      int fd = accept(fd_, nullptr, nullptr);
+      if (fd >= 0) return std::unique_ptr<Connection>(new Connection(fd));
+      if (errno != EINTR && errno != ECONNABORTED) {
+        FATAL_ERROR("accept(2) failed: " << strerror(errno));
+      }
+    }
+  }
+
+ private:
+  std::string path_;
+  int fd_;
+};
+
+// Jobs accepted while the previous ones run are taken by the next batch
+template <class Job>
+class JobQueue {
+ public:
+  void push(std::unique_ptr<Job> job) {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      jobs_.push_back(std::move(job));
+    }
+    pushed_.notify_one();
+  }
+
+  // Waits for a job and takes all the queued ones
+  std::vector<std::unique_ptr<Job>> pop_all() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    pushed_.wait(lock, [this]() { return !jobs_.empty(); });
+    std::vector<std::unique_ptr<Job>> result(std::make_move_iterator(jobs_.begin()),
+                                             std::make_move_iterator(jobs_.end()));
+    jobs_.clear();
+    return result;
+  }
+
+ private:
+  std::mutex mutex_;
+  std::condition_variable pushed_;
+  std::deque<std::unique_ptr<Job>> jobs_;
+};
+
+// vim: set ts=2 sw=2 et :
@@ -1,12 +1,14 @@
 #pragma once
 
+#include "cursor_adjacency.hpp"
+#include "cursor_set.hpp"
+
 #include <vector>
 #include <utility>
-#include <unordered_set>
 
 template <class GraphCursor>
 struct OptimizedRestrictedGraphCursorContext {
-    const std::unordered_set<GraphCursor> &space;
+    const CursorSet<GraphCursor> &space;
     typename GraphCursor::Context context;
 };
 
@@ -24,30 +26,44 @@ class OptimizedRestrictedGraphCursor : public GraphCursor {
   OptimizedRestrictedGraphCursor(GraphCursor &&other) : GraphCursor(std::move(other)) {}
 
   std::vector<OptimizedRestrictedGraphCursor> next(Context context) const {
-    return filter_(GraphCursor::next(context->context), context->space);
+    std::vector<OptimizedRestrictedGraphCursor> result;
+    for_each_next(context, [&result](const OptimizedRestrictedGraphCursor &cursor) { result.push_back(cursor); });
+    return result;
   }
 
   std::vector<OptimizedRestrictedGraphCursor> prev(Context context) const {
-    return filter_(GraphCursor::prev(context->context), context->space);
+    std::vector<OptimizedRestrictedGraphCursor> result;
+    for_each_prev(context, [&result](const OptimizedRestrictedGraphCursor &cursor) { result.push_back(cursor); });
+    return result;
+  }
+
+  template <typename F>
+  void for_each_next(Context context, F &&f) const {
+    ::for_each_next(base(), context->context, filter_(context->space, f));
+  }
+
+  template <typename F>
+  void for_each_prev(Context context, F &&f) const {
+    ::for_each_prev(base(), context->context, filter_(context->space, f));
   }
 
   char letter(Context context) const { return GraphCursor::letter(context->context); }
 
  private:
-  std::vector<OptimizedRestrictedGraphCursor> filter_(std::vector<GraphCursor> v, const std::unordered_set<GraphCursor> &space) const {
-    std::vector<OptimizedRestrictedGraphCursor> result;
-    for (auto &&cursor : v) {
+  const GraphCursor &base() const { return *this; }
+
+  template <typename F>
+  static auto filter_(const CursorSet<GraphCursor> &space, F &f) {
+    return [&space, &f](const GraphCursor &cursor) {
       if (space.count(cursor)) {
-        result.emplace_back(std::move(cursor));
+        f(OptimizedRestrictedGraphCursor(cursor));
       }
-    }
-
-    return result;
+    };
   }
 };
 
 template <class GraphCursor>
-auto make_optimized_restricted_cursor_context(const std::unordered_set<GraphCursor> &space, typename GraphCursor::Context context) {
+auto make_optimized_restricted_cursor_context(const CursorSet<GraphCursor> &space, typename GraphCursor::Context context) {
     return OptimizedRestrictedGraphCursorContext<GraphCursor>{space, context};
 }
 
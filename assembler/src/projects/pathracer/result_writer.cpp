@@ -0,0 +1,132 @@
+//***************************************************************************
+//* Copyright (c) 2019 Saint Petersburg State University
+//* All Rights Reserved
+//* See file LICENSE for details.
+//***************************************************************************
+
+#include "result_writer.hpp"
+
+#include "utils/logger/logger.hpp"
+
+#include <zlib.h>
+
+#include <cassert>
+#include <fstream>
+
+#include "io/reads/mpmc_bounded.hpp"
+
+namespace {
+
+// gzip -1: the writer thread should keep up with the tasks
+class GzipBuffer : public std::streambuf {
+ public:
+  explicit GzipBuffer(const std::string &filename) : file_{gzopen(filename.c_str(), "wb1")}, buffer_(1 << 16) {
+    setp(buffer_.data(), buffer_.data() + buffer_.size());
+  }
+  ~GzipBuffer() {
+    if (file_) {
+      sync();
+      gzclose(file_);
+    }
+  }
+
+  bool is_open() const { return file_ != nullptr; }
+
+ protected:
+  int overflow(int c) override {
+    if (sync() != 0) {
+      return traits_type::eof();
+    }
+    if (c != traits_type::eof()) {
+      *pptr() = traits_type::to_char_type(c);
+      pbump(1);
+    }
+    return traits_type::not_eof(c);
+  }
+
+  int sync() override {
+    unsigned size = static_cast<unsigned>(pptr() - pbase());
+    if (size && gzwrite(file_, pbase(), size) != static_cast<int>(size)) {
+      return -1;
+    }
+    setp(buffer_.data(), buffer_.data() + buffer_.size());
+    return 0;
+  }
+
+ private:
+  gzFile file_;
+  std::vector<char> buffer_;
+};
+
+}  // namespace
+
+ResultWriter::ResultWriter(bool gzip, size_t queue_size)
+    : gzip_{gzip}, queue_{new mpmc_bounded_queue<Batch>(queue_size)} {
+  thread_ = std::thread([this]() { run(); });
+}
+
+ResultWriter::~ResultWriter() {
+  queue_->close();
+  thread_.join();
+}
+
+void ResultWriter::push(std::vector<std::string> filenames, Formatter format) {
+  Batch batch;
+  batch.ticket = pushed_++;
+  batch.filenames = std::move(filenames);
+  batch.format = std::move(format);
+  while (!queue_->enqueue(std::move(batch))) {
+    usleep(100);
+  }
+}
+
+void ResultWriter::wait(size_t ticket) const {
+  while (written_ < ticket) {
+    usleep(100);
+  }
+}
+
+void ResultWriter::run() {
+  Batch batch;
+  while (queue_->wait_dequeue(batch)) {
+    write(batch);
+    written_ahead_.insert(batch.ticket);
+    batch = Batch();
+
+    size_t written = written_;
+    while (!written_ahead_.empty() && *written_ahead_.begin() == written) {
+      written_ahead_.erase(written_ahead_.begin());
+      ++written;
+    }
+    written_ = written;
+  }
+}
+
+void ResultWriter::write(const Batch &batch) const {
+  std::vector<std::unique_ptr<std::streambuf>> buffers;
+  std::vector<std::unique_ptr<std::ostream>> streams;
+  std::vector<std::ostream *> files;
+  for (const auto &name : batch.filenames) {
+    if (gzip_) {
+      std::unique_ptr<GzipBuffer> buffer(new GzipBuffer(filename(name)));
+      if (!buffer->is_open()) {
+        WARN("Cannot open " << filename(name) << ", the results are not saved");
+        return;
+      }
+      buffers.emplace_back(std::move(buffer));
+    } else {
+      std::unique_ptr<std::filebuf> buffer(new std::filebuf);
+      if (!buffer->open(name, std::ios::out)) {
+        WARN("Cannot open " << name << ", the results are not saved");
+        return;
+      }
+      buffers.emplace_back(std::move(buffer));
+    }
+    streams.emplace_back(new std::ostream(buffers.back().get()));
+    files.push_back(streams.back().get());
+  }
+
+  batch.format(files);
+}
+
+// vim: set ts=2 sw=2 et :
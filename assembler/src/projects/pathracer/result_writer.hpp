@@ -0,0 +1,67 @@
+//***************************************************************************
+//* Copyright (c) 2019 Saint Petersburg State University
+//* All Rights Reserved
+//* See file LICENSE for details.
+//***************************************************************************
+
+#pragma once
+
+#include <atomic>
+#include <functional>
+#include <memory>
+#include <ostream>
+#include <set>
+#include <string>
+#include <thread>
+#include <vector>
+
+template <typename T>
+class mpmc_bounded_queue;
+
+// Output stage of a run: the tasks push batches of results, the writer thread formats and writes them,
+// so the tasks are not stalled by formatting and I/O. A batch is a set of files written entirely by its
+// formatter, in the same format as before. With gzip the files get .gz suffix
+class ResultWriter {
+ public:
+  using Formatter = std::function<void(const std::vector<std::ostream *> &files)>;
+
+  explicit ResultWriter(bool gzip, size_t queue_size = 64);
+  ResultWriter(const ResultWriter &) = delete;
+  ResultWriter &operator=(const ResultWriter &) = delete;
+  // Writes all the pushed batches
+  ~ResultWriter();
+
+  std::string filename(const std::string &name) const { return gzip_ ? name + ".gz" : name; }
+
+  // Thread-safe, waits while the queue is full. The formatter runs in the writer thread, so it must not
+  // refer to the state of the caller. Filenames are given without .gz
+  void push(std::vector<std::string> filenames, Formatter format);
+
+  // Waits until all the batches pushed so far (by any thread) are written
+  void flush() const { wait(pushed()); }
+
+  // The number of the batches pushed so far, a ticket for wait()
+  size_t pushed() const { return pushed_; }
+  // Waits until the batches numbered below the ticket are written
+  void wait(size_t ticket) const;
+
+ private:
+  struct Batch {
+    size_t ticket = 0;
+    std::vector<std::string> filenames;
+    Formatter format;
+  };
+
+  void run();
+  void write(const Batch &batch) const;
+
+  bool gzip_;
+  std::unique_ptr<mpmc_bounded_queue<Batch>> queue_;
+  // Batches are numbered when pushed, they could be enqueued in a slightly different order
+  std::atomic<size_t> pushed_{0};
+  std::atomic<size_t> written_{0};  // all the batches numbered below are written
+  std::set<size_t> written_ahead_;
+  std::thread thread_;
+};
+
+// vim: set ts=2 sw=2 et :
@@ -5,6 +5,8 @@
 //***************************************************************************
 
 #pragma once
+#include "cursor_adjacency.hpp"
+
 #include <vector>
 
 template <class GraphCursor>
@@ -32,6 +34,20 @@ public:
         auto result = GraphCursor::next(context);
         return std::vector<ReversedGraphCursor>(std::cbegin(result), std::cend(result));
     }
+
+    // Should be defined here, otherwise the members of GraphCursor would be used going the wrong way
+    template <typename F>
+    void for_each_next(typename GraphCursor::Context context, F &&f) const {
+        ::for_each_prev(base(), context, [&f](const GraphCursor &cursor) { f(ReversedGraphCursor(cursor)); });
+    }
+
+    template <typename F>
+    void for_each_prev(typename GraphCursor::Context context, F &&f) const {
+        ::for_each_next(base(), context, [&f](const GraphCursor &cursor) { f(ReversedGraphCursor(cursor)); });
+    }
+
+private:
+    const GraphCursor &base() const { return *this; }
 };
 
 namespace std {
@@ -0,0 +1,513 @@
+//***************************************************************************
+//* Copyright (c) 2019 Saint Petersburg State University
+//* All Rights Reserved
+//* See file LICENSE for details.
+//***************************************************************************
+
+#pragma once
+
+#include "common/utils/verify.hpp"
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <limits>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+// Ancestor list of an object of a SlabArena, a block of its edge pool. Most of the objects have the only ancestor,
+// a block of capacity one keeps it inline in begin and its score is the best score the owner keeps anyway.
+// Objects keep the block as their field, so it is defined before the arena, which needs complete objects
+struct SlabBlock {
+  uint32_t begin = 0;
+  uint32_t size = 0;
+  uint32_t capacity = 0;
+};
+
+// Event graph storage of one search. Objects of type T live in 1 MiB slabs and are addressed by 32-bit indices.
+// Their ancestor lists are blocks of a CSR-style edge pool, which keeps ancestor indices and scores in separate
+// arrays, so a narrower Score shrinks the pool.
+// Objects are not refcounted. collect() frees the objects unreachable from the given roots: the young generation
+// (objects created since the previous collection) on every call, the whole graph only when it has doubled, so
+// a collection costs about as much as the allocations before it. The edge pool is compacted by the full
+// collections. The arena and all its objects are released in one step when its last owner is gone.
+// Objects are created in the arena of the Scope of the calling thread. Each task of a search opens its own
+// Scope over the arena of the search, so tasks allocate concurrently. Collections run when no task is active
+template <typename T, typename Score>
+class SlabArena : public std::enable_shared_from_this<SlabArena<T, Score>> {
+ public:
+  using Index = uint32_t;
+
+  using Block = SlabBlock;
+
+  // Allocation context of the calling thread. The first scope of a search creates the arena,
+  // tasks helping the search open their scopes over it
+  class Scope {
+   public:
+    Scope() : Scope(std::shared_ptr<SlabArena>(new SlabArena())) {}
+
+    explicit Scope(std::shared_ptr<SlabArena> arena) : arena_{std::move(arena)}, prev_{current_} {
+      current_ = this;
+      std::lock_guard<std::mutex> lock(arena_->mutex_);
+      ++arena_->scopes_;
+    }
+    Scope(const Scope &) = delete;
+    Scope &operator=(const Scope &) = delete;
+
+    ~Scope() {
+      current_ = prev_;
+      std::lock_guard<std::mutex> lock(arena_->mutex_);
+      flush();
+      --arena_->scopes_;
+    }
+
+    // Scope of the calling thread, nullptr if there is none
+    static Scope *current() { return current_; }
+
+    SlabArena &arena() const { return *arena_; }
+    const std::shared_ptr<SlabArena> &arena_ptr() const { return arena_; }
+
+    // Frees the objects unreachable from the roots: roots(visit) should call visit(const T *) for all
+    // the objects in use. Other scopes of the arena should be closed
+    template <typename Roots>
+    void collect(Roots &&roots) {
+      std::lock_guard<std::mutex> lock(arena_->mutex_);
+      VERIFY_MSG(arena_->scopes_ == 1, "Event graph is collected while other tasks allocate in it");
+      flush();
+      edges_ = edges_end_ = 0;
+      arena_->collect(std::forward<Roots>(roots));
+    }
+
+   private:
+    friend class SlabArena;
+
+    std::shared_ptr<SlabArena> arena_;
+    Scope *prev_;
+    std::vector<Index> slots_;  // free slots claimed from the arena
+    std::vector<Index> young_;  // objects created in the scope
+    std::vector<std::pair<Index, Index>> remembered_;  // old objects got new ancestors from this position
+    Index edges_ = 0, edges_end_ = 0;  // unused part of the claimed edge chunk
+
+    Index new_slot() {
+      if (slots_.empty()) {
+        std::lock_guard<std::mutex> lock(arena_->mutex_);
+        arena_->claim_slots(slots_);
+      }
+      Index i = slots_.back();
+      slots_.pop_back();
+      arena_->flags(i) = 0;
+      young_.push_back(i);
+      return i;
+    }
+
+    Index new_block(Index capacity) {
+      if (capacity > SMALL_BLOCK) {
+        std::lock_guard<std::mutex> lock(arena_->mutex_);
+        return arena_->new_run(capacity);
+      }
+      if (edges_end_ - edges_ < capacity) {
+        std::lock_guard<std::mutex> lock(arena_->mutex_);
+        edges_ = arena_->new_run(CHUNK_EDGES);
+        edges_end_ = edges_ + Index(CHUNK_EDGES);
+      }
+      Index begin = edges_;
+      edges_ += capacity;
+      return begin;
+    }
+
+    // Should be called under the arena mutex
+    void flush() {
+      arena_->free_.insert(arena_->free_.end(), slots_.cbegin(), slots_.cend());
+      arena_->young_.insert(arena_->young_.end(), young_.cbegin(), young_.cend());
+      arena_->remembered_.insert(arena_->remembered_.end(), remembered_.cbegin(), remembered_.cend());
+      slots_.clear();
+      young_.clear();
+      remembered_.clear();
+      edges_ = edges_end_;
+    }
+  };
+
+  SlabArena(const SlabArena &) = delete;
+  SlabArena &operator=(const SlabArena &) = delete;
+
+  ~SlabArena() {
+    static_assert(std::is_trivially_destructible<T>::value, "Objects are released without destruction");
+    for (auto &dir : slabs_) {
+      if (!dir) continue;
+      for (size_t i = 0; i < DIR_SIZE; ++i) {
+        std::free(dir[i]);
+      }
+    }
+    for (const auto &run : runs_) {
+      release_run(run.first);
+    }
+  }
+
+  // Memory for a new object in the arena of the calling thread
+  static void *allocate() {
+    Scope *scope = Scope::current();
+    VERIFY_MSG(scope, "Event graph object is created outside of a search");
+    return scope->arena_->object(scope->new_slot());
+  }
+
+  // Arena of an object
+  static SlabArena &of(const T *p) { return *header(p)->arena; }
+
+  Index index(const T *p) const {
+    const SlabHeader *h = header(p);
+    return h->first + Index(p - objects(h));
+  }
+
+  T *object(Index i) const {
+    return objects(slab(i)) + (i & SLOT_MASK);
+  }
+
+  // Ancestors and their scores, single is the score of the inline ancestor (see SlabBlock)
+  const Index *ancestors(const Block &block) const {
+    return block.capacity > 1 ? chunk(block.begin).ancestors + block.begin % CHUNK_EDGES : &block.begin;
+  }
+  Index *ancestors(Block &block) {
+    return block.capacity > 1 ? chunk(block.begin).ancestors + block.begin % CHUNK_EDGES : &block.begin;
+  }
+  const Score *scores(const Block &block, const Score &single) const {
+    return block.capacity > 1 ? chunk(block.begin).scores + block.begin % CHUNK_EDGES : &single;
+  }
+  Score *scores(Block &block, Score &single) {
+    return block.capacity > 1 ? chunk(block.begin).scores + block.begin % CHUNK_EDGES : &single;
+  }
+
+  // Appends an ancestor to the block of the owner, a full block is moved into a twice larger one.
+  // The score of the first ancestor is not stored, the owner should keep it as single
+  void push_back(const T *owner, Block &block, const Score &single, Index ancestor, Score score) {
+    Scope *scope = Scope::current();
+    VERIFY_MSG(scope && scope->arena_.get() == this, "Event graph object is updated outside of its search");
+    if (block.capacity == 0) {
+      block.begin = ancestor;
+      block.size = block.capacity = 1;
+      remember(scope, owner, 0);
+      return;
+    }
+    if (block.size == block.capacity) {
+      Block grown;
+      grown.capacity = 2 * block.capacity;
+      grown.begin = scope->new_block(grown.capacity);
+      grown.size = block.size;
+      std::copy_n(ancestors(block), block.size, ancestors(grown));
+      std::copy_n(scores(block, single), block.size, scores(grown, score));
+      block = grown;
+    }
+
+    remember(scope, owner, block.size);
+    ancestors(block)[block.size] = ancestor;
+    scores(block, score)[block.size] = score;
+    ++block.size;
+  }
+
+
+  // Should be called after the ancestors of the owner were reordered or removed in place
+  void rewritten(const T *owner) {
+    uint8_t &f = flags(owner);
+    if (f & REMEMBERED) {
+      f |= REWRITTEN;
+    }
+  }
+
+  size_t size() const { return live_; }
+  // Object indices are less than it
+  size_t slots() const { return slab_count_ << SLOT_BITS; }
+  size_t collections() const { return minor_collections_ + major_collections_; }
+  size_t allocated_bytes() const {
+    return slab_count_ * SLAB_BYTES + edges_ * (sizeof(Index) + sizeof(Score));
+  }
+
+ private:
+  struct SlabHeader {
+    SlabArena *arena;
+    Index first;
+  };
+
+  struct Chunk {
+    Index *ancestors = nullptr;
+    Score *scores = nullptr;
+  };
+
+  enum : uint8_t { FREE = 1, OLD = 2, MARK = 4, REMEMBERED = 8, REWRITTEN = 16 };
+
+  // Slab: header, objects, their flags
+  static constexpr size_t SLAB_BYTES = size_t(1) << 20;
+  static constexpr size_t HEADER_BYTES = 64;
+  static constexpr size_t SLOTS = (SLAB_BYTES - HEADER_BYTES) / (sizeof(T) + 1);
+  // Indices are (slab, slot) pairs, so an object is found with shifts rather than divisions
+  static constexpr unsigned bits(size_t n) { return n ? 1 + bits(n >> 1) : 0; }
+  static constexpr unsigned SLOT_BITS = bits(SLOTS - 1);
+  static constexpr Index SLOT_MASK = Index((size_t(1) << SLOT_BITS) - 1);
+  static constexpr size_t MAX_SLABS = (size_t(1) << 32) >> SLOT_BITS;
+  static constexpr size_t CHUNK_EDGES = size_t(1) << 16;
+  static constexpr size_t MAX_CHUNKS = (size_t(1) << 32) / CHUNK_EDGES;
+  static constexpr Index SMALL_BLOCK = Index(CHUNK_EDGES / 8);
+  // Tables of slabs and chunks are two-level, so their entries never move while other threads read them
+  static constexpr size_t DIR_SIZE = 1024;
+  static constexpr size_t SLAB_DIRS = (MAX_SLABS + DIR_SIZE - 1) / DIR_SIZE;
+  static constexpr size_t CHUNK_DIRS = MAX_CHUNKS / DIR_SIZE;
+  static constexpr size_t CLAIM_SLOTS = 256;
+  static constexpr size_t YOUNG_MIN = size_t(1) << 16;
+  static constexpr size_t OLD_MIN = size_t(1) << 16;
+  static constexpr size_t EDGES_MIN = size_t(1) << 18;
+  static_assert(HEADER_BYTES >= sizeof(SlabHeader) && HEADER_BYTES % alignof(T) == 0, "Invalid slab header size");
+
+  static thread_local Scope *current_;
+
+  std::mutex mutex_;
+  size_t scopes_ = 0;
+
+  std::unique_ptr<char *[]> slabs_[SLAB_DIRS];
+  size_t slab_count_ = 0;
+  size_t fresh_ = 0;  // the first slot never used
+  std::vector<Index> free_;
+
+  std::unique_ptr<Chunk[]> chunks_[CHUNK_DIRS];
+  std::vector<std::pair<Index, Index>> runs_;  // first chunk and length of the edge chunk runs in use
+  std::vector<Index> free_chunks_;
+  Index chunk_count_ = 0;
+
+  std::vector<Index> young_;
+  std::vector<std::pair<Index, Index>> remembered_;
+  size_t live_ = 0;
+  size_t old_ = 0, old_after_major_ = 0;
+  size_t edges_ = 0, edges_after_major_ = 0;
+  size_t minor_collections_ = 0, major_collections_ = 0;
+
+  SlabArena() = default;
+
+  static SlabHeader *header(const T *p) {
+    return reinterpret_cast<SlabHeader *>(reinterpret_cast<uintptr_t>(p) & ~uintptr_t(SLAB_BYTES - 1));
+  }
+  static T *objects(const SlabHeader *h) {
+    return reinterpret_cast<T *>(reinterpret_cast<char *>(const_cast<SlabHeader *>(h)) + HEADER_BYTES);
+  }
+  static uint8_t *slab_flags(const SlabHeader *h) {
+    return reinterpret_cast<uint8_t *>(objects(h) + SLOTS);
+  }
+
+  // Write barrier: old objects getting young ancestors are remembered with the number of their old ancestors
+  void remember(Scope *scope, const T *owner, Index from) {
+    uint8_t &f = flags(owner);
+    if ((f & (OLD | REMEMBERED)) == OLD) {
+      f |= REMEMBERED;
+      scope->remembered_.emplace_back(index(owner), from);
+    }
+  }
+
+  SlabHeader *slab(Index i) const {
+    const size_t n = i >> SLOT_BITS;
+    return reinterpret_cast<SlabHeader *>(slabs_[n / DIR_SIZE][n % DIR_SIZE]);
+  }
+
+  static size_t next_slot(size_t i) {
+    return (++i & SLOT_MASK) == SLOTS ? (i | SLOT_MASK) + 1 : i;
+  }
+
+  uint8_t &flags(Index i) const {
+    return slab_flags(slab(i))[i & SLOT_MASK];
+  }
+  uint8_t &flags(const T *p) const {
+    const SlabHeader *h = header(p);
+    return slab_flags(h)[p - objects(h)];
+  }
+
+  Chunk &chunk(Index begin) const { return chunks_[begin / CHUNK_EDGES / DIR_SIZE][begin / CHUNK_EDGES % DIR_SIZE]; }
+
+  // Should be called under the mutex
+  void claim_slots(std::vector<Index> &slots) {
+    size_t n = std::min(free_.size(), CLAIM_SLOTS);
+    slots.assign(free_.end() - n, free_.end());
+    free_.resize(free_.size() - n);
+    for (; slots.size() < CLAIM_SLOTS; fresh_ = next_slot(fresh_)) {
+      if ((fresh_ & SLOT_MASK) == 0) {
+        add_slab();
+      }
+      flags(Index(fresh_)) = FREE;
+      slots.push_back(Index(fresh_));
+    }
+  }
+
+  void add_slab() {
+    VERIFY_MSG(slab_count_ < MAX_SLABS, "Event graph is too large");
+    void *memory = nullptr;
+    if (posix_memalign(&memory, SLAB_BYTES, SLAB_BYTES) != 0) {
+      throw std::bad_alloc();
+    }
+    auto *h = static_cast<SlabHeader *>(memory);
+    h->arena = this;
+    h->first = Index(slab_count_ << SLOT_BITS);
+    auto &dir = slabs_[slab_count_ / DIR_SIZE];
+    if (!dir) {
+      dir.reset(new char *[DIR_SIZE]());
+    }
+    dir[slab_count_ % DIR_SIZE] = static_cast<char *>(memory);
+    ++slab_count_;
+  }
+
+  // A run of chunks holding a block of the given capacity, should be called under the mutex
+  Index new_run(size_t capacity) {
+    const Index length = Index((capacity + CHUNK_EDGES - 1) / CHUNK_EDGES);
+    Index first;
+    if (length == 1 && !free_chunks_.empty()) {
+      first = free_chunks_.back();
+      free_chunks_.pop_back();
+    } else {
+      VERIFY_MSG(chunk_count_ + length <= MAX_CHUNKS, "Event graph edge pool is too large");
+      first = chunk_count_;
+      chunk_count_ += length;
+    }
+
+    auto &dir = chunks_[first / DIR_SIZE];
+    if (!dir) {
+      dir.reset(new Chunk[DIR_SIZE]);
+    }
+    Chunk &c = dir[first % DIR_SIZE];
+    c.ancestors = new Index[length * CHUNK_EDGES];
+    c.scores = new Score[length * CHUNK_EDGES];
+    runs_.emplace_back(first, length);
+    edges_ += length * CHUNK_EDGES;
+    return Index(first * CHUNK_EDGES);
+  }
+
+  void release_run(Index first) {
+    Chunk &c = chunks_[first / DIR_SIZE][first % DIR_SIZE];
+    delete[] c.ancestors;
+    delete[] c.scores;
+    c = Chunk();
+  }
+
+  // Should be called under the mutex with all the scopes flushed
+  template <typename Roots>
+  void collect(Roots &&roots) {
+    const bool major = old_ > 2 * std::max(old_after_major_, OLD_MIN) ||
+                       edges_ > 2 * std::max(edges_after_major_, EDGES_MIN);
+    if (!major && young_.size() < YOUNG_MIN) {
+      return;
+    }
+
+    // Minor collections do not enter the old generation: old objects refer to young ones only if they got
+    // ancestors after they had been promoted, and those are remembered
+    std::vector<Index> stack;
+    auto visit = [&](Index i) {
+      uint8_t &f = flags(i);
+      if ((f & MARK) || (!major && (f & OLD))) return;
+      f |= MARK;
+      stack.push_back(i);
+    };
+    auto mark = [&]() {
+      while (!stack.empty()) {
+        const Block &block = object(stack.back())->block_;
+        stack.pop_back();
+        const Index *a = ancestors(block);
+        for (Index j = 0; j < block.size; ++j) {
+          visit(a[j]);
+        }
+      }
+    };
+    roots([&](const T *p) {
+      if (p) {
+        visit(index(p));
+        mark();
+      }
+    });
+    if (!major) {
+      for (const auto &r : remembered_) {
+        const Block &block = object(r.first)->block_;
+        const Index *a = ancestors(block);
+        for (Index j = (flags(r.first) & REWRITTEN) ? 0 : std::min(r.second, block.size); j < block.size; ++j) {
+          visit(a[j]);
+        }
+        mark();
+      }
+    }
+    for (const auto &r : remembered_) {
+      flags(r.first) &= uint8_t(~(REMEMBERED | REWRITTEN));
+    }
+    remembered_.clear();
+
+    auto release = [&](Index i) {
+      uint8_t &f = flags(i);
+      if (f & MARK) {
+        f = OLD;
+        return true;
+      }
+      f = FREE;
+      free_.push_back(i);
+      return false;
+    };
+
+    if (!major) {
+      for (Index i : young_) {
+        old_ += release(i);
+      }
+      young_.clear();
+      live_ = old_;
+      ++minor_collections_;
+      return;
+    }
+
+    young_.clear();
+    old_ = 0;
+    for (size_t i = 0; i < fresh_; i = next_slot(i)) {
+      if (!(flags(Index(i)) & FREE)) {
+        old_ += release(Index(i));
+      }
+    }
+    compact();
+    live_ = old_after_major_ = old_;
+    edges_after_major_ = edges_;
+    ++major_collections_;
+  }
+
+  // Moves the blocks of all the objects into new chunks and releases the old ones at once
+  void compact() {
+    std::vector<std::pair<Index, Index>> retired;
+    retired.swap(runs_);
+    edges_ = 0;
+    Index begin = 0, end = 0;
+    Score none{};  // blocks of more than one ancestor keep all the scores
+    for (size_t i = 0; i < fresh_; i = next_slot(i)) {
+      if (flags(Index(i)) & FREE) continue;
+      Block &block = object(Index(i))->block_;
+      Block moved;
+      moved.size = moved.capacity = block.size;
+      if (block.size == 1) {
+        moved.begin = ancestors(block)[0];
+      } else if (block.size > SMALL_BLOCK) {
+        moved.begin = new_run(block.size);
+      } else if (block.size) {
+        if (end - begin < block.size) {
+          begin = new_run(CHUNK_EDGES);
+          end = begin + Index(CHUNK_EDGES);
+        }
+        moved.begin = begin;
+        begin += block.size;
+      }
+      if (block.size > 1) {
+        std::copy_n(ancestors(block), block.size, ancestors(moved));
+        std::copy_n(scores(block, none), block.size, scores(moved, none));
+      }
+      block = moved;
+    }
+    for (const auto &run : retired) {
+      release_run(run.first);
+      for (Index c = run.first; c < run.first + run.second; ++c) {
+        free_chunks_.push_back(c);
+      }
+    }
+  }
+};
+
+template <typename T, typename Score>
+thread_local typename SlabArena<T, Score>::Scope *SlabArena<T, Score>::current_ = nullptr;
+
+// vim: set ts=2 sw=2 et :
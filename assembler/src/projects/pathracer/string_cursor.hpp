@@ -45,6 +45,20 @@ public:
         }
     }
 
+    template <typename F>
+    void for_each_prev(Context, F &&f) const {
+        if (pos_ != 0) {
+            f(StringCursor(pos_ - 1));
+        }
+    }
+
+    template <typename F>
+    void for_each_next(Context context, F &&f) const {
+        if (pos_ != context->length() - 1) {
+            f(StringCursor(pos_ + 1));
+        }
+    }
+
     size_t position() const { return pos_; }
 
 private:
@@ -3,6 +3,24 @@
 #include "hmmpath.hpp"
 
 #include "cursor_utils.hpp"
+#include "cursor_set.hpp"
+#include "component_contexts.hpp"
+#include "cursor_index.hpp"
+#include "debruijn_graph_cursor.hpp"
+#include "graph_cache.hpp"
+#include "edge_neighborhood.hpp"
+
+#include "io/graph/gfa_reader.hpp"
+#include "utils/filesystem/temporary.hpp"
+
+#include <fcntl.h>
+#include <sys/stat.h>
+
+#include <algorithm>
+#include <fstream>
+#include <queue>
+#include <random>
+#include <unordered_set>
 
 TEST(ChechIsolatedLoopDetection, cursor_utils_hpp) {
     size_t n = 1000, k = 21;
@@ -11,3 +29,365 @@ TEST(ChechIsolatedLoopDetection, cursor_utils_hpp) {
     auto vcursors = vertex_cursors(graph.all(), nullptr);
     EXPECT_EQ(vcursors.size(), 1);
 }
+
+TEST(UnbranchedRuns, cursor_utils_hpp) {
+    size_t k = 5;
+    std::vector<std::string> strings = {"AAAAACGTACGTAAAAA", "AAAAATTTGGGACC", "AAAAAGGGGG"};
+    auto graph = DBGraph(k, strings);
+    auto cursors = graph.all();
+    auto vcursors = vertex_cursors(cursors, nullptr);
+    hmm::DigitalCodind code;
+    UnbranchedRuns<DBGraph::GraphCursor> runs(vcursors, nullptr, code);
+
+    size_t total = 0;
+    for (uint32_t run = 0; run < runs.size(); ++run) {
+        EXPECT_TRUE(vcursors.count(runs.source(run)));
+        EXPECT_TRUE(vcursors.count(runs.end(run)));
+        auto cursor = runs.source(run);
+        for (uint32_t offset = 0; offset < runs.length(run); ++offset) {
+            auto next = runs.cursor(run, offset);
+            EXPECT_FALSE(vcursors.count(next));
+            auto nexts = cursor.next(nullptr);
+            EXPECT_TRUE(std::find(nexts.begin(), nexts.end(), next) != nexts.end());
+            EXPECT_EQ(runs.code(run, offset), code(next.letter(nullptr)));
+            auto position = runs.position(next);
+            EXPECT_EQ(position.run, run);
+            EXPECT_EQ(position.offset, offset);
+            cursor = next;
+        }
+        total += runs.length(run);
+    }
+    EXPECT_EQ(total + vcursors.size(), cursors.size());
+}
+
+TEST(CursorSet, cursor_set_hpp) {
+    std::mt19937 rng(42);
+    std::vector<DebruijnGraphCursor> cursors;
+    // Full intervals, sparse edges and repeated cursors
+    for (uint64_t id = 1; id <= 50; ++id) {
+        size_t first = rng() % 100, len = 1 + rng() % 300;
+        for (size_t pos = first; pos < first + len; ++pos) {
+            if (id % 2 || rng() % 3) {
+                cursors.emplace_back(debruijn_graph::EdgeId(id), pos);
+            }
+        }
+        for (size_t i = 0; i < 10; ++i) {
+            cursors.push_back(cursors[rng() % cursors.size()]);
+        }
+    }
+    std::shuffle(cursors.begin(), cursors.end(), rng);
+
+    std::unordered_set<DebruijnGraphCursor> expected(cursors.cbegin(), cursors.cend());
+    CursorSet<DebruijnGraphCursor> set(cursors.cbegin(), cursors.cend());
+    EXPECT_EQ(set.size(), expected.size());
+    for (uint64_t id = 1; id <= 60; ++id) {
+        for (size_t pos = 0; pos < 500; ++pos) {
+            DebruijnGraphCursor cursor(debruijn_graph::EdgeId(id), pos);
+            EXPECT_EQ(set.count(cursor), expected.count(cursor));
+        }
+    }
+}
+
+TEST(ParallelGFAReader, gfa_reader_hpp) {
+    // Several batches with links before the segments, self-conjugate segments, CRLF lines and paths
+    std::mt19937 rng(42);
+    auto random_seq = [&rng](size_t len) {
+        std::string s;
+        for (size_t i = 0; i < len; ++i) s += "ACGT"[rng() % 4];
+        return s;
+    };
+    const size_t n = 20000;
+    auto workdir = fs::tmp::make_temp_dir("/tmp", "gfa");
+    const std::string filename = workdir->dir() + "/graph.gfa";
+    {
+        std::ofstream gfa(filename);
+        for (size_t i = 0; i < 2 * n; ++i) {
+            gfa << "L\t" << rng() % n << "\t" << "+-"[rng() % 2] << "\t" << rng() % n << "\t" << "+-"[rng() % 2] << "\t5M"
+                << (i % 7 ? "\n" : "\r\n");
+            if (i % 2) continue;
+            size_t id = i / 2;
+            std::string seq = random_seq(20 + rng() % 60);
+            if (id % 100 == 0) seq += (!Sequence(seq)).str();
+            gfa << "S\t" << id << "\t" << seq << "\tKC:i:" << id << "\n";
+        }
+        for (size_t i = 0; i < 10; ++i) {
+            gfa << "P\tpath" << i << "\t" << i << "+," << i + 1 << "-," << i * 100 << "+\t*\n";
+        }
+    }
+
+    debruijn_graph::ConjugateDeBruijnGraph graph(5), parallel_graph(5);
+    io::IdMapper<std::string> id_mapper, parallel_id_mapper;
+    gfa::GFAReader gfa(filename), parallel_gfa;
+    gfa.to_graph(graph, &id_mapper);
+    // Small chunks, so the file takes several batches
+    ASSERT_TRUE(parallel_gfa.read_graph(filename, parallel_graph, &parallel_id_mapper, 4, 1 << 16));
+    EXPECT_EQ(gfa.num_edges(), parallel_gfa.num_edges());
+    EXPECT_EQ(gfa.num_links(), parallel_gfa.num_links());
+
+    EXPECT_EQ(graph.size(), parallel_graph.size());
+    EXPECT_EQ(graph.e_size(), parallel_graph.e_size());
+    for (auto it = graph.ConstEdgeBegin(); !it.IsEnd(); ++it) {
+        auto e = *it;
+        ASSERT_TRUE(parallel_graph.contains(e));
+        EXPECT_EQ(graph.EdgeNucls(e), parallel_graph.EdgeNucls(e));
+        EXPECT_EQ(graph.conjugate(e), parallel_graph.conjugate(e));
+        EXPECT_EQ(graph.EdgeStart(e), parallel_graph.EdgeStart(e));
+        EXPECT_EQ(graph.EdgeEnd(e), parallel_graph.EdgeEnd(e));
+        EXPECT_EQ(graph.coverage_index().RawCoverage(e), parallel_graph.coverage_index().RawCoverage(e));
+        EXPECT_EQ(id_mapper[e.int_id()], parallel_id_mapper[e.int_id()]);
+    }
+    ASSERT_EQ(gfa.num_paths(), parallel_gfa.num_paths());
+    for (size_t i = 0; i < gfa.num_paths(); ++i) {
+        EXPECT_EQ(gfa.path_begin()[i].name, parallel_gfa.path_begin()[i].name);
+        EXPECT_EQ(gfa.path_begin()[i].edges, parallel_gfa.path_begin()[i].edges);
+    }
+}
+
+TEST(GraphCache, graph_cache_hpp) {
+    // Long segments, so sequences span several words, and self-conjugate ones. The file takes a few MB,
+    // so its middle is far from both ends
+    std::mt19937 rng(42);
+    const size_t n = 30000, k = 5;
+    auto workdir = fs::tmp::make_temp_dir("/tmp", "cache");
+    const std::string gfa_filename = workdir->dir() + "/graph.gfa", cache_dir = workdir->dir() + "/cache";
+    {
+        std::ofstream gfa(gfa_filename);
+        for (size_t id = 0; id < n; ++id) {
+            std::string seq;
+            for (size_t i = 0, len = 6 + rng() % 100; i < len; ++i) seq += "ACGT"[rng() % 4];
+            if (id % 500 == 0) seq += (!Sequence(seq)).str();
+            gfa << "S\t" << id << "\t" << seq << "\tKC:i:" << id << "\n";
+        }
+        for (size_t i = 0; i < 2 * n; ++i) {
+            gfa << "L\t" << rng() % n << "\t" << "+-"[rng() % 2] << "\t" << rng() % n << "\t" << "+-"[rng() % 2] << "\t5M\n";
+        }
+    }
+
+    debruijn_graph::ConjugateDeBruijnGraph graph(k);
+    io::IdMapper<std::string> id_mapper;
+    gfa::GFAReader(gfa_filename).to_graph(graph, &id_mapper);
+    std::vector<std::vector<debruijn_graph::EdgeId>> paths = {{*graph.ConstEdgeBegin()}};
+
+    debruijn_graph::ConjugateDeBruijnGraph loaded(k);
+    io::IdMapper<std::string> loaded_id_mapper;
+    std::vector<std::vector<debruijn_graph::EdgeId>> loaded_paths;
+    EXPECT_FALSE(GraphCache::Load(cache_dir, gfa_filename, loaded, loaded_paths, &loaded_id_mapper));
+    ASSERT_TRUE(GraphCache::Save(cache_dir, gfa_filename, graph, paths, &id_mapper));
+    ASSERT_TRUE(GraphCache::Load(cache_dir, gfa_filename, loaded, loaded_paths, &loaded_id_mapper));
+
+    EXPECT_EQ(loaded.size(), graph.size());
+    EXPECT_EQ(loaded.e_size(), graph.e_size());
+    for (auto it = graph.ConstEdgeBegin(); !it.IsEnd(); ++it) {
+        auto e = *it;
+        ASSERT_TRUE(loaded.contains(e));
+        EXPECT_EQ(loaded.EdgeNucls(e), graph.EdgeNucls(e));
+        EXPECT_EQ(loaded.conjugate(e), graph.conjugate(e));
+        EXPECT_EQ(loaded.EdgeStart(e), graph.EdgeStart(e));
+        EXPECT_EQ(loaded.EdgeEnd(e), graph.EdgeEnd(e));
+        EXPECT_EQ(loaded.coverage_index().RawCoverage(e), graph.coverage_index().RawCoverage(e));
+        EXPECT_EQ(loaded_id_mapper[e.int_id()], id_mapper[e.int_id()]);
+    }
+    EXPECT_EQ(loaded_paths, paths);
+
+    // A change in the middle of the file keeping its size and modification time is caught by the hash
+    struct stat st;
+    ASSERT_EQ(stat(gfa_filename.c_str(), &st), 0);
+    ASSERT_GT(st.st_size, 3 << 20);
+    {
+        std::fstream gfa(gfa_filename, std::ios::in | std::ios::out);
+        gfa.seekp(st.st_size / 2);
+        gfa.put('#');
+    }
+    const timespec times[2] = {st.st_atim, st.st_mtim};
+    ASSERT_EQ(utimensat(AT_FDCWD, gfa_filename.c_str(), times, 0), 0);
+    debruijn_graph::ConjugateDeBruijnGraph outdated(k);
+    EXPECT_FALSE(GraphCache::Load(cache_dir, gfa_filename, outdated, loaded_paths, nullptr));
+    EXPECT_EQ(outdated.size(), 0);
+}
+
+TEST(CursorIndex, cursor_index_hpp) {
+    // Random segments with random links, so cursors branch and codons cross edges
+    std::mt19937 rng(42);
+    const size_t n = 300, k = 5;
+    auto workdir = fs::tmp::make_temp_dir("/tmp", "idx");
+    const std::string gfa_filename = workdir->dir() + "/graph.gfa", filename = workdir->dir() + "/graph.idx";
+    {
+        std::ofstream gfa(gfa_filename);
+        for (size_t id = 0; id < n; ++id) {
+            std::string seq;
+            for (size_t i = 0, len = 6 + rng() % 30; i < len; ++i) seq += "ACGT"[rng() % 4];
+            gfa << "S\t" << id << "\t" << seq << "\n";
+        }
+        for (size_t i = 0; i < 2 * n; ++i) {
+            gfa << "L\t" << rng() % n << "\t" << "+-"[rng() % 2] << "\t" << rng() % n << "\t" << "+-"[rng() % 2] << "\t5M\n";
+        }
+    }
+    debruijn_graph::ConjugateDeBruijnGraph graph(k);
+    io::IdMapper<std::string> id_mapper;
+    gfa::GFAReader(gfa_filename).to_graph(graph, &id_mapper);
+    CursorIndex::Build(graph, filename, gfa_filename);
+    CursorIndex same_source(filename, graph, gfa_filename);
+    // The graph of a changed file is checked by the fingerprint
+    std::ofstream(gfa_filename, std::ios::app) << "\n";
+    CursorIndex index(filename, graph, gfa_filename);
+    EXPECT_EQ(index.size(), same_source.size());
+
+    auto edge_cursors = [&](size_t skip) {
+        std::vector<DebruijnGraphCursor> cursors;
+        std::unordered_set<DebruijnGraphCursor> seen;
+        for (auto it = graph.ConstEdgeBegin(); !it.IsEnd(); ++it) {
+            if (skip && (*it).int_id() % skip == 0) continue;
+            for (size_t pos = 0; pos < graph.length(*it) + k; ++pos) {
+                for (const auto &cursor : DebruijnGraphCursor::get_cursors(graph, *it, pos)) {
+                    if (seen.insert(cursor).second) cursors.push_back(cursor);
+                }
+            }
+        }
+        return cursors;
+    };
+
+    auto expect_equal = [](const CachedCursorContext &actual, const CachedCursorContext &expected) {
+        ASSERT_EQ(actual.size(), expected.size());
+        for (const auto &cursor : expected.Cursors()) {
+            EXPECT_EQ(cursor.letter(&actual), cursor.letter(&expected));
+            EXPECT_EQ(actual.position(cursor.index()), expected.position(cursor.index()));
+            auto actual_next = cursor.next(&actual), expected_next = cursor.next(&expected);
+            EXPECT_TRUE(std::equal(actual_next.begin(), actual_next.end(), expected_next.begin(), expected_next.end()));
+            auto actual_prev = cursor.prev(&actual), expected_prev = cursor.prev(&expected);
+            EXPECT_TRUE(std::equal(actual_prev.begin(), actual_prev.end(), expected_prev.begin(), expected_prev.end()));
+        }
+    };
+
+    // The whole graph is carved the way its cursors are cached
+    auto all = edge_cursors(0);
+    auto graph_context = index.Context(all);
+    ASSERT_TRUE(graph_context);
+    expect_equal(*graph_context, CachedCursorContext(all, &graph));
+
+    // Codons read from the index are the ones the context derives. The component is a part of the edges,
+    // so some of the codons leave it
+    auto cursors = edge_cursors(3);
+    auto context = index.Context(cursors);
+    ASSERT_TRUE(context);
+    std::vector<AAGraphCursor<CachedCursor>> aa_cursors;
+    auto aa_context = index.AAContext(*context, cursors, aa_cursors);
+    auto expected_aa_cursors = make_aa_cursors(context->Cursors(), context.get());
+    EXPECT_FALSE(aa_cursors.empty());
+    EXPECT_EQ(aa_cursors, expected_aa_cursors);
+    expect_equal(*aa_context, CachedCursorContext(expected_aa_cursors, context.get()));
+}
+
+TEST(ComponentCache, component_contexts_hpp) {
+    const size_t k = 5;
+    auto workdir = fs::tmp::make_temp_dir("/tmp", "cache");
+    const std::string gfa_filename = workdir->dir() + "/graph.gfa";
+    std::ofstream(gfa_filename) << "S\t1\tACGTTGCAAC\nS\t2\tTGCAACGGA\nS\t3\tTGCAACTTAG\n"
+                                << "L\t1\t+\t2\t+\t5M\nL\t1\t+\t3\t+\t5M\n";
+    debruijn_graph::ConjugateDeBruijnGraph graph(k);
+    io::IdMapper<std::string> id_mapper;
+    gfa::GFAReader(gfa_filename).to_graph(graph, &id_mapper);
+
+    // The same component collected in two different orders
+    std::unordered_set<DebruijnGraphCursor> component;
+    for (auto it = graph.ConstEdgeBegin(); !it.IsEnd(); ++it) {
+        for (size_t pos = 0; pos < graph.length(*it) + k; ++pos) {
+            for (const auto &cursor : DebruijnGraphCursor::get_cursors(graph, *it, pos)) {
+                component.insert(cursor);
+            }
+        }
+    }
+    std::vector<DebruijnGraphCursor> cursors(component.cbegin(), component.cend());
+    std::vector<DebruijnGraphCursor> shuffled = cursors;
+    std::shuffle(shuffled.begin(), shuffled.end(), std::mt19937(42));
+    ASSERT_NE(cursors, shuffled);
+
+    ComponentCache cache(graph, nullptr);
+    cache.Register(cursors);
+    cache.Register(shuffled);
+    EXPECT_EQ(cache.size(), 1);
+    auto contexts = cache.Acquire(shuffled);
+    EXPECT_TRUE(std::is_sorted(contexts->cursors().cbegin(), contexts->cursors().cend()));
+    EXPECT_EQ(cache.Acquire(cursors), contexts);
+    EXPECT_EQ(cache.size(), 0);
+}
+
+// The cursor-by-cursor BFS neighborhood() used before edge_neighborhood(), see depth_subset_dirty_heap()
+// in cursor_neighborhood.hpp
+std::vector<DebruijnGraphCursor> bfs_neighborhood(const std::vector<std::pair<DebruijnGraphCursor, size_t>> &initial,
+                                                  DebruijnGraphCursor::Context context, bool forward) {
+    struct CursorWithDepth {
+        DebruijnGraphCursor cursor;
+        size_t depth;
+        bool operator<(const CursorWithDepth &other) const { return depth < other.depth; }
+    };
+    std::priority_queue<CursorWithDepth> q;
+    for (const auto &cursor_with_depth : initial) {
+        q.push({cursor_with_depth.first, cursor_with_depth.second});
+    }
+
+    std::unordered_set<DebruijnGraphCursor> visited;
+    while (!q.empty()) {
+        CursorWithDepth cursor_with_depth = q.top();
+        q.pop();
+        if (!visited.insert(cursor_with_depth.cursor).second || cursor_with_depth.depth == 0) {
+            continue;
+        }
+        auto push = [&](const DebruijnGraphCursor &cursor) {
+            if (!visited.count(cursor)) {
+                q.push({cursor, cursor_with_depth.depth - 1});
+            }
+        };
+        forward ? for_each_next(cursor_with_depth.cursor, context, push) : for_each_prev(cursor_with_depth.cursor, context, push);
+    }
+
+    return std::vector<DebruijnGraphCursor>(visited.cbegin(), visited.cend());
+}
+
+TEST(EdgeNeighborhood, edge_neighborhood_hpp) {
+    // Few short segments with many links, so the neighbourhoods go around cycles and self-loops
+    std::mt19937 rng(7);
+    const size_t n = 20, k = 5;
+    auto workdir = fs::tmp::make_temp_dir("/tmp", "nbhd");
+    const std::string gfa_filename = workdir->dir() + "/graph.gfa";
+    {
+        std::ofstream gfa(gfa_filename);
+        for (size_t id = 0; id < n; ++id) {
+            std::string seq;
+            for (size_t i = 0, len = 6 + rng() % 10; i < len; ++i) seq += "ACGT"[rng() % 4];
+            gfa << "S\t" << id << "\t" << seq << "\n";
+        }
+        gfa << "L\t0\t+\t0\t+\t5M\n";
+        for (size_t i = 0; i < 3 * n; ++i) {
+            gfa << "L\t" << rng() % n << "\t" << "+-"[rng() % 2] << "\t" << rng() % n << "\t" << "+-"[rng() % 2] << "\t5M\n";
+        }
+    }
+    debruijn_graph::ConjugateDeBruijnGraph graph(k);
+    io::IdMapper<std::string> id_mapper;
+    gfa::GFAReader(gfa_filename).to_graph(graph, &id_mapper);
+    std::vector<debruijn_graph::EdgeId> edges;
+    for (auto it = graph.ConstEdgeBegin(); !it.IsEnd(); ++it) {
+        edges.push_back(*it);
+    }
+
+    auto sorted = [](std::vector<DebruijnGraphCursor> cursors) {
+        std::sort(cursors.begin(), cursors.end());
+        return cursors;
+    };
+
+    for (size_t round = 0; round < 50; ++round) {
+        // Queries at the ends of edges as ConnCompsFromEdgesMatches() makes them, and inside of them
+        std::vector<std::pair<DebruijnGraphCursor, size_t>> initial;
+        for (size_t i = 0, count = 1 + rng() % 4; i < count; ++i) {
+            auto e = edges[rng() % edges.size()];
+            size_t len = graph.length(e) + k;
+            size_t pos = rng() % 3 == 0 ? rng() % len : (rng() % 2 ? 0 : len - 1);
+            for (const auto &cursor : DebruijnGraphCursor::get_cursors(graph, e, pos)) {
+                initial.emplace_back(cursor, rng() % 80);
+            }
+        }
+        for (bool forward : {false, true}) {
+            EXPECT_EQ(sorted(edge_neighborhood(initial, &graph, forward)),
+                      sorted(bfs_neighborhood(initial, &graph, forward)));
+        }
+    }
+}
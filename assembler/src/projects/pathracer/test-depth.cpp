@@ -1,6 +1,7 @@
 #include <gtest/gtest.h>
 #include "graph.hpp"
 #include "hmmpath.hpp"
+#include "depth_oracle.hpp"
 
 TEST(InfinteDepthAtLeast, Depth) {
     size_t n = 1000, k = 21;
@@ -31,3 +32,49 @@ TEST(InfinteDepthAtLeast, Depth) {
         EXPECT_EQ(depth.depth(cursor, nullptr), i);
     }
 }
+
+TEST(PrecomputedDepthInt, Depth) {
+    size_t k = 5;
+    std::vector<std::string> strings = {"AAAAACGTACGTAAAAA", "AAAAATTTGGG*CC", "AAAAAGGGGG"};
+    auto graph = DBGraph(k, strings);
+    std::vector<DBGraph::GraphCursor> cursors;
+    for (size_t i = 0; i < strings.size(); ++i) {
+        for (size_t j = 0; j < strings[i].size(); ++j) {
+            cursors.push_back(graph.get_pointer(i, j));
+        }
+    }
+
+    depth_filter::DepthInt<DBGraph::GraphCursor> lazy, precomputed;
+    precomputed.precompute(std::vector<DBGraph::GraphCursor>(cursors.rbegin(), cursors.rend()), nullptr);
+    for (const auto &cursor : cursors) {
+        EXPECT_EQ(precomputed.depth(cursor, nullptr), lazy.depth(cursor, nullptr));
+    }
+}
+
+TEST(DepthOracle, Depth) {
+    size_t k = 5;
+    // A loop (the first string), a stop codon and plain dead ends
+    std::vector<std::string> strings = {"AAAAACGTACGTAAAAA", "AAAAATTTGGG*CC", "AAAAAGGGGG", "CCCCCAXTT"};
+    auto graph = DBGraph(k, strings);
+    std::vector<DBGraph::GraphCursor> cursors;
+    for (size_t i = 0; i < strings.size(); ++i) {
+        for (size_t j = 0; j < strings[i].size(); ++j) {
+            cursors.push_back(graph.get_pointer(i, j));
+        }
+    }
+
+    CachedCursorContext context(cursors, nullptr);
+    depth_filter::DepthOracle oracle(&context);
+    depth_filter::DepthInt<CachedCursor> depth;
+    ASSERT_EQ(oracle.size(), context.size());
+    bool finite = false, infinite = false;
+    for (const auto &cursor : context.Cursors()) {
+        size_t expected = depth.depth(cursor, &context);
+        EXPECT_EQ(oracle.depth(cursor), expected);
+        EXPECT_EQ(oracle.depth_at_least(cursor, 3), depth.depth_at_least(cursor, 3, &context));
+        (expected == depth.INF ? infinite : finite) = true;
+    }
+    EXPECT_TRUE(finite);
+    EXPECT_TRUE(infinite);
+    EXPECT_EQ(oracle.depth(CachedCursor()), depth.depth(CachedCursor(), &context));
+}
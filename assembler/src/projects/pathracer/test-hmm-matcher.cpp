@@ -0,0 +1,53 @@
+#include <gtest/gtest.h>
+
+#include "hmm/hmmfile.hpp"
+#include "hmm/hmmmatcher.hpp"
+
+#include <random>
+#include <tuple>
+
+TEST(HMMMatcherMerge, HMM_MATCHER) {
+  std::mt19937 rng(42);
+  auto random_seq = [&rng](size_t len) {
+    std::string seq;
+    for (size_t i = 0; i < len; ++i) {
+      seq += "ACGT"[rng() % 4];
+    }
+    return seq;
+  };
+  const std::string query = random_seq(200);
+  std::vector<std::string> targets;
+  for (size_t i = 0; i < 40; ++i) {
+    std::string target = query;
+    for (size_t j = 0; j < i; ++j) {
+      target[rng() % target.size()] = "ACGT"[rng() % 4];
+    }
+    targets.push_back(random_seq(rng() % 100) + target + random_seq(rng() % 100));
+  }
+
+  hmmer::HMMSequenceBuilder builder(hmmer::Alphabet::DNA, hmmer::ScoreSystem::Default);
+  auto hmm = builder.from_string("query", query.c_str(), nullptr);
+  hmmer::hmmer_cfg cfg;
+  cfg.reseed = true;
+
+  // Hits of the targets split between two matchers are the same as of a single one
+  hmmer::HMMMatcher serial(hmm, cfg), merged(hmm, cfg), other(hmm, cfg);
+  for (size_t i = 0; i < targets.size(); ++i) {
+    const std::string name = std::to_string(i);
+    serial.match(name.c_str(), targets[i].c_str());
+    (i % 3 ? merged : other).match(name.c_str(), targets[i].c_str());
+  }
+  serial.summarize();
+  merged.merge(other);
+  merged.summarize();
+
+  std::vector<std::tuple<std::string, float, size_t, bool>> expected, actual;
+  for (const auto &hit : serial.hits()) {
+    expected.emplace_back(hit.name(), hit.score(), hit.ndom(), hit.included());
+  }
+  for (const auto &hit : merged.hits()) {
+    actual.emplace_back(hit.name(), hit.score(), hit.ndom(), hit.included());
+  }
+  EXPECT_GT(expected.size(), 10u);
+  EXPECT_EQ(actual, expected);
+}
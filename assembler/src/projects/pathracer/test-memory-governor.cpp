@@ -0,0 +1,35 @@
+#include <gtest/gtest.h>
+
+#include "find_best_path.hpp"
+#include "fees.hpp"
+#include "memory_governor.hpp"
+
+double levenshtein_substring_score(const std::string &s, const std::string &query) {
+  auto fees = hmm::levenshtein_fees(query);
+  fees.minimal_match_length = 0;
+  return -score_subsequence(fees, s);
+}
+
+TEST(MemoryGovernor, MEMORY_GOVERNOR) {
+  auto &governor = MemoryGovernor::instance();
+  governor.configure(1000, 100);
+  {
+    MemoryGovernor::Search search;
+    search.report(400, 1);
+    EXPECT_DOUBLE_EQ(governor.pressure(), 0.5);
+    EXPECT_EQ(governor.state_limit_scale(), 1);
+    search.report(620, 1);
+    EXPECT_EQ(governor.state_limit_scale(), 0.5);
+    search.report(2000, 1);
+    EXPECT_EQ(governor.state_limit_scale(), 1. / 64);
+  }
+  EXPECT_DOUBLE_EQ(governor.pressure(), 0.1);
+
+  // Searches under pressure get tighter state limits, but small ones are not affected
+  governor.configure(1, 1);
+  EXPECT_EQ(governor.state_limit_scale(), 1. / 64);
+  EXPECT_DOUBLE_EQ(levenshtein_substring_score("TTTTTTTTTTTTTAAAAACGTAAAAAAACGTTTTTTTTTTTTCCCC", "AAAAACGTAAAAAAACGTTTTTTTTTTTTCCC"), 0);
+  EXPECT_GT(governor.degraded(), 0u);
+  governor.configure(0, 0);
+  EXPECT_FALSE(governor.enabled());
+}
@@ -0,0 +1,70 @@
+#include <gtest/gtest.h>
+
+#include "query_server.hpp"
+
+#include <cstdio>
+#include <thread>
+
+TEST(QueryServer, QUERY_SERVER) {
+  const std::string path = "/tmp/pathracer-test-" + std::to_string(getpid()) + ".sock";
+  const std::string filename = path + ".txt";
+  std::ofstream(filename) << "ACGT\n";
+  {
+    QueryServer server(path);
+    JobQueue<std::string> queue;
+    std::thread thread([&]() {
+      auto connection = server.Accept();
+      std::unique_ptr<std::string> request(new std::string);
+      ASSERT_TRUE(connection->ReadLine(*request));
+      queue.push(std::move(request));
+      connection->SendFile("result.fa", filename);
+      connection->SendFile("missing.fa", filename + ".missing");
+      connection->Write("#done\n");
+    });
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, path.c_str(), sizeof(addr.sun_path) - 1);
+    ASSERT_EQ(connect(fd, reinterpret_cast<const sockaddr *>(&addr), sizeof(addr)), 0);
+    const std::string request = "query.hmm --output out\nignored";
+    ASSERT_EQ(send(fd, request.data(), request.size(), 0), ssize_t(request.size()));
+    std::string response;
+    char buffer[256];
+    for (ssize_t n; (n = recv(fd, buffer, sizeof(buffer), 0)) > 0;) {
+      response.append(buffer, size_t(n));
+    }
+    close(fd);
+    thread.join();
+
+    EXPECT_EQ(response, "#file result.fa\nACGT\n#done\n");
+    auto jobs = queue.pop_all();
+    ASSERT_EQ(jobs.size(), 1u);
+    EXPECT_EQ(*jobs[0], "query.hmm --output out");
+  }
+  EXPECT_NE(access(path.c_str(), F_OK), 0);
+  std::remove(filename.c_str());
+}
+
+TEST(QueryServer, QUERY_SERVER_TIMEOUT) {
+  const std::string path = "/tmp/pathracer-test-timeout-" + std::to_string(getpid()) + ".sock";
+  QueryServer server(path);
+  std::thread thread([&]() {
+    auto connection = server.Accept();
+    connection->SetTimeout(1);
+    std::string request;
+    EXPECT_FALSE(connection->ReadLine(request));
+  });
+
+  // Connected, but the request never comes
+  int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  sockaddr_un addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strncpy(addr.sun_path, path.c_str(), sizeof(addr.sun_path) - 1);
+  ASSERT_EQ(connect(fd, reinterpret_cast<const sockaddr *>(&addr), sizeof(addr)), 0);
+  send(fd, "query.hmm", 9, 0);
+  thread.join();
+  close(fd);
+}
@@ -0,0 +1,59 @@
+#include <gtest/gtest.h>
+
+#include "result_writer.hpp"
+
+#include <zlib.h>
+#include <unistd.h>
+
+#include <cstdio>
+#include <fstream>
+
+TEST(ResultWriter, RESULT_WRITER) {
+  const std::string prefix = "/tmp/pathracer-test-" + std::to_string(getpid());
+  auto read_gzip = [](const std::string &filename) {
+    std::string contents;
+    gzFile file = gzopen(filename.c_str(), "rb");
+    char buffer[4096];
+    for (int n; file && (n = gzread(file, buffer, sizeof(buffer))) > 0;) {
+      contents.append(buffer, size_t(n));
+    }
+    gzclose(file);
+    return contents;
+  };
+
+  for (bool gzip : {false, true}) {
+    ResultWriter writer(gzip, 2);
+    // More batches than the queue holds are pushed concurrently, every file is written once flushed
+    #pragma omp parallel for num_threads(4)
+    for (size_t i = 0; i < 16; ++i) {
+      const std::string name = prefix + "." + std::to_string(i);
+      std::string record = ">" + std::to_string(i) + "\n";
+      writer.push({ name + ".fa", name + ".nucs.fa" }, [record](const std::vector<std::ostream *> &files) {
+        *files[0] << record << std::string(100000, 'A') << '\n';
+        *files[1] << record;
+      });
+    }
+    // Every batch is numbered below the ticket
+    EXPECT_EQ(writer.pushed(), 16u);
+    writer.wait(writer.pushed());
+
+    for (size_t i = 0; i < 16; ++i) {
+      const std::string name = prefix + "." + std::to_string(i);
+      const std::string record = ">" + std::to_string(i) + "\n";
+      std::string contents, nucs;
+      if (gzip) {
+        EXPECT_EQ(writer.filename(name + ".fa"), name + ".fa.gz");
+        contents = read_gzip(name + ".fa.gz");
+        nucs = read_gzip(name + ".nucs.fa.gz");
+      } else {
+        std::ifstream in(name + ".fa"), in_nucs(name + ".nucs.fa");
+        std::getline(in, contents, '\0');
+        std::getline(in_nucs, nucs, '\0');
+      }
+      EXPECT_EQ(contents, record + std::string(100000, 'A') + '\n');
+      EXPECT_EQ(nucs, record);
+      std::remove(writer.filename(name + ".fa").c_str());
+      std::remove(writer.filename(name + ".nucs.fa").c_str());
+    }
+  }
+}
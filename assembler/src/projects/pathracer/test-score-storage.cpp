@@ -0,0 +1,69 @@
+#include <gtest/gtest.h>
+
+#include "find_best_path.hpp"
+#include "fees.hpp"
+
+// Built once per PATHRACER_SCORE_STORAGE, see CMakeLists.txt
+
+TEST(ScoreStorage, SCORE_STORAGE) {
+  const double inf = std::numeric_limits<double>::infinity();
+  for (double score : {0., 1., -2.5, 1234.567, -0.0004}) {
+    EXPECT_DOUBLE_EQ(DoubleScoreStorage::load(DoubleScoreStorage::store(score)), score);
+    EXPECT_NEAR(FloatScoreStorage::load(FloatScoreStorage::store(score)), score, 1e-3);
+    EXPECT_NEAR(MilliNatScoreStorage::load(MilliNatScoreStorage::store(score)), score, 5e-4);
+  }
+  EXPECT_EQ(FloatScoreStorage::load(FloatScoreStorage::store(inf)), inf);
+  EXPECT_EQ(MilliNatScoreStorage::load(MilliNatScoreStorage::store(inf)), inf);
+  EXPECT_EQ(MilliNatScoreStorage::load(MilliNatScoreStorage::store(1e12)), inf);
+  // Infinity is the worst score, so any finite one is better
+  EXPECT_LT(MilliNatScoreStorage::store(1e5), MilliNatScoreStorage::store(inf));
+}
+
+struct TopPath {
+  std::string seq;
+  double score;
+};
+
+std::vector<TopPath> top_paths(const std::string &s, const hmm::Fees &fees, size_t k) {
+  std::vector<StringCursor> cursors;
+  for (size_t i = 0; i < s.length(); ++i) {
+    cursors.emplace_back(i);
+  }
+  CachedCursorContext ccc(cursors, &s);
+  auto result = find_best_path(fees, ccc.Cursors(), &ccc);
+  auto paths = result.top_k(&ccc, k);
+  std::vector<TopPath> top;
+  for (size_t i = 0; i < paths.size(); ++i) {
+    top.push_back({paths.str(i, &ccc), paths[i].score});
+  }
+  return top;
+}
+
+TEST(ScoreStorageTopPaths, TOP_K) {
+  // Fractional fees, so the scores are rounded by the narrow storages
+  const std::string query = "ACGGTTTACGA";
+  auto fees = hmm::levenshtein_fees(query, 1.2347, 1.7771, 0.4313);
+  // Matches are rewarded, so the paths get positive (reportable) scores
+  for (size_t i = 1; i <= fees.M; ++i) {
+    fees.mat[i][fees.code(query[i - 1])] = -0.6129 - 0.0001 * static_cast<double>(i);
+  }
+  fees.minimal_match_length = 0;
+  const auto top = top_paths("ACGTACGTACGTTTGACGGTCATTACGGTTAACGAGG", fees, 10);
+
+  // Found with double storage. Prefixes of the reported paths (e.g. ACGTTTGA of ACGTTTGACGG) are rejected
+  const std::vector<TopPath> expected = {
+    {"ACGGTTAACGA", 4.9002},
+    {"ACGGTCATTACGG", 2.6914},
+    {"ACGTTTGACGG", 1.2035},
+    {"ACGTACGTA", 0.4915},
+    {"ACGTACGT", 0.4199}
+  };
+  ASSERT_EQ(top.size(), expected.size());
+  // The best path follows exact scores, the other ones deviate through a few rounded edges
+  EXPECT_DOUBLE_EQ(top[0].score, expected[0].score);
+  const double tolerance = std::is_same<ScoreStorage, DoubleScoreStorage>::value ? 1e-9 : 2e-3;
+  for (size_t i = 0; i < top.size(); ++i) {
+    EXPECT_EQ(top[i].seq, expected[i].seq);
+    EXPECT_NEAR(top[i].score, expected[i].score, tolerance);
+  }
+}
@@ -1,7 +1,12 @@
 #include <gtest/gtest.h>
 
 #include "find_best_path.hpp"
+#include "graph.hpp"
+#include "hmmpath.hpp"
 #include "fees.hpp"
+#include "trie.hpp"
+
+#include <random>
 
 double levenshtein_string_score(const std::string &s, const std::string &query) {
   auto fees = hmm::levenshtein_fees(query);
@@ -37,3 +42,453 @@ TEST(LevenshteinNonZero, LEVENSHTEIN_SUBSTRING) {
   EXPECT_DOUBLE_EQ(levenshtein_substring_score("ATA", "TA"), 0);
   EXPECT_DOUBLE_EQ(levenshtein_substring_score("", "AA"), 2);
 }
+
+double levenshtein_cached_substring_score(const std::string &s, const std::string &query, bool dense, bool bidirectional = false) {
+  auto fees = hmm::levenshtein_fees(query);
+  fees.minimal_match_length = 0;
+  fees.use_dense_columns = dense;
+  fees.use_bidirectional_search = bidirectional;
+  std::vector<StringCursor> cursors;
+  for (size_t i = 0; i < s.length(); ++i) {
+    cursors.emplace_back(i);
+  }
+  CachedCursorContext ccc(cursors, &s);
+  return -find_best_path(fees, ccc.Cursors(), &ccc).best_score();
+}
+
+TEST(LevenshteinDenseColumns, LEVENSHTEIN_SUBSTRING) {
+  const std::vector<std::pair<std::string, std::string>> cases = {
+    {"AAAAACGTAAAAAAACGT", "CGT"},
+    {"AAAAACGTAAAAAAACGT", "AAAAACGTAAAAAAACGT"},
+    {"TTTTTTTTTTTTTAAAAACGTAAAAAAACGTTTTTTTTTTTTCCCCT", "AAAACCGTAAATAAACGT"},
+    {"AAAAAAAAACGGGGGGGCCCCCAAAAAAGGGGGGCCCCGGG", "T"},
+    {"AT", "TA"},
+    {"ACGTACGTACGTTTGACGGTCA", "ACGGTTTACGA"}
+  };
+  for (const auto &c : cases) {
+    double sparse = levenshtein_cached_substring_score(c.first, c.second, false);
+    EXPECT_DOUBLE_EQ(sparse, levenshtein_substring_score(c.first, c.second));
+    EXPECT_DOUBLE_EQ(levenshtein_cached_substring_score(c.first, c.second, true), sparse);
+  }
+}
+
+double limited_cached_substring_score(const std::string &s, const std::string &query, size_t limit, bool dense) {
+  auto fees = hmm::levenshtein_fees(query);
+  fees.minimal_match_length = 0;
+  fees.state_limits.l25 = fees.state_limits.l100 = fees.state_limits.l500 = limit;
+  fees.use_dense_columns = dense;
+  std::vector<StringCursor> cursors;
+  for (size_t i = 0; i < s.length(); ++i) {
+    cursors.emplace_back(i);
+  }
+  CachedCursorContext ccc(cursors, &s);
+  return -find_best_path(fees, ccc.Cursors(), &ccc).best_score();
+}
+
+TEST(LevenshteinDenseColumnsLimited, LEVENSHTEIN_SUBSTRING) {
+  // Queries longer than 25 positions, so the dense columns create links only for the states kept by the limits
+  const std::string s = "TTTTTTTTTTTTTAAAAACGTAAAAAAACGTTTTTTTTTTTTCCCCTACGTACGTACGTTTGACGGTCAGGGGGGCCCCGGG";
+  const std::vector<std::string> queries = {
+    "AAAAACGTAAAAAAACGTTTTTTTTTTTTCCC",
+    "ACGTACGTACGTTTGACGGTCAGGGGTGCCCC",
+    "ACGTTTGACGGTCAAAAAAAACGTTTTTTTTTTT"
+  };
+  for (const auto &query : queries) {
+    for (size_t limit : {1, 3, 10, 1000}) {
+      EXPECT_DOUBLE_EQ(limited_cached_substring_score(s, query, limit, true),
+                       limited_cached_substring_score(s, query, limit, false));
+    }
+  }
+}
+
+TEST(LevenshteinBidirectional, LEVENSHTEIN_SUBSTRING) {
+  const std::vector<std::pair<std::string, std::string>> cases = {
+    {"AAAAACGTAAAAAAACGT", "CGT"},
+    {"TTTTTTTTTTTTTAAAAACGTAAAAAAACGTTTTTTTTTTTTCCCCT", "AAAACCGTAAATAAACGT"},
+    {"AAAAAAAAACGGGGGGGCCCCCAAAAAAGGGGGGCCCCGGG", "T"},
+    {"AT", "TA"},
+    {"ACGTACGTACGTTTGACGGTCA", "ACGGTTTACGA"}
+  };
+  for (const auto &c : cases) {
+    EXPECT_DOUBLE_EQ(levenshtein_cached_substring_score(c.first, c.second, false, true),
+                     levenshtein_cached_substring_score(c.first, c.second, false));
+  }
+}
+
+hmm::Fees rewarded_fees(const std::string &query) {
+  auto fees = hmm::levenshtein_fees(query);
+  // Matches are rewarded, so good alignments get positive (reportable) scores. Fees depend on the position,
+  // so different alignments of a path do not tie and the search does not choose between them
+  for (size_t i = 1; i <= fees.M; ++i) {
+    for (auto &fee : fees.mat[i]) {
+      fee += 0.005 * static_cast<double>(i);
+    }
+    fees.mat[i][fees.code(query[i - 1])] = -1 - 0.01 * static_cast<double>(i);
+    fees.t[i][p7H_MI] += 0.003 * static_cast<double>(i);
+    fees.t[i][p7H_MD] += 0.007 * static_cast<double>(i);
+  }
+  fees.minimal_match_length = 0;
+  return fees;
+}
+
+std::vector<std::pair<std::string, double>> cached_top_paths(const hmm::Fees &fees, const CachedCursorContext &ccc) {
+  auto result = find_best_path(fees, ccc.Cursors(), &ccc);
+  auto paths = result.top_k(&ccc, 20);
+  std::vector<std::pair<std::string, double>> top;
+  for (size_t i = 0; i < paths.size(); ++i) {
+    top.emplace_back(paths.str(i, &ccc), paths[i].score);
+  }
+  return top;
+}
+
+std::vector<std::pair<std::string, double>> rewarded_top_paths(const std::string &s, const std::string &query,
+                                                               bool cost_bounds) {
+  auto fees = rewarded_fees(query);
+  fees.use_cost_bounds = cost_bounds;
+  std::vector<StringCursor> cursors;
+  for (size_t i = 0; i < s.length(); ++i) {
+    cursors.emplace_back(i);
+  }
+  return cached_top_paths(fees, CachedCursorContext(cursors, &s));
+}
+
+TEST(LevenshteinCostBounds, LEVENSHTEIN_SUBSTRING) {
+  const std::vector<std::pair<std::string, std::string>> cases = {
+    {"AAAAACGTAAAAAAACGT", "CGT"},
+    {"TTTTTTTTTTTTTAAAAACGTAAAAAAACGTTTTTTTTTTTTCCCCT", "AAAACCGTAAATAAACGT"},
+    {"ACGTACGTACGTTTGACGGTCA", "ACGGTTTACGA"},
+    {"ACGTACGTACGTTTGACGGTCA", "TTTTTTTTTTTTTTTTTTTT"}
+  };
+  for (const auto &c : cases) {
+    // Only the paths that could not be reported are dropped
+    EXPECT_EQ(rewarded_top_paths(c.first, c.second, true), rewarded_top_paths(c.first, c.second, false));
+  }
+  EXPECT_FALSE(rewarded_top_paths(cases[0].first, cases[0].second, true).empty());
+
+  auto bounds = hmm::levenshtein_fees("ACGT").remaining_cost_bounds();
+  for (size_t m = 0; m <= 4; ++m) {
+    EXPECT_DOUBLE_EQ(bounds.match[m], 0);
+    EXPECT_DOUBLE_EQ(bounds.insertion[m], 0);
+  }
+}
+
+TEST(LevenshteinCompressedRuns, LEVENSHTEIN_SUBSTRING) {
+  // Long unbranched runs between branching vertices and a cycle. Queries have insertions against the graph,
+  // so the I-loops are relaxed along the runs
+  const size_t k = 5;
+  const DBGraph graph(k, {"TTTTTAAAAACGTAAAAAAACGTTTTTTTTTTTTCCCCTACGTA",
+                          "TTTTTGACGGTCAGGGGGGCCCCGGGACGTACGTACGTTTGA",
+                          "CGTTTGACGGTCATTACGGTTAACGAGGTTTTT"});
+  CachedCursorContext ccc(graph.all(), nullptr);
+  const std::vector<std::string> queries = {
+    "AAAAACGTAAAAAAACGT",
+    "ACGGTCAGGGTTTTGGGCCCC",
+    "GACGGTCATTACTTTGGTTAACG",
+    "TTTTTTTTTTTTTTTTTTTT"
+  };
+  for (const auto &query : queries) {
+    auto fees = rewarded_fees(query);
+    auto expected = cached_top_paths(fees, ccc);
+    fees.use_compressed_runs = true;
+    EXPECT_EQ(cached_top_paths(fees, ccc), expected);
+    EXPECT_FALSE(expected.empty());
+  }
+}
+
+double limited_substring_score(const std::string &s, const std::string &query, size_t limit, bool streaming) {
+  auto fees = hmm::levenshtein_fees(query);
+  fees.minimal_match_length = 0;
+  fees.state_limits.l25 = fees.state_limits.l100 = fees.state_limits.l500 = limit;
+  fees.use_streaming_filter = streaming;
+  return -score_subsequence(fees, s);
+}
+
+TEST(LevenshteinStreamingFilter, LEVENSHTEIN_SUBSTRING) {
+  // Queries longer than 25 positions, so the top score filter is applied
+  const std::string s = "TTTTTTTTTTTTTAAAAACGTAAAAAAACGTTTTTTTTTTTTCCCCTACGTACGTACGTTTGACGGTCAGGGGGGCCCCGGG";
+  const std::vector<std::string> queries = {
+    "AAAAACGTAAAAAAACGTTTTTTTTTTTTCCC",
+    "ACGTACGTACGTTTGACGGTCAGGGGTGCCCC",
+    "ACGTTTGACGGTCAAAAAAAACGTTTTTTTTTTT"
+  };
+  for (const auto &query : queries) {
+    for (size_t limit : {1, 3, 10, 1000}) {
+      EXPECT_DOUBLE_EQ(limited_substring_score(s, query, limit, true),
+                       limited_substring_score(s, query, limit, false));
+    }
+  }
+}
+
+TEST(StreamingScoreFilter, STATE_SET) {
+  using Link = pathtree::PathLink<StringCursor>;
+  Link::Arena::Scope scope;
+  auto source = Link::create_source();
+
+  // Many ties, so the states scored as the n-th best one are all kept by both filters
+  std::mt19937 rng(17);
+  impl::StateSet<StringCursor> states;
+  for (size_t i = 0; i < 1000; ++i) {
+    states.update(StringCursor(i), static_cast<double>(rng() % 200), source);
+  }
+  impl::ScoreFilterBuffer<StringCursor> buffer;
+  for (size_t n : {0, 1, 10, 100, 999, 1000, 2000}) {
+    for (double limit : {50., 150., 1000.}) {
+      impl::ScoreThreshold threshold;
+      threshold.reset(n, limit);
+      impl::StateSet<StringCursor> streamed = states, expected = states;
+      EXPECT_EQ(streamed.score_filter(n, 120, threshold, buffer), expected.score_filter(n, std::min(120., limit)));
+      ASSERT_EQ(streamed.size(), expected.size());
+      for (const auto &kv : expected) {
+        EXPECT_TRUE(streamed.count(kv.first));
+      }
+    }
+  }
+}
+
+TEST(ShardedTransfer, STATE_SET) {
+  using Link = pathtree::PathLink<StringCursor>;
+  Link::Arena::Scope scope;
+  auto source = Link::create_source();
+
+  // Sources spanning a few chunks, each target is reached from several chunks
+  const size_t N = 3 * impl::ShardedTransfer<StringCursor>::CHUNK_SIZE + 17;
+  impl::StateSet<StringCursor> from;
+  for (size_t i = 0; i < N; ++i) {
+    from.update(StringCursor(i), static_cast<double>((i * 37) % 101), source);
+  }
+  auto relax = [&](const impl::State<StringCursor> &state, const auto &emit) {
+    const size_t i = state.cursor.position();
+    emit(StringCursor((i * 7) % 1999), state.score + 1);
+    emit(StringCursor(i / 3), state.score + 0.5);
+    emit(StringCursor((i * 7) % 1999), state.score + static_cast<double>(i % 5));
+  };
+
+  impl::StateSet<StringCursor> serial;
+  for (const auto &state : from.states()) {
+    relax(state, [&](const StringCursor &next, score_t score) { serial.update(next, score, state.plink); });
+  }
+  impl::StateSet<StringCursor> sharded;
+  // The links are created in the arena of the calling thread
+#pragma omp parallel num_threads(4)
+#pragma omp master
+  impl::ShardedTransfer<StringCursor>::run(sharded, from, relax);
+
+  // The same states in the same order with the same incoming links
+  ASSERT_EQ(sharded.size(), serial.size());
+  for (auto it = serial.cbegin(), jt = sharded.cbegin(); it != serial.cend(); ++it, ++jt) {
+    ASSERT_EQ(it->first, jt->first);
+    EXPECT_EQ(it->second->score(), jt->second->score());
+    std::vector<std::pair<double, const Link *>> expected, actual;
+    it->second->for_each_ancestor([&](double score, const auto &ancestor) { expected.emplace_back(score, ancestor.get()); });
+    jt->second->for_each_ancestor([&](double score, const auto &ancestor) { actual.emplace_back(score, ancestor.get()); });
+    EXPECT_EQ(actual, expected);
+  }
+}
+
+TEST(SlabArena, EVENT_GRAPH) {
+  using Link = pathtree::PathLink<StringCursor>;
+  using LinkRef = pathtree::PathLinkRef<StringCursor>;
+  Link::Arena::Scope scope;
+  const auto &arena = scope.arena();
+  auto source = Link::create_source();
+  std::vector<LinkRef> kept;
+  auto roots = [&](auto &&visit) {
+    visit(source.get());
+    for (const auto &link : kept) visit(link.get());
+  };
+
+  // Chains of links, every other one is dropped by the first (minor) collection
+  const size_t CHAINS = 4096, LENGTH = 32;
+  for (size_t i = 0; i < CHAINS; ++i) {
+    LinkRef link = source;
+    for (size_t j = 0; j < LENGTH; ++j) {
+      LinkRef next = Link::create(StringCursor(j));
+      next->update(static_cast<double>(j), link);
+      link = next;
+    }
+    if (i % 2 == 0) kept.push_back(link);
+  }
+  scope.collect(roots);
+  EXPECT_EQ(arena.collections(), 1u);
+  EXPECT_EQ(arena.size(), CHAINS / 2 * LENGTH + 1);
+
+  // Young ancestors of old links are remembered, unreachable young links are reused
+  for (size_t i = 0; i < kept.size(); ++i) {
+    LinkRef young = Link::create(StringCursor(1000 + i));
+    young->update(0, source);
+    kept[i]->update(-1, young);
+  }
+  for (size_t i = 0; i < 70000; ++i) {
+    Link::create(StringCursor(999999))->update(0, source);
+  }
+  scope.collect(roots);
+  EXPECT_EQ(arena.collections(), 2u);
+  EXPECT_EQ(arena.size(), CHAINS / 2 * (LENGTH + 1) + 1);
+  for (size_t i = 0; i < 70000; ++i) {
+    Link::create(StringCursor(999999))->update(0, source);
+  }
+  for (size_t i = 0; i < kept.size(); ++i) {
+    ASSERT_EQ(kept[i]->size(), 2u);
+    std::vector<std::pair<double, size_t>> ancestors;
+    kept[i]->for_each_ancestor([&](double score, const LinkRef &ancestor) {
+      ancestors.emplace_back(score, ancestor->cursor().position());
+    });
+    EXPECT_DOUBLE_EQ(ancestors[0].first, static_cast<double>(LENGTH - 1));
+    EXPECT_EQ(ancestors[0].second, LENGTH - 2);
+    EXPECT_DOUBLE_EQ(ancestors[1].first, -1);
+    EXPECT_EQ(ancestors[1].second, 1000 + i);
+  }
+
+  // Promoted ballast doubles the old generation, so the next collection is a major one: it releases
+  // old links and compacts the ancestors, a trimmed link keeps its only ancestor inline
+  for (size_t i = 0; i < 70000; ++i) {
+    kept.push_back(Link::create(StringCursor(999999)));
+    kept.back()->update(0, source);
+  }
+  scope.collect(roots);
+  EXPECT_EQ(arena.collections(), 3u);
+  kept.resize(16);
+  kept[0]->collapse_and_trim_to_one();
+  scope.collect(roots);
+  EXPECT_EQ(arena.collections(), 4u);
+  // The trimmed link has lost its chain
+  EXPECT_EQ(arena.size(), 16 * (LENGTH + 1) + 1 - (LENGTH - 1));
+  ASSERT_EQ(kept[0]->size(), 1u);
+  EXPECT_DOUBLE_EQ(kept[0]->score(), -1);
+  EXPECT_EQ(kept[0]->get_unique_ancestor()->cursor().position(), 1000u);
+  for (size_t i = 1; i < kept.size(); ++i) {
+    ASSERT_EQ(kept[i]->size(), 2u);
+    EXPECT_DOUBLE_EQ(kept[i]->score(), -1);
+    std::vector<size_t> positions;
+    kept[i]->for_each_ancestor([&](double, const LinkRef &ancestor) {
+      positions.push_back(ancestor->cursor().position());
+    });
+    EXPECT_EQ(positions, std::vector<size_t>({LENGTH - 2, 1000 + i}));
+  }
+}
+
+TEST(PackedFees, FEES) {
+  auto fees = hmm::levenshtein_fees("ACGTTGCA");
+  hmm::PackedFees packed(fees);
+  ASSERT_EQ(packed.width(), 4u);
+  EXPECT_EQ(reinterpret_cast<uintptr_t>(packed.mat(0)) % hmm::PackedFees::ALIGNMENT, 0u);
+  EXPECT_EQ(reinterpret_cast<uintptr_t>(packed.ins(0)) % hmm::PackedFees::ALIGNMENT, 0u);
+  EXPECT_EQ(reinterpret_cast<uintptr_t>(packed.t(0)) % hmm::PackedFees::ALIGNMENT, 0u);
+  for (size_t m = 0; m <= fees.M; ++m) {
+    for (size_t j = 0; j < 4; ++j) {
+      EXPECT_EQ(packed.mat(m)[j], fees.mat[m][j]);
+      EXPECT_EQ(packed.ins(m)[j], fees.ins[m][j]);
+    }
+    for (size_t j = 0; j < hmm::PackedFees::TRANSITIONS; ++j) {
+      EXPECT_EQ(packed.t(m)[j], fees.t[m][j]);
+    }
+  }
+}
+
+TEST(CachedCursorContextRenumbering, CACHED_CURSOR) {
+  const std::string s = "ACGTACGTACGTTTGACGGTCA";
+  // Cursors in a shuffled order, so the context renumbers them
+  std::vector<StringCursor> cursors;
+  for (size_t i = 0; i < s.length(); ++i) {
+    cursors.emplace_back((i * 7) % s.length());
+  }
+  CachedCursorContext ccc(cursors, &s);
+  ASSERT_EQ(ccc.size(), cursors.size());
+
+  auto cached_cursors = ccc.Cursors();
+  auto unpacked = ccc.UnpackPath(cached_cursors, cursors);
+  for (size_t i = 0; i < cached_cursors.size(); ++i) {
+    const auto &cursor = cached_cursors[i];
+    EXPECT_EQ(cursor.letter(&ccc), unpacked[i].letter(&s));
+    auto next = cursor.next(&ccc);
+    EXPECT_EQ(ccc.UnpackPath(std::vector<CachedCursor>(next.begin(), next.end()), cursors), unpacked[i].next(&s));
+    auto prev = cursor.prev(&ccc);
+    EXPECT_EQ(ccc.UnpackPath(std::vector<CachedCursor>(prev.begin(), prev.end()), cursors), unpacked[i].prev(&s));
+    // Unbranched string is laid out sequentially
+    for (const auto &n : next) {
+      EXPECT_EQ(n.index(), cursor.index() + 1);
+    }
+  }
+}
+
+// Top paths extraction as it was before streaming: a priority queue, two trimming sets and a trie of reported
+// nucleotide paths rejecting the prefixes and the extensions of them
+std::vector<std::pair<std::string, double>> trie_top_paths(const pathtree::PathLink<CachedCursor> *sink,
+                                                           const CachedCursorContext *context, size_t k) {
+  using Link = pathtree::PathLink<CachedCursor>;
+  struct QueueElement {
+    pathtrie::NodeRef<const Link *> path;
+    double cost;
+  };
+  struct Comp {
+    bool operator()(const QueueElement &e1, const QueueElement &e2) const { return e1.cost > e2.cost; }
+  };
+  std::priority_queue<QueueElement, std::vector<QueueElement>, Comp> q;
+  q.push({pathtrie::make_root<const Link *>(sink), sink->score()});
+  std::unordered_set<const Link *> was_end_of_some_path, was_nonend_of_some_path;
+  trie::Trie<CachedCursor> trie;
+  std::vector<std::pair<std::string, double>> result;
+  while (!q.empty() && result.size() < k) {
+    auto qe = q.top();
+    q.pop();
+    const Link *path_link = qe.path->data();
+    if (!std::isfinite(qe.cost)) break;
+    if (!qe.path->is_root()) {
+      if (qe.path->parent()->data()->cursor().is_empty()) {
+        was_end_of_some_path.insert(path_link);
+        if (was_nonend_of_some_path.count(path_link)) continue;
+      } else {
+        if (was_end_of_some_path.count(path_link)) continue;
+        was_nonend_of_some_path.insert(path_link);
+      }
+    }
+    if (path_link->is_source()) {
+      if (-qe.cost < 0) break;
+      std::vector<CachedCursor> path;
+      for (const Link *link : qe.path->collect()) {
+        if (!link->cursor().is_empty()) path.push_back(link->cursor());
+      }
+      if (path.empty()) break;
+      if (trie.try_add(path)) result.emplace_back(pathtree::path2string(path, context), -qe.cost);
+      continue;
+    }
+    path_link->for_each_ancestor([&](double score, const auto &ancestor) {
+      q.push({qe.path->child(ancestor.get()), qe.cost + score - path_link->score()});
+    });
+  }
+  return result;
+}
+
+TEST(TopPathsStreaming, TOP_K) {
+  const std::string s = "ACGTTTTTACGTTTTTACCTTTTTAGGTTTTTACGT";
+  std::vector<StringCursor> cursors;
+  for (size_t i = 0; i < s.length(); ++i) {
+    cursors.emplace_back(i);
+  }
+  CachedCursorContext ccc(cursors, &s);
+  // Insertions at the ends make paths extending the reported ones
+  for (const std::string query : {"ACGT", "TTTAC", "ACGTTTTTAC"}) {
+    auto fees = hmm::levenshtein_fees(query);
+    fees.minimal_match_length = 0;
+    auto result = find_best_path(fees, ccc.Cursors(), &ccc);
+
+    const size_t k = 30;
+    auto expected = trie_top_paths(result.pathlink(), &ccc, k);
+    ASSERT_FALSE(expected.empty());
+    std::vector<std::pair<std::string, double>> streamed;
+    const size_t queue_memory = pathtree::PathLink<CachedCursor>::DEFAULT_TOP_QUEUE_MEMORY;
+    size_t count = result.for_each_top(&ccc, k, queue_memory, [&](auto &&path) {
+      streamed.emplace_back(path.str(&ccc), path.score);
+    });
+    EXPECT_EQ(count, streamed.size());
+    EXPECT_EQ(streamed, expected);
+
+    auto top_paths = result.top_k(&ccc, k);
+    ASSERT_EQ(top_paths.size(), streamed.size());
+    for (size_t i = 0; i < top_paths.size(); ++i) {
+      EXPECT_EQ(top_paths.str(i, &ccc), streamed[i].first);
+    }
+    EXPECT_EQ(streamed[0].first, query);
+    EXPECT_DOUBLE_EQ(streamed[0].second, 0);
+  }
+}